@@ -1,180 +1,129 @@
-// CNN-For-CPP.cpp : Defines the entry point for the application.
+// CNN-For-CPP.cpp : Defines the entry point for the batch classification tool.
 //
 
 #include "stdafx.h"
-#include "CNN-For-CPP.h"
+#include <opencv2/opencv.hpp>
 
-#define MAX_LOADSTRING 100
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
 
-// Global Variables:
-HINSTANCE hInst;                                // current instance
-WCHAR szTitle[MAX_LOADSTRING];                  // The title bar text
-WCHAR szWindowClass[MAX_LOADSTRING];            // the main window class name
+#include "ConvolutionalNeuralNetwork.h"
+#include "BatchClassifier.h"
+#include "OutputHead.h"
 
-// Forward declarations of functions included in this code module:
-ATOM                MyRegisterClass(HINSTANCE hInstance);
-BOOL                InitInstance(HINSTANCE, int);
-LRESULT CALLBACK    WndProc(HWND, UINT, WPARAM, LPARAM);
-INT_PTR CALLBACK    About(HWND, UINT, WPARAM, LPARAM);
+using namespace std;
 
-int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
-                     _In_opt_ HINSTANCE hPrevInstance,
-                     _In_ LPWSTR    lpCmdLine,
-                     _In_ int       nCmdShow)
-{
-    UNREFERENCED_PARAMETER(hPrevInstance);
-    UNREFERENCED_PARAMETER(lpCmdLine);
-
-    // TODO: Place code here.
-
-    // Initialize global strings
-    LoadStringW(hInstance, IDS_APP_TITLE, szTitle, MAX_LOADSTRING);
-    LoadStringW(hInstance, IDC_CNNFORCPP, szWindowClass, MAX_LOADSTRING);
-    MyRegisterClass(hInstance);
-
-    // Perform application initialization:
-    if (!InitInstance (hInstance, nCmdShow))
-    {
-        return FALSE;
-    }
-
-    HACCEL hAccelTable = LoadAccelerators(hInstance, MAKEINTRESOURCE(IDC_CNNFORCPP));
-
-    MSG msg;
-
-    // Main message loop:
-    while (GetMessage(&msg, nullptr, 0, 0))
-    {
-        if (!TranslateAccelerator(msg.hwnd, hAccelTable, &msg))
-        {
-            TranslateMessage(&msg);
-            DispatchMessage(&msg);
-        }
-    }
-
-    return (int) msg.wParam;
-}
-
-
-
-//
-//  FUNCTION: MyRegisterClass()
-//
-//  PURPOSE: Registers the window class.
-//
-ATOM MyRegisterClass(HINSTANCE hInstance)
-{
-    WNDCLASSEXW wcex;
-
-    wcex.cbSize = sizeof(WNDCLASSEX);
-
-    wcex.style          = CS_HREDRAW | CS_VREDRAW;
-    wcex.lpfnWndProc    = WndProc;
-    wcex.cbClsExtra     = 0;
-    wcex.cbWndExtra     = 0;
-    wcex.hInstance      = hInstance;
-    wcex.hIcon          = LoadIcon(hInstance, MAKEINTRESOURCE(IDI_CNNFORCPP));
-    wcex.hCursor        = LoadCursor(nullptr, IDC_ARROW);
-    wcex.hbrBackground  = (HBRUSH)(COLOR_WINDOW+1);
-    wcex.lpszMenuName   = MAKEINTRESOURCEW(IDC_CNNFORCPP);
-    wcex.lpszClassName  = szWindowClass;
-    wcex.hIconSm        = LoadIcon(wcex.hInstance, MAKEINTRESOURCE(IDI_SMALL));
-
-    return RegisterClassExW(&wcex);
-}
-
-//
-//   FUNCTION: InitInstance(HINSTANCE, int)
-//
-//   PURPOSE: Saves instance handle and creates main window
-//
-//   COMMENTS:
-//
-//        In this function, we save the instance handle in a global variable and
-//        create and display the main program window.
-//
-BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
-{
-   hInst = hInstance; // Store instance handle in our global variable
-
-   HWND hWnd = CreateWindowW(szWindowClass, szTitle, WS_OVERLAPPEDWINDOW,
-      CW_USEDEFAULT, 0, CW_USEDEFAULT, 0, nullptr, nullptr, hInstance, nullptr);
-
-   if (!hWnd)
-   {
-      return FALSE;
-   }
+void printUsage(const char* program);
 
-   ShowWindow(hWnd, nCmdShow);
-   UpdateWindow(hWnd);
+/**
+	Loads a model and classifies a directory of images or a list of image files with it, writing one result per image to a CSV or
+	JSON file and printing the throughput and latency percentiles at the end.
 
-   return TRUE;
-}
-
-//
-//  FUNCTION: WndProc(HWND, UINT, WPARAM, LPARAM)
-//
-//  PURPOSE:  Processes messages for the main window.
-//
-//  WM_COMMAND  - process the application menu
-//  WM_PAINT    - Paint the main window
-//  WM_DESTROY  - post a quit message and return
-//
-//
-LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+	CNN-For-CPP --model model.cnn (--dir images | --list files.txt) [--output results.csv] [--labels labels.txt] [--threads 0]
+		[--batch 32] [--top 1] [--quiet]
+*/
+int main(int argc, char* argv[])
 {
-    switch (message)
-    {
-    case WM_COMMAND:
-        {
-            int wmId = LOWORD(wParam);
-            // Parse the menu selections:
-            switch (wmId)
-            {
-            case IDM_ABOUT:
-                DialogBox(hInst, MAKEINTRESOURCE(IDD_ABOUTBOX), hWnd, About);
-                break;
-            case IDM_EXIT:
-                DestroyWindow(hWnd);
-                break;
-            default:
-                return DefWindowProc(hWnd, message, wParam, lParam);
-            }
-        }
-        break;
-    case WM_PAINT:
-        {
-            PAINTSTRUCT ps;
-            HDC hdc = BeginPaint(hWnd, &ps);
-            // TODO: Add any drawing code that uses hdc here...
-            EndPaint(hWnd, &ps);
-        }
-        break;
-    case WM_DESTROY:
-        PostQuitMessage(0);
-        break;
-    default:
-        return DefWindowProc(hWnd, message, wParam, lParam);
-    }
-    return 0;
+	string modelPath, directory, listPath, outputPath = "results.csv", labelPath;
+	int threadNum = 0, batchSize = 32, topK = 1;
+	bool showProgress = true;
+
+	for (int argIndex = 1; argIndex < argc; argIndex++) {
+		string arg = argv[argIndex];
+		bool hasValue = argIndex + 1 < argc;
+		if (arg == "--help" || arg == "-h") {
+			printUsage(argv[0]);
+			return 0;
+		}
+		else if (arg == "--quiet") {
+			showProgress = false;
+		}
+		else if (!hasValue) {
+			cout << "Missing value for " << arg << "." << endl;
+			printUsage(argv[0]);
+			return 1;
+		}
+		else if (arg == "--model") {
+			modelPath = argv[++argIndex];
+		}
+		else if (arg == "--dir") {
+			directory = argv[++argIndex];
+		}
+		else if (arg == "--list") {
+			listPath = argv[++argIndex];
+		}
+		else if (arg == "--output") {
+			outputPath = argv[++argIndex];
+		}
+		else if (arg == "--labels") {
+			labelPath = argv[++argIndex];
+		}
+		else if (arg == "--threads") {
+			threadNum = atoi(argv[++argIndex]);
+		}
+		else if (arg == "--batch") {
+			batchSize = atoi(argv[++argIndex]);
+		}
+		else if (arg == "--top") {
+			topK = atoi(argv[++argIndex]);
+		}
+		else {
+			cout << "Unknown option " << arg << "." << endl;
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+	if (modelPath.empty() || directory.empty() == listPath.empty()) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	ConvolutionalNeuralNetwork cnn;
+	if (!cnn.loadModel(modelPath)) {
+		return 2;
+	}
+	if (!cnn.isInitialized()) {
+		cout << "The model " << modelPath << " was saved before it was initialized, so its input size is unknown." << endl;
+		return 2;
+	}
+
+	LabelDictionary labels;
+	if (!labelPath.empty() && !labels.load(labelPath)) {
+		return 1;
+	}
+
+	vector<string> paths = directory.empty() ? BatchClassifier::readFileList(listPath) : BatchClassifier::listImages(directory);
+	if (paths.empty()) {
+		cout << "No images to classify." << endl;
+		return 3;
+	}
+
+	ResultWriter writer(outputPath, ResultWriter::formatFor(outputPath), topK, labelPath.empty() ? nullptr : &labels);
+	if (!writer.isOpen()) {
+		cout << "Could not write " << outputPath << "." << endl;
+		return 3;
+	}
+
+	BatchClassifier classifier(cnn, threadNum, batchSize, topK);
+	BatchStatistics statistics = classifier.classify(paths, writer, showProgress);
+	writer.close();
+	statistics.printStatistics();
+	return 0;
 }
 
-// Message handler for about box.
-INT_PTR CALLBACK About(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
-{
-    UNREFERENCED_PARAMETER(lParam);
-    switch (message)
-    {
-    case WM_INITDIALOG:
-        return (INT_PTR)TRUE;
-
-    case WM_COMMAND:
-        if (LOWORD(wParam) == IDOK || LOWORD(wParam) == IDCANCEL)
-        {
-            EndDialog(hDlg, LOWORD(wParam));
-            return (INT_PTR)TRUE;
-        }
-        break;
-    }
-    return (INT_PTR)FALSE;
+/**
+	Prints the command line options.
+
+	@param program The name the tool was run as
+*/
+void printUsage(const char* program) {
+	cout << "Usage: " << program << " --model <model file> (--dir <image directory> | --list <file with one image path per line>)" << endl;
+	cout << "  --output <file>   Results, as JSON if the name ends in .json, otherwise CSV (default results.csv)" << endl;
+	cout << "  --labels <file>   Class names, one per line in class ID order" << endl;
+	cout << "  --threads <n>     Threads to classify with (default 0, every hardware thread)" << endl;
+	cout << "  --batch <n>       Images a thread takes at a time (default 32)" << endl;
+	cout << "  --top <k>         Best classes written per image (default 1)" << endl;
+	cout << "  --quiet           Do not print progress" << endl;
 }
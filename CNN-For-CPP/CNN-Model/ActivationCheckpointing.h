@@ -0,0 +1,221 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include "CNNLayer.h"
+
+using namespace std;
+
+/**
+	Which activations a training pass keeps for the backward pass. Tensor 0 is the prepared input image and tensor i + 1 is the output
+	of layer i, the same as in a MemoryPlan. Kept tensors (checkpoints) stay in memory from the forward pass until the backward pass
+	needs them. Every other tensor is dropped as soon as the next layer has read it, and is recomputed from the nearest checkpoint
+	before it when the backward pass reaches its segment. The input and the scores are always kept.
+	Sizes are counted in doubles, since every activation is a CV_64F matrix.
+*/
+struct CheckpointPlan {
+	vector<TensorShape> shapes;		// The shape of every tensor
+	vector<double> layerCosts;		// The forward cost of every layer (ex. its measured seconds)
+	vector<bool> kept;				// Whether each tensor is a checkpoint
+
+	int getLayerCount() const {
+		return (int)shapes.size() - 1;
+	}
+
+	/**
+		@param tensorIndex A tensor after the input
+		@return The index of the closest checkpoint before the tensor
+	*/
+	int checkpointBefore(int tensorIndex) const {
+		int checkpoint = tensorIndex - 1;
+		while (checkpoint > 0 && !kept.at(checkpoint)) {
+			checkpoint--;
+		}
+		return checkpoint;
+	}
+
+	/**
+		@return The doubles of the two gradients the backward pass holds at once, for the largest layer
+	*/
+	size_t gradientSize() const {
+		size_t largest = 0;
+		for (int layerIndex = 0; layerIndex < getLayerCount(); layerIndex++) {
+			largest = max(largest, (size_t)shapes.at(layerIndex).size() + shapes.at(layerIndex + 1).size());
+		}
+		return largest;
+	}
+
+	/**
+		The backward pass holds every checkpoint, the recomputed tensors of one segment and two gradients at once.
+
+		@return The most doubles one training pass holds at once with this plan
+	*/
+	size_t peakSize() const {
+		size_t keptSize = 0, largestSegment = 0, segmentSize = 0;
+		for (int tensorIndex = 0; tensorIndex < shapes.size(); tensorIndex++) {
+			if (kept.at(tensorIndex)) {
+				keptSize += shapes.at(tensorIndex).size();
+				segmentSize = 0;
+			}
+			else {
+				segmentSize += shapes.at(tensorIndex).size();
+				largestSegment = max(largestSegment, segmentSize);
+			}
+		}
+		return keptSize + largestSegment + gradientSize();
+	}
+
+	/**
+		@return The most doubles one training pass holds at once if every activation is kept
+	*/
+	size_t fullSize() const {
+		size_t total = 0;
+		for (int tensorIndex = 0; tensorIndex < shapes.size(); tensorIndex++) {
+			total += shapes.at(tensorIndex).size();
+		}
+		return total + gradientSize();
+	}
+
+	/**
+		@return The cost of the layers the backward pass runs again, which are the ones that produce dropped tensors
+	*/
+	double recomputeCost() const {
+		double cost = 0.0;
+		for (int layerIndex = 0; layerIndex < getLayerCount(); layerIndex++) {
+			if (!kept.at(layerIndex + 1)) {
+				cost += layerCosts.at(layerIndex);
+			}
+		}
+		return cost;
+	}
+
+	/**
+		@return The cost of one forward pass
+	*/
+	double forwardCost() const {
+		double cost = 0.0;
+		for (int layerIndex = 0; layerIndex < layerCosts.size(); layerIndex++) {
+			cost += layerCosts.at(layerIndex);
+		}
+		return cost;
+	}
+
+	/**
+		@return The amount of layers the backward pass runs again
+	*/
+	int recomputedLayerCount() const {
+		int count = 0;
+		for (int layerIndex = 0; layerIndex < getLayerCount(); layerIndex++) {
+			count += kept.at(layerIndex + 1) ? 0 : 1;
+		}
+		return count;
+	}
+
+	/**
+		This function prints out which activations are kept and what the plan trades: the memory it saves against the extra forward
+		work it costs.
+	*/
+	void printPlan() const {
+		cout << "Checkpoint Plan" << endl;
+		for (int tensorIndex = 0; tensorIndex < shapes.size(); tensorIndex++) {
+			const TensorShape& shape = shapes.at(tensorIndex);
+			cout << " - Tensor " << tensorIndex << " (" << shape.channels << "x" << shape.rows << "x" << shape.cols << "): " <<
+				(kept.at(tensorIndex) ? "kept" : "recomputed") << endl;
+		}
+		double forward = forwardCost();
+		cout << "Peak bytes per image: " << peakSize() * sizeof(double) << ", Without checkpointing: " << fullSize() * sizeof(double) <<
+			", Recomputed layers: " << recomputedLayerCount() << " of " << getLayerCount() << " (" <<
+			(forward > 0.0 ? 100.0 * recomputeCost() / forward : 0.0) << "% of a forward pass)" << endl << endl;
+	}
+};
+
+class CheckpointPlanner {
+public:
+
+	/**
+		@param shapes The shape of every tensor
+		@param layerCosts The forward cost of every layer
+		@return A plan that keeps every activation, so nothing is recomputed
+	*/
+	static CheckpointPlan keepAll(const vector<TensorShape>& shapes, const vector<double>& layerCosts) {
+		CheckpointPlan plan;
+		plan.shapes = shapes;
+		plan.layerCosts = layerCosts;
+		plan.kept.assign(shapes.size(), true);
+		return plan;
+	}
+
+	/**
+		@param shapes The shape of every tensor
+		@param layerCosts The forward cost of every layer
+		@param layerIndices The layers whose outputs are kept. Other outputs are recomputed.
+		@return The plan
+	*/
+	static CheckpointPlan keepLayers(const vector<TensorShape>& shapes, const vector<double>& layerCosts, const vector<int>& layerIndices) {
+		CheckpointPlan plan = keepAll(shapes, layerCosts);
+		for (int tensorIndex = 1; tensorIndex + 1 < shapes.size(); tensorIndex++) {
+			plan.kept.at(tensorIndex) = find(layerIndices.begin(), layerIndices.end(), tensorIndex - 1) != layerIndices.end();
+		}
+		return plan;
+	}
+
+	/**
+		Keeps as few checkpoints as possible while no segment of dropped tensors holds more than segmentLimit doubles. Scanning
+		forward, a tensor is dropped while its segment still fits, and kept once it does not.
+
+		@param shapes The shape of every tensor
+		@param layerCosts The forward cost of every layer
+		@param segmentLimit The most doubles the dropped tensors between two checkpoints may hold
+		@return The plan
+	*/
+	static CheckpointPlan limitSegments(const vector<TensorShape>& shapes, const vector<double>& layerCosts, size_t segmentLimit) {
+		CheckpointPlan plan = keepAll(shapes, layerCosts);
+		size_t segmentSize = 0;
+		for (int tensorIndex = 1; tensorIndex + 1 < shapes.size(); tensorIndex++) {
+			size_t tensorSize = shapes.at(tensorIndex).size();
+			plan.kept.at(tensorIndex) = segmentSize + tensorSize > segmentLimit;
+			segmentSize = plan.kept.at(tensorIndex) ? 0 : segmentSize + tensorSize;
+		}
+		return plan;
+	}
+
+	/**
+		Finds the plan that recomputes the least while fitting a memory budget. Every limit on the size of a segment gives one plan
+		(see limitSegments). Only the sums of runs of consecutive tensors can change the plan, so those are all tried, and the plan
+		with the lowest recompute cost among the ones that fit is picked. If none fits, the plan with the lowest peak is used.
+
+		@param shapes The shape of every tensor
+		@param layerCosts The forward cost of every layer
+		@param budget The most doubles one training pass may hold at once
+		@return The plan
+	*/
+	static CheckpointPlan plan(const vector<TensorShape>& shapes, const vector<double>& layerCosts, size_t budget) {
+		CheckpointPlan best = keepAll(shapes, layerCosts);
+		if (best.peakSize() <= budget) {
+			return best;
+		}
+		bool fits = false;
+		for (int first = 1; first + 1 < shapes.size(); first++) {
+			size_t segmentLimit = 0;
+			for (int last = first; last + 1 < shapes.size(); last++) {
+				segmentLimit += shapes.at(last).size();
+				CheckpointPlan candidate = limitSegments(shapes, layerCosts, segmentLimit);
+				size_t peak = candidate.peakSize();
+				bool candidateFits = peak <= budget;
+				bool better = fits ? candidateFits && (candidate.recomputeCost() < best.recomputeCost() ||
+					(candidate.recomputeCost() == best.recomputeCost() && peak < best.peakSize())) : candidateFits || peak < best.peakSize();
+				if (better) {
+					best = candidate;
+					fits = candidateFits;
+				}
+			}
+		}
+		if (!fits) {
+			cout << "No checkpoint plan fits in " << budget * sizeof(double) << " bytes. The smallest plan needs " <<
+				best.peakSize() * sizeof(double) << " bytes." << endl;
+		}
+		return best;
+	}
+};
@@ -0,0 +1,315 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <vector>
+#include <tuple>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+
+#include "CNNLayer.h"
+#include "ParameterInit.h"
+
+using namespace std;
+
+/**
+	How much an augmented copy of an image may differ from the original. A setting of 0 turns that change off.
+*/
+struct AugmentationSettings {
+	double minCropScale;		// The smallest crop, as a fraction of the image's width and height (0.0 - 1.0). 1.0 never crops.
+	double flipProbability;		// The chance of mirroring the image left to right
+	double maxRotation;			// The largest rotation in degrees, either way
+	double maxBrightness;		// The largest value added to every pixel, either way, in the image's own units (ex. 0 - 255)
+	double maxContrast;			// The largest relative change of contrast, either way (ex. 0.2 scales the pixels by 0.8 - 1.2)
+	double noiseDeviation;		// The standard deviation of the Gaussian noise added to every pixel, in the image's own units
+
+	AugmentationSettings(double myMinCropScale = 0.8, double myFlipProbability = 0.5, double myMaxRotation = 10.0, double myMaxBrightness = 0.0,
+		double myMaxContrast = 0.0, double myNoiseDeviation = 0.0) : minCropScale(myMinCropScale), flipProbability(myFlipProbability),
+		maxRotation(myMaxRotation), maxBrightness(myMaxBrightness), maxContrast(myMaxContrast), noiseDeviation(myNoiseDeviation) {}
+};
+
+/**
+	Makes randomly changed copies of training images: a random crop scaled back to the network's input size, a mirror, a rotation,
+	a brightness and contrast change and noise. The crop, mirror and rotation are one affine warp, so each copy is read from the
+	original only once. Every random value comes from a counter-based stream keyed by the seed, the epoch and the image's position
+	in the epoch, so a copy does not depend on which thread makes it or when.
+*/
+class Augmenter {
+private:
+	AugmentationSettings settings;
+	unsigned long long seed;
+
+	static const int DRAWS_PER_IMAGE = 8;	// The random values of one copy, before its noise
+
+public:
+
+	/**
+		@param mySettings How much copies may differ from the originals
+		@param mySeed The seed every random value is derived from
+	*/
+	Augmenter(const AugmentationSettings& mySettings = AugmentationSettings(), unsigned long long mySeed = 0) : settings(mySettings),
+		seed(mySeed) {}
+
+	const AugmentationSettings& getSettings() const { return settings; }
+	unsigned long long getSeed() const { return seed; }
+
+	/**
+		@param epoch The pass over the training set
+		@return The key of the stream that orders the images of an epoch
+	*/
+	unsigned long long shuffleKey(unsigned long long epoch) const {
+		return streamKey(seed, 2 * epoch);
+	}
+
+	/**
+		Writes a changed copy of an image.
+
+		@param image The original image, with as many channels as the network's input
+		@param augmented Receives the copy as CV_64F. Its memory is reused when it already has the right size.
+		@param outputSize The size of the copy (the network's input size)
+		@param epoch The pass over the training set
+		@param position The image's position in the epoch
+	*/
+	void augment(const cv::Mat& image, cv::Mat& augmented, cv::Size outputSize, unsigned long long epoch, unsigned long long position) const {
+		unsigned long long key = streamKey(seed, 2 * epoch + 1);
+		unsigned long long counter = position * DRAWS_PER_IMAGE;
+		double draws[DRAWS_PER_IMAGE];
+		for (int drawIndex = 0; drawIndex < DRAWS_PER_IMAGE; drawIndex++) {
+			draws[drawIndex] = counterUniform(key, counter + drawIndex);
+		}
+
+		// The crop keeps the image's aspect ratio and lies inside it
+		double cropScale = settings.minCropScale + (1.0 - settings.minCropScale) * draws[0];
+		double cropWidth = image.cols * cropScale, cropHeight = image.rows * cropScale;
+		double centerX = cropWidth / 2.0 + (image.cols - cropWidth) * draws[1] - 0.5;
+		double centerY = cropHeight / 2.0 + (image.rows - cropHeight) * draws[2] - 0.5;
+		bool mirrored = draws[3] < settings.flipProbability;
+		double angle = settings.maxRotation * (2.0 * draws[4] - 1.0) * CV_PI / 180.0;
+		double brightness = settings.maxBrightness * (2.0 * draws[5] - 1.0);
+		double contrast = 1.0 + settings.maxContrast * (2.0 * draws[6] - 1.0);
+
+		// Maps every output pixel back to the original: scale to the crop, mirror, rotate, then move to the crop's center
+		double scaleX = cropWidth / outputSize.width * (mirrored ? -1.0 : 1.0), scaleY = cropHeight / outputSize.height;
+		double cosine = cos(angle), sine = sin(angle);
+		double outCenterX = (outputSize.width - 1) / 2.0, outCenterY = (outputSize.height - 1) / 2.0;
+		cv::Mat inverseMap(2, 3, CV_64FC1);
+		inverseMap.at<double>(0, 0) = cosine * scaleX;
+		inverseMap.at<double>(0, 1) = -sine * scaleY;
+		inverseMap.at<double>(1, 0) = sine * scaleX;
+		inverseMap.at<double>(1, 1) = cosine * scaleY;
+		inverseMap.at<double>(0, 2) = centerX - inverseMap.at<double>(0, 0) * outCenterX - inverseMap.at<double>(0, 1) * outCenterY;
+		inverseMap.at<double>(1, 2) = centerY - inverseMap.at<double>(1, 0) * outCenterX - inverseMap.at<double>(1, 1) * outCenterY;
+
+		cv::Mat warped;
+		cv::warpAffine(image, warped, inverseMap, outputSize, cv::INTER_LINEAR | cv::WARP_INVERSE_MAP, cv::BORDER_REFLECT_101);
+		warped.convertTo(augmented, CV_64F, contrast, brightness);
+
+		if (settings.noiseDeviation > 0.0) {
+			unsigned long long noiseKey = streamKey(key, position + 1);
+			int valuesPerRow = augmented.cols * augmented.channels();
+			for (int row = 0; row < augmented.rows; row++) {
+				double* augmentedRow = augmented.ptr<double>(row);
+				unsigned long long rowCounter = 2ULL * row * valuesPerRow;
+				for (int i = 0; i < valuesPerRow; i++) {
+					// Box-Muller turns two uniform values into one normal value
+					double radius = sqrt(-2.0 * log(1.0 - counterUniform(noiseKey, rowCounter + 2 * i)));
+					augmentedRow[i] += settings.noiseDeviation * radius * cos(2.0 * CV_PI * counterUniform(noiseKey, rowCounter + 2 * i + 1));
+				}
+			}
+		}
+	}
+};
+
+/**
+	One batch of training images and their labels, ready for Trainer::trainBatch.
+*/
+struct TrainingBatch {
+	vector<cv::Mat> images;
+	vector<int> labels;
+};
+
+/**
+	Augments a labeled set on worker threads just ahead of training, so augmented copies are never stored and the gradient step does
+	not wait for them. The workers fill a small ring of batch buffers in order. Each image is its own task, so several workers share a
+	batch, and a worker only moves on to a buffer once the trainer has given it back. The trainer takes the finished batches in order
+	and trains on the buffers directly.
+
+	The set is only read, so several pipelines (ex. of a hyperparameter sweep) may share one set.
+*/
+class AugmentationPipeline {
+private:
+	const vector<tuple<cv::Mat, int>>& labeledSet;
+	Augmenter augmenter;
+	cv::Size outputSize;
+	int channels;
+	int batchSize;
+	int workerNum;
+
+	vector<TrainingBatch> buffers;		// Batch b of an epoch is written into buffer b % buffers.size()
+	vector<int> finishedImages;			// The images of each buffer that are written
+	vector<int> order;					// The set index of each position in the epoch
+	unsigned long long epoch;
+	long long takenBatches;				// Batches the trainer has taken
+	long long releasedBatches;			// Batches the trainer has given back
+	atomic<long long> nextImage;		// The next position a worker claims
+	bool stopping;
+	mutex stateMutex;
+	condition_variable stateChanged;
+	vector<thread> workers;
+
+	long long batchNum() const {
+		return ((long long)order.size() + batchSize - 1) / batchSize;
+	}
+
+	int imagesInBatch(long long batchIndex) const {
+		return (int)min((long long)batchSize, (long long)order.size() - batchIndex * batchSize);
+	}
+
+	/**
+		Claims positions one at a time and writes each augmented image into its batch buffer, waiting whenever that buffer still holds
+		a batch the trainer has not given back.
+	*/
+	void work() {
+		for (long long position = nextImage.fetch_add(1); position < (long long)order.size(); position = nextImage.fetch_add(1)) {
+			long long batchIndex = position / batchSize;
+			TrainingBatch& buffer = buffers.at(batchIndex % buffers.size());
+			{
+				unique_lock<mutex> lock(stateMutex);
+				stateChanged.wait(lock, [&]() { return stopping || batchIndex < releasedBatches + (long long)buffers.size(); });
+				if (stopping) {
+					return;
+				}
+			}
+
+			int slot = (int)(position % batchSize);
+			const tuple<cv::Mat, int>& labeled = labeledSet.at(order.at(position));
+			if (get<0>(labeled).channels() == channels) {
+				augmenter.augment(get<0>(labeled), buffer.images.at(slot), outputSize, epoch, position);
+			}
+			else {
+				cout << "Image " << order.at(position) << " does not have the network's " << channels << " channels." << endl;
+				buffer.images.at(slot) = cv::Mat::zeros(outputSize, CV_64FC(channels));
+			}
+			buffer.labels.at(slot) = get<1>(labeled);
+
+			lock_guard<mutex> lock(stateMutex);
+			finishedImages.at(batchIndex % buffers.size())++;
+			stateChanged.notify_all();
+		}
+	}
+
+	/**
+		Wakes the workers, tells them to stop and waits for them.
+	*/
+	void stopWorkers() {
+		{
+			lock_guard<mutex> lock(stateMutex);
+			stopping = true;
+			stateChanged.notify_all();
+		}
+		for (int workerIndex = 0; workerIndex < workers.size(); workerIndex++) {
+			workers.at(workerIndex).join();
+		}
+		workers.clear();
+	}
+
+public:
+
+	/**
+		@param myLabeledSet Images with their class IDs {(img1, 3), (img2, 0), ...}. It must outlive the pipeline.
+		@param myAugmenter How the images are changed
+		@param inputShape The network's input dimensions, which every copy is made in
+		@param myBatchSize The amount of images in a batch
+		@param myWorkerNum The amount of worker threads. 0 uses a quarter of the hardware threads, leaving the rest to the trainer.
+		@param bufferedBatches How many batches may be ready or in progress at once, including the one being trained on
+	*/
+	AugmentationPipeline(const vector<tuple<cv::Mat, int>>& myLabeledSet, const Augmenter& myAugmenter, TensorShape inputShape,
+		int myBatchSize = 32, int myWorkerNum = 0, int bufferedBatches = 3) : labeledSet(myLabeledSet), augmenter(myAugmenter),
+		nextImage(0) {
+		outputSize = cv::Size(inputShape.cols, inputShape.rows);
+		channels = inputShape.channels;
+		batchSize = max(1, myBatchSize);
+		workerNum = myWorkerNum <= 0 ? max(1, hardwareThreads() / 4) : myWorkerNum;
+		buffers.resize(max(2, bufferedBatches));
+		finishedImages.assign(buffers.size(), 0);
+		epoch = 0;
+		takenBatches = 0;
+		releasedBatches = 0;
+		stopping = false;
+	}
+
+	~AugmentationPipeline() {
+		stopWorkers();
+	}
+
+	/**
+		Shuffles the set for an epoch and starts the workers on it. An epoch that is still running is abandoned.
+
+		@param myEpoch The pass over the training set. The same seed and epoch give the same batches.
+	*/
+	void startEpoch(unsigned long long myEpoch) {
+		stopWorkers();
+		epoch = myEpoch;
+		order.resize(labeledSet.size());
+		for (int position = 0; position < order.size(); position++) {
+			order.at(position) = position;
+		}
+		unsigned long long key = augmenter.shuffleKey(epoch);
+		for (int position = (int)order.size() - 1; position > 0; position--) {
+			swap(order.at(position), order.at((int)(counterUniform(key, position) * (position + 1))));
+		}
+
+		for (int bufferIndex = 0; bufferIndex < buffers.size(); bufferIndex++) {
+			buffers.at(bufferIndex).images.resize(batchSize);
+			buffers.at(bufferIndex).labels.resize(batchSize);
+		}
+		finishedImages.assign(buffers.size(), 0);
+		takenBatches = 0;
+		releasedBatches = 0;
+		nextImage = 0;
+		stopping = false;
+		for (int workerIndex = 0; workerIndex < min((long long)workerNum, (long long)order.size()); workerIndex++) {
+			workers.push_back(thread(&AugmentationPipeline::work, this));
+		}
+	}
+
+	/**
+		Waits for the next batch of the epoch. Give it back with releaseBatch before taking another one.
+
+		@param batch Receives the batch. Its buffers stay valid until releaseBatch.
+		@return False once every batch of the epoch has been taken
+	*/
+	bool nextBatch(TrainingBatch*& batch) {
+		if (takenBatches >= batchNum()) {
+			return false;
+		}
+		long long batchIndex = takenBatches;
+		int bufferIndex = (int)(batchIndex % buffers.size());
+		unique_lock<mutex> lock(stateMutex);
+		stateChanged.wait(lock, [&]() { return finishedImages.at(bufferIndex) == imagesInBatch(batchIndex); });
+
+		TrainingBatch& buffer = buffers.at(bufferIndex);
+		buffer.images.resize(imagesInBatch(batchIndex));
+		buffer.labels.resize(imagesInBatch(batchIndex));
+		batch = &buffer;
+		takenBatches++;
+		return true;
+	}
+
+	/**
+		Gives the batch taken last back to the workers.
+	*/
+	void releaseBatch() {
+		lock_guard<mutex> lock(stateMutex);
+		finishedImages.at(releasedBatches % buffers.size()) = 0;
+		releasedBatches++;
+		stateChanged.notify_all();
+	}
+
+	int getBatchSize() const { return batchSize; }
+	int getWorkerNum() const { return workerNum; }
+};
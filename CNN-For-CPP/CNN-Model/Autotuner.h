@@ -0,0 +1,357 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+#include "ConvolutionalNeuralNetwork.h"
+#include "ParallelFor.h"
+
+using namespace std;
+
+/**
+	Each timing sample repeats a layer's forward pass until it takes about this long, so small layers are not timed below the
+	clock's resolution.
+*/
+const double TUNING_SAMPLE_SECONDS = 0.0005;
+
+/**
+	The engine picked for one layer of a network.
+*/
+struct LayerTuning {
+	int headIndex;				// The exit head the layer belongs to, or -1 for the network's own layers
+	int layerIndex;				// The index of the layer in the network or in its exit head
+	string signature;
+	LayerEngine engine;
+	bool cached;				// Whether the engine came from the tuning cache instead of being timed
+	bool shared;				// Whether the layer was left alone because another network shares it
+	vector<pair<LayerEngine, double>> seconds;	// The median seconds per forward call of each engine that was timed
+
+	LayerTuning() : headIndex(-1), layerIndex(0), engine(DENSE_ENGINE), cached(false), shared(false) {}
+};
+
+/**
+	The engines an autotuner picked for a network.
+*/
+struct TuningReport {
+	string cpu;
+	vector<LayerTuning> layers;
+	int tunedNum;				// Layers that were timed
+	int cachedNum;				// Layers whose engine came from the cache
+	double seconds;				// The time the tuning took
+
+	TuningReport() : tunedNum(0), cachedNum(0), seconds(0.0) {}
+
+	/**
+		This function prints out the engine of each layer, with the timings of the layers that were timed.
+	*/
+	void printReport() const {
+		cout << "Autotuning on " << cpu << endl;
+		cout << "Tuned layers: " << tunedNum << ", Cached layers: " << cachedNum << ", Seconds: " << seconds << endl;
+		for (int index = 0; index < layers.size(); index++) {
+			const LayerTuning& layer = layers.at(index);
+			cout << " - " << (layer.headIndex >= 0 ? "Exit head " + to_string(layer.headIndex) + " layer " : string("Layer ")) <<
+				layer.layerIndex << " (" << layer.signature << "): " << engineName(layer.engine) << (layer.cached ? " (cached)" : "") <<
+				(layer.shared ? " (shared, not tuned)" : "");
+			for (int engineIndex = 0; engineIndex < layer.seconds.size(); engineIndex++) {
+				cout << (engineIndex == 0 ? " | " : ", ") << engineName(layer.seconds.at(engineIndex).first) << " ms: " <<
+					layer.seconds.at(engineIndex).second * 1000.0;
+			}
+			cout << endl;
+		}
+		cout << endl;
+	}
+};
+
+/**
+	Picks the fastest engine for every layer of a network by timing each engine on the machine the network runs on. The choices are
+	kept in a tuning cache file, keyed by the layer's signature and the CPU, so the next startup on the same machine looks them up
+	instead of timing them again. A cache file can be shared between machines, since each keeps its own entries.
+
+	The cache is a text file with one choice per line: the CPU, the layer signature and the engine name, separated by tabs.
+*/
+class Autotuner {
+private:
+	string cachePath;
+	int runs;
+	string cpu;
+	map<string, LayerEngine> cache;		// Keyed by CPU and layer signature, separated by a tab
+
+	/**
+		@param leaf, subleaf The cpuid leaf to read
+		@param registers Receives eax, ebx, ecx and edx after the cpuid instruction, or zeros on CPUs without it
+	*/
+	static void cpuid(unsigned int leaf, unsigned int subleaf, unsigned int registers[4]) {
+		registers[0] = registers[1] = registers[2] = registers[3] = 0;
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		int values[4];
+		__cpuidex(values, (int)leaf, (int)subleaf);
+		for (int i = 0; i < 4; i++) {
+			registers[i] = (unsigned int)values[i];
+		}
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+		__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+	}
+
+	void loadCache() {
+		ifstream in(cachePath.c_str());
+		string line;
+		while (getline(in, line)) {
+			size_t firstTab = line.find('\t');
+			size_t lastTab = line.rfind('\t');
+			if (line.empty() || line.at(0) == '#' || firstTab == string::npos || firstTab == lastTab) {
+				continue;
+			}
+			string engine = line.substr(lastTab + 1);
+			for (int candidate = DENSE_ENGINE; candidate <= SPARSE_ENGINE; candidate++) {
+				if (engine == engineName((LayerEngine)candidate)) {
+					cache[line.substr(0, lastTab)] = (LayerEngine)candidate;
+				}
+			}
+		}
+	}
+
+	/**
+		Writes the cache to a temporary file, then moves it over the old one, so a crash never leaves half a cache.
+	*/
+	bool saveCache() const {
+		string temporaryPath = cachePath + ".tmp";
+		{
+			ofstream out(temporaryPath.c_str());
+			if (!out) {
+				cout << "Could not write tuning cache " << temporaryPath << "." << endl;
+				return false;
+			}
+			out << "# CPU\tLayer signature\tEngine" << endl;
+			for (auto entry = cache.begin(); entry != cache.end(); entry++) {
+				out << entry->first << "\t" << engineName(entry->second) << endl;
+			}
+			if (!out) {
+				cout << "Could not write tuning cache " << temporaryPath << "." << endl;
+				return false;
+			}
+		}
+		if (!replaceFile(temporaryPath, cachePath)) {
+			cout << "Could not replace tuning cache " << cachePath << "." << endl;
+			return false;
+		}
+		return true;
+	}
+
+	/**
+		@param layer The layer, already switched to the engine to time
+		@param input The matrix input into the layer
+		@param output Receives the layer's output
+		@return The median seconds per forward call
+	*/
+	double timeEngine(const CNNLayer& layer, const vector<cv::Mat>& input, vector<cv::Mat>& output) const {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		layer.forward(input, output);		// Also warms the caches and allocates the output
+		double once = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		int repeats = max(1, min(1000, (int)(TUNING_SAMPLE_SECONDS / max(once, 1e-9))));
+
+		vector<double> samples;
+		for (int run = 0; run < runs; run++) {
+			start = chrono::steady_clock::now();
+			for (int repeat = 0; repeat < repeats; repeat++) {
+				layer.forward(input, output);
+			}
+			samples.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count() / repeats);
+		}
+		nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+		return samples.at(samples.size() / 2);
+	}
+
+	/**
+		Times every engine of a layer and leaves it on the fastest. An engine whose output differs from the layer's current engine by
+		more than rounding is skipped.
+
+		@param layer The layer
+		@param inputShape The dimensions of the matrix input into the layer
+		@param tuning Receives the timings and the chosen engine
+	*/
+	void tuneLayer(CNNLayer& layer, TensorShape inputShape, LayerTuning& tuning) const {
+		vector<cv::Mat> input;
+		CNNLayer::allocateOutput(input, inputShape);
+		for (int channel = 0; channel < input.size(); channel++) {
+			cv::randu(input.at(channel), -1.0, 1.0);
+		}
+		vector<cv::Mat> reference, output;
+		layer.forward(input, reference);
+
+		vector<LayerEngine> engines = layer.getEngines();
+		double bestSeconds = 0.0;
+		for (int engineIndex = 0; engineIndex < engines.size(); engineIndex++) {
+			LayerEngine engine = engines.at(engineIndex);
+			layer.setEngine(engine);
+			double seconds = timeEngine(layer, input, output);
+			double largest = 0.0, difference = 0.0;
+			for (int channel = 0; channel < reference.size(); channel++) {
+				largest = max(largest, cv::norm(reference.at(channel), cv::NORM_INF));
+				difference = max(difference, cv::norm(reference.at(channel), output.at(channel), cv::NORM_INF));
+			}
+			if (difference > 1e-9 * (1.0 + largest)) {
+				cout << "The " << engineName(engine) << " engine of " << tuning.signature << " gives different results, so it is skipped." << endl;
+				continue;
+			}
+			tuning.seconds.push_back(make_pair(engine, seconds));
+			if (tuning.seconds.size() == 1 || seconds < bestSeconds) {
+				bestSeconds = seconds;
+				tuning.engine = engine;
+			}
+		}
+		layer.setEngine(tuning.engine);
+	}
+
+public:
+
+	/**
+		Constructor method for an Autotuner. Reads the tuning cache if it exists.
+
+		@param myCachePath The tuning cache file, which is created if it does not exist
+		@param myRuns The amount of timing samples per engine. The median is used, so a sample slowed down by another process does
+			not decide the choice.
+	*/
+	Autotuner(string myCachePath, int myRuns = 15) {
+		cachePath = myCachePath;
+		runs = max(1, myRuns);
+		cpu = cpuSignature();
+		loadCache();
+	}
+
+	/**
+		@return The CPU's model name, the vector instruction sets the kernels can use and the amount of hardware threads. Choices
+			are only reused on CPUs with the same signature.
+	*/
+	static string cpuSignature() {
+		unsigned int registers[4];
+		cpuid(0x80000000, 0, registers);
+		string brand;
+		if (registers[0] >= 0x80000004) {
+			char text[49] = {};
+			for (unsigned int leaf = 0; leaf < 3; leaf++) {
+				cpuid(0x80000002 + leaf, 0, registers);
+				memcpy(text + leaf * 16, registers, 16);
+			}
+			brand = text;
+			brand.erase(0, brand.find_first_not_of(' '));
+			brand.erase(brand.find_last_not_of(' ') + 1);
+		}
+		if (brand.empty()) {
+			brand = "Unknown CPU";
+		}
+
+		cpuid(0, 0, registers);
+		unsigned int maxLeaf = registers[0];
+		string features;
+		if (maxLeaf >= 1) {
+			cpuid(1, 0, registers);
+			features += registers[2] & (1u << 20) ? " sse4.2" : "";
+			features += registers[2] & (1u << 28) ? " avx" : "";
+			features += registers[2] & (1u << 12) ? " fma" : "";
+		}
+		if (maxLeaf >= 7) {
+			cpuid(7, 0, registers);
+			features += registers[1] & (1u << 5) ? " avx2" : "";
+			features += registers[1] & (1u << 16) ? " avx512f" : "";
+		}
+		return brand + " |" + features + " | " + to_string(hardwareThreads()) + " threads";
+	}
+
+	/**
+		Puts every layer of a network and of its exit heads on its fastest engine. Layers whose signature is in the cache for this CPU
+		are switched without timing. The network must be initialized and must not be running on another thread while it is tuned.
+		Layers that are shared with copies of the network (ex. a StreamingExecutor's or another model's in a ModelRegistry) are left
+		on their engine, since the other network may be running them and may feed them other shapes. Training a pruned fully connected
+		layer (updateParameters or setParameters) moves it back to the dense engine, so tune the network once training is done.
+
+		@param cnn The network
+		@param retune Whether to time every layer again, for example after the program was built with different settings
+		@return The engine of each layer that has a choice
+	*/
+	TuningReport tune(ConvolutionalNeuralNetwork& cnn, bool retune = false) {
+		TuningReport report;
+		report.cpu = cpu;
+		if (!cnn.isInitialized()) {
+			cout << "The network needs to be initialized before it is tuned." << endl;
+			return report;
+		}
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+		// The input shape of every layer, in the order replaceLayers visits them
+		vector<LayerTuning> tunings;
+		vector<TensorShape> inputShapes;
+		vector<TensorShape> layerOutputs;
+		TensorShape shape = cnn.getInputShape();
+		for (int layerIndex = 0; layerIndex < cnn.getLayerCount(); layerIndex++) {
+			LayerTuning tuning;
+			tuning.layerIndex = layerIndex;
+			tunings.push_back(tuning);
+			inputShapes.push_back(shape);
+			shape = cnn.getLayer(layerIndex)->outputShape(shape);
+			layerOutputs.push_back(shape);
+		}
+		for (int headIndex = 0; headIndex < cnn.getExitHeadCount(); headIndex++) {
+			const ExitHead& head = cnn.getExitHead(headIndex);
+			TensorShape headShape = layerOutputs.at(head.afterLayer);
+			for (int layerIndex = 0; layerIndex < head.layers.size(); layerIndex++) {
+				LayerTuning tuning;
+				tuning.headIndex = headIndex;
+				tuning.layerIndex = layerIndex;
+				tunings.push_back(tuning);
+				inputShapes.push_back(headShape);
+				headShape = head.layers.at(layerIndex)->outputShape(headShape);
+			}
+		}
+
+		int visitedNum = 0;
+		cnn.replaceLayers([&](const shared_ptr<CNNLayer>& layer) {
+			LayerTuning& tuning = tunings.at(visitedNum);
+			TensorShape inputShape = inputShapes.at(visitedNum++);
+			if (layer->getEngines().size() < 2) {
+				return layer;
+			}
+			tuning.signature = layer->getSignature(inputShape);
+			if (layer.use_count() > 1) {
+				tuning.engine = layer->getEngine();
+				tuning.shared = true;
+				report.layers.push_back(tuning);
+				return layer;
+			}
+			string key = cpu + "\t" + tuning.signature;
+			auto cached = cache.find(key);
+			if (!retune && cached != cache.end() && layer->setEngine(cached->second)) {
+				tuning.engine = cached->second;
+				tuning.cached = true;
+				report.cachedNum++;
+			}
+			else {
+				tuneLayer(*layer, inputShape, tuning);
+				cache[key] = tuning.engine;
+				report.tunedNum++;
+			}
+			report.layers.push_back(tuning);
+			return layer;
+		});
+
+		if (report.tunedNum > 0) {
+			saveCache();
+		}
+		report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		return report;
+	}
+};
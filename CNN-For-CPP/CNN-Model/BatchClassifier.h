@@ -0,0 +1,465 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+#include "ConvolutionalNeuralNetwork.h"
+#include "OutputHead.h"
+#include "ParallelFor.h"
+
+using namespace std;
+
+/**
+	What happened to one image file.
+*/
+enum ImageStatus {
+	IMAGE_CLASSIFIED,
+	IMAGE_UNREADABLE,		// The file could not be read as an image with the network's channel count
+	IMAGE_FAILED			// The image was read, but the network gave no scores for it
+};
+
+inline const char* statusName(ImageStatus status) {
+	static const char* names[] = { "ok", "unreadable", "failed" };
+	return names[status];
+}
+
+/**
+	The classification of one image file.
+*/
+struct BatchResult {
+	string path;
+	ImageStatus status;				// Nothing else is set unless the image was classified
+	vector<int> classes;			// The best classes, best first
+	vector<double> probabilities;	// The softmax probability of each of those classes
+	double latencySeconds;			// The time from starting to read the file to having its scores
+
+	BatchResult() : status(IMAGE_UNREADABLE), latencySeconds(0.0) {}
+};
+
+/**
+	Writes classification results as they come in, either as CSV (one row per image) or as a JSON array (one object per image), so a
+	run over millions of images never holds more than one batch of results in memory.
+*/
+class ResultWriter {
+public:
+	enum Format { CSV, JSON };
+
+private:
+	ofstream out;
+	Format format;
+	int topK;
+	const LabelDictionary* labels;
+	long long written;
+
+	string labelOf(int classId) const {
+		return labels ? labels->labelName(classId) : to_string(classId);
+	}
+
+	static string csvField(const string& text) {
+		if (text.find_first_of(",\"\r\n") == string::npos) {
+			return text;
+		}
+		string quoted = "\"";
+		for (int i = 0; i < text.size(); i++) {
+			quoted += text[i] == '"' ? "\"\"" : string(1, text[i]);
+		}
+		return quoted + "\"";
+	}
+
+	static string jsonString(const string& text) {
+		ostringstream escaped;
+		escaped << '"';
+		for (int i = 0; i < text.size(); i++) {
+			unsigned char c = (unsigned char)text[i];
+			if (c == '"' || c == '\\') {
+				escaped << '\\' << text[i];
+			}
+			else if (c < 0x20) {
+				escaped << "\\u" << hex << setw(4) << setfill('0') << (int)c << dec << setfill(' ');
+			}
+			else {
+				escaped << text[i];
+			}
+		}
+		escaped << '"';
+		return escaped.str();
+	}
+
+public:
+
+	/**
+		@param path The file to write
+		@param myFormat CSV or JSON
+		@param myTopK The amount of best classes written per image
+		@param myLabels Turns class IDs into names. If null, the IDs are written as the names.
+	*/
+	ResultWriter(string path, Format myFormat, int myTopK = 1, const LabelDictionary* myLabels = nullptr) :
+		out(path.c_str()), format(myFormat), topK(max(1, myTopK)), labels(myLabels), written(0)
+	{
+		out << setprecision(6);
+		if (format == CSV) {
+			out << "path,status,latency_ms";
+			for (int rank = 1; rank <= topK; rank++) {
+				out << ",class_" << rank << ",label_" << rank << ",probability_" << rank;
+			}
+			out << "\n";
+		}
+		else {
+			out << "[";
+		}
+	}
+
+	~ResultWriter() {
+		close();
+	}
+
+	/**
+		@param path A file name
+		@return JSON if the name ends in .json, otherwise CSV
+	*/
+	static Format formatFor(const string& path) {
+		string extension = path.size() >= 5 ? path.substr(path.size() - 5) : "";
+		transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		return extension == ".json" ? JSON : CSV;
+	}
+
+	bool isOpen() const {
+		return out.is_open() && out.good();
+	}
+
+	void write(const BatchResult& result) {
+		if (format == CSV) {
+			out << csvField(result.path) << "," << statusName(result.status) << "," << result.latencySeconds * 1000.0;
+			for (int rank = 0; rank < topK; rank++) {
+				if (rank < result.classes.size()) {
+					out << "," << result.classes.at(rank) << "," << csvField(labelOf(result.classes.at(rank))) << "," << result.probabilities.at(rank);
+				}
+				else {
+					out << ",,,";
+				}
+			}
+			out << "\n";
+		}
+		else {
+			out << (written > 0 ? ",\n" : "\n") << "  {\"path\": " << jsonString(result.path) << ", \"status\": \"" <<
+				statusName(result.status) << "\", \"latency_ms\": " << result.latencySeconds * 1000.0 << ", \"top\": [";
+			for (int rank = 0; rank < result.classes.size(); rank++) {
+				out << (rank > 0 ? ", " : "") << "{\"class\": " << result.classes.at(rank) << ", \"label\": " <<
+					jsonString(labelOf(result.classes.at(rank))) << ", \"probability\": " << result.probabilities.at(rank) << "}";
+			}
+			out << "]}";
+		}
+		written++;
+	}
+
+	/**
+		Finishes the file. Called by the destructor if it was not called before.
+	*/
+	void close() {
+		if (!out.is_open()) {
+			return;
+		}
+		if (format == JSON) {
+			out << (written > 0 ? "\n]\n" : "]\n");
+		}
+		out.close();
+	}
+};
+
+/**
+	Counts latencies in logarithmic buckets, 100 per factor of ten from a microsecond up, so percentiles of a run over any amount of
+	images take a fixed amount of memory and are within about 2% of the exact value.
+*/
+class LatencyHistogram {
+private:
+	static const int BUCKETS_PER_DECADE = 100;
+	static const int DECADES = 10;		// A microsecond to 10000 seconds
+	vector<long long> buckets;
+	long long count;
+	double maxSeconds;
+
+	static double lowestSeconds() {
+		return 1e-6;
+	}
+
+public:
+
+	LatencyHistogram() : buckets(BUCKETS_PER_DECADE * DECADES, 0), count(0), maxSeconds(0.0) {}
+
+	void add(double seconds) {
+		int bucket = seconds > lowestSeconds() ? (int)(log10(seconds / lowestSeconds()) * BUCKETS_PER_DECADE) : 0;
+		buckets.at(min(bucket, (int)buckets.size() - 1))++;
+		count++;
+		maxSeconds = max(maxSeconds, seconds);
+	}
+
+	/**
+		@param fraction Which percentile (ex. 0.99 for the 99th)
+		@return The latency in seconds that this fraction of the latencies stayed under, or 0.0 if there are none
+	*/
+	double percentile(double fraction) const {
+		if (count == 0) {
+			return 0.0;
+		}
+		long long rank = min(count - 1, (long long)(fraction * count));
+		long long seen = 0;
+		int bucket = 0;
+		for (; bucket + 1 < buckets.size(); bucket++) {
+			seen += buckets.at(bucket);
+			if (seen > rank) {
+				break;
+			}
+		}
+		// The middle of the bucket on the logarithmic scale
+		return min(maxSeconds, lowestSeconds() * pow(10.0, (bucket + 0.5) / BUCKETS_PER_DECADE));
+	}
+
+	long long size() const {
+		return count;
+	}
+
+	double maxLatency() const {
+		return maxSeconds;
+	}
+};
+
+/**
+	Throughput and per-image latency of a batch classification run.
+*/
+struct BatchStatistics {
+	long long imageNum;
+	long long unreadable;
+	long long failed;
+	double seconds;
+	LatencyHistogram latencies;		// Seconds per classified image
+
+	BatchStatistics() : imageNum(0), unreadable(0), failed(0), seconds(0.0) {}
+
+	/**
+		@param fraction Which percentile (ex. 0.99 for the 99th)
+		@return The latency in seconds that this fraction of the images stayed under
+	*/
+	double percentile(double fraction) const {
+		return latencies.percentile(fraction);
+	}
+
+	/**
+		This function prints out the throughput and the latency percentiles.
+	*/
+	void printStatistics() const {
+		cout << "Batch Classification" << endl;
+		cout << "Images: " << imageNum << ", Unreadable: " << unreadable << ", Failed: " << failed << ", Seconds: " << seconds <<
+			", Images/second: " << (seconds > 0.0 ? imageNum / seconds : 0.0) << endl;
+		cout << "Latency ms: p50: " << percentile(0.5) * 1000.0 << ", p90: " << percentile(0.9) * 1000.0 << ", p99: " <<
+			percentile(0.99) * 1000.0 << ", max: " << latencies.maxLatency() * 1000.0 << endl << endl;
+	}
+};
+
+/**
+	Classifies image files on disk in parallel batches with one shared network. Each image is read, converted to the network's input
+	size and channel count, classified and written out in the order it was given. The files are worked through in chunks of a few
+	batches per thread, so memory use does not grow with the amount of files.
+*/
+class BatchClassifier {
+private:
+	const ConvolutionalNeuralNetwork& cnn;
+	int threadNum;
+	int batchSize;		// The amount of images a thread takes at a time
+	int topK;
+
+	/**
+		The scratch data of one thread, kept for the whole run.
+	*/
+	struct ThreadScratch {
+		ExecutionContext context;
+		vector<double> probabilities;
+		vector<int> bestClasses;
+	};
+
+	/**
+		Reads, classifies and times one image.
+	*/
+	void classifyFile(const string& path, BatchResult& result, ThreadScratch& scratch) const {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		result = BatchResult();
+		result.path = path;
+
+		cv::Mat image;
+		if (!loadImage(path, image)) {
+			return;
+		}
+		vector<double> scores = cnn.forwardPass(image, scratch.context);
+		if (scores.empty()) {
+			result.status = IMAGE_FAILED;
+			return;
+		}
+		scratch.probabilities.resize(scores.size());
+		softmax(scores.data(), (int)scores.size(), scratch.probabilities.data());
+		topKClasses(scratch.probabilities, topK, scratch.bestClasses);
+
+		result.status = IMAGE_CLASSIFIED;
+		result.classes = scratch.bestClasses;
+		for (int rank = 0; rank < result.classes.size(); rank++) {
+			result.probabilities.push_back(scratch.probabilities.at(result.classes.at(rank)));
+		}
+		result.latencySeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+
+public:
+
+	/**
+		@param myCnn An initialized network, which must outlive this object
+		@param myThreadNum The amount of threads to use. 0 uses every hardware thread.
+		@param myBatchSize The amount of images a thread takes at a time
+		@param myTopK The amount of best classes kept per image
+	*/
+	BatchClassifier(const ConvolutionalNeuralNetwork& myCnn, int myThreadNum = 0, int myBatchSize = 32, int myTopK = 1) : cnn(myCnn)
+	{
+		threadNum = myThreadNum <= 0 ? hardwareThreads() : myThreadNum;
+		batchSize = max(1, myBatchSize);
+		topK = max(1, myTopK);
+	}
+
+	/**
+		Reads an image file as the network expects it: grayscale for a network with one input channel, otherwise color, and resized
+		to the network's input width and height.
+
+		@param path The image file
+		@param image Receives the image
+		@return Whether the file could be read
+	*/
+	bool loadImage(const string& path, cv::Mat& image) const {
+		TensorShape inputShape = cnn.getInputShape();
+		image = cv::imread(path, inputShape.channels == 1 ? cv::IMREAD_GRAYSCALE : cv::IMREAD_COLOR);
+		if (image.empty() || image.channels() != inputShape.channels) {
+			return false;
+		}
+		if (image.rows != inputShape.rows || image.cols != inputShape.cols) {
+			cv::resize(image, image, cv::Size(inputShape.cols, inputShape.rows), 0, 0, cv::INTER_AREA);
+		}
+		return true;
+	}
+
+	/**
+		Classifies every file and writes one result per file, in the order of the paths.
+
+		@param paths The image files
+		@param writer Receives the results
+		@param showProgress Whether to print a line after every chunk of files
+		@return The throughput and latencies of the run
+	*/
+	BatchStatistics classify(const vector<string>& paths, ResultWriter& writer, bool showProgress = true) const {
+		BatchStatistics statistics;
+		if (!cnn.isInitialized() || cnn.getLayerCount() == 0) {
+			cout << "The network needs to be initialized before it can classify images." << endl;
+			return statistics;
+		}
+
+		vector<ThreadScratch> scratches(threadNum);
+		int chunkSize = batchSize * threadNum * 4;	// Enough batches that threads rarely wait for the slowest one in a chunk
+		vector<BatchResult> results(min((size_t)chunkSize, paths.size()));
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (size_t chunkStart = 0; chunkStart < paths.size(); chunkStart += chunkSize) {
+			int chunkImages = (int)min((size_t)chunkSize, paths.size() - chunkStart);
+			int batchNum = (chunkImages + batchSize - 1) / batchSize;
+			parallelFor(batchNum, threadNum, [&](int batchIndex, int threadIndex) {
+				int endIndex = min(chunkImages, (batchIndex + 1) * batchSize);
+				for (int imageIndex = batchIndex * batchSize; imageIndex < endIndex; imageIndex++) {
+					classifyFile(paths.at(chunkStart + imageIndex), results.at(imageIndex), scratches.at(threadIndex));
+				}
+			});
+
+			for (int imageIndex = 0; imageIndex < chunkImages; imageIndex++) {
+				const BatchResult& result = results.at(imageIndex);
+				writer.write(result);
+				if (result.status == IMAGE_CLASSIFIED) {
+					statistics.latencies.add(result.latencySeconds);
+				}
+				else if (result.status == IMAGE_FAILED) {
+					statistics.failed++;
+				}
+				else {
+					statistics.unreadable++;
+				}
+			}
+			statistics.imageNum += chunkImages;
+			if (showProgress) {
+				double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+				cout << "Classified " << statistics.imageNum << " / " << paths.size() << " images (" <<
+					(seconds > 0.0 ? statistics.imageNum / seconds : 0.0) << " images/second)" << endl;
+			}
+		}
+		statistics.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		return statistics;
+	}
+
+	/**
+		@param path A file name
+		@return Whether the name ends in an image extension OpenCV can read
+	*/
+	static bool isImageFile(const string& path) {
+		static const char* extensions[] = { ".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff", ".pgm", ".ppm", ".pbm", ".webp" };
+		size_t dot = path.find_last_of('.');
+		if (dot == string::npos) {
+			return false;
+		}
+		string extension = path.substr(dot);
+		transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		for (int i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+			if (extension == extensions[i]) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+		@param directory A directory of images, which is searched recursively
+		@return The image files in it, sorted by path
+	*/
+	static vector<string> listImages(const string& directory) {
+		vector<cv::String> files;
+		cv::glob(directory + "/*", files, true);
+		vector<string> paths;
+		for (int fileIndex = 0; fileIndex < files.size(); fileIndex++) {
+			string path = files.at(fileIndex);
+			if (isImageFile(path)) {
+				paths.push_back(path);
+			}
+		}
+		sort(paths.begin(), paths.end());
+		return paths;
+	}
+
+	/**
+		@param listPath A text file with one image path per line. Empty lines are skipped.
+		@return The image paths
+	*/
+	static vector<string> readFileList(const string& listPath) {
+		vector<string> paths;
+		ifstream in(listPath.c_str());
+		if (!in) {
+			cout << "Could not read file list " << listPath << "." << endl;
+			return paths;
+		}
+		string path;
+		while (getline(in, path)) {
+			if (!path.empty() && path.back() == '\r') {
+				path.pop_back();
+			}
+			if (!path.empty()) {
+				paths.push_back(path);
+			}
+		}
+		return paths;
+	}
+};
@@ -0,0 +1,397 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <stdio.h>
+#ifdef _WIN32
+#include <tchar.h>
+#endif
+#include <iostream>
+#include <string>
+#include <vector>
+#include <tuple>
+#include <memory>
+#include <cmath>
+#include "CNNLayer.h"
+
+class BatchNormLayer : public CNNLayer {
+private:
+	int channels;
+	double epsilon;					// Added to the variance so a constant channel does not divide by zero
+	double momentum;				// How much each training batch moves the running statistics (0.0 - 1.0)
+	vector<double> gammas;			// The learned scale of each channel
+	vector<double> betas;			// The learned shift of each channel
+	vector<double> runningMeans;	// The mean of each channel, averaged over the training batches
+	vector<double> runningVariances;
+
+public:
+
+	/**
+		Constructor method for a Batch Normalization Layer. This layer normalizes each channel of its input to a mean of 0 and a variance
+		of 1, then scales and shifts it by learned values. This keeps the values flowing through deep stacks of convolutional layers in a
+		steady range, which lets them train. During training each batch is normalized with its own statistics, and running averages of
+		those statistics are kept. At inference the running averages are used, which makes the layer a fixed scale and shift per channel
+		that can be folded into the convolutional layer in front of it.
+
+		@param myEpsilon Added to the variance before taking its square root
+		@param myMomentum How much each training batch moves the running statistics
+	*/
+	BatchNormLayer(double myEpsilon = 1e-5, double myMomentum = 0.1) :CNNLayer()
+	{
+		channels = 0;
+		epsilon = myEpsilon;
+		momentum = myMomentum;
+	}
+
+	/**
+		Creates the per-channel parameters for the depth of the input. A layer that already has parameters for that depth keeps them.
+
+		@param inputShape The dimensions of the matrix input into the layer
+	*/
+	void initialize(TensorShape inputShape) {
+		if (channels == inputShape.channels) {
+			return;
+		}
+		channels = inputShape.channels;
+		gammas.assign(channels, 1.0);
+		betas.assign(channels, 0.0);
+		runningMeans.assign(channels, 0.0);
+		runningVariances.assign(channels, 1.0);
+	}
+
+	/**
+		At inference the layer is gamma * (x - mean) / sqrt(variance + epsilon) + beta, which is scale * x + shift per channel.
+
+		@param scales Receives the scale of each channel
+		@param shifts Receives the shift of each channel
+	*/
+	void scaleAndShift(vector<double>& scales, vector<double>& shifts) const {
+		scales.resize(channels);
+		shifts.resize(channels);
+		for (int channel = 0; channel < channels; channel++) {
+			scales.at(channel) = gammas.at(channel) / sqrt(runningVariances.at(channel) + epsilon);
+			shifts.at(channel) = betas.at(channel) - runningMeans.at(channel) * scales.at(channel);
+		}
+	}
+
+	/**
+		This function normalizes the input with the running statistics.
+
+		@param image The matrix to be normalized
+		@param normalizedImg Receives the normalized matrix, with the same dimensions
+	*/
+	void forward(const vector<cv::Mat>& image, vector<cv::Mat>& normalizedImg) const {
+		TensorShape shape = shapeOf(image);
+		forwardRegion(image, normalizedImg, cv::Rect(0, 0, shape.cols, shape.rows));
+	}
+
+	/**
+		Normalizes a rectangle of the input with the running statistics.
+
+		@param image The matrix to be normalized
+		@param normalizedImg The normalized matrix from the previous call, which is updated in place
+		@param outputRegion The rectangle of every channel to recompute
+	*/
+	void forwardRegion(const vector<cv::Mat>& image, vector<cv::Mat>& normalizedImg, cv::Rect outputRegion) const {
+		allocateOutput(normalizedImg, shapeOf(image));
+		if (image.size() != channels) {
+			cout << "Improper channel count for batch normalization" << endl;
+			return;
+		}
+		for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+			double scale = gammas.at(imgChannel) / sqrt(runningVariances.at(imgChannel) + epsilon);
+			double shift = betas.at(imgChannel) - runningMeans.at(imgChannel) * scale;
+			for (int y = outputRegion.y; y < outputRegion.y + outputRegion.height; y++) {
+				const double* imgRow = image.at(imgChannel).ptr<double>(y);
+				double* normalizedRow = normalizedImg.at(imgChannel).ptr<double>(y);
+				for (int x = outputRegion.x; x < outputRegion.x + outputRegion.width; x++) {
+					normalizedRow[x] = imgRow[x] * scale + shift;
+				}
+			}
+		}
+	}
+
+	cv::Rect affectedRegion(cv::Rect inputRegion, TensorShape inputShape) const {
+		return inputRegion;
+	}
+
+	/**
+		Training mode: normalizes a batch with the mean and variance of each channel over every image and position in the batch, and
+		moves the running statistics towards them. Unlike forward, this modifies the layer, so only one thread may call it.
+
+		@param batch The matrices input into the layer for every image in the batch
+		@param normalizedBatch Receives the normalized matrices
+	*/
+	void forwardTraining(const vector<vector<cv::Mat>>& batch, vector<vector<cv::Mat>>& normalizedBatch) {
+		normalizedBatch.resize(batch.size());
+		if (batch.empty()) {
+			return;
+		}
+		for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+			double sum = 0.0, squareSum = 0.0;
+			long long count = 0;
+			for (int imageIndex = 0; imageIndex < batch.size(); imageIndex++) {
+				const cv::Mat& imgLayer = batch.at(imageIndex).at(imgChannel);
+				for (int y = 0; y < imgLayer.rows; y++) {
+					const double* imgRow = imgLayer.ptr<double>(y);
+					for (int x = 0; x < imgLayer.cols; x++) {
+						sum += imgRow[x];
+						squareSum += imgRow[x] * imgRow[x];
+					}
+				}
+				count += (long long)imgLayer.rows * imgLayer.cols;
+			}
+			double mean = count > 0 ? sum / count : 0.0;
+			double variance = count > 0 ? max(0.0, squareSum / count - mean * mean) : 0.0;
+
+			double scale = gammas.at(imgChannel) / sqrt(variance + epsilon);
+			double shift = betas.at(imgChannel) - mean * scale;
+			for (int imageIndex = 0; imageIndex < batch.size(); imageIndex++) {
+				const cv::Mat& imgLayer = batch.at(imageIndex).at(imgChannel);
+				if (imgChannel == 0) {
+					allocateOutput(normalizedBatch.at(imageIndex), shapeOf(batch.at(imageIndex)));
+				}
+				cv::Mat& normalizedLayer = normalizedBatch.at(imageIndex).at(imgChannel);
+				for (int y = 0; y < imgLayer.rows; y++) {
+					const double* imgRow = imgLayer.ptr<double>(y);
+					double* normalizedRow = normalizedLayer.ptr<double>(y);
+					for (int x = 0; x < imgLayer.cols; x++) {
+						normalizedRow[x] = imgRow[x] * scale + shift;
+					}
+				}
+			}
+
+			// The running variance uses the unbiased estimate, since it stands in for the variance of the whole training set
+			double unbiasedVariance = count > 1 ? variance * count / (count - 1) : variance;
+			runningMeans.at(imgChannel) = (1.0 - momentum) * runningMeans.at(imgChannel) + momentum * mean;
+			runningVariances.at(imgChannel) = (1.0 - momentum) * runningVariances.at(imgChannel) + momentum * unbiasedVariance;
+		}
+	}
+
+	/**
+		Training mode: passes the gradient of a whole batch back through forwardTraining. Each channel was normalized with the mean and
+		variance of the batch, so the gradient of every element also flows through those statistics into every other element of the
+		channel in the batch.
+
+		@param batch The matrices that were input into forwardTraining
+		@param outputGradients How the cost changes with each element of every normalized matrix
+		@param inputGradients If not null, receives how the cost changes with each element of every input matrix
+		@param parameterGradient If not null, receives the gradients of every gamma followed by every beta, summed over the batch
+	*/
+	void backwardTraining(const vector<vector<cv::Mat>>& batch, const vector<vector<cv::Mat>>& outputGradients,
+		vector<vector<cv::Mat>>* inputGradients, double* parameterGradient) const {
+		if (inputGradients) {
+			inputGradients->resize(batch.size());
+			for (int imageIndex = 0; imageIndex < batch.size(); imageIndex++) {
+				allocateOutput(inputGradients->at(imageIndex), shapeOf(batch.at(imageIndex)));
+			}
+		}
+		for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+			double sum = 0.0, squareSum = 0.0;
+			long long count = 0;
+			for (int imageIndex = 0; imageIndex < batch.size(); imageIndex++) {
+				const cv::Mat& imgLayer = batch.at(imageIndex).at(imgChannel);
+				for (int y = 0; y < imgLayer.rows; y++) {
+					const double* imgRow = imgLayer.ptr<double>(y);
+					for (int x = 0; x < imgLayer.cols; x++) {
+						sum += imgRow[x];
+						squareSum += imgRow[x] * imgRow[x];
+					}
+				}
+				count += (long long)imgLayer.rows * imgLayer.cols;
+			}
+			if (count == 0) {
+				continue;
+			}
+			double mean = sum / count;
+			double deviation = 1.0 / sqrt(max(0.0, squareSum / count - mean * mean) + epsilon);
+
+			// gammaGradient is the sum of gradient * normalized input, betaGradient the sum of gradient
+			double gammaGradient = 0.0, betaGradient = 0.0;
+			for (int imageIndex = 0; imageIndex < batch.size(); imageIndex++) {
+				const cv::Mat& imgLayer = batch.at(imageIndex).at(imgChannel);
+				const cv::Mat& gradientLayer = outputGradients.at(imageIndex).at(imgChannel);
+				for (int y = 0; y < imgLayer.rows; y++) {
+					const double* imgRow = imgLayer.ptr<double>(y);
+					const double* gradientRow = gradientLayer.ptr<double>(y);
+					for (int x = 0; x < imgLayer.cols; x++) {
+						gammaGradient += gradientRow[x] * (imgRow[x] - mean) * deviation;
+						betaGradient += gradientRow[x];
+					}
+				}
+			}
+			if (parameterGradient) {
+				parameterGradient[imgChannel] += gammaGradient;
+				parameterGradient[channels + imgChannel] += betaGradient;
+			}
+			if (!inputGradients) {
+				continue;
+			}
+
+			// d input = gamma / sigma * (d output - mean(d output) - normalized input * mean(d output * normalized input))
+			double scale = gammas.at(imgChannel) * deviation;
+			double meanGradient = betaGradient / count, meanGammaGradient = gammaGradient / count;
+			for (int imageIndex = 0; imageIndex < batch.size(); imageIndex++) {
+				const cv::Mat& imgLayer = batch.at(imageIndex).at(imgChannel);
+				const cv::Mat& gradientLayer = outputGradients.at(imageIndex).at(imgChannel);
+				cv::Mat& inputGradientLayer = inputGradients->at(imageIndex).at(imgChannel);
+				for (int y = 0; y < imgLayer.rows; y++) {
+					const double* imgRow = imgLayer.ptr<double>(y);
+					const double* gradientRow = gradientLayer.ptr<double>(y);
+					double* inputGradientRow = inputGradientLayer.ptr<double>(y);
+					for (int x = 0; x < imgLayer.cols; x++) {
+						double normalized = (imgRow[x] - mean) * deviation;
+						inputGradientRow[x] = scale * (gradientRow[x] - meanGradient - normalized * meanGammaGradient);
+					}
+				}
+			}
+		}
+	}
+
+	/**
+		@return The running mean and variance of every channel, which are not parameters but still have to be saved with a run
+	*/
+	int getStatisticCount() const {
+		return 2 * channels;
+	}
+
+	/**
+		@param values Receives every running mean followed by every running variance
+	*/
+	void getStatistics(double* values) const {
+		values = std::copy(runningMeans.begin(), runningMeans.end(), values);
+		std::copy(runningVariances.begin(), runningVariances.end(), values);
+	}
+
+	/**
+		@param values Every running mean followed by every running variance
+	*/
+	void setStatistics(const double* values) {
+		runningMeans.assign(values, values + channels);
+		runningVariances.assign(values + channels, values + 2 * channels);
+	}
+
+	/**
+		@return The scale and shift of every channel
+	*/
+	int getParameterCount() const {
+		return 2 * channels;
+	}
+
+	/**
+		Passes the gradient back through the normalization with the running statistics, the same way forward normalizes. The
+		statistics are treated as constants, which is right for a single image at inference. Training uses backwardTraining instead.
+
+		@param image The matrix that was input into the layer
+		@param normalizedImg The matrix forward produced for image
+		@param outputGradient How the cost changes with each element of normalizedImg
+		@param inputGradient If not null, receives how the cost changes with each element of image
+		@param parameterGradient If not null, receives the gradients of every gamma followed by every beta
+	*/
+	void backward(const vector<cv::Mat>& image, const vector<cv::Mat>& normalizedImg, const vector<cv::Mat>& outputGradient,
+		vector<cv::Mat>* inputGradient, double* parameterGradient) const {
+		if (inputGradient) {
+			allocateOutput(*inputGradient, shapeOf(image));
+		}
+		for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+			double deviation = 1.0 / sqrt(runningVariances.at(imgChannel) + epsilon);
+			double scale = gammas.at(imgChannel) * deviation;
+			double gammaGradient = 0.0, betaGradient = 0.0;
+			for (int y = 0; y < image.at(imgChannel).rows; y++) {
+				const double* imgRow = image.at(imgChannel).ptr<double>(y);
+				const double* gradientRow = outputGradient.at(imgChannel).ptr<double>(y);
+				double* inputGradientRow = inputGradient ? inputGradient->at(imgChannel).ptr<double>(y) : nullptr;
+				for (int x = 0; x < image.at(imgChannel).cols; x++) {
+					gammaGradient += gradientRow[x] * (imgRow[x] - runningMeans.at(imgChannel)) * deviation;
+					betaGradient += gradientRow[x];
+					if (inputGradientRow) {
+						inputGradientRow[x] = gradientRow[x] * scale;
+					}
+				}
+			}
+			if (parameterGradient) {
+				parameterGradient[imgChannel] += gammaGradient;
+				parameterGradient[channels + imgChannel] += betaGradient;
+			}
+		}
+	}
+
+	/**
+		@param changes The change of every gamma followed by the change of every beta
+	*/
+	void updateParameters(const double* changes) {
+		for (int channel = 0; channel < channels; channel++) {
+			gammas.at(channel) += changes[channel];
+			betas.at(channel) += changes[channels + channel];
+		}
+	}
+
+	/**
+		@param values Receives every gamma followed by every beta
+	*/
+	void getParameters(double* values) const {
+		values = std::copy(gammas.begin(), gammas.end(), values);
+		std::copy(betas.begin(), betas.end(), values);
+	}
+
+	/**
+		@param values Every gamma followed by every beta
+	*/
+	void setParameters(const double* values) {
+		gammas.assign(values, values + channels);
+		betas.assign(values + channels, values + 2 * channels);
+	}
+
+	/**
+		Each output element only depends on the input element at the same position, so the input can be overwritten.
+	*/
+	bool worksInPlace() const {
+		return true;
+	}
+
+	int getChannels() const { return channels; }
+
+	/**
+		Writes the layer's attributes, learned parameters and running statistics to a model file.
+
+		@param out The model file
+	*/
+	void save(ostream& out) const {
+		writeValue<int>(out, BATCH_NORM_LAYER);
+		writeValue<double>(out, epsilon);
+		writeValue<double>(out, momentum);
+		writeVector(out, gammas);
+		writeVector(out, betas);
+		writeVector(out, runningMeans);
+		writeVector(out, runningVariances);
+	}
+
+	/**
+		Reads a layer written by save. The type tag has already been read by the caller.
+
+		@param in The model file
+		@return The layer, or nullptr if the file is damaged
+	*/
+	static shared_ptr<BatchNormLayer> load(istream& in) {
+		double myEpsilon = readValue<double>(in);
+		double myMomentum = readValue<double>(in);
+		shared_ptr<BatchNormLayer> layer(new BatchNormLayer(myEpsilon, myMomentum));
+		layer->gammas = readVector<double>(in);
+		layer->betas = readVector<double>(in);
+		layer->runningMeans = readVector<double>(in);
+		layer->runningVariances = readVector<double>(in);
+		layer->channels = (int)layer->gammas.size();
+		if (!in || myEpsilon < 0.0 || layer->betas.size() != layer->channels || layer->runningMeans.size() != layer->channels ||
+			layer->runningVariances.size() != layer->channels) {
+			return nullptr;
+		}
+		return layer;
+	}
+
+	/**
+		This function prints out the layer's description and attributes.
+	*/
+	void printLayer() {
+		cout << "Batch Normalization Layer" << endl;
+		cout << "Channel number: " << channels << ", Epsilon: " << epsilon << ", Momentum: " << momentum << endl << endl;
+	}
+};
@@ -0,0 +1,406 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+
+#include "CNNLayer.h"
+#include "ConvolutionalLayer.h"
+#include "FullyConnectedLayer.h"
+#include "SpecializedKernels.h"
+#include "BlockedConvolution.h"
+#include "HalfPrecisionConvolutionalLayer.h"
+#include "HalfPrecisionFullyConnectedLayer.h"
+#include "Trainer.h"
+#include "Autotuner.h"
+#include "PostTrainingQuantization.h"
+
+using namespace std;
+
+/**
+	Measures the average seconds one forward call of a layer takes.
+
+	@param layer The layer to time
+	@param input The matrix input into the layer
+	@param runs The amount of calls to average over
+	@return The average seconds per call
+*/
+inline double timeLayer(const CNNLayer& layer, const vector<cv::Mat>& input, int runs) {
+	vector<cv::Mat> output;
+	layer.forward(input, output);	// Allocates the output before timing
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int run = 0; run < runs; run++) {
+		layer.forward(input, output);
+	}
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count() / runs;
+}
+
+/**
+	Makes a 3D matrix filled with random values.
+
+	@param shape The dimensions of the matrix
+*/
+inline vector<cv::Mat> randomTensor(TensorShape shape) {
+	vector<cv::Mat> tensor;
+	CNNLayer::allocateOutput(tensor, shape);
+	for (int channel = 0; channel < shape.channels; channel++) {
+		randu(tensor.at(channel), -1.0, 1.0);
+	}
+	return tensor;
+}
+
+/**
+	Times the dense and sparse kernels of a fully connected and a convolutional layer at increasing sparsity, and prints the
+	lowest sparsity at which the sparse kernel wins. SPARSE_CROSSOVER should be set from this on the target machine.
+
+	@param runs The amount of calls to average every measurement over
+*/
+inline void benchmarkSparseCrossover(int runs = 20) {
+	const double sparsities[] = { 0.0, 0.25, 0.5, 0.6, 0.7, 0.8, 0.9, 0.95, 0.99 };
+	const int sparsityNum = sizeof(sparsities) / sizeof(sparsities[0]);
+
+	TensorShape fcInputShape(16, 32, 32);
+	vector<cv::Mat> fcInput = randomTensor(fcInputShape);
+	TensorShape convInputShape(8, 64, 64);
+	vector<cv::Mat> convInput = randomTensor(convInputShape);
+
+	for (int layerKind = 0; layerKind < 2; layerKind++) {
+		cout << (layerKind == 0 ? "Fully Connected Layer (16x32x32 -> 64)" : "Convolutional Layer (8x64x64, 16 filters 5x5)") << endl;
+		double crossover = -1.0;
+		for (int sparsityIndex = 0; sparsityIndex < sparsityNum; sparsityIndex++) {
+			double sparsity = sparsities[sparsityIndex];
+			double seconds[2];
+			for (int sparseKernel = 0; sparseKernel < 2; sparseKernel++) {
+				// sparseAbove 0.0 always switches to the sparse kernel, anything above 1.0 never does
+				double sparseAbove = sparseKernel == 1 ? 0.0 : 2.0;
+				if (layerKind == 0) {
+					FullyConnectedLayer layer(64);
+					layer.initialize(fcInputShape);
+					layer.pruneToSparsity(sparsity, sparseAbove);
+					seconds[sparseKernel] = timeLayer(layer, fcInput, runs);
+				}
+				else {
+					ConvolutionalLayer layer(16, 5, 5, 1, 1, convInputShape.channels);
+					layer.pruneToSparsity(sparsity, sparseAbove);
+					seconds[sparseKernel] = timeLayer(layer, convInput, runs);
+				}
+			}
+			if (crossover < 0.0 && seconds[1] < seconds[0]) {
+				crossover = sparsity;
+			}
+			cout << " - Sparsity " << sparsity << ": Dense ms: " << seconds[0] * 1000.0 << ", Sparse ms: " << seconds[1] * 1000.0 <<
+				", Speedup: " << seconds[0] / seconds[1] << endl;
+		}
+		if (crossover < 0.0) {
+			cout << "The sparse kernel never won." << endl << endl;
+		}
+		else {
+			cout << "The sparse kernel wins from sparsity " << crossover << " (SPARSE_CROSSOVER is " << SPARSE_CROSSOVER << ")" << endl << endl;
+		}
+	}
+}
+
+/**
+	Times every specialized convolution and pooling kernel against the generic kernel on the same input and prints the speedup
+	of each shape.
+
+	@param runs The amount of calls to average every measurement over
+*/
+inline void benchmarkSpecializedKernels(int runs = 20) {
+	TensorShape inputShape(8, 64, 64);
+	vector<cv::Mat> input = randomTensor(inputShape);
+	const int filterNum = 16;
+
+	cout << "Specialized Kernels (8x64x64 input, 16 filters)" << endl;
+	for (int entryIndex = 0; entryIndex < SPECIALIZED_KERNEL_NUM; entryIndex++) {
+		const KernelEntry<ConvolutionKernel>& convEntry = CONVOLUTION_KERNELS[entryIndex];
+		const KernelEntry<PoolingKernel>& poolEntry = POOLING_KERNELS[entryIndex];
+		int width = convEntry.subsecWidth, height = convEntry.subsecHeight, slideX = convEntry.slideX, slideY = convEntry.slideY;
+
+		vector<vector<cv::Mat>> filters(filterNum);
+		vector<double> biases(filterNum, 0.0);
+		for (int filterIndex = 0; filterIndex < filterNum; filterIndex++) {
+			filters.at(filterIndex) = randomTensor(TensorShape(inputShape.channels, height, width));
+		}
+		TensorShape outShape(filterNum, (inputShape.rows - height) / slideY + 1, (inputShape.cols - width) / slideX + 1);
+		vector<cv::Mat> convOutput;
+		CNNLayer::allocateOutput(convOutput, outShape);
+		cv::Mat poolOutput(outShape.rows, outShape.cols, CV_64FC1);
+
+		double seconds[4];	// Generic conv, specialized conv, generic pool, specialized pool
+		for (int variant = 0; variant < 4; variant++) {
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			for (int run = 0; run < runs; run++) {
+				if (variant < 2) {
+					ConvolutionKernel kernel = variant == 0 ? &convolveGeneric : convEntry.kernel;
+					kernel(input, filters, biases, convOutput, width, height, slideX, slideY);
+				}
+				else {
+					PoolingKernel kernel = variant == 2 ? &poolGeneric : poolEntry.kernel;
+					for (int channel = 0; channel < inputShape.channels; channel++) {
+						kernel(input.at(channel), poolOutput, width, height, slideX, slideY);
+					}
+				}
+			}
+			seconds[variant] = chrono::duration<double>(chrono::steady_clock::now() - start).count() / runs;
+		}
+		cout << " - " << width << "x" << height << " slide " << slideX << ": Convolution generic ms: " << seconds[0] * 1000.0 <<
+			", specialized ms: " << seconds[1] * 1000.0 << ", speedup: " << seconds[0] / seconds[1] <<
+			" | Pooling generic ms: " << seconds[2] * 1000.0 << ", specialized ms: " << seconds[3] * 1000.0 <<
+			", speedup: " << seconds[2] / seconds[3] << endl;
+	}
+	cout << endl;
+}
+
+/**
+	Times the channel-blocked convolution against the per-channel convolution on a large image, and prints the memory each needs
+	next to what an im2col lowering of the same layer would need.
+
+	@param runs The amount of calls to average every measurement over
+*/
+inline void benchmarkBlockedConvolution(int runs = 5) {
+	const int shapes[][5] = { { 16, 128, 128, 32, 3 }, { 32, 128, 128, 32, 3 }, { 16, 128, 128, 16, 5 } };	// Channels, rows, cols, filters, size
+	const int shapeNum = sizeof(shapes) / sizeof(shapes[0]);
+
+	cout << "Blocked Convolution (" << CHANNEL_BLOCK << " channels per block)" << endl;
+	for (int shapeIndex = 0; shapeIndex < shapeNum; shapeIndex++) {
+		TensorShape inputShape(shapes[shapeIndex][0], shapes[shapeIndex][1], shapes[shapeIndex][2]);
+		int filterNum = shapes[shapeIndex][3], size = shapes[shapeIndex][4];
+		ConvolutionalLayer layer(filterNum, size, size, 1, 1, inputShape.channels);
+		BlockedConvolution blockedLayer(layer);
+		vector<cv::Mat> input = randomTensor(inputShape);
+		TensorShape outShape = layer.outputShape(inputShape);
+
+		double seconds = timeLayer(layer, input, runs);
+		BlockedTensor blockedInput, blockedOutput;
+		blockedInput.fromMats(input);
+		blockedLayer.forward(blockedInput, blockedOutput);	// Allocates the output before timing
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (int run = 0; run < runs; run++) {
+			blockedLayer.forward(blockedInput, blockedOutput);
+		}
+		double blockedSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count() / runs;
+
+		// im2col copies every input window into its own column: (channels * size * size) x (output positions)
+		double im2colMB = (double)inputShape.channels * size * size * outShape.rows * outShape.cols * sizeof(double) / (1024.0 * 1024.0);
+		double blockedMB = (double)(blockedInput.data.size() + blockedOutput.data.size()) * sizeof(double) / (1024.0 * 1024.0);
+		cout << " - " << inputShape.channels << "x" << inputShape.rows << "x" << inputShape.cols << ", " << filterNum << " filters " <<
+			size << "x" << size << ": Per-channel ms: " << seconds * 1000.0 << ", Blocked ms: " << blockedSeconds * 1000.0 <<
+			", Speedup: " << seconds / blockedSeconds << " | im2col buffer MB: " << im2colMB << ", Blocked input and output MB: " <<
+			blockedMB << endl;
+	}
+	cout << endl;
+}
+
+/**
+	Trains a small network on random images with every activation kept, and again with checkpoints chosen for 85% and 75% of
+	that memory, and prints the activation memory each plan held against the time it took.
+
+	@param batches The amount of batches to train with each plan
+*/
+inline void benchmarkActivationCheckpointing(int batches = 4) {
+	ConvolutionalNeuralNetwork cnn;
+	cnn.addConvolutionalLayer(8, 3, 3, 1, 1, 3);
+	cnn.addActivationLayer();
+	cnn.addConvolutionalLayer(8, 3, 3, 1, 1, 8);
+	cnn.addActivationLayer();
+	cnn.addPoolingLayer(2, 2, 2, 2);
+	cnn.addConvolutionalLayer(16, 3, 3, 1, 1, 8);
+	cnn.addActivationLayer();
+	cnn.addPoolingLayer(2, 2, 2, 2);
+	cnn.addFullyConnectedLayer(10);
+	cnn.initializeNetwork(64, 64, 3);
+
+	vector<cv::Mat> images;
+	vector<int> labels;
+	for (int imageIndex = 0; imageIndex < 16; imageIndex++) {
+		cv::Mat image(64, 64, CV_64FC3);
+		randu(image, 0.0, 1.0);
+		images.push_back(image);
+		labels.push_back(imageIndex % 10);
+	}
+
+	cout << "Activation Checkpointing (3x64x64 input, 16 images per batch)" << endl;
+	const double budgetFractions[] = { 1.0, 0.85, 0.75 };
+	for (int planIndex = 0; planIndex < 3; planIndex++) {
+		Trainer trainer(cnn, 0.001, (int)images.size());
+		trainer.setMemoryBudget((size_t)(trainer.getCheckpointPlan().fullSize() * sizeof(double) * budgetFractions[planIndex]));
+		TrainingStatistics statistics;
+		for (int batch = 0; batch < batches; batch++) {
+			statistics.add(trainer.trainBatch(images, labels));
+		}
+		cout << " - Budget " << budgetFractions[planIndex] * 100.0 << "%: Activation bytes per thread: " << statistics.peakSize * sizeof(double) <<
+			", Recomputed layers: " << trainer.getCheckpointPlan().recomputedLayerCount() << " of " << cnn.getLayerCount() <<
+			", ms per batch: " << statistics.seconds * 1000.0 / batches << ", Recompute ms per batch: " <<
+			statistics.recomputeSeconds * 1000.0 / batches << endl;
+	}
+	cout << endl;
+}
+
+/**
+	Times a large fully connected layer and a convolutional layer with double weights against the same layers with fp16 and bf16
+	weights, and prints the weight memory and the largest output difference of each.
+
+	@param runs The amount of calls to average every measurement over
+*/
+inline void benchmarkHalfPrecision(int runs = 20) {
+	TensorShape fcInputShape(16, 32, 32);
+	vector<cv::Mat> fcInput = randomTensor(fcInputShape);
+	FullyConnectedLayer fcLayer(256);
+	fcLayer.initialize(fcInputShape);
+	TensorShape convInputShape(16, 64, 64);
+	vector<cv::Mat> convInput = randomTensor(convInputShape);
+	ConvolutionalLayer convLayer(32, 3, 3, 1, 1, convInputShape.channels);
+
+	const HalfFormat formats[] = { FP16_FORMAT, BF16_FORMAT };
+	for (int layerKind = 0; layerKind < 2; layerKind++) {
+		cout << (layerKind == 0 ? "16-bit Weights, Fully Connected Layer (16x32x32 -> 256)" :
+			"16-bit Weights, Convolutional Layer (16x64x64, 32 filters 3x3)") << endl;
+		const CNNLayer& layer = layerKind == 0 ? (const CNNLayer&)fcLayer : (const CNNLayer&)convLayer;
+		const vector<cv::Mat>& input = layerKind == 0 ? fcInput : convInput;
+		size_t weightNum = layerKind == 0 ? fcLayer.getWeights().size() : convLayer.getWeights().size();
+		vector<cv::Mat> output, halfOutput;
+		layer.forward(input, output);
+		double seconds = timeLayer(layer, input, runs);
+		cout << " - double: ms: " << seconds * 1000.0 << ", Weight MB: " << weightNum * sizeof(double) / (1024.0 * 1024.0) << endl;
+
+		for (int formatIndex = 0; formatIndex < 2; formatIndex++) {
+			shared_ptr<CNNLayer> halfLayer;
+			if (layerKind == 0) {
+				halfLayer.reset(new HalfPrecisionFullyConnectedLayer(fcLayer, formats[formatIndex]));
+			}
+			else {
+				halfLayer.reset(new HalfPrecisionConvolutionalLayer(convLayer, formats[formatIndex]));
+			}
+			halfLayer->forward(input, halfOutput);
+			double maxDifference = 0.0;
+			for (int channel = 0; channel < output.size(); channel++) {
+				maxDifference = max(maxDifference, cv::norm(output.at(channel), halfOutput.at(channel), cv::NORM_INF));
+			}
+			double halfSeconds = timeLayer(*halfLayer, input, runs);
+			cout << " - " << halfFormatName(formats[formatIndex]) << ": ms: " << halfSeconds * 1000.0 << ", Speedup: " << seconds / halfSeconds <<
+				", Weight MB: " << weightNum * sizeof(uint16_t) / (1024.0 * 1024.0) << ", Largest output difference: " << maxDifference << endl;
+		}
+		cout << endl;
+	}
+}
+
+/**
+	Tunes a network with a pruned convolutional layer and a pruned fully connected layer twice: first with an empty tuning cache, so
+	every layer is timed, then again, so every choice comes from the cache.
+
+	@param cachePath The tuning cache file to use, which is replaced
+*/
+inline void benchmarkAutotuner(string cachePath = "benchmark.tuning") {
+	ConvolutionalNeuralNetwork cnn;
+	cnn.addConvolutionalLayer(16, 3, 3, 1, 1, 8);
+	cnn.addActivationLayer();
+	cnn.addPoolingLayer(2, 2, 2, 2);
+	cnn.addConvolutionalLayer(16, 5, 5, 1, 1, 16);
+	cnn.addActivationLayer();
+	cnn.addFullyConnectedLayer(64);
+	cnn.initializeNetwork(64, 64, 8);
+	// The crossover puts the first pruned layer on its sparse kernel and leaves the second dense. The autotuner times both.
+	cnn.pruneLayer(3, 0.9);
+	cnn.pruneLayer(5, 0.3);
+
+	std::remove(cachePath.c_str());
+	for (int pass = 0; pass < 2; pass++) {
+		Autotuner autotuner(cachePath);
+		cout << (pass == 0 ? "Autotuner, empty cache" : "Autotuner, cached") << endl;
+		autotuner.tune(cnn).printReport();
+	}
+}
+
+/**
+	Saves and reloads a small network for every kind of layer the model file stores, and checks that the reloaded network gives
+	the same scores. A layer whose save or load gets out of step with the other shows up here as a failed load or a difference.
+
+	@param path The model file to use, which is removed afterwards
+	@return Whether every network came back with the same scores
+*/
+inline bool benchmarkModelRoundTrip(string path = "benchmark.cnn") {
+	const int rows = 12, cols = 12, channels = 3, classNum = 10;
+	vector<cv::Mat> images;
+	for (int imageIndex = 0; imageIndex < 8; imageIndex++) {
+		cv::Mat image(rows, cols, CV_64FC3);
+		cv::randu(image, -1.0, 1.0);
+		images.push_back(image);
+	}
+
+	// One network per kind of layer, built from a dense layer and then converted where needed
+	const char* names[] = { "Convolutional, dense", "Convolutional, sparse", "Fully connected, dense", "Fully connected, sparse",
+		"Quantized convolutional", "Quantized fully connected", "Batch normalization", "RELU and pooling", "Exit head",
+		"16-bit convolutional (fp16)", "16-bit fully connected (bf16)", "Quantized with exit head" };
+	vector<pair<string, ConvolutionalNeuralNetwork>> networks;
+	for (int kind = 0; kind < 12; kind++) {
+		ConvolutionalNeuralNetwork cnn;
+		if (kind <= 1 || kind == 4 || kind == 9) {
+			cnn.addConvolutionalLayer(4, 3, 3, 1, 1, channels);
+		}
+		else if (kind <= 3 || kind == 5 || kind == 10) {
+			cnn.addFullyConnectedLayer(classNum);
+		}
+		else if (kind == 6) {
+			cnn.addBatchNormLayer();
+		}
+		else if (kind == 7) {
+			cnn.addActivationLayer();
+			cnn.addPoolingLayer(2, 2, 2, 2);
+		}
+		else {
+			cnn.addConvolutionalLayer(4, 3, 3, 1, 1, channels);
+			cnn.addActivationLayer();
+			cnn.addFullyConnectedLayer(classNum);
+			cnn.addExitHead(1, 0.0, classNum);
+		}
+		cnn.initializeNetwork(rows, cols, channels);
+
+		if (kind == 1 || kind == 3) {
+			cnn.pruneLayer(0, 0.9);
+		}
+		else if (kind == 4 || kind == 5 || kind == 11) {
+			cnn = PostTrainingQuantization::quantize(cnn, images);
+		}
+		else if (kind == 6) {
+			cnn.updateBatchNormStatistics(images);
+		}
+		else if (kind == 9 || kind == 10) {
+			cnn.storeWeightsAsHalf(kind == 9 ? FP16_FORMAT : BF16_FORMAT);
+		}
+		networks.push_back(make_pair(string(names[kind]), cnn));
+	}
+
+	cout << "Model File Round Trip" << endl;
+	bool allMatch = true;
+	ExecutionContext context, loadedContext;
+	for (int networkIndex = 0; networkIndex < networks.size(); networkIndex++) {
+		const ConvolutionalNeuralNetwork& cnn = networks.at(networkIndex).second;
+		ConvolutionalNeuralNetwork loaded;
+		bool loadedOk = cnn.saveModel(path) && loaded.loadModel(path);
+		loadedOk = loadedOk && loaded.getLayerCount() == cnn.getLayerCount() && loaded.getExitHeadCount() == cnn.getExitHeadCount();
+
+		// Early exit passes cover the exit heads too, and are the same as forwardPass for networks without heads
+		double maxDifference = 0.0;
+		for (int imageIndex = 0; imageIndex < images.size() && loadedOk; imageIndex++) {
+			int exitIndex, loadedExitIndex;
+			vector<double> scores = cnn.forwardPassEarlyExit(images.at(imageIndex), context, &exitIndex);
+			vector<double> loadedScores = loaded.forwardPassEarlyExit(images.at(imageIndex), loadedContext, &loadedExitIndex);
+			if (scores.empty() || scores.size() != loadedScores.size() || exitIndex != loadedExitIndex) {
+				loadedOk = false;
+				break;
+			}
+			for (int scoreIndex = 0; scoreIndex < scores.size(); scoreIndex++) {
+				maxDifference = max(maxDifference, fabs(scores.at(scoreIndex) - loadedScores.at(scoreIndex)));
+			}
+		}
+		bool match = loadedOk && maxDifference == 0.0;
+		allMatch = allMatch && match;
+		cout << " - " << networks.at(networkIndex).first << ": " << (match ? "ok" : loadedOk ? "scores differ" : "could not be reloaded") <<
+			", Largest score difference: " << maxDifference << endl;
+	}
+	std::remove(path.c_str());
+	cout << endl;
+	return allMatch;
+}
@@ -0,0 +1,429 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "ConvolutionalNeuralNetwork.h"
+
+using namespace std;
+
+/**
+	Channels are interleaved in blocks of CHANNEL_BLOCK, so the values of CHANNEL_BLOCK channels at one position sit next to each
+	other in memory (NCHWc). 4 doubles fill one AVX2 register, so the innermost loops over a block map onto single vector instructions.
+*/
+const int CHANNEL_BLOCK = 4;
+
+/**
+	Output positions computed together by the convolution. Their accumulators stay in registers while the filter taps stream past.
+*/
+const int TILE_WIDTH = 4;
+
+/**
+	Output rows computed for every block of filters before moving on, so the input rows they read stay in the L2 cache while each
+	block of filters (which stays in L1 for common sizes) is applied to them.
+*/
+const int TILE_ROWS = 4;
+
+/**
+	A 3D matrix in the channel-blocked layout: block, row, column, then channel within the block. Channels past the last real channel
+	are padding and always hold zero.
+*/
+struct BlockedTensor {
+	int channels, rows, cols, blockNum;
+	vector<double> data;
+
+	BlockedTensor() : channels(0), rows(0), cols(0), blockNum(0) {}
+
+	/**
+		Resizes the tensor, reusing its memory when the size does not change.
+	*/
+	void allocate(int myChannels, int myRows, int myCols) {
+		channels = myChannels;
+		rows = myRows;
+		cols = myCols;
+		blockNum = (channels + CHANNEL_BLOCK - 1) / CHANNEL_BLOCK;
+		data.resize((size_t)blockNum * rows * cols * CHANNEL_BLOCK);
+	}
+
+	TensorShape shape() const {
+		return TensorShape(channels, rows, cols);
+	}
+
+	double* pixel(int block, int row, int col) {
+		return data.data() + (((size_t)block * rows + row) * cols + col) * CHANNEL_BLOCK;
+	}
+
+	const double* pixel(int block, int row, int col) const {
+		return data.data() + (((size_t)block * rows + row) * cols + col) * CHANNEL_BLOCK;
+	}
+
+	/**
+		Converts a vector of 2D Mats into the blocked layout.
+
+		@param image The 3D matrix
+	*/
+	void fromMats(const vector<cv::Mat>& image) {
+		TensorShape imageShape = CNNLayer::shapeOf(image);
+		allocate(imageShape.channels, imageShape.rows, imageShape.cols);
+		for (int block = 0; block < blockNum; block++) {
+			for (int row = 0; row < rows; row++) {
+				double* blockedRow = pixel(block, row, 0);
+				for (int lane = 0; lane < CHANNEL_BLOCK; lane++) {
+					int channel = block * CHANNEL_BLOCK + lane;
+					const double* imgRow = channel < channels ? image.at(channel).ptr<double>(row) : nullptr;
+					for (int col = 0; col < cols; col++) {
+						blockedRow[col * CHANNEL_BLOCK + lane] = imgRow ? imgRow[col] : 0.0;
+					}
+				}
+			}
+		}
+	}
+
+	/**
+		Converts the blocked layout back into a vector of 2D Mats, dropping the padding channels.
+
+		@param image Receives the 3D matrix
+	*/
+	void toMats(vector<cv::Mat>& image) const {
+		CNNLayer::allocateOutput(image, shape());
+		for (int channel = 0; channel < channels; channel++) {
+			int block = channel / CHANNEL_BLOCK, lane = channel % CHANNEL_BLOCK;
+			for (int row = 0; row < rows; row++) {
+				const double* blockedRow = pixel(block, row, 0);
+				double* imgRow = image.at(channel).ptr<double>(row);
+				for (int col = 0; col < cols; col++) {
+					imgRow[col] = blockedRow[col * CHANNEL_BLOCK + lane];
+				}
+			}
+		}
+	}
+};
+
+/**
+	A layer that works on the channel-blocked layout. It is built from one of the network's layers and gives the same result.
+*/
+class BlockedLayer {
+public:
+	virtual ~BlockedLayer() {}
+	virtual void forward(const BlockedTensor& image, BlockedTensor& output) const = 0;
+};
+
+/**
+	Direct convolution on the blocked layout. Filters are stored blocked by output channel, so one multiply-add applies an input value
+	to CHANNEL_BLOCK filters at once, and TILE_WIDTH neighbouring outputs of those filters are accumulated in registers. Unlike im2col
+	lowering, the input is never copied, so large images need no extra memory.
+*/
+class BlockedConvolution : public BlockedLayer {
+private:
+	int filterNum, channels, subsecWidth, subsecHeight, slideX, slideY;
+	int inBlockNum, outBlockNum;
+	vector<double> weights;		// Output block, input block, row, col, input lane, output lane
+	vector<double> biases;		// Padded to a whole number of output blocks
+
+	/**
+		Computes TileWidth neighbouring outputs of one block of filters. The TileWidth x CHANNEL_BLOCK sums stay in registers while
+		the input blocks and filter taps stream past, and each input value is multiplied with the weights of CHANNEL_BLOCK filters at once.
+	*/
+	template <int TileWidth>
+	void convolveTile(const BlockedTensor& image, BlockedTensor& output, int outBlock, int outY, int outX) const {
+		double sums[TileWidth][CHANNEL_BLOCK];
+		const double* bias = biases.data() + outBlock * CHANNEL_BLOCK;
+		for (int tile = 0; tile < TileWidth; tile++) {
+			for (int outLane = 0; outLane < CHANNEL_BLOCK; outLane++) {
+				sums[tile][outLane] = bias[outLane];
+			}
+		}
+
+		const double* weight = weights.data() + (size_t)outBlock * inBlockNum * subsecHeight * subsecWidth * CHANNEL_BLOCK * CHANNEL_BLOCK;
+		int stride = slideX * CHANNEL_BLOCK;
+		for (int inBlock = 0; inBlock < inBlockNum; inBlock++) {
+			for (int row = 0; row < subsecHeight; row++) {
+				const double* imgPixel = image.pixel(inBlock, outY * slideY + row, outX * slideX);
+				for (int col = 0; col < subsecWidth; col++) {
+					for (int tile = 0; tile < TileWidth; tile++) {
+						for (int inLane = 0; inLane < CHANNEL_BLOCK; inLane++) {
+							double value = imgPixel[tile * stride + inLane];
+							for (int outLane = 0; outLane < CHANNEL_BLOCK; outLane++) {
+								sums[tile][outLane] += value * weight[inLane * CHANNEL_BLOCK + outLane];
+							}
+						}
+					}
+					imgPixel += CHANNEL_BLOCK;
+					weight += CHANNEL_BLOCK * CHANNEL_BLOCK;
+				}
+			}
+		}
+
+		for (int tile = 0; tile < TileWidth; tile++) {
+			double* outPixel = output.pixel(outBlock, outY, outX + tile);
+			for (int outLane = 0; outLane < CHANNEL_BLOCK; outLane++) {
+				outPixel[outLane] = sums[tile][outLane];
+			}
+		}
+	}
+
+public:
+
+	/**
+		@param layer A dense convolutional layer
+	*/
+	BlockedConvolution(const ConvolutionalLayer& layer) {
+		filterNum = layer.getFilterNum();
+		channels = layer.getChannels();
+		subsecWidth = layer.getSubsecWidth();
+		subsecHeight = layer.getSubsecHeight();
+		slideX = layer.getSlideX();
+		slideY = layer.getSlideY();
+		inBlockNum = (channels + CHANNEL_BLOCK - 1) / CHANNEL_BLOCK;
+		outBlockNum = (filterNum + CHANNEL_BLOCK - 1) / CHANNEL_BLOCK;
+
+		vector<double> layerWeights = layer.getWeights();	// Filter, channel, row, col
+		vector<double> layerBiases = layer.getBiases();
+		weights.assign((size_t)outBlockNum * inBlockNum * subsecHeight * subsecWidth * CHANNEL_BLOCK * CHANNEL_BLOCK, 0.0);
+		biases.assign(outBlockNum * CHANNEL_BLOCK, 0.0);
+		size_t filterSize = (size_t)channels * subsecHeight * subsecWidth;
+		for (int filterIndex = 0; filterIndex < filterNum; filterIndex++) {
+			int outBlock = filterIndex / CHANNEL_BLOCK, outLane = filterIndex % CHANNEL_BLOCK;
+			biases.at(filterIndex) = layerBiases.at(filterIndex);
+			for (int channel = 0; channel < channels; channel++) {
+				int inBlock = channel / CHANNEL_BLOCK, inLane = channel % CHANNEL_BLOCK;
+				for (int row = 0; row < subsecHeight; row++) {
+					for (int col = 0; col < subsecWidth; col++) {
+						size_t blockedIndex = ((((((size_t)outBlock * inBlockNum + inBlock) * subsecHeight + row) * subsecWidth + col) *
+							CHANNEL_BLOCK + inLane) * CHANNEL_BLOCK) + outLane;
+						weights.at(blockedIndex) = layerWeights.at(filterIndex * filterSize + ((size_t)channel * subsecHeight + row) * subsecWidth + col);
+					}
+				}
+			}
+		}
+	}
+
+	void forward(const BlockedTensor& image, BlockedTensor& output) const {
+		output.allocate(filterNum, (image.rows - subsecHeight) / slideY + 1, (image.cols - subsecWidth) / slideX + 1);
+		if (image.blockNum != inBlockNum) {
+			cout << "Improper channel count for blocked convolution" << endl;
+			return;
+		}
+		for (int firstRow = 0; firstRow < output.rows; firstRow += TILE_ROWS) {
+			int endRow = min(output.rows, firstRow + TILE_ROWS);
+			for (int outBlock = 0; outBlock < outBlockNum; outBlock++) {
+				for (int outY = firstRow; outY < endRow; outY++) {
+					int outX = 0;
+					for (; outX + TILE_WIDTH <= output.cols; outX += TILE_WIDTH) {
+						convolveTile<TILE_WIDTH>(image, output, outBlock, outY, outX);
+					}
+					for (; outX < output.cols; outX++) {
+						convolveTile<1>(image, output, outBlock, outY, outX);
+					}
+				}
+			}
+		}
+	}
+};
+
+/**
+	Max pooling on the blocked layout, which compares a whole block of channels at once.
+*/
+class BlockedPooling : public BlockedLayer {
+private:
+	int subsecWidth, subsecHeight, slideX, slideY;
+
+public:
+	BlockedPooling(const PoolingLayer& layer) {
+		subsecWidth = layer.getSubsecWidth();
+		subsecHeight = layer.getSubsecHeight();
+		slideX = layer.getSlideX();
+		slideY = layer.getSlideY();
+	}
+
+	void forward(const BlockedTensor& image, BlockedTensor& output) const {
+		output.allocate(image.channels, (image.rows - subsecHeight) / slideY + 1, (image.cols - subsecWidth) / slideX + 1);
+		for (int block = 0; block < image.blockNum; block++) {
+			for (int outY = 0; outY < output.rows; outY++) {
+				for (int outX = 0; outX < output.cols; outX++) {
+					double* outPixel = output.pixel(block, outY, outX);
+					const double* corner = image.pixel(block, outY * slideY, outX * slideX);
+					copy(corner, corner + CHANNEL_BLOCK, outPixel);
+					for (int row = 0; row < subsecHeight; row++) {
+						const double* imgRow = image.pixel(block, outY * slideY + row, outX * slideX);
+						for (int col = 0; col < subsecWidth; col++) {
+							for (int lane = 0; lane < CHANNEL_BLOCK; lane++) {
+								outPixel[lane] = max(outPixel[lane], imgRow[col * CHANNEL_BLOCK + lane]);
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+};
+
+/**
+	RELU on the blocked layout. The padding channels are zero and stay zero.
+*/
+class BlockedRELU : public BlockedLayer {
+public:
+	void forward(const BlockedTensor& image, BlockedTensor& output) const {
+		output.allocate(image.channels, image.rows, image.cols);
+		for (size_t i = 0; i < image.data.size(); i++) {
+			output.data[i] = max(0.0, image.data[i]);
+		}
+	}
+};
+
+/**
+	Inference batch normalization on the blocked layout, as a scale and shift per channel. The padding channels get a scale and
+	shift of zero, so they stay zero.
+*/
+class BlockedBatchNorm : public BlockedLayer {
+private:
+	vector<double> scales, shifts;	// Padded to a whole number of blocks
+
+public:
+	BlockedBatchNorm(const BatchNormLayer& layer) {
+		layer.scaleAndShift(scales, shifts);
+		int paddedSize = (((int)scales.size() + CHANNEL_BLOCK - 1) / CHANNEL_BLOCK) * CHANNEL_BLOCK;
+		scales.resize(paddedSize, 0.0);
+		shifts.resize(paddedSize, 0.0);
+	}
+
+	void forward(const BlockedTensor& image, BlockedTensor& output) const {
+		output.allocate(image.channels, image.rows, image.cols);
+		if (image.blockNum * CHANNEL_BLOCK != scales.size()) {
+			cout << "Improper channel count for batch normalization" << endl;
+			return;
+		}
+		for (int block = 0; block < image.blockNum; block++) {
+			const double* scale = scales.data() + block * CHANNEL_BLOCK;
+			const double* shift = shifts.data() + block * CHANNEL_BLOCK;
+			const double* imgPixel = image.pixel(block, 0, 0);
+			double* outPixel = output.pixel(block, 0, 0);
+			for (int position = 0; position < image.rows * image.cols; position++) {
+				for (int lane = 0; lane < CHANNEL_BLOCK; lane++) {
+					outPixel[lane] = imgPixel[lane] * scale[lane] + shift[lane];
+				}
+				imgPixel += CHANNEL_BLOCK;
+				outPixel += CHANNEL_BLOCK;
+			}
+		}
+	}
+};
+
+/**
+	The scratch tensors of one blocked forward pass. Each thread needs its own.
+*/
+struct BlockedContext {
+	vector<cv::Mat> input;
+	vector<BlockedTensor> blocked;			// The blocked input followed by the output of each blocked layer
+	vector<vector<cv::Mat>> activations;	// The output of the first unblocked layer and every layer after it
+	vector<cv::Mat> boundary;				// The last blocked output converted back to 2D Mats
+};
+
+/**
+	Runs a network with its leading convolutional, batch normalization, RELU and pooling layers in the channel-blocked layout. The
+	image is converted to the blocked layout once on the way in, and the activations are converted back once, in front of the first
+	layer that has no blocked version (usually the fully connected layer). Pruned (sparse) and int8 layers end the blocked part.
+*/
+class BlockedNetwork {
+private:
+	const ConvolutionalNeuralNetwork& cnn;
+	vector<shared_ptr<BlockedLayer>> blockedLayers;		// The blocked versions of the network's first blockedLayers.size() layers
+
+public:
+
+	/**
+		@param myCnn An initialized network, which must outlive this object. Rebuild the BlockedNetwork if the network's weights change.
+	*/
+	BlockedNetwork(const ConvolutionalNeuralNetwork& myCnn) : cnn(myCnn) {
+		for (int layerIndex = 0; layerIndex < cnn.getLayerCount(); layerIndex++) {
+			shared_ptr<const CNNLayer> layer = cnn.getLayer(layerIndex);
+			shared_ptr<const ConvolutionalLayer> convLayer = dynamic_pointer_cast<const ConvolutionalLayer>(layer);
+			shared_ptr<const PoolingLayer> poolLayer = dynamic_pointer_cast<const PoolingLayer>(layer);
+			shared_ptr<const BatchNormLayer> batchNormLayer = dynamic_pointer_cast<const BatchNormLayer>(layer);
+			if (convLayer && !convLayer->isSparse()) {
+				blockedLayers.push_back(shared_ptr<BlockedLayer>(new BlockedConvolution(*convLayer)));
+			}
+			else if (poolLayer) {
+				blockedLayers.push_back(shared_ptr<BlockedLayer>(new BlockedPooling(*poolLayer)));
+			}
+			else if (batchNormLayer) {
+				blockedLayers.push_back(shared_ptr<BlockedLayer>(new BlockedBatchNorm(*batchNormLayer)));
+			}
+			else if (dynamic_pointer_cast<const RELULayer>(layer)) {
+				blockedLayers.push_back(shared_ptr<BlockedLayer>(new BlockedRELU()));
+			}
+			else {
+				break;
+			}
+		}
+	}
+
+	/**
+		@return The amount of leading layers that run in the blocked layout
+	*/
+	int getBlockedLayerCount() const {
+		return (int)blockedLayers.size();
+	}
+
+	/**
+		Passes an image through the network, giving the same scores as the network's forwardPass.
+
+		@param image The image to be classified
+		@param context The scratch tensors for this forward pass. Each thread needs its own context.
+		@return A list of scores for image classification (0.89, 0.02, ...)
+	*/
+	vector<double> forwardPass(const cv::Mat& image, BlockedContext& context) const {
+		vector<double> scores;
+		TensorShape inputShape = cnn.getInputShape();
+		if (!cnn.isInitialized()) {
+			cout << "The network needs to be initialized before a forward pass." << endl;
+			return scores;
+		}
+		if (image.rows != inputShape.rows || image.cols != inputShape.cols || image.channels() != inputShape.channels) {
+			cout << "Image dimensions do not match the dimensions the network was initialized for." << endl;
+			return scores;
+		}
+
+		cnn.prepareImage(image, context.input);
+		const vector<cv::Mat>* modifiedImg = &context.input;
+		if (!blockedLayers.empty()) {
+			context.blocked.resize(blockedLayers.size() + 1);
+			context.blocked.at(0).fromMats(context.input);
+			for (int layerIndex = 0; layerIndex < blockedLayers.size(); layerIndex++) {
+				blockedLayers.at(layerIndex)->forward(context.blocked.at(layerIndex), context.blocked.at(layerIndex + 1));
+			}
+			context.blocked.back().toMats(context.boundary);
+			modifiedImg = &context.boundary;
+		}
+
+		int layerNum = cnn.getLayerCount();
+		context.activations.resize(layerNum);
+		for (int layerIndex = (int)blockedLayers.size(); layerIndex < layerNum; layerIndex++) {
+			cnn.getLayer(layerIndex)->forward(*modifiedImg, context.activations.at(layerIndex));
+			modifiedImg = &context.activations.at(layerIndex);
+		}
+
+		for (int channel = 0; channel < modifiedImg->size(); channel++) {
+			const cv::Mat& scoreLayer = modifiedImg->at(channel);
+			for (int row = 0; row < scoreLayer.rows; row++) {
+				const double* scoreRow = scoreLayer.ptr<double>(row);
+				scores.insert(scores.end(), scoreRow, scoreRow + scoreLayer.cols);
+			}
+		}
+		return scores;
+	}
+
+	/**
+		Passes an image through the network using a context that belongs to the calling thread.
+
+		@param image The image to be classified
+		@return A list of scores for image classification (0.89, 0.02, ...)
+	*/
+	vector<double> forwardPass(const cv::Mat& image) const {
+		static thread_local BlockedContext context;
+		return forwardPass(image, context);
+	}
+};
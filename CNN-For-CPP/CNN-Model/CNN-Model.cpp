@@ -10,21 +10,34 @@
 #include <tuple>
 
 #include "ConvolutionalNeuralNetwork.h"
+#include "Benchmark.h"
+#include "Evaluator.h"
+#include "OutputHead.h"
+#include "Trainer.h"
 
 using namespace std;
 
-ConvolutionalNeuralNetwork trainCNN(ConvolutionalNeuralNetwork cnn, vector<tuple<cv::Mat, string>> labeledSet, double desiredAccuracy);
-ConvolutionalNeuralNetwork gradientDescentStep(ConvolutionalNeuralNetwork cnn, vector<tuple<cv::Mat, string>> labeledTrainingSet);
-vector<double> backpropagation(ConvolutionalNeuralNetwork cnn, cv::Mat image, string imageLabel);
-double testAccuracy(ConvolutionalNeuralNetwork cnn, vector<tuple<cv::Mat, string>> labeledTestingSet);
+ConvolutionalNeuralNetwork trainCNN(ConvolutionalNeuralNetwork cnn, vector<tuple<cv::Mat, int>> labeledSet, double desiredAccuracy);
+ConvolutionalNeuralNetwork gradientDescentStep(ConvolutionalNeuralNetwork cnn, vector<tuple<cv::Mat, int>> labeledTrainingSet);
+vector<double> backpropagation(ConvolutionalNeuralNetwork cnn, cv::Mat image, int imageLabel);
+double testAccuracy(ConvolutionalNeuralNetwork cnn, vector<tuple<cv::Mat, int>> labeledTestingSet);
 vector<double> averageAdjustments(vector<vector<double>> adjustments);
 vector<double> testCNN(ConvolutionalNeuralNetwork cnn, cv::Mat image);
-string classify(vector<double> scores);
+int classify(vector<double> scores);
 
-int main()
+int main(int argc, char* argv[])
 {
+	if (argc > 1 && string(argv[1]) == "--benchmark") {
+		benchmarkSparseCrossover();
+		benchmarkSpecializedKernels();
+		benchmarkBlockedConvolution();
+		benchmarkActivationCheckpointing();
+		benchmarkHalfPrecision();
+		benchmarkAutotuner();
+		return benchmarkModelRoundTrip() ? 0 : 1;
+	}
 
-	cv::Mat tinyMatrix = (cv::Mat_<double>(2, 4) << 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0);
+	cv::Mat tinyMatrix = (cv::Mat_<double>(3, 4) << 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0, 12.0);
 	cout << "tinyMatrix:" << endl << " " << tinyMatrix << endl << endl;
 
 	ConvolutionalNeuralNetwork cnn;
@@ -32,61 +45,81 @@ int main()
 	cnn.addActivationLayer("RELU");
 	cnn.addPoolingLayer(2, 2, 1, 1);
 	cnn.addFullyConnectedLayer(3);
+	cnn.initializeNetwork(tinyMatrix.rows, tinyMatrix.cols, tinyMatrix.channels());
 
 
 	// trainCNN(cnn, labeledSet, .9);
 	vector<double> classification = cnn.forwardPass(tinyMatrix);
 	cnn.printNetwork();
+	cnn.getMemoryPlan().printPlan();
+
+	cout << "Scores:" << endl;
+	for (int classIndex = 0; classIndex < classification.size(); classIndex++) {
+		cout << "Class " << classIndex << ": " << classification.at(classIndex) << endl;
+	}
 
+#ifdef _WIN32
 	system("pause");
+#endif
     return 0;
 }
 
 /**
 	Trains a CNN model's weights, biases, and kernal values to a desiredAccuracy.
-	There is a limit to the amount of gradient descent steps possible.
+	There is a limit to the amount of epochs possible, and training stops early once the loss on the testing images stops improving.
+	Progress is saved to a checkpoint file after every epoch, and a run that was interrupted continues from it.
 
 	@param cnn The cnn model
-	@param labeledSet A vector of images with their accompanying labels {(img1, label1), (img2, label2), ...}. Needs to be larger than six images.
-	@param desiredAccuracy The training will not step until this desiredAccuracy is met our the maximum amount of steps is reached
+	@param labeledSet A vector of images with their accompanying class IDs {(img1, 3), (img2, 0), ...}. Needs to be larger than six images.
+		Sets labeled with names can be converted with LabelDictionary::encode.
+	@param desiredAccuracy The training will not stop until this desiredAccuracy is met, the loss stops improving, or the maximum amount
+		of epochs is reached
 	@return The cnn model with the updated weights, biases, and kernal values
 */
-ConvolutionalNeuralNetwork trainCNN(ConvolutionalNeuralNetwork cnn, vector<tuple<cv::Mat, string>> labeledSet, double desiredAccuracy) {
-	const int MAX_STEPS = 100; // For performance reasons, we may want to cap the amount of steps even if the desired accuracy is never reached
-
-	double accuracy = 0.0;
+ConvolutionalNeuralNetwork trainCNN(ConvolutionalNeuralNetwork cnn, vector<tuple<cv::Mat, int>> labeledSet, double desiredAccuracy) {
+	const int MAX_EPOCHS = 100; // For performance reasons, we may want to cap the amount of epochs even if the desired accuracy is never reached
+	const int PATIENCE = 10; // Epochs without a lower testing loss before giving up
+	const double LEARNING_RATE = 0.01;
+	const int BATCH_SIZE = 32;
 
 	// Split labeled set into 5/6 for training and 1/6 for testing accuracy
 	size_t const oneSixthSize = labeledSet.size() / 6;
-	vector<tuple<cv::Mat, string>> labeledTrainingSet(labeledSet.begin(), labeledSet.begin() + (5 * oneSixthSize));
-	vector<tuple<cv::Mat, string>> labeledTestingSet(labeledSet.begin() + (5 * oneSixthSize), labeledSet.end());
-
-	int stepCnt = 0;
-	while (accuracy < desiredAccuracy && stepCnt < MAX_STEPS) {
-		cnn = gradientDescentStep(cnn, labeledTrainingSet);
-		accuracy = testAccuracy(cnn, labeledTestingSet);
-		stepCnt++;
-	}
+	vector<tuple<cv::Mat, int>> labeledTrainingSet(labeledSet.begin(), labeledSet.begin() + (5 * oneSixthSize));
+	vector<tuple<cv::Mat, int>> labeledTestingSet(labeledSet.begin() + (5 * oneSixthSize), labeledSet.end());
+
+	// Warm up over the first epoch, then ease the learning rate down to zero by the last epoch
+	long long stepsPerEpoch = max((long long)1, ((long long)labeledTrainingSet.size() + BATCH_SIZE - 1) / BATCH_SIZE);
+	Trainer trainer(cnn, LEARNING_RATE, BATCH_SIZE);
+	trainer.setMomentum(0.9);
+	trainer.setSchedule(LearningRateSchedule(COSINE_SCHEDULE, LEARNING_RATE, stepsPerEpoch, 1, 1.0, MAX_EPOCHS * stepsPerEpoch));
+
+	TrainingOptions options;
+	options.maxEpochs = MAX_EPOCHS;
+	options.patience = PATIENCE;
+	options.desiredAccuracy = desiredAccuracy;
+	options.checkpointPath = "training.ckpt";
+	options.resume = false;		// Every call trains a new network. Set this to continue a run that was interrupted.
+	trainer.fit(labeledTrainingSet, labeledTestingSet, options);
 
 	return cnn;
 }
 
 /**
 	Each gradient descent step adjusts a CNN model's weights, biases, and kernal values to lower the cost of the model.
-	The cost of the model is defined as the summed squares of the differences between the actual answer and expected answer.
-	C(W) = (a0 - e0)^2 + (a1 - e1)^2 + ...
+	The cost of the model is the softmax cross-entropy of the scores and the label, averaged over the training images.
+	C(W) = log(e^s0 + e^s1 + ...) - s_label
 
 	@param cnn The cnn model
-	@param labeledTrainingSet A vector of images with their accompanying labels {(img1, label1), (img2, label2), ...} meant for training
+	@param labeledTrainingSet A vector of images with their accompanying class IDs {(img1, 3), (img2, 0), ...} meant for training
 	the model
 	@return The cnn model with the updated weights, biases, and kernal values
 */
-ConvolutionalNeuralNetwork gradientDescentStep(ConvolutionalNeuralNetwork cnn, vector<tuple<cv::Mat, string>> labeledTrainingSet) {
+ConvolutionalNeuralNetwork gradientDescentStep(ConvolutionalNeuralNetwork cnn, vector<tuple<cv::Mat, int>> labeledTrainingSet) {
 	vector<vector<double>> adjustments;
 
 	for (int trainImgIndex = 0; trainImgIndex < labeledTrainingSet.size(); trainImgIndex++) {
 		cv::Mat img = get<0>(labeledTrainingSet.at(trainImgIndex));
-		string label = get<1>(labeledTrainingSet.at(trainImgIndex));
+		int label = get<1>(labeledTrainingSet.at(trainImgIndex));
 		vector<double> adjustmentsForEachImg = backpropagation(cnn, img, label);
 		adjustments.push_back(adjustmentsForEachImg);
 	}
@@ -102,21 +135,22 @@ ConvolutionalNeuralNetwork gradientDescentStep(ConvolutionalNeuralNetwork cnn, v
 
 	@param cnn The cnn model
 	@param image The specific training image to find optimizations for
-	@param imageLabel The specific training image's label
+	@param imageLabel The specific training image's class ID
 	@return A vector of adjustments to make to the weights, biases, and kernal values (0.03, -0.15, 0.32, ...)
 */
-vector<double> backpropagation(ConvolutionalNeuralNetwork cnn, cv::Mat image, string imageLabel) {
-	vector<double> changes;
-	// TODO implement this function
+vector<double> backpropagation(ConvolutionalNeuralNetwork cnn, cv::Mat image, int imageLabel) {
+	const double LEARNING_RATE = 0.01;	// How far each step moves the values against the gradient
 
-	// Determine the ideal scores
-	
-	// For each classification, figure out how to change the kernal values, weights, and biases
+	// How the cost changes with each kernal value, weight, and bias: the gradient of softmax(scores) - onehot(label) passed back
+	// through every layer
+	Trainer trainer(cnn, LEARNING_RATE, 1, 1);
+	vector<double> changes;
+	trainer.computeGradient(image, imageLabel, changes);
 
-	// TODO: watch the video about partial derivatives again. Can you figure that out once and use it for the entire training,
-	// or do you need redo it for each image or something? Maybe use another function that returns a vector<vector<double>
-	// where the first vector<double> can be for kernal values, the second for biases, and the third for weights. And the
-	// double values is how much that value affects the cost function
+	// Stepping against the gradient lowers the cost
+	for (int valueIndex = 0; valueIndex < changes.size(); valueIndex++) {
+		changes.at(valueIndex) *= -LEARNING_RATE;
+	}
 	return changes;
 }
 
@@ -124,37 +158,24 @@ vector<double> backpropagation(ConvolutionalNeuralNetwork cnn, cv::Mat image, st
 	This function tests the accuracy of the CNN model by using a set of testing images with labels. The function
 	uses the CNN model to guess the classifications of each image and compares the classification to the real label.
 	Finally, the function counts the number of correct guesses and divides by the total amount of images.
+	The images are classified in parallel by the Evaluator, which also reports top-k accuracy, a confusion matrix and throughput.
 
 	@param cnn The cnn model
-	@param labeledTestingSet A vector of images with their accompanying labels {(img1, label1), (img2, label2), ...}
+	@param labeledTestingSet A vector of images with their accompanying class IDs {(img1, 3), (img2, 0), ...}
 	meant for testing the model
-	@return an accuracy value between 0.0 - 100.0
+	@return an accuracy value between 0.0 - 1.0
 */
-double testAccuracy(ConvolutionalNeuralNetwork cnn, vector<tuple<cv::Mat, string>> labeledTestingSet) {
-	double accuracy = 0.0;
-	int correct = 0;
-
-	for (int testImgIndex = 0; testImgIndex < labeledTestingSet.size(); testImgIndex++) {
-		cv::Mat image = get<0>(labeledTestingSet.at(testImgIndex));
-		string label = get<1>(labeledTestingSet.at(testImgIndex));
-
-		vector<double> scores = testCNN(cnn, image);
-		string classification = classify(scores);
-		if (classification.compare(label) == 0) {
-			correct++;
-		}
-	}
-
-	accuracy = (double)(correct / labeledTestingSet.size());
-	return accuracy;
+double testAccuracy(ConvolutionalNeuralNetwork cnn, vector<tuple<cv::Mat, int>> labeledTestingSet) {
+	EvaluationReport report = Evaluator::evaluate(cnn, labeledTestingSet);
+	return report.accuracy;
 }
 
 /**
 	This function takes all of the adjusments to optimize the CNN model for each training image, and combines
 	them to get one list of adjusments to make that will improve the model for all cases generally. Improvement
 	is measured by reducing the Cost function.
-	The cost of the model is defined as the summed squares of the differences between the actual answer and expected answer.
-	C(W) = (a0 - e0)^2 + (a1 - e1)^2 + ...
+	The cost of the model is the softmax cross-entropy of the scores and the label.
+	C(W) = log(e^s0 + e^s1 + ...) - s_label
 
 	@param adjustments A list of adjustments that each training image wants to make to improve the scores for itself
 		{image 1 adjustments, images 2 adjustments, ...} -> {(w0, w1, ....), (w0, w1, ...), ...}
@@ -162,11 +183,12 @@ double testAccuracy(ConvolutionalNeuralNetwork cnn, vector<tuple<cv::Mat, string
 	@return A list of adjustments to optimize the CNN model for all training images
 */
 vector<double> averageAdjustments(vector<vector<double>> adjustments) {
-	vector<double> avgAdj;	// TODO make the same size as the first vector of adjustments
+	vector<double> avgAdj(adjustments.empty() ? 0 : adjustments.at(0).size(), 0.0);
 	for (int weightBiasKernalIndex = 0; weightBiasKernalIndex < avgAdj.size(); weightBiasKernalIndex++) {
 		for (int imgIndex = 0; imgIndex < adjustments.size(); imgIndex++) {
 			avgAdj.at(weightBiasKernalIndex) += adjustments.at(imgIndex).at(weightBiasKernalIndex);
 		}
+		avgAdj.at(weightBiasKernalIndex) /= adjustments.size();
 	}
 	return avgAdj;
 }
@@ -186,20 +208,12 @@ vector<double> testCNN(ConvolutionalNeuralNetwork cnn, cv::Mat image) {
 
 /**
 	Determines the classification based on score values (ie. the classification is whatever class had
-	the largest score). In the future, this may include a way for objects to be classified as multiple classes.
+	the largest score, even if every score is negative). Use a LabelDictionary to turn the class ID into a name for display, and
+	topKClasses for more than one classification.
 
 	@param scores A list of scores for one image classification (0.89, 0.02, ...)
-	@return A classification for one image (ex. "1")
+	@return The class ID of one image (ex. 1), or -1 if there are no scores
 */
-string classify(vector<double> scores) {
-	int classIndex = -1;
-	double largestScore = 0.0;
-	for (int i = 0; i < scores.size(); i++) {
-		if (scores.at(i) > largestScore) {
-			largestScore = scores.at(i);
-			classIndex = i;
-		}
-	}
-	string classification = to_string(classIndex);
-	return classification;
+int classify(vector<double> scores) {
+	return argmaxClass(scores);
 }
@@ -2,29 +2,297 @@
 #include <opencv2/opencv.hpp>
 
 #include <stdio.h>
+#ifdef _WIN32
 #include <tchar.h>
+#endif
 #include <iostream>
 #include <string>
 #include <vector>
 #include <tuple>
 #include <memory>
+#include <algorithm>
+
+#include "Serialization.h"
+#include "SparseMatrix.h"
+#include "ParameterInit.h"
 
 using namespace std;
 
+/**
+	The dimensions of a 3D matrix (a vector of 2D Mats) flowing between layers.
+*/
+struct TensorShape {
+	int channels, rows, cols;
+
+	TensorShape(int myChannels = 0, int myRows = 0, int myCols = 0) : channels(myChannels), rows(myRows), cols(myCols) {}
+
+	/**
+		@return The amount of elements in a 3D matrix of this shape
+	*/
+	int size() const {
+		return channels * rows * cols;
+	}
+};
+
+/**
+	The implementations a layer can run with. They give the same output up to the order sums are added in, but which one is fastest
+	depends on the layer's shape, its sparsity and the CPU, so the autotuner times them on the machine that runs the network.
+	The names are stored in tuning caches, so existing engines must never be renamed.
+*/
+enum LayerEngine {
+	DENSE_ENGINE,		// The dense kernel, specialized for the layer's shape when there is one
+	GENERIC_ENGINE,		// The dense kernel that takes the shape at runtime
+	SPARSE_ENGINE		// The kernel that skips zero weights
+};
+
+inline const char* engineName(LayerEngine engine) {
+	const char* names[] = { "dense", "generic", "sparse" };
+	return names[engine];
+}
+
 class CNNLayer {
 public:
 	CNNLayer() {}
+	virtual ~CNNLayer() {}
 
 	/**
-		This function executes a layer's functionality, meaning it passes through the input image and
-		manipulates it according to the layer. This function is generic and should be implemented by subclasses.
+		This function executes a layer's functionality, meaning it passes through the input image and writes the manipulated
+		image into output. Layers must not modify themselves here, so a single layer can be shared by several threads as long
+		as each thread passes its own output buffers. Any Mat already in output with the right size is reused instead of reallocated.
+		This function is generic and should be implemented by subclasses.
+
+		@param image The matrix to be manipulated
+		@param output The manipulated matrix
+	*/
+	virtual void forward(const vector<cv::Mat>& image, vector<cv::Mat>& output) const {
+		cout << "Forward function called on parent class with no implementation." << endl;
+	}
+
+	/**
+		Recomputes only a rectangle of the output, for example the part of a video frame that changed since the last frame. The rest
+		of output is left as it was. Layers that cannot compute part of their output recompute all of it.
+
+		@param image The matrix to be manipulated
+		@param output The manipulated matrix from the previous call, which is updated in place
+		@param outputRegion The rectangle of every output channel to recompute
+	*/
+	virtual void forwardRegion(const vector<cv::Mat>& image, vector<cv::Mat>& output, cv::Rect outputRegion) const {
+		forward(image, output);
+	}
+
+	/**
+		Finds which part of the output depends on a rectangle of the input. By default every output element depends on every input
+		element (ex. the fully connected layer).
+
+		@param inputRegion A rectangle of every input channel
+		@param inputShape The dimensions of the matrix input into the layer
+		@return The rectangle of every output channel that depends on inputRegion
+	*/
+	virtual cv::Rect affectedRegion(cv::Rect inputRegion, TensorShape inputShape) const {
+		TensorShape outShape = outputShape(inputShape);
+		return inputRegion.area() > 0 ? cv::Rect(0, 0, outShape.cols, outShape.rows) : cv::Rect();
+	}
+
+	/**
+		Convenience wrapper around forward that allocates a new output matrix on every call.
 
 		@param image The matrix to be manipulated
 		@return The manipulated matrix
 	*/
-	virtual vector<cv::Mat> execute(vector<cv::Mat> image) {
-		cout << "Execute function called on parent class with no implementation." << endl;
-		return cv::Mat_<int>(0, 0);
+	vector<cv::Mat> execute(vector<cv::Mat> image) const {
+		vector<cv::Mat> output;
+		forward(image, output);
+		return output;
+	}
+
+	/**
+		This function calculates the dimensions of the matrix this layer produces for a given input. Layers that keep the
+		dimensions of their input do not need to override it.
+
+		@param inputShape The dimensions of the matrix input into the layer
+		@return The dimensions of the matrix output by the layer
+	*/
+	virtual TensorShape outputShape(TensorShape inputShape) const {
+		return inputShape;
+	}
+
+	/**
+		This function creates any parameters that depend on the dimensions of the layer's input (ex. the weights of a fully
+		connected layer). It is called once when the network is initialized, before any forward pass.
+
+		@param inputShape The dimensions of the matrix input into the layer
+	*/
+	virtual void initialize(TensorShape inputShape) {}
+
+	/**
+		Draws the layer's weights from its random stream and sets its biases to zero. A layer whose weights depend on its input size
+		keeps the initializer and draws them once it is initialized. Layers without weights ignore this.
+
+		@param initializer The scheme and seed to draw with
+		@param stream The layer's random stream (ex. its index in the network)
+	*/
+	virtual void initializeParameters(const ParameterInitializer& initializer, unsigned long long stream) {}
+
+	/**
+		@return The amount of values the layer learns (weights, biases, scales, ...). Layers without learned values return 0.
+	*/
+	virtual int getParameterCount() const {
+		return 0;
+	}
+
+	/**
+		This function passes the gradient of the cost backwards through the layer. Given how the cost changes with each output element,
+		it finds how the cost changes with each input element and with each of the layer's parameters. Like forward, it does not modify
+		the layer, so several threads can run it on one shared layer with their own buffers.
+		This function is generic and should be implemented by subclasses that can be trained.
+
+		@param image The matrix that was input into the layer
+		@param output The matrix forward produced for image
+		@param outputGradient How the cost changes with each element of output
+		@param inputGradient If not null, receives how the cost changes with each element of image
+		@param parameterGradient If not null, getParameterCount() values that the gradient of each parameter is added to, in the
+			order of updateParameters
+	*/
+	virtual void backward(const vector<cv::Mat>& image, const vector<cv::Mat>& output, const vector<cv::Mat>& outputGradient,
+		vector<cv::Mat>* inputGradient, double* parameterGradient) const {
+		cout << "Backward function called on a layer that cannot be trained." << endl;
+		if (inputGradient) {
+			allocateZeros(*inputGradient, shapeOf(image));
+		}
+	}
+
+	/**
+		Adds a change to every learned value of the layer, for example a gradient descent step.
+
+		@param changes getParameterCount() values, in the same order as the parameter gradient of backward
+	*/
+	virtual void updateParameters(const double* changes) {}
+
+	/**
+		Copies every learned value of the layer, for example into a training checkpoint.
+
+		@param values Receives getParameterCount() values, in the same order as updateParameters
+	*/
+	virtual void getParameters(double* values) const {}
+
+	/**
+		Replaces every learned value of the layer, for example when resuming from a training checkpoint.
+
+		@param values getParameterCount() values, in the same order as updateParameters
+	*/
+	virtual void setParameters(const double* values) {}
+
+	/**
+		Layers that compute each output element only from the input element at the same position can write their output over their
+		input. The memory planner then gives both the same memory.
+
+		@return Whether forward still works when the output Mats share memory with the input Mats
+	*/
+	virtual bool worksInPlace() const {
+		return false;
+	}
+
+	/**
+		Writes the layer's type tag, attributes and parameters to a model file. Each layer is in charge of implementing this function
+		and a matching static load function. A layer that cannot be saved fails the stream, so the model file is not left looking complete.
+
+		@param out The model file
+	*/
+	virtual void save(ostream& out) const {
+		cout << "Save function called on parent class with no implementation." << endl;
+		out.setstate(ios::failbit);
+	}
+
+	/**
+		@return All of the layer's weights in a fixed order, including the ones that were pruned to zero. Layers without weights return
+			an empty vector.
+	*/
+	virtual vector<double> getWeights() const {
+		return vector<double>();
+	}
+
+	/**
+		Sets every weight whose magnitude is below a threshold to zero. If enough weights are zero for the sparse kernels to be faster,
+		the layer switches to its sparse storage. Layers without weights ignore this.
+
+		@param threshold The magnitude below which weights are pruned
+		@param sparseAbove The fraction of zero weights at which the layer switches to its sparse kernels
+	*/
+	virtual void pruneWeights(double threshold, double sparseAbove = SPARSE_CROSSOVER) {}
+
+	/**
+		Prunes the smallest weights of the layer until the given fraction of them is zero.
+
+		@param sparsity The fraction of weights to prune (0.0 - 1.0)
+		@param sparseAbove The fraction of zero weights at which the layer switches to its sparse kernels
+	*/
+	void pruneToSparsity(double sparsity, double sparseAbove = SPARSE_CROSSOVER) {
+		vector<double> weights = getWeights();
+		if (!weights.empty()) {
+			pruneWeights(sparsityThreshold(weights, sparsity), sparseAbove);
+		}
+	}
+
+	/**
+		@return Whether the layer currently runs its sparse kernels
+	*/
+	virtual bool isSparse() const {
+		return false;
+	}
+
+	/**
+		@return The fraction of the layer's weights that are zero, or 0 for layers without weights
+	*/
+	double zeroWeightFraction() const {
+		vector<double> weights = getWeights();
+		if (weights.empty()) {
+			return 0.0;
+		}
+		return (double)count(weights.begin(), weights.end(), 0.0) / weights.size();
+	}
+
+	/**
+		@return The engines the layer can switch between. Layers with nothing to choose from return an empty vector.
+	*/
+	virtual vector<LayerEngine> getEngines() const {
+		return vector<LayerEngine>();
+	}
+
+	/**
+		@return The engine the layer currently runs
+	*/
+	virtual LayerEngine getEngine() const {
+		return DENSE_ENGINE;
+	}
+
+	/**
+		Switches the layer to another engine. Engines are not written to model files, since the best one depends on the machine.
+		Like pruneWeights, this modifies the layer, so no other thread may pass images through it at the same time.
+
+		@param engine One of getEngines()
+		@return Whether the layer can run that engine
+	*/
+	virtual bool setEngine(LayerEngine engine) {
+		return engine == DENSE_ENGINE;
+	}
+
+	/**
+		Describes everything the speed of the layer's engines depends on, so a timing measured for one layer holds for every layer
+		with the same signature (ex. the same layer in another version of a model).
+
+		@param inputShape The dimensions of the matrix input into the layer
+		@return The signature, or an empty string for layers without engines
+	*/
+	virtual string getSignature(TensorShape inputShape) const {
+		return "";
+	}
+
+	/**
+		@param shape The dimensions of a 3D matrix
+		@return The dimensions as text (ex. 8x64x64 for 8 channels of 64 rows and 64 columns)
+	*/
+	static string shapeText(TensorShape shape) {
+		return to_string(shape.channels) + "x" + to_string(shape.rows) + "x" + to_string(shape.cols);
 	}
 
 	/**
@@ -34,4 +302,123 @@ public:
 	virtual void printLayer() {
 		cout << "Print Layer function called on parent class with no implementation." << endl;
 	}
-};
\ No newline at end of file
+
+	/**
+		@param image A 3D matrix
+		@return The dimensions of the 3D matrix
+	*/
+	static TensorShape shapeOf(const vector<cv::Mat>& image) {
+		if (image.empty()) {
+			return TensorShape();
+		}
+		return TensorShape((int)image.size(), image.at(0).rows, image.at(0).cols);
+	}
+
+	/**
+		The affected region of a layer that slides a window over its input, like the convolutional and pooling layers. Output
+		element o covers input elements o * slide to o * slide + size - 1.
+
+		@param inputRegion A rectangle of the input
+		@param subsecWidth, subsecHeight The size of the window
+		@param slideX, slideY The distance the window slides
+		@param outShape The dimensions of the output
+		@return The rectangle of output elements whose window overlaps inputRegion
+	*/
+	static cv::Rect windowRegion(cv::Rect inputRegion, int subsecWidth, int subsecHeight, int slideX, int slideY, TensorShape outShape) {
+		if (inputRegion.area() <= 0) {
+			return cv::Rect();
+		}
+		// The first window that reaches the region starts at region.x - size + 1, rounded up to a multiple of the slide
+		int firstX = (max(0, inputRegion.x - subsecWidth + 1) + slideX - 1) / slideX;
+		int firstY = (max(0, inputRegion.y - subsecHeight + 1) + slideY - 1) / slideY;
+		int lastX = min(outShape.cols - 1, (inputRegion.x + inputRegion.width - 1) / slideX);
+		int lastY = min(outShape.rows - 1, (inputRegion.y + inputRegion.height - 1) / slideY);
+		if (lastX < firstX || lastY < firstY) {
+			return cv::Rect();
+		}
+		return cv::Rect(firstX, firstY, lastX - firstX + 1, lastY - firstY + 1);
+	}
+
+	/**
+		The input window needed to compute a rectangle of a sliding window layer's output.
+
+		@param outputRegion A rectangle of the output
+		@param subsecWidth, subsecHeight The size of the window
+		@param slideX, slideY The distance the window slides
+		@return The rectangle of the input that outputRegion reads
+	*/
+	static cv::Rect windowInput(cv::Rect outputRegion, int subsecWidth, int subsecHeight, int slideX, int slideY) {
+		return cv::Rect(outputRegion.x * slideX, outputRegion.y * slideY,
+			(outputRegion.width - 1) * slideX + subsecWidth, (outputRegion.height - 1) * slideY + subsecHeight);
+	}
+
+	/**
+		@param image A 3D matrix
+		@param region A rectangle of every channel
+		@return Headers that share image's memory and only see the rectangle
+	*/
+	static vector<cv::Mat> regionOf(const vector<cv::Mat>& image, cv::Rect region) {
+		vector<cv::Mat> window(image.size());
+		for (int channel = 0; channel < image.size(); channel++) {
+			window.at(channel) = image.at(channel)(region);
+		}
+		return window;
+	}
+
+	/**
+		Makes output a 3D matrix of the given shape, reusing its Mats when they already have the right size.
+
+		@param output The 3D matrix to resize
+		@param shape The wanted dimensions
+	*/
+	static void allocateOutput(vector<cv::Mat>& output, TensorShape shape) {
+		output.resize(shape.channels);
+		for (int channel = 0; channel < shape.channels; channel++) {
+			output.at(channel).create(shape.rows, shape.cols, CV_64FC1);
+		}
+	}
+
+	/**
+		Makes output a 3D matrix of the given shape filled with zeros, for example a gradient that is added up element by element.
+
+		@param output The 3D matrix to resize and clear
+		@param shape The wanted dimensions
+	*/
+	static void allocateZeros(vector<cv::Mat>& output, TensorShape shape) {
+		allocateOutput(output, shape);
+		for (int channel = 0; channel < shape.channels; channel++) {
+			output.at(channel).setTo(0.0);
+		}
+	}
+
+	/**
+		Gives a pointer to all elements of a 3D matrix in channel, row, column order. Matrices laid out by the memory planner are
+		already stored that way, so their memory is used directly. Otherwise the elements are copied into scratch.
+
+		@param image A 3D matrix
+		@param scratch Storage for the copy, if one is needed
+		@return The elements of image, one channel after another
+	*/
+	static const double* flatten(const vector<cv::Mat>& image, vector<double>& scratch) {
+		TensorShape shape = shapeOf(image);
+		size_t channelSize = (size_t)shape.rows * shape.cols;
+		bool contiguous = true;
+		for (int channel = 0; channel < image.size() && contiguous; channel++) {
+			contiguous = image.at(channel).isContinuous() &&
+				image.at(channel).ptr<double>(0) == image.at(0).ptr<double>(0) + channel * channelSize;
+		}
+		if (contiguous && !image.empty()) {
+			return image.at(0).ptr<double>(0);
+		}
+
+		scratch.resize(shape.size());
+		double* copy = scratch.data();
+		for (int channel = 0; channel < image.size(); channel++) {
+			for (int row = 0; row < shape.rows; row++) {
+				const double* imgRow = image.at(channel).ptr<double>(row);
+				copy = std::copy(imgRow, imgRow + shape.cols, copy);
+			}
+		}
+		return scratch.data();
+	}
+};
@@ -2,18 +2,61 @@
 #include <opencv2/opencv.hpp>
 
 #include <stdio.h>
+#ifdef _WIN32
 #include <tchar.h>
+#endif
 #include <iostream>
 #include <string>
 #include <vector>
 #include <tuple>
 #include <memory>
 #include "CNNLayer.h"
+#include "SpecializedKernels.h"
 
 class ConvolutionalLayer : public CNNLayer {
 private:
 	int filterNum, subsecWidth, subsecHeight, slideX, slideY, channels;
 	vector<vector<cv::Mat>> filters;	// Each 3D filter is split into a vector of 2D Mat rectangles. Filters is a vector that contains multiple of these 3D filters.
+	vector<double> biases;				// One bias per filter, added to every dot product of that filter
+	ConvolutionKernel kernel;			// The dense kernel for this layer's subsection size and slide
+
+	// After pruning, the non-zero weights of every filter as a list of taps. Filter f's taps are taps[tapStarts[f]] to taps[tapStarts[f + 1] - 1].
+	struct SparseTap {
+		int channel, row, col;
+		double weight;
+	};
+	bool sparse;
+	vector<int> tapStarts;
+	vector<SparseTap> taps;
+
+	/**
+		Reads the taps written by save, one field at a time. Files before version 5 hold the raw structs instead.
+
+		@param in The model file
+		@return The taps, or an empty list with the stream failed if the file is damaged
+	*/
+	static vector<SparseTap> readTaps(istream& in) {
+		long long tapNum = readValue<long long>(in);
+		vector<SparseTap> myTaps;
+		if (!in || tapNum < 0) {
+			in.setstate(ios::failbit);
+			return myTaps;
+		}
+		// Grows as the taps arrive, so a damaged count fails at the end of the file instead of allocating it up front
+		for (long long tapIndex = 0; tapIndex < tapNum; tapIndex++) {
+			SparseTap tap;
+			tap.channel = readValue<int>(in);
+			tap.row = readValue<int>(in);
+			tap.col = readValue<int>(in);
+			tap.weight = readValue<double>(in);
+			if (!in) {
+				myTaps.clear();
+				return myTaps;
+			}
+			myTaps.push_back(tap);
+		}
+		return myTaps;
+	}
 
 public:
 
@@ -29,8 +72,12 @@ public:
 		@param mySubsecHeight The height of the image subsections that you will look for the features in
 		@param mySlideX The amount to slide over in the x direction after each subsection has been checked for features
 		@param mySlideY The amount to slide over in the y direction after each subsection has been checked for features
+		@param myChannels The depth of the matrix input into the layer (ex. 3 for RGB)
+		@param initializer The scheme and seed the filters are drawn with
+		@param stream The layer's random stream (ex. its index in the network)
 	*/
-	ConvolutionalLayer(int myFilterNum, int mySubsecWidth, int mySubsecHeight, int mySlideX, int mySlideY, int myChannels) :CNNLayer()
+	ConvolutionalLayer(int myFilterNum, int mySubsecWidth, int mySubsecHeight, int mySlideX, int mySlideY, int myChannels,
+		const ParameterInitializer& initializer = ParameterInitializer(), unsigned long long stream = 0) :CNNLayer()
 	{
 		filterNum = myFilterNum;
 		subsecWidth = mySubsecWidth;
@@ -38,76 +85,531 @@ public:
 		slideX = mySlideX;
 		slideY = mySlideY;
 		channels = myChannels;
+		sparse = false;
+		kernel = selectConvolutionKernel(subsecWidth, subsecHeight, slideX, slideY);
 
-		initializeFilters();
+		initializeParameters(initializer, stream);
 	}
 
 	/**
-		This function intializes the filter kernals with random values from 0.01 (inclusive) to 1.0 (exclusive).
-		It will create filterNum amount of filters and push them into filters.
+		This function creates filterNum filters with the depth of the input (RGB = 3) and draws their weights from the layer's random
+		stream. Weight i of filter f, channel c is always element (f * channels + c) * subsecHeight * subsecWidth + i of the stream, so
+		the filters do not depend on how many threads draw them. The biases start at zero.
+
+		@param initializer The scheme and seed to draw with
+		@param stream The layer's random stream (ex. its index in the network)
 	*/
-	void initializeFilters() {
-		double low_inc = 0.01;
-		double high_exc = 1.0;
-		for (int i = 0; i < filterNum; i++) {
-			// Each filter has a depth of the same amount as the input depth (RGB = 3)
-			vector<cv::Mat> newFilter;
-			for (int channelIndex = 0; channelIndex < channels; channelIndex++) {
-				cv::Mat newFilterChannelRandom(subsecHeight, subsecWidth, CV_64FC1);
-				randu(newFilterChannelRandom, low_inc, high_exc);
-				newFilter.push_back(newFilterChannelRandom);
+	void initializeParameters(const ParameterInitializer& initializer, unsigned long long stream) {
+		size_t filterSize = (size_t)subsecHeight * subsecWidth;
+		filters.assign(filterNum, vector<cv::Mat>());
+		vector<ParameterSegment> segments;
+		for (int filterIndex = 0; filterIndex < filterNum; filterIndex++) {
+			for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+				cv::Mat filterLayer(subsecHeight, subsecWidth, CV_64FC1);
+				segments.push_back(ParameterSegment(filterLayer.ptr<double>(0), filterSize, ((size_t)filterIndex * channels + imgChannel) * filterSize));
+				filters.at(filterIndex).push_back(filterLayer);
 			}
-			filters.push_back(newFilter);
 		}
+		initializer.fill(segments, (int)(channels * filterSize), (int)(filterNum * filterSize), stream);
+		biases.assign(filterNum, 0.0);
+		sparse = false;
+		tapStarts.clear();
+		taps.clear();
+	}
+
+	/**
+		Every subsection that fully fits into the input produces one element of each 2D activation map.
+
+		@param inputShape The dimensions of the matrix input into the layer
+		@return The dimensions of the activation maps, with a depth equal to the amount of filters
+	*/
+	TensorShape outputShape(TensorShape inputShape) const {
+		return TensorShape(filterNum, (inputShape.rows - subsecHeight) / slideY + 1, (inputShape.cols - subsecWidth) / slideX + 1);
 	}
 
 	/**
 		This function implements how the convolutional layer manipulates the input matrix
 
 		@param image The matrix to be manipulated
-		@return a vector of 2D matrices (essentially a 3D matrix) that contains all of the dot products with the filters and
-			the input matrix. Each filter generates a 2D matrix of dot products, so the depth of the returned vector is equal to
+		@param activationMap3D A vector of 2D matrices (essentially a 3D matrix) that receives all of the dot products with the filters and
+			the input matrix. Each filter generates a 2D matrix of dot products, so the depth of the output is equal to
 			the amount of filters used in this layer.
 	*/
-	vector<cv::Mat> execute(vector<cv::Mat> image) {
-		vector<cv::Mat> activationMap3D;
-		int x = 0;
-		int y = 0;
-		int imageHeight = image.at(0).rows;
-		int imageWidth = image.at(0).cols;
+	void forward(const vector<cv::Mat>& image, vector<cv::Mat>& activationMap3D) const {
+		TensorShape outShape = outputShape(shapeOf(image));
+		allocateOutput(activationMap3D, outShape);
+		if (sparse) {
+			forwardSparse(image, activationMap3D, outShape);
+			return;
+		}
+
+		kernel(image, filters, biases, activationMap3D, subsecWidth, subsecHeight, slideX, slideY);
+	}
+
+	/**
+		Recomputes a rectangle of the activation maps by running the layer's kernel on a window of the input and of the output.
+
+		@param image The matrix to be manipulated
+		@param activationMap3D The activation maps from the previous call, which are updated in place
+		@param outputRegion The rectangle of every activation map to recompute
+	*/
+	void forwardRegion(const vector<cv::Mat>& image, vector<cv::Mat>& activationMap3D, cv::Rect outputRegion) const {
+		TensorShape outShape = outputShape(shapeOf(image));
+		allocateOutput(activationMap3D, outShape);
+		outputRegion &= cv::Rect(0, 0, outShape.cols, outShape.rows);
+		if (outputRegion.area() <= 0) {
+			return;
+		}
+
+		vector<cv::Mat> inputWindow = regionOf(image, windowInput(outputRegion, subsecWidth, subsecHeight, slideX, slideY));
+		vector<cv::Mat> outputWindow = regionOf(activationMap3D, outputRegion);
+		if (sparse) {
+			forwardSparse(inputWindow, outputWindow, TensorShape(filterNum, outputRegion.height, outputRegion.width));
+		}
+		else {
+			kernel(inputWindow, filters, biases, outputWindow, subsecWidth, subsecHeight, slideX, slideY);
+		}
+	}
+
+	cv::Rect affectedRegion(cv::Rect inputRegion, TensorShape inputShape) const {
+		return windowRegion(inputRegion, subsecWidth, subsecHeight, slideX, slideY, outputShape(inputShape));
+	}
+
+	/**
+		@return Every filter weight followed by every bias
+	*/
+	int getParameterCount() const {
+		return filterNum * (channels * subsecWidth * subsecHeight + 1);
+	}
+
+	/**
+		Weight (row, col) of filter f, channel c multiplied input element (y * slideY + row, x * slideX + col) into activation (y, x)
+		of filter f, so its gradient is the sum of those input elements times the activation gradients, and each input element
+		receives the weight times the activation gradient back. Both sums run along whole rows, which keeps the inner loops simple
+		enough to vectorize. The dense filters are used even when the layer is sparse, since they hold the same weights.
+
+		@param image The matrix that was input into the layer
+		@param activationMap3D The activation maps forward produced for image
+		@param outputGradient How the cost changes with each activation
+		@param inputGradient If not null, receives how the cost changes with each element of image
+		@param parameterGradient If not null, receives the gradients of every weight (in getWeights order) followed by every bias
+	*/
+	void backward(const vector<cv::Mat>& image, const vector<cv::Mat>& activationMap3D, const vector<cv::Mat>& outputGradient,
+		vector<cv::Mat>* inputGradient, double* parameterGradient) const {
+		TensorShape outShape = shapeOf(activationMap3D);
+		size_t filterSize = (size_t)subsecHeight * subsecWidth;
+		if (inputGradient) {
+			allocateZeros(*inputGradient, shapeOf(image));
+		}
+
+		for (int filterIndex = 0; filterIndex < filterNum; filterIndex++) {
+			const cv::Mat& gradientLayer = outputGradient.at(filterIndex);
+			if (parameterGradient) {
+				double biasGradient = 0.0;
+				for (int outY = 0; outY < outShape.rows; outY++) {
+					const double* gradientRow = gradientLayer.ptr<double>(outY);
+					for (int outX = 0; outX < outShape.cols; outX++) {
+						biasGradient += gradientRow[outX];
+					}
+				}
+				parameterGradient[(size_t)filterNum * channels * filterSize + filterIndex] += biasGradient;
+			}
+
+			for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+				const cv::Mat& filterLayer = filters.at(filterIndex).at(imgChannel);
+				double* weightGradient = parameterGradient ? parameterGradient + ((size_t)filterIndex * channels + imgChannel) * filterSize : nullptr;
+				for (int row = 0; row < subsecHeight; row++) {
+					for (int col = 0; col < subsecWidth; col++) {
+						double weight = filterLayer.at<double>(row, col);
+						double gradientSum = 0.0;
+						for (int outY = 0; outY < outShape.rows; outY++) {
+							const double* gradientRow = gradientLayer.ptr<double>(outY);
+							const double* imgRow = image.at(imgChannel).ptr<double>(outY * slideY + row) + col;
+							double* inputGradientRow = inputGradient ? inputGradient->at(imgChannel).ptr<double>(outY * slideY + row) + col : nullptr;
+							for (int outX = 0; outX < outShape.cols; outX++) {
+								gradientSum += gradientRow[outX] * imgRow[outX * slideX];
+							}
+							if (inputGradientRow) {
+								for (int outX = 0; outX < outShape.cols; outX++) {
+									inputGradientRow[outX * slideX] += gradientRow[outX] * weight;
+								}
+							}
+						}
+						if (weightGradient) {
+							weightGradient[row * subsecWidth + col] += gradientSum;
+						}
+					}
+				}
+			}
+		}
+	}
 
-		for (int i = 0; i < filters.size(); i++) {
-			cv::Mat activationMap2D = cv::Mat::zeros(imageHeight, imageWidth, CV_64FC1);
-			activationMap3D.push_back(activationMap2D);
+	/**
+		Adds the changes to the dense filters and biases. A sparse layer rebuilds its taps afterwards, so weights that were pruned
+		keep learning and come back into the taps once they move away from zero.
+
+		@param changes The change of every weight (in getWeights order) followed by the change of every bias
+	*/
+	void updateParameters(const double* changes) {
+		for (int filterIndex = 0; filterIndex < filterNum; filterIndex++) {
+			for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+				cv::Mat& filterLayer = filters.at(filterIndex).at(imgChannel);
+				for (int row = 0; row < subsecHeight; row++) {
+					double* filterRow = filterLayer.ptr<double>(row);
+					for (int col = 0; col < subsecWidth; col++) {
+						filterRow[col] += *changes;
+						changes++;
+					}
+				}
+			}
+		}
+		for (int filterIndex = 0; filterIndex < filterNum; filterIndex++) {
+			biases.at(filterIndex) += changes[filterIndex];
+		}
+		if (sparse) {
+			buildTaps();
 		}
+	}
 
-		while (y + subsecHeight <= imageHeight) {
-			while (x + subsecWidth <= imageWidth) {
+	/**
+		@param values Receives every weight (in getWeights order) followed by every bias
+	*/
+	void getParameters(double* values) const {
+		vector<double> weights = getWeights();
+		values = std::copy(weights.begin(), weights.end(), values);
+		std::copy(biases.begin(), biases.end(), values);
+	}
 
-				for (int filterIndex = 0; filterIndex < filters.size(); filterIndex++) {
+	/**
+		@param values Every weight (in getWeights order) followed by every bias
+	*/
+	void setParameters(const double* values) {
+		for (int filterIndex = 0; filterIndex < filterNum; filterIndex++) {
+			for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+				cv::Mat& filterLayer = filters.at(filterIndex).at(imgChannel);
+				for (int row = 0; row < subsecHeight; row++) {
+					std::copy(values, values + subsecWidth, filterLayer.ptr<double>(row));
+					values += subsecWidth;
+				}
+			}
+		}
+		biases.assign(values, values + filterNum);
+		if (sparse) {
+			buildTaps();
+		}
+	}
+
+	/**
+		The sparse kernel only visits the taps that survived pruning, so its cost shrinks with the amount of pruned weights.
 
-					double dotProduct = 0.0;
-					for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
-						cv::Mat subImage = cv::Mat(image.at(imgChannel), cv::Rect(x, y, subsecWidth, subsecHeight));
-						dotProduct += subImage.dot(filters.at(filterIndex).at(imgChannel));
+		@param image The matrix to be manipulated
+		@param activationMap3D The allocated activation maps
+		@param outShape The dimensions of the activation maps
+	*/
+	void forwardSparse(const vector<cv::Mat>& image, vector<cv::Mat>& activationMap3D, TensorShape outShape) const {
+		for (int filterIndex = 0; filterIndex < filterNum; filterIndex++) {
+			const SparseTap* firstTap = taps.data() + tapStarts[filterIndex];
+			const SparseTap* endTap = taps.data() + tapStarts[filterIndex + 1];
+			for (int outY = 0; outY < outShape.rows; outY++) {
+				int y = outY * slideY;
+				double* activationRow = activationMap3D.at(filterIndex).ptr<double>(outY);
+				for (int outX = 0; outX < outShape.cols; outX++) {
+					int x = outX * slideX;
+					double dotProduct = biases[filterIndex];
+					for (const SparseTap* tap = firstTap; tap != endTap; tap++) {
+						dotProduct += tap->weight * image[tap->channel].ptr<double>(y + tap->row)[x + tap->col];
 					}
-					activationMap3D.at(filterIndex).col(x).row(y) = dotProduct;
+					activationRow[outX] = dotProduct;
 				}
-				x += slideX;
 			}
-			y += slideY;
 		}
+	}
 
-		cout << "Activation Map" << endl;
-		for (int i = 0; i < activationMap3D.size(); i++) {
-			cout << " - Layer: " << i << endl;
-			cout << activationMap3D.at(i) << endl;
+	/**
+		@return Every filter's weights, filter by filter, then channel by channel, row by row
+	*/
+	vector<double> getWeights() const {
+		vector<double> weights;
+		for (int filterIndex = 0; filterIndex < filters.size(); filterIndex++) {
+			for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+				const cv::Mat& filterLayer = filters.at(filterIndex).at(imgChannel);
+				for (int row = 0; row < subsecHeight; row++) {
+					const double* filterRow = filterLayer.ptr<double>(row);
+					weights.insert(weights.end(), filterRow, filterRow + subsecWidth);
+				}
+			}
 		}
-		cout << endl;
+		return weights;
+	}
 
-		return activationMap3D;
+	/**
+		@return The bias of every filter
+	*/
+	vector<double> getBiases() const {
+		return biases;
 	}
 
+	/**
+		Folds a per-filter scale and shift that follows this layer (ex. a batch normalization layer at inference) into the filters and
+		biases, so the layer's output becomes scale * output + shift at no extra cost.
+
+		@param scales The factor to multiply each filter's output by
+		@param shifts The value to add to each filter's output after scaling
+	*/
+	void foldScaleShift(const vector<double>& scales, const vector<double>& shifts) {
+		if (scales.size() != filterNum || shifts.size() != filterNum) {
+			cout << "Improper scale count for the amount of filters" << endl;
+			return;
+		}
+		for (int filterIndex = 0; filterIndex < filterNum; filterIndex++) {
+			for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+				filters.at(filterIndex).at(imgChannel) *= scales.at(filterIndex);
+			}
+			biases.at(filterIndex) = biases.at(filterIndex) * scales.at(filterIndex) + shifts.at(filterIndex);
+		}
+		if (sparse) {
+			buildTaps();
+		}
+	}
+
+	/**
+		Makes a copy of this layer with a per-filter scale and shift folded in, leaving this layer untouched. Layers are shared between
+		copies of a network, so folding has to go into a copy for the other networks to keep their scores.
+
+		@param scales The factor to multiply each filter's output by
+		@param shifts The value to add to each filter's output after scaling
+		@return The folded copy of this layer
+	*/
+	shared_ptr<ConvolutionalLayer> foldedCopy(const vector<double>& scales, const vector<double>& shifts) const {
+		shared_ptr<ConvolutionalLayer> copy(new ConvolutionalLayer(*this));
+		// A copied Mat still points at this layer's weights, so give the copy weights of its own before scaling them
+		for (int filterIndex = 0; filterIndex < filterNum; filterIndex++) {
+			for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+				copy->filters.at(filterIndex).at(imgChannel) = filters.at(filterIndex).at(imgChannel).clone();
+			}
+		}
+		copy->foldScaleShift(scales, shifts);
+		return copy;
+	}
+
+	/**
+		Sets every filter weight whose magnitude is below a threshold to zero. The dense filters are kept, because they are small,
+		but the layer switches to the sparse kernel once the fraction of zero weights reaches sparseAbove.
+
+		@param threshold The magnitude below which weights are pruned
+		@param sparseAbove The fraction of zero weights at which the layer switches to its sparse kernels
+	*/
+	void pruneWeights(double threshold, double sparseAbove = SPARSE_CROSSOVER) {
+		int zeroNum = 0;
+		for (int filterIndex = 0; filterIndex < filters.size(); filterIndex++) {
+			for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+				cv::Mat& filterLayer = filters.at(filterIndex).at(imgChannel);
+				for (int row = 0; row < subsecHeight; row++) {
+					double* filterRow = filterLayer.ptr<double>(row);
+					for (int col = 0; col < subsecWidth; col++) {
+						if (fabs(filterRow[col]) < threshold) {
+							filterRow[col] = 0.0;
+						}
+						if (filterRow[col] == 0.0) {
+							zeroNum++;
+						}
+					}
+				}
+			}
+		}
+
+		double sparsity = (double)zeroNum / ((double)filterNum * channels * subsecWidth * subsecHeight);
+		sparse = false;
+		if (sparsity >= sparseAbove) {
+			buildTaps();
+		}
+	}
+
+	/**
+		Collects the non-zero filter weights into taps and switches to the sparse kernel.
+	*/
+	void buildTaps() {
+		tapStarts.assign(1, 0);
+		taps.clear();
+		for (int filterIndex = 0; filterIndex < filters.size(); filterIndex++) {
+			for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+				const cv::Mat& filterLayer = filters.at(filterIndex).at(imgChannel);
+				for (int row = 0; row < subsecHeight; row++) {
+					for (int col = 0; col < subsecWidth; col++) {
+						double weight = filterLayer.at<double>(row, col);
+						if (weight != 0.0) {
+							SparseTap tap = { imgChannel, row, col, weight };
+							taps.push_back(tap);
+						}
+					}
+				}
+			}
+			tapStarts.push_back((int)taps.size());
+		}
+		sparse = true;
+	}
+
+	bool isSparse() const {
+		return sparse;
+	}
+
+	/**
+		@return The specialized kernel when the layer's shape has one, the generic kernel, and the sparse kernel if any weight is zero
+	*/
+	vector<LayerEngine> getEngines() const {
+		vector<LayerEngine> engines(1, DENSE_ENGINE);
+		if (selectConvolutionKernel(subsecWidth, subsecHeight, slideX, slideY) != &convolveGeneric) {
+			engines.push_back(GENERIC_ENGINE);
+		}
+		if (zeroWeightFraction() > 0.0) {
+			engines.push_back(SPARSE_ENGINE);
+		}
+		return engines;
+	}
+
+	LayerEngine getEngine() const {
+		if (sparse) {
+			return SPARSE_ENGINE;
+		}
+		return kernel == selectConvolutionKernel(subsecWidth, subsecHeight, slideX, slideY) ? DENSE_ENGINE : GENERIC_ENGINE;
+	}
+
+	/**
+		Switches between the dense kernels and the sparse kernel without pruning any weights. The dense filters are always kept, so
+		switching back is cheap.
+
+		@param engine One of getEngines()
+		@return Whether the layer can run that engine
+	*/
+	bool setEngine(LayerEngine engine) {
+		vector<LayerEngine> engines = getEngines();
+		if (find(engines.begin(), engines.end(), engine) == engines.end()) {
+			return false;
+		}
+		kernel = engine == GENERIC_ENGINE ? &convolveGeneric : selectConvolutionKernel(subsecWidth, subsecHeight, slideX, slideY);
+		if (engine == SPARSE_ENGINE) {
+			buildTaps();
+		}
+		else {
+			sparse = false;
+		}
+		return true;
+	}
+
+	string getSignature(TensorShape inputShape) const {
+		return "Convolutional " + to_string(filterNum) + " " + to_string(subsecWidth) + "x" + to_string(subsecHeight) + " slide " +
+			to_string(slideX) + "x" + to_string(slideY) + " input " + shapeText(inputShape) + " zeros " +
+			to_string((int)(zeroWeightFraction() * 20.0) * 5) + "%";
+	}
+
+	/**
+		Writes the layer to a model file. Sparse layers only store their taps.
+
+		@param out The model file
+	*/
+	void save(ostream& out) const {
+		writeValue<int>(out, CONVOLUTIONAL_LAYER);
+		writeValue<int>(out, filterNum);
+		writeValue<int>(out, subsecWidth);
+		writeValue<int>(out, subsecHeight);
+		writeValue<int>(out, slideX);
+		writeValue<int>(out, slideY);
+		writeValue<int>(out, channels);
+		writeValue<int>(out, sparse ? SPARSE_STORAGE : DENSE_STORAGE);
+		if (sparse) {
+			writeVector(out, tapStarts);
+			// Field by field, since the struct's padding is up to the compiler
+			writeValue<long long>(out, (long long)taps.size());
+			for (int tapIndex = 0; tapIndex < taps.size(); tapIndex++) {
+				writeValue<int>(out, taps.at(tapIndex).channel);
+				writeValue<int>(out, taps.at(tapIndex).row);
+				writeValue<int>(out, taps.at(tapIndex).col);
+				writeValue<double>(out, taps.at(tapIndex).weight);
+			}
+		}
+		else {
+			writeVector(out, getWeights());
+		}
+		writeVector(out, biases);
+	}
+
+	/**
+		Reads a layer written by save. The type tag has already been read by the caller.
+
+		@param in The model file
+		@param version The version of the model file. Layers from version 1 files have no biases.
+		@return The layer, or nullptr if the file is damaged
+	*/
+	static shared_ptr<ConvolutionalLayer> load(istream& in, int version = MODEL_FILE_VERSION) {
+		int myFilterNum = readValue<int>(in);
+		int mySubsecWidth = readValue<int>(in);
+		int mySubsecHeight = readValue<int>(in);
+		int mySlideX = readValue<int>(in);
+		int mySlideY = readValue<int>(in);
+		int myChannels = readValue<int>(in);
+		int storage = readValue<int>(in);
+		if (!in || myFilterNum <= 0 || mySubsecWidth <= 0 || mySubsecHeight <= 0 || mySlideX <= 0 || mySlideY <= 0 || myChannels <= 0) {
+			return nullptr;
+		}
+
+		shared_ptr<ConvolutionalLayer> layer(new ConvolutionalLayer(myFilterNum, mySubsecWidth, mySubsecHeight, mySlideX, mySlideY, myChannels,
+			ParameterInitializer(ZERO_INIT)));
+		size_t filterSize = (size_t)mySubsecWidth * mySubsecHeight;
+		if (storage == SPARSE_STORAGE) {
+			vector<int> myTapStarts = readVector<int>(in);
+			vector<SparseTap> myTaps = version >= 5 ? readTaps(in) : readVector<SparseTap>(in);
+			if (!in || !validStarts(myTapStarts, myFilterNum, myTaps.size())) {
+				return nullptr;
+			}
+			for (int filterIndex = 0; filterIndex < myFilterNum; filterIndex++) {
+				for (int imgChannel = 0; imgChannel < myChannels; imgChannel++) {
+					layer->filters.at(filterIndex).at(imgChannel) = cv::Mat::zeros(mySubsecHeight, mySubsecWidth, CV_64FC1);
+				}
+				for (int tapIndex = myTapStarts.at(filterIndex); tapIndex < myTapStarts.at(filterIndex + 1); tapIndex++) {
+					const SparseTap& tap = myTaps.at(tapIndex);
+					if (tap.channel < 0 || tap.channel >= myChannels || tap.row < 0 || tap.row >= mySubsecHeight || tap.col < 0 || tap.col >= mySubsecWidth) {
+						return nullptr;
+					}
+					layer->filters.at(filterIndex).at(tap.channel).at<double>(tap.row, tap.col) = tap.weight;
+				}
+			}
+		}
+		else {
+			vector<double> weights = readVector<double>(in);
+			if (!in || weights.size() != myFilterNum * myChannels * filterSize) {
+				return nullptr;
+			}
+			const double* weight = weights.data();
+			for (int filterIndex = 0; filterIndex < myFilterNum; filterIndex++) {
+				for (int imgChannel = 0; imgChannel < myChannels; imgChannel++) {
+					cv::Mat& filterLayer = layer->filters.at(filterIndex).at(imgChannel);
+					for (int row = 0; row < mySubsecHeight; row++) {
+						std::copy(weight, weight + mySubsecWidth, filterLayer.ptr<double>(row));
+						weight += mySubsecWidth;
+					}
+				}
+			}
+		}
+		if (version >= 2) {
+			vector<double> myBiases = readVector<double>(in);
+			if (!in || myBiases.size() != myFilterNum) {
+				return nullptr;
+			}
+			layer->biases = myBiases;
+		}
+		if (storage == SPARSE_STORAGE) {
+			layer->buildTaps();
+		}
+		return layer;
+	}
+
+	int getFilterNum() const { return filterNum; }
+	int getSubsecWidth() const { return subsecWidth; }
+	int getSubsecHeight() const { return subsecHeight; }
+	int getSlideX() const { return slideX; }
+	int getSlideY() const { return slideY; }
+	int getChannels() const { return channels; }
+
 	/**
 		This function prints out the layer's description and attributes.
 	*/
@@ -127,8 +629,9 @@ public:
 			for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
 				cout << " -- Channel " << imgChannel << endl << filters.at(filterIndex).at(imgChannel) << endl;
 			}
+			cout << " -- Bias " << biases.at(filterIndex) << endl;
 		}
 		cout << endl;
 	}
 
-};
\ No newline at end of file
+};
@@ -1,19 +1,32 @@
+#pragma once
 #include "targetver.h"
 
 #include <stdio.h>
+#ifdef _WIN32
 #include <tchar.h>
+#endif
 #include <iostream>
 #include <string>
 #include <vector>
 #include <tuple>
 #include <memory>
+#include <chrono>
+#include <fstream>
+#include <functional>
 
 #include <opencv2/opencv.hpp>
 #include "CNNLayer.h"
 #include "ConvolutionalLayer.h"
 #include "RELULayer.h"
 #include "PoolingLayer.h"
+#include "BatchNormLayer.h"
 #include "FullyConnectedLayer.h"
+#include "QuantizedConvolutionalLayer.h"
+#include "QuantizedFullyConnectedLayer.h"
+#include "HalfPrecisionConvolutionalLayer.h"
+#include "HalfPrecisionFullyConnectedLayer.h"
+#include "ExecutionContext.h"
+#include "EarlyExit.h"
 
 using namespace std;
 
@@ -22,67 +35,647 @@ private:
 	// Note: I used shared_ptr to avoid memory leaks. I first tried unique_ptr, but you can't have a vector of unique_ptrs.
 	// Please refer to https://stackoverflow.com/questions/16126578/vectors-and-polymorphism-in-c
 	vector<shared_ptr<CNNLayer>> layers;
+	TensorShape inputShape;		// The dimensions of the images this network was initialized for
+	MemoryPlan memoryPlan;		// Where each layer's output lives during a forward pass
+	vector<ExitHead> exitHeads;	// Sorted by the layer they are attached after
+	int headLayerNum = 0;		// The most layers any exit head has, so a context holds every head's scratch matrices
+	ParameterInitializer parameterInitializer;	// How the weights of new layers are drawn
+	bool initialized = false;
+
+	/**
+	Layer i of the network draws from stream i. Layer j of the head attached after layer i draws from its own stream above those.
+	*/
+	static unsigned long long headStream(int afterLayer, int headLayerIndex) {
+		return ((unsigned long long)(afterLayer + 1) << 32) + headLayerIndex;
+	}
+
+	/**
+	Replaces a convolutional or fully connected layer with a copy that stores its weights in a 16-bit format.
+	@param layer The layer, which is replaced in place
+	@param format The 16-bit format
+	@return Whether the layer was replaced
+	*/
+	static bool toHalfPrecision(shared_ptr<CNNLayer>& layer, HalfFormat format) {
+		shared_ptr<ConvolutionalLayer> convLayer = dynamic_pointer_cast<ConvolutionalLayer>(layer);
+		shared_ptr<FullyConnectedLayer> fcLayer = dynamic_pointer_cast<FullyConnectedLayer>(layer);
+		if (convLayer) {
+			layer.reset(new HalfPrecisionConvolutionalLayer(*convLayer, format));
+		}
+		else if (fcLayer) {
+			layer.reset(new HalfPrecisionFullyConnectedLayer(*fcLayer, format));
+		}
+		return convLayer || fcLayer;
+	}
+
+	/**
+	Copies the elements of the last layer's output into a list of scores.
+	@param output The output of the last layer
+	@param scores Receives the scores
+	*/
+	static void collectScores(const vector<cv::Mat>& output, vector<double>& scores) {
+		scores.clear();
+		for (int channel = 0; channel < output.size(); channel++) {
+			const cv::Mat& scoreLayer = output.at(channel);
+			for (int row = 0; row < scoreLayer.rows; row++) {
+				const double* scoreRow = scoreLayer.ptr<double>(row);
+				scores.insert(scores.end(), scoreRow, scoreRow + scoreLayer.cols);
+			}
+		}
+	}
 
 public:
 
 	/**
 	Changes the CNN's weights, biases, and kernal values.
-	@param changes A list of values to add to the current weights, biases, and kernal values
-	(weight0_changes, weight1_changes, ..., bias0_changes, ... kernal0_changes, ...) -> (0.13, 0.04, -0.05)
+	@param changes A list of values to add to the current weights, biases, and kernal values, layer by layer in the order of each
+	layer's updateParameters (layer0_kernal0_changes, ..., layer0_bias0_changes, ..., layer3_weight0_changes, ...) -> (0.13, 0.04, -0.05)
 	*/
 	void updateParams(vector<double> changes) {
-		//TODO changes weights, biases, and kernal values
-		cout << "Parameters updated" << endl;
+		if (changes.size() != getParameterCount()) {
+			cout << "Improper change count for the amount of parameters" << endl;
+			return;
+		}
+		const double* layerChanges = changes.data();
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			layers.at(layerIndex)->updateParameters(layerChanges);
+			layerChanges += layers.at(layerIndex)->getParameterCount();
+		}
+	}
+
+	/**
+	Copies every learned value of the network, in the order of updateParams.
+	@param values Receives the values. Its memory is reused between calls.
+	*/
+	void getParams(vector<double>& values) const {
+		values.resize(getParameterCount());
+		double* layerValues = values.data();
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			layers.at(layerIndex)->getParameters(layerValues);
+			layerValues += layers.at(layerIndex)->getParameterCount();
+		}
+	}
+
+	/**
+	Replaces every learned value of the network, for example with values saved by getParams.
+	@param values The values, in the order of updateParams
+	@return Whether the amount of values matched the network
+	*/
+	bool setParams(const vector<double>& values) {
+		if (values.size() != getParameterCount()) {
+			cout << "Improper value count for the amount of parameters" << endl;
+			return false;
+		}
+		const double* layerValues = values.data();
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			layers.at(layerIndex)->setParameters(layerValues);
+			layerValues += layers.at(layerIndex)->getParameterCount();
+		}
+		return true;
+	}
+
+	/**
+	@return The amount of values the network learns, in the order of updateParams: layer 0's parameters, then layer 1's, and so on.
+	Exit heads are not included.
+	*/
+	size_t getParameterCount() const {
+		size_t count = 0;
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			count += layers.at(layerIndex)->getParameterCount();
+		}
+		return count;
+	}
+
+	/**
+	Redraws the weights of every layer and exit head with a new scheme or seed, and uses them for layers added afterwards. Each layer
+	draws from its own counter-based stream, so the same initializer always gives bit-identical weights, however many threads it
+	fills them with. Layers whose weights depend on the input size (ex. fully connected layers) draw them in initializeNetwork.
+	@param initializer The scheme, seed and thread count to draw with (ex. ParameterInitializer(HE_INIT, 42))
+	*/
+	void initializeParameters(const ParameterInitializer& initializer) {
+		parameterInitializer = initializer;
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			layers.at(layerIndex)->initializeParameters(initializer, layerIndex);
+		}
+		for (int headIndex = 0; headIndex < exitHeads.size(); headIndex++) {
+			const ExitHead& head = exitHeads.at(headIndex);
+			for (int layerIndex = 0; layerIndex < head.layers.size(); layerIndex++) {
+				head.layers.at(layerIndex)->initializeParameters(initializer, headStream(head.afterLayer, layerIndex));
+			}
+		}
+	}
+
+	const ParameterInitializer& getParameterInitializer() const {
+		return parameterInitializer;
+	}
+
+	/**
+	Creates the parameters of every layer that depend on the size of its input (ex. the fully connected layer's weights). This needs to
+	be called once after all layers are added and before the first forward pass. After this, a forward pass never modifies the network.
+	@param inputRows The height of the images that will be classified
+	@param inputCols The width of the images that will be classified
+	@param inputChannels The depth of the images that will be classified (ex. 3 for RGB)
+	*/
+	void initializeNetwork(int inputRows, int inputCols, int inputChannels) {
+		inputShape = TensorShape(inputChannels, inputRows, inputCols);
+		TensorShape shape = inputShape;
+		// Tensor 0 is the input image, tensor i + 1 is the output of layer i. Each tensor is only read by the next layer.
+		vector<PlannedTensor> tensors;
+		tensors.push_back(PlannedTensor(shape, -1, 0));
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			layers.at(layerIndex)->initialize(shape);
+			shape = layers.at(layerIndex)->outputShape(shape);
+			if (shape.rows <= 0 || shape.cols <= 0) {
+				cout << "Layer " << layerIndex << " does not fit the output of the previous layer." << endl;
+				initialized = false;
+				return;
+			}
+			int aliasOf = layers.at(layerIndex)->worksInPlace() ? layerIndex : -1;
+			tensors.push_back(PlannedTensor(shape, layerIndex, layerIndex + 1, aliasOf));
+		}
+		memoryPlan = MemoryPlanner::plan(tensors);
+
+		headLayerNum = 0;
+		for (int headIndex = 0; headIndex < exitHeads.size(); headIndex++) {
+			ExitHead& head = exitHeads.at(headIndex);
+			headLayerNum = max(headLayerNum, (int)head.layers.size());
+			if (head.afterLayer < 0 || head.afterLayer >= layers.size()) {
+				cout << "Exit head " << headIndex << " is attached after a layer that does not exist." << endl;
+				initialized = false;
+				return;
+			}
+			TensorShape headShape = tensors.at(head.afterLayer + 1).shape;
+			for (int layerIndex = 0; layerIndex < head.layers.size(); layerIndex++) {
+				head.layers.at(layerIndex)->initialize(headShape);
+				headShape = head.layers.at(layerIndex)->outputShape(headShape);
+			}
+			if (headShape.size() != shape.size() || headShape.rows <= 0 || headShape.cols <= 0) {
+				cout << "Exit head " << headIndex << " does not output one score per class." << endl;
+				initialized = false;
+				return;
+			}
+		}
+		initialized = true;
+	}
+
+	bool isInitialized() const {
+		return initialized;
+	}
+
+	/**
+	@return The arena layout every ExecutionContext uses for this network
+	*/
+	const MemoryPlan& getMemoryPlan() const {
+		return memoryPlan;
+	}
+
+	int getLayerCount() const {
+		return (int)layers.size();
+	}
+
+	/**
+	@param layerIndex The index of a layer in the network
+	@return The layer. Layers are only read during a forward pass, so they may be shared between threads.
+	*/
+	shared_ptr<const CNNLayer> getLayer(int layerIndex) const {
+		return layers.at(layerIndex);
+	}
+
+	TensorShape getInputShape() const {
+		return inputShape;
+	}
+
+	/**
+	@param layerIndex The index of a layer in the network
+	@return The dimensions of the matrix that layer outputs
+	*/
+	TensorShape getOutputShape(int layerIndex) const {
+		return memoryPlan.tensors.at(layerIndex + 1).shape;
 	}
 
 	/**
 	Passes an image through the CNN to generate classification scores for an image.
+	This function does not modify the network, so several threads can call it at the same time on one shared network.
 	@param image The image to be classified
+	@param context The scratch matrices for this forward pass. Each thread needs its own context.
 	@return A list of scores for image classification (0.89, 0.02, ...)
 	*/
-	vector<double> forwardPass(cv::Mat image) {
+	vector<double> forwardPass(const cv::Mat& image, ExecutionContext& context) const {
 		vector<double> scores;
-		// TODO plan out method
-		vector<cv::Mat> modifiedImg = prepareImage(image);
+		if (!initialized) {
+			cout << "The network needs to be initialized before a forward pass." << endl;
+			return scores;
+		}
+		if (image.rows != inputShape.rows || image.cols != inputShape.cols || image.channels() != inputShape.channels) {
+			cout << "Image dimensions do not match the dimensions the network was initialized for." << endl;
+			return scores;
+		}
+
+		context.bind(memoryPlan);
+		prepareImage(image, context.input());
 
+		const vector<cv::Mat>* modifiedImg = &context.input();
 		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
-			shared_ptr<CNNLayer> nextLayer = layers.at(layerIndex);
+			layers.at(layerIndex)->forward(*modifiedImg, context.activation(layerIndex));
+			modifiedImg = &context.activation(layerIndex);
+		}
 
-			if (typeid(*nextLayer).name() == typeid(FullyConnectedLayer).name()) {
-				shared_ptr<FullyConnectedLayer> fcLayer = dynamic_pointer_cast<FullyConnectedLayer> (nextLayer);
-				fcLayer->initializeNodes(modifiedImg.size() * modifiedImg.at(0).rows * modifiedImg.at(0).cols);
-				scores = fcLayer->score(modifiedImg);
-			}
-			else {
-				modifiedImg = nextLayer->execute(modifiedImg);
+		collectScores(*modifiedImg, scores);
+		return scores;
+	}
+
+	/**
+	Passes an image through the CNN, but stops at the first exit head that is confident enough about the image. Easy images
+	only pay for the layers before their exit. Like forwardPass, this does not modify the network.
+	@param image The image to be classified
+	@param context The scratch matrices for this forward pass. Each thread needs its own context.
+	@param exitIndex If not null, receives the exit head the image left through, or getExitHeadCount() if it went through the
+	whole network
+	@return A list of scores for image classification (0.89, 0.02, ...)
+	*/
+	vector<double> forwardPassEarlyExit(const cv::Mat& image, ExecutionContext& context, int* exitIndex = nullptr) const {
+		vector<double> scores;
+		if (!initialized) {
+			cout << "The network needs to be initialized before a forward pass." << endl;
+			return scores;
+		}
+		if (image.rows != inputShape.rows || image.cols != inputShape.cols || image.channels() != inputShape.channels) {
+			cout << "Image dimensions do not match the dimensions the network was initialized for." << endl;
+			return scores;
+		}
+
+		context.bind(memoryPlan);
+		context.bindHeads(headLayerNum);
+		prepareImage(image, context.input());
+
+		int headIndex = 0;
+		const vector<cv::Mat>* modifiedImg = &context.input();
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			layers.at(layerIndex)->forward(*modifiedImg, context.activation(layerIndex));
+			modifiedImg = &context.activation(layerIndex);
+
+			// The heads have to run now, before a later layer reuses this layer's slab
+			for (; headIndex < exitHeads.size() && exitHeads.at(headIndex).afterLayer == layerIndex; headIndex++) {
+				const ExitHead& head = exitHeads.at(headIndex);
+				const vector<cv::Mat>* headImg = modifiedImg;
+				for (int headLayerIndex = 0; headLayerIndex < head.layers.size(); headLayerIndex++) {
+					head.layers.at(headLayerIndex)->forward(*headImg, context.headActivation(headLayerIndex));
+					headImg = &context.headActivation(headLayerIndex);
+				}
+				collectScores(*headImg, scores);
+				if (exitConfidence(scores) >= head.threshold) {
+					if (exitIndex) {
+						*exitIndex = headIndex;
+					}
+					return scores;
+				}
 			}
 		}
 
+		collectScores(*modifiedImg, scores);
+		if (exitIndex) {
+			*exitIndex = (int)exitHeads.size();
+		}
 		return scores;
 	}
 
+	/**
+	Classifies a set of images with early exits and reports how many left at each exit, the average latency of each exit, and the
+	average latency of a full forward pass for comparison.
+	@param images Images with the dimensions the network was initialized for
+	@return The exit statistics
+	*/
+	ExitStatistics measureEarlyExit(const vector<cv::Mat>& images) const {
+		ExitStatistics statistics((int)exitHeads.size() + 1);
+		if (!initialized || images.empty()) {
+			return statistics;
+		}
+
+		ExecutionContext context;
+		forwardPass(images.at(0), context);		// Allocates the context before timing
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (int imageIndex = 0; imageIndex < images.size(); imageIndex++) {
+			forwardPass(images.at(imageIndex), context);
+		}
+		statistics.fullPassSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count() / images.size();
+
+		for (int imageIndex = 0; imageIndex < images.size(); imageIndex++) {
+			int exitIndex = 0;
+			chrono::steady_clock::time_point imageStart = chrono::steady_clock::now();
+			forwardPassEarlyExit(images.at(imageIndex), context, &exitIndex);
+			statistics.record(exitIndex, chrono::duration<double>(chrono::steady_clock::now() - imageStart).count());
+		}
+		return statistics;
+	}
+
+	/**
+	Passes an image through the CNN using a context that belongs to the calling thread.
+	@param image The image to be classified
+	@return A list of scores for image classification (0.89, 0.02, ...)
+	*/
+	vector<double> forwardPass(const cv::Mat& image) const {
+		static thread_local ExecutionContext context;
+		return forwardPass(image, context);
+	}
+
+	/**
+	Measures how long each layer takes for a sample image. This is used to split the layers into balanced groups, for example
+	the stages of a StreamingExecutor.
+	@param image A sample image with the dimensions the network was initialized for
+	@param runs The amount of forward passes to average over
+	@return The average seconds spent in each layer
+	*/
+	vector<double> profileLayers(const cv::Mat& image, int runs = 10) const {
+		vector<double> layerSeconds(layers.size(), 0.0);
+		if (!initialized || runs <= 0) {
+			return layerSeconds;
+		}
+
+		ExecutionContext context;
+		context.bind(memoryPlan);
+		for (int run = 0; run < runs; run++) {
+			prepareImage(image, context.input());
+			const vector<cv::Mat>* modifiedImg = &context.input();
+			for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+				chrono::steady_clock::time_point start = chrono::steady_clock::now();
+				layers.at(layerIndex)->forward(*modifiedImg, context.activation(layerIndex));
+				layerSeconds.at(layerIndex) += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+				modifiedImg = &context.activation(layerIndex);
+			}
+		}
+
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			layerSeconds.at(layerIndex) /= runs;
+		}
+		return layerSeconds;
+	}
+
 	/**
 	Since OpenCV's support for 3D Mats is very bad and limited to a depth of 4, we convert the image into a vector
-	of 2D Mats
+	of 2D Mats. The layers work on doubles, so each channel is also converted to CV_64F.
 	@param image An RGB image to be classified
+	@param imageLayers Receives the 2D channels of the image
 	*/
-	vector<cv::Mat> prepareImage(cv::Mat image) {
-		if (image.channels() == 3) {
-			vector<cv::Mat> bgr_channels;
-			split(image, bgr_channels);
-			return bgr_channels;
+	void prepareImage(const cv::Mat& image, vector<cv::Mat>& imageLayers) const {
+		vector<cv::Mat> channels;
+		if (image.channels() == 1) {
+			channels.push_back(image);
+		}
+		else {
+			split(image, channels);
+		}
+		imageLayers.resize(channels.size());
+		for (int channel = 0; channel < channels.size(); channel++) {
+			channels.at(channel).convertTo(imageLayers.at(channel), CV_64F);
 		}
+	}
+
+	/**
+	Since OpenCV's support for 3D Mats is very bad and limited to a depth of 4, we convert the image into a vector
+	of 2D Mats
+	@param image An RGB image to be classified
+	*/
+	vector<cv::Mat> prepareImage(cv::Mat image) const {
 		vector<cv::Mat> imageLayers;
-		imageLayers.push_back(image);
+		prepareImage(image, imageLayers);
 		return imageLayers;
 	}
 
+	/**
+	Sets every weight in the network whose magnitude is below a threshold to zero. Layers that end up sparse enough switch to their
+	sparse kernels and storage.
+	@param threshold The magnitude below which weights are pruned
+	*/
+	void pruneWeights(double threshold) {
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			layers.at(layerIndex)->pruneWeights(threshold);
+		}
+	}
+
+	/**
+	Prunes the smallest weights of every layer until each layer has the given fraction of zero weights.
+	@param sparsity The fraction of each layer's weights to prune (0.0 - 1.0)
+	*/
+	void pruneToSparsity(double sparsity) {
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			layers.at(layerIndex)->pruneToSparsity(sparsity);
+		}
+	}
+
+	/**
+	Prunes the smallest weights of one layer until it has the given fraction of zero weights.
+	@param layerIndex The index of the layer to prune
+	@param sparsity The fraction of the layer's weights to prune (0.0 - 1.0)
+	*/
+	void pruneLayer(int layerIndex, double sparsity) {
+		layers.at(layerIndex)->pruneToSparsity(sparsity);
+	}
+
+	/**
+	Attaches a classifier head after one of the network's layers. During forwardPassEarlyExit, an image whose best class has a
+	softmax probability of at least threshold at this head skips the rest of the network. The head's last layer has to output one
+	score per class, the same as the network's last layer.
+	@param afterLayer The index of the layer whose output the head classifies
+	@param threshold The confidence an image needs to exit at this head (0.0 - 1.0)
+	@param headLayers The layers of the head, usually a pooling layer and a fully connected layer
+	*/
+	void addExitHead(int afterLayer, double threshold, vector<shared_ptr<CNNLayer>> headLayers) {
+		ExitHead head(afterLayer, threshold);
+		head.layers = headLayers;
+		vector<ExitHead>::iterator position = exitHeads.begin();
+		while (position != exitHeads.end() && position->afterLayer <= afterLayer) {
+			position++;
+		}
+		exitHeads.insert(position, head);
+		initialized = false;
+	}
+
+	/**
+	Attaches a lightweight classifier head, a pooling layer followed by a fully connected layer, after one of the network's layers.
+	@param afterLayer The index of the layer whose output the head classifies
+	@param threshold The confidence an image needs to exit at this head (0.0 - 1.0)
+	@param classNum The amount of classes the network scores
+	@param poolSize The width and height of the pooling subsections, which shrink the input of the fully connected layer
+	*/
+	void addExitHead(int afterLayer, double threshold, int classNum, int poolSize = 2) {
+		vector<shared_ptr<CNNLayer>> headLayers;
+		headLayers.push_back(shared_ptr<CNNLayer>(new PoolingLayer(poolSize, poolSize, poolSize, poolSize)));
+		headLayers.push_back(shared_ptr<CNNLayer>(new FullyConnectedLayer(classNum, parameterInitializer, headStream(afterLayer, 1))));
+		addExitHead(afterLayer, threshold, headLayers);
+	}
+
+	/**
+	@param headIndex The index of an exit head, in the order of the layers they are attached after
+	@param threshold The confidence an image needs to exit at this head (0.0 - 1.0). Above 1.0 disables the head.
+	*/
+	void setExitThreshold(int headIndex, double threshold) {
+		exitHeads.at(headIndex).threshold = threshold;
+	}
+
+	int getExitHeadCount() const {
+		return (int)exitHeads.size();
+	}
+
+	const ExitHead& getExitHead(int headIndex) const {
+		return exitHeads.at(headIndex);
+	}
+
+	/**
+	Adds an already built layer to the end of the network, for example one read from a model file.
+	@param layer The layer to add
+	*/
+	void addLayer(shared_ptr<CNNLayer> layer) {
+		layers.push_back(layer);
+		initialized = false;
+	}
+
+	/**
+	Writes the network's layers, exit heads and parameters to a binary model file. Pruned layers are written in their sparse layout.
+	@param path The file to write
+	@return Whether the file was written
+	*/
+	bool saveModel(string path) const {
+		ofstream out(path.c_str(), ios::binary);
+		if (!out) {
+			cout << "Could not open model file " << path << " for writing." << endl;
+			return false;
+		}
+		writeValue<int>(out, MODEL_FILE_MAGIC);
+		writeValue<int>(out, MODEL_FILE_VERSION);
+		writeValue<int>(out, initialized ? 1 : 0);
+		writeValue<int>(out, inputShape.channels);
+		writeValue<int>(out, inputShape.rows);
+		writeValue<int>(out, inputShape.cols);
+		writeValue<int>(out, (int)layers.size());
+		for (int layerIndex = 0; layerIndex < layers.size() && out; layerIndex++) {
+			layers.at(layerIndex)->save(out);
+		}
+		writeValue<int>(out, (int)exitHeads.size());
+		for (int headIndex = 0; headIndex < exitHeads.size(); headIndex++) {
+			const ExitHead& head = exitHeads.at(headIndex);
+			writeValue<int>(out, head.afterLayer);
+			writeValue<double>(out, head.threshold);
+			writeValue<int>(out, (int)head.layers.size());
+			for (int layerIndex = 0; layerIndex < head.layers.size() && out; layerIndex++) {
+				head.layers.at(layerIndex)->save(out);
+			}
+		}
+		if (!out) {
+			cout << "Could not write model file " << path << "." << endl;
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	Replaces this network with one read from a model file written by saveModel. If the saved network was initialized, the loaded one
+	is initialized for the same input dimensions. The network is left unchanged if the file cannot be read.
+	@param path The file to read
+	@return Whether the model was loaded
+	*/
+	bool loadModel(string path) {
+		ifstream in(path.c_str(), ios::binary);
+		if (!in || readValue<int>(in) != MODEL_FILE_MAGIC) {
+			cout << "Could not read model file " << path << "." << endl;
+			return false;
+		}
+		int version = readValue<int>(in);
+		if (version < 1 || version > MODEL_FILE_VERSION) {
+			cout << "Model file " << path << " has unsupported version " << version << "." << endl;
+			return false;
+		}
+		bool wasInitialized = readValue<int>(in) != 0;
+		TensorShape savedShape;
+		savedShape.channels = readValue<int>(in);
+		savedShape.rows = readValue<int>(in);
+		savedShape.cols = readValue<int>(in);
+		int layerNum = readValue<int>(in);
+
+		vector<shared_ptr<CNNLayer>> loadedLayers;
+		for (int layerIndex = 0; layerIndex < layerNum && in; layerIndex++) {
+			shared_ptr<CNNLayer> layer = loadLayer(in, version);
+			if (!layer) {
+				cout << "Model file " << path << " has a damaged layer " << layerIndex << "." << endl;
+				return false;
+			}
+			loadedLayers.push_back(layer);
+		}
+
+		vector<ExitHead> loadedHeads;
+		int headNum = version >= 3 ? readValue<int>(in) : 0;
+		for (int headIndex = 0; headIndex < headNum && in; headIndex++) {
+			ExitHead head;
+			head.afterLayer = readValue<int>(in);
+			head.threshold = readValue<double>(in);
+			int headLayerNum = readValue<int>(in);
+			for (int layerIndex = 0; layerIndex < headLayerNum && in; layerIndex++) {
+				shared_ptr<CNNLayer> layer = loadLayer(in, version);
+				if (!layer) {
+					cout << "Model file " << path << " has a damaged exit head " << headIndex << "." << endl;
+					return false;
+				}
+				head.layers.push_back(layer);
+			}
+			loadedHeads.push_back(head);
+		}
+		if (!in || layerNum < 0 || headNum < 0) {
+			cout << "Model file " << path << " is incomplete." << endl;
+			return false;
+		}
+
+		layers = loadedLayers;
+		exitHeads = loadedHeads;
+		initialized = false;
+		if (wasInitialized) {
+			initializeNetwork(savedShape.rows, savedShape.cols, savedShape.channels);
+		}
+		return true;
+	}
+
+	/**
+	Reads one layer from a model file by looking at its type tag.
+	@param in The model file
+	@param version The version of the model file
+	@return The layer, or nullptr if the tag is unknown or the layer is damaged
+	*/
+	static shared_ptr<CNNLayer> loadLayer(istream& in, int version = MODEL_FILE_VERSION) {
+		int type = readValue<int>(in);
+		switch (type) {
+		case CONVOLUTIONAL_LAYER:
+			return ConvolutionalLayer::load(in, version);
+		case RELU_LAYER:
+			return shared_ptr<CNNLayer>(new RELULayer());
+		case POOLING_LAYER:
+			return PoolingLayer::load(in);
+		case FULLY_CONNECTED_LAYER:
+			return FullyConnectedLayer::load(in);
+		case QUANTIZED_CONVOLUTIONAL_LAYER:
+			return QuantizedConvolutionalLayer::load(in, version);
+		case QUANTIZED_FULLY_CONNECTED_LAYER:
+			return QuantizedFullyConnectedLayer::load(in);
+		case BATCH_NORM_LAYER:
+			return BatchNormLayer::load(in);
+		case HALF_PRECISION_CONVOLUTIONAL_LAYER:
+			return HalfPrecisionConvolutionalLayer::load(in);
+		case HALF_PRECISION_FULLY_CONNECTED_LAYER:
+			return HalfPrecisionFullyConnectedLayer::load(in);
+		default:
+			return nullptr;
+		}
+	}
+
 	void printNetwork() {
 		printLine();
 		cout << "CNN MODEL" << endl << endl;
 		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
 			layers.at(layerIndex)->printLayer();
 		}
+		for (int headIndex = 0; headIndex < exitHeads.size(); headIndex++) {
+			cout << "Exit Head " << headIndex << " (after layer " << exitHeads.at(headIndex).afterLayer <<
+				", threshold " << exitHeads.at(headIndex).threshold << ")" << endl;
+			for (int layerIndex = 0; layerIndex < exitHeads.at(headIndex).layers.size(); layerIndex++) {
+				exitHeads.at(headIndex).layers.at(layerIndex)->printLayer();
+			}
+		}
 		printLine();
 	}
 
@@ -111,8 +704,10 @@ public:
 	*/
 	void addConvolutionalLayer(int filterNum, int subsecWidth, int subsecHeight, int slideX, int slideY, int channels) {
 		//CNNLayer *layer = new ConvolutionalLayer(filterNum, subsecWidth, subsecHeight, slideX, slideY);
-		shared_ptr<CNNLayer> layer(new ConvolutionalLayer(filterNum, subsecWidth, subsecHeight, slideX, slideY, channels));
+		shared_ptr<CNNLayer> layer(new ConvolutionalLayer(filterNum, subsecWidth, subsecHeight, slideX, slideY, channels, parameterInitializer,
+			layers.size()));
 		layers.push_back(layer);
+		initialized = false;
 	}
 
 	/**
@@ -125,6 +720,7 @@ public:
 	void addActivationLayer(string type = "RELU") {
 		shared_ptr<CNNLayer> layer(new RELULayer());
 		layers.push_back(layer);
+		initialized = false;
 	}
 
 	/**
@@ -143,6 +739,7 @@ public:
 	void addPoolingLayer(int subsecWidth, int subsecHeight, int slideX, int slideY) {
 		shared_ptr<CNNLayer> layer(new PoolingLayer(subsecWidth, subsecHeight, slideX, slideY));
 		layers.push_back(layer);
+		initialized = false;
 	}
 
 	/**
@@ -155,8 +752,205 @@ public:
 	@param nodeNum The number of nodes in this layer
 	*/
 	void addFullyConnectedLayer(int nodeNum) {
-		shared_ptr<CNNLayer> layer(new FullyConnectedLayer(nodeNum));
+		shared_ptr<CNNLayer> layer(new FullyConnectedLayer(nodeNum, parameterInitializer, layers.size()));
 		layers.push_back(layer);
+		initialized = false;
+	}
+
+	/**
+	This layer normalizes each channel of the 3D box to a mean of 0 and a variance of 1, and then scales and shifts it by learned values.
+	It is usually added right after a convolutional layer, which keeps the values in deep stacks of convolutional layers in a range
+	that still trains. Once training is done, foldBatchNorm merges it into that convolutional layer.
+	@param epsilon Added to the variance before taking its square root
+	@param momentum How much each training batch moves the running statistics (0.0 - 1.0)
+	*/
+	void addBatchNormLayer(double epsilon = 1e-5, double momentum = 0.1) {
+		shared_ptr<CNNLayer> layer(new BatchNormLayer(epsilon, momentum));
+		layers.push_back(layer);
+		initialized = false;
+	}
+
+	/**
+	Runs a batch of images through the network in training mode, so every batch normalization layer normalizes with the statistics
+	of the batch and updates its running statistics. This modifies the network, so it must not run alongside forward passes.
+	@param images The training batch, with the dimensions the network was initialized for
+	*/
+	void updateBatchNormStatistics(const vector<cv::Mat>& images) {
+		if (!initialized) {
+			cout << "The network needs to be initialized before training." << endl;
+			return;
+		}
+		vector<vector<cv::Mat>> batch(images.size()), nextBatch(images.size());
+		for (int imageIndex = 0; imageIndex < images.size(); imageIndex++) {
+			prepareImage(images.at(imageIndex), batch.at(imageIndex));
+		}
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			shared_ptr<BatchNormLayer> batchNorm = dynamic_pointer_cast<BatchNormLayer>(layers.at(layerIndex));
+			if (batchNorm) {
+				batchNorm->forwardTraining(batch, nextBatch);
+			}
+			else {
+				for (int imageIndex = 0; imageIndex < batch.size(); imageIndex++) {
+					layers.at(layerIndex)->forward(batch.at(imageIndex), nextBatch.at(imageIndex));
+				}
+			}
+			batch.swap(nextBatch);
+		}
+	}
+
+	/**
+	@param values Receives the running statistics of every batch normalization layer, in layer order. They are not parameters, so
+	getParams leaves them out, but a run that is continued or returns to an earlier epoch needs them back.
+	*/
+	void getBatchNormStatistics(vector<double>& values) const {
+		values.clear();
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			shared_ptr<BatchNormLayer> batchNorm = dynamic_pointer_cast<BatchNormLayer>(layers.at(layerIndex));
+			if (batchNorm) {
+				size_t first = values.size();
+				values.resize(first + batchNorm->getStatisticCount());
+				batchNorm->getStatistics(values.data() + first);
+			}
+		}
+	}
+
+	/**
+	@param values The running statistics of every batch normalization layer, as getBatchNormStatistics gives them
+	@return Whether the amount of values matched the network
+	*/
+	bool setBatchNormStatistics(const vector<double>& values) {
+		size_t count = 0;
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			shared_ptr<BatchNormLayer> batchNorm = dynamic_pointer_cast<BatchNormLayer>(layers.at(layerIndex));
+			count += batchNorm ? batchNorm->getStatisticCount() : 0;
+		}
+		if (count != values.size()) {
+			cout << "Improper amount of batch normalization statistics" << endl;
+			return false;
+		}
+		const double* value = values.data();
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			shared_ptr<BatchNormLayer> batchNorm = dynamic_pointer_cast<BatchNormLayer>(layers.at(layerIndex));
+			if (batchNorm) {
+				batchNorm->setStatistics(value);
+				value += batchNorm->getStatisticCount();
+			}
+		}
+		return true;
+	}
+
+	/**
+	Merges every batch normalization layer that directly follows a convolutional layer into that layer's filters and biases, and removes
+	it. At inference a batch normalization layer is a fixed scale and shift per channel, so the folded network gives the same scores
+	without the extra pass over the activations. Call this once training is done, before saving or serving the model. A batch
+	normalization layer is kept when an exit head reads the convolutional layer's output before it, since folding would change what
+	that head sees.
+	@return The amount of batch normalization layers that were folded
+	*/
+	int foldBatchNorm() {
+		int foldedNum = 0;
+		vector<shared_ptr<CNNLayer>> foldedLayers;
+		vector<bool> removed(layers.size(), false);
+		int keptIndex = -1;		// The index of foldedLayers.back() in layers
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			shared_ptr<BatchNormLayer> batchNorm = dynamic_pointer_cast<BatchNormLayer>(layers.at(layerIndex));
+			shared_ptr<ConvolutionalLayer> conv = foldedLayers.empty() ? nullptr : dynamic_pointer_cast<ConvolutionalLayer>(foldedLayers.back());
+			bool headReadsConv = false;
+			for (int headIndex = 0; headIndex < exitHeads.size(); headIndex++) {
+				int afterLayer = exitHeads.at(headIndex).afterLayer;
+				headReadsConv = headReadsConv || (afterLayer >= keptIndex && afterLayer < layerIndex);
+			}
+			if (batchNorm && conv && batchNorm->getChannels() == conv->getFilterNum() && !headReadsConv) {
+				vector<double> scales, shifts;
+				batchNorm->scaleAndShift(scales, shifts);
+				// The conv layer may be shared with copies of this network, so the folded layer replaces it instead of changing it
+				foldedLayers.back() = conv->foldedCopy(scales, shifts);
+				removed.at(layerIndex) = true;
+				foldedNum++;
+			}
+			else {
+				if (batchNorm && conv && headReadsConv) {
+					cout << "Batch normalization layer " << layerIndex << " is not folded, because an exit head reads the layer before it." << endl;
+				}
+				foldedLayers.push_back(layers.at(layerIndex));
+				keptIndex = layerIndex;
+			}
+		}
+
+		if (foldedNum > 0) {
+			// A head attached after a removed layer now reads the output of the layer it was folded into
+			for (int headIndex = 0; headIndex < exitHeads.size(); headIndex++) {
+				int removedNum = 0;
+				for (int layerIndex = 0; layerIndex <= exitHeads.at(headIndex).afterLayer && layerIndex < layers.size(); layerIndex++) {
+					removedNum += removed.at(layerIndex) ? 1 : 0;
+				}
+				exitHeads.at(headIndex).afterLayer -= removedNum;
+			}
+			layers = foldedLayers;
+			if (initialized) {
+				initializeNetwork(inputShape.rows, inputShape.cols, inputShape.channels);
+			}
+		}
+		return foldedNum;
+	}
+
+	/**
+	Stores the weights of every convolutional and fully connected layer, including those of the exit heads, in a 16-bit format. This
+	halves the memory and memory traffic of the weights compared to floats (a quarter of doubles), and the layers widen them back as
+	they use them. No calibration is needed, but the converted layers can no longer be trained, so call this once training is done.
+	The network has to be initialized, since the fully connected layers have no weights before that.
+	@param format FP16_FORMAT keeps more precision, BF16_FORMAT keeps the range of any weight
+	@return The amount of layers that were converted
+	*/
+	int storeWeightsAsHalf(HalfFormat format) {
+		if (!initialized) {
+			cout << "The network needs to be initialized before its weights are converted." << endl;
+			return 0;
+		}
+		int convertedNum = 0;
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			convertedNum += toHalfPrecision(layers.at(layerIndex), format) ? 1 : 0;
+		}
+		for (int headIndex = 0; headIndex < exitHeads.size(); headIndex++) {
+			for (int layerIndex = 0; layerIndex < exitHeads.at(headIndex).layers.size(); layerIndex++) {
+				convertedNum += toHalfPrecision(exitHeads.at(headIndex).layers.at(layerIndex), format) ? 1 : 0;
+			}
+		}
+		if (convertedNum > 0 && initialized) {
+			initializeNetwork(inputShape.rows, inputShape.cols, inputShape.channels);
+		}
+		return convertedNum;
+	}
+
+	/**
+	Offers every layer of the network and of its exit heads to a function that may swap it for an equal layer, for example one that
+	another network already holds, so both networks share its weights. The replacement must score exactly like the layer it replaces.
+	@param replace Returns the layer to use in place of the one it is given, or the same layer to keep it
+	@return The amount of layers that were replaced
+	*/
+	int replaceLayers(const function<shared_ptr<CNNLayer>(const shared_ptr<CNNLayer>&)>& replace) {
+		int replacedNum = 0;
+		for (int layerIndex = 0; layerIndex < layers.size(); layerIndex++) {
+			shared_ptr<CNNLayer> replacement = replace(layers.at(layerIndex));
+			if (replacement && replacement != layers.at(layerIndex)) {
+				layers.at(layerIndex) = replacement;
+				replacedNum++;
+			}
+		}
+		for (int headIndex = 0; headIndex < exitHeads.size(); headIndex++) {
+			for (int layerIndex = 0; layerIndex < exitHeads.at(headIndex).layers.size(); layerIndex++) {
+				shared_ptr<CNNLayer>& layer = exitHeads.at(headIndex).layers.at(layerIndex);
+				shared_ptr<CNNLayer> replacement = replace(layer);
+				if (replacement && replacement != layer) {
+					layer = replacement;
+					replacedNum++;
+				}
+			}
+		}
+		if (replacedNum > 0 && initialized) {
+			initializeNetwork(inputShape.rows, inputShape.cols, inputShape.channels);
+		}
+		return replacedNum;
 	}
 
 };
\ No newline at end of file
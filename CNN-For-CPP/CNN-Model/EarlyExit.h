@@ -0,0 +1,113 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "CNNLayer.h"
+#include "OutputHead.h"
+
+using namespace std;
+
+/**
+	A small classifier attached after one of the network's layers. If the head is confident enough about an image, the rest of the
+	network is skipped for that image.
+*/
+struct ExitHead {
+	int afterLayer;							// The index of the layer whose output the head classifies
+	double threshold;						// The softmax probability the best class needs for the image to exit here (0.0 - 1.0)
+	vector<shared_ptr<CNNLayer>> layers;	// Usually a pooling layer and a fully connected layer with one node per class
+
+	ExitHead(int myAfterLayer = 0, double myThreshold = 1.0) : afterLayer(myAfterLayer), threshold(myThreshold) {}
+};
+
+/**
+	@param scores The raw scores of one image
+	@return The softmax probability of the best class
+*/
+inline double exitConfidence(const vector<double>& scores) {
+	if (scores.empty()) {
+		return 0.0;
+	}
+	// The best class's probability is 1 / sum(exp(score_j - best score))
+	return exp(*max_element(scores.begin(), scores.end()) - logSumExp(scores.data(), (int)scores.size()));
+}
+
+/**
+	How many images left the network at each exit and how long they took. Exit i < headNum is the i-th exit head, and the last exit
+	is the end of the network. Each thread keeps its own statistics and merges them when it is done.
+*/
+struct ExitStatistics {
+	vector<long long> exits;
+	vector<double> seconds;
+	double fullPassSeconds;		// The average time of a forward pass without early exits, for comparison (0 if not measured)
+
+	ExitStatistics(int exitNum = 0) : exits(exitNum, 0), seconds(exitNum, 0.0), fullPassSeconds(0.0) {}
+
+	/**
+		@param exitIndex The exit an image left through
+		@param imageSeconds The time the image took
+	*/
+	void record(int exitIndex, double imageSeconds) {
+		if (exitIndex < 0) {
+			return;
+		}
+		if (exitIndex >= exits.size()) {
+			exits.resize(exitIndex + 1, 0);
+			seconds.resize(exitIndex + 1, 0.0);
+		}
+		exits.at(exitIndex)++;
+		seconds.at(exitIndex) += imageSeconds;
+	}
+
+	void merge(const ExitStatistics& other) {
+		if (other.exits.size() > exits.size()) {
+			exits.resize(other.exits.size(), 0);
+			seconds.resize(other.exits.size(), 0.0);
+		}
+		for (int exitIndex = 0; exitIndex < other.exits.size(); exitIndex++) {
+			exits.at(exitIndex) += other.exits.at(exitIndex);
+			seconds.at(exitIndex) += other.seconds.at(exitIndex);
+		}
+	}
+
+	long long imageNum() const {
+		long long total = 0;
+		for (int exitIndex = 0; exitIndex < exits.size(); exitIndex++) {
+			total += exits.at(exitIndex);
+		}
+		return total;
+	}
+
+	/**
+		@return The average seconds per image over every exit
+	*/
+	double averageSeconds() const {
+		double total = 0.0;
+		for (int exitIndex = 0; exitIndex < seconds.size(); exitIndex++) {
+			total += seconds.at(exitIndex);
+		}
+		long long images = imageNum();
+		return images > 0 ? total / images : 0.0;
+	}
+
+	/**
+		This function prints out the share of images and the average latency of every exit.
+	*/
+	void printStatistics() const {
+		long long images = imageNum();
+		cout << "Early Exit Statistics" << endl;
+		for (int exitIndex = 0; exitIndex < exits.size(); exitIndex++) {
+			cout << " - " << (exitIndex + 1 == exits.size() ? string("Full network") : "Exit head " + to_string(exitIndex)) <<
+				": Images: " << exits.at(exitIndex) << " (" << (images > 0 ? 100.0 * exits.at(exitIndex) / images : 0.0) << "%)" <<
+				", Average ms: " << (exits.at(exitIndex) > 0 ? seconds.at(exitIndex) * 1000.0 / exits.at(exitIndex) : 0.0) << endl;
+		}
+		cout << "Average ms per image: " << averageSeconds() * 1000.0;
+		if (fullPassSeconds > 0.0 && averageSeconds() > 0.0) {
+			cout << ", Without early exits: " << fullPassSeconds * 1000.0 << ", Speedup: " << fullPassSeconds / averageSeconds();
+		}
+		cout << endl << endl;
+	}
+};
@@ -0,0 +1,161 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <tuple>
+#include <chrono>
+#include <algorithm>
+
+#include "ConvolutionalNeuralNetwork.h"
+#include "OutputHead.h"
+#include "ParallelFor.h"
+
+using namespace std;
+
+/**
+	The results of classifying a labeled set. confusionMatrix[actual][predicted] counts the images of class actual that were
+	classified as class predicted.
+*/
+struct EvaluationReport {
+	int imageNum;					// Images that were evaluated
+	int skippedNum;					// Images left out because their label or scores did not fit the network's classes
+	int correct;
+	int topKCorrect;
+	int topK;
+	double accuracy;				// Fraction of images whose highest score was their label (0.0 - 1.0)
+	double topKAccuracy;			// Fraction of images whose label was among their topK highest scores (0.0 - 1.0)
+	double averageLoss;				// Mean softmax cross-entropy loss
+	vector<vector<int>> confusionMatrix;
+	double seconds;
+	double imagesPerSecond;
+
+	EvaluationReport() : imageNum(0), skippedNum(0), correct(0), topKCorrect(0), topK(1), accuracy(0.0), topKAccuracy(0.0), averageLoss(0.0), seconds(0.0), imagesPerSecond(0.0) {}
+
+	/**
+		This function prints out the accuracies, the throughput and the confusion matrix.
+	*/
+	void printReport() const {
+		cout << "Evaluation" << endl;
+		cout << "Images: " << imageNum << ", Skipped: " << skippedNum << ", Accuracy: " << accuracy << ", Top-" << topK << " Accuracy: " << topKAccuracy <<
+			", Loss: " << averageLoss << ", Seconds: " << seconds << ", Images/second: " << imagesPerSecond << endl;
+		cout << "Confusion Matrix (rows: label, columns: classification)" << endl;
+		for (int actual = 0; actual < confusionMatrix.size(); actual++) {
+			cout << setw(6) << actual << ":";
+			for (int predicted = 0; predicted < confusionMatrix.at(actual).size(); predicted++) {
+				cout << setw(7) << confusionMatrix.at(actual).at(predicted);
+			}
+			cout << endl;
+		}
+		cout << endl;
+	}
+};
+
+class Evaluator {
+private:
+
+	/**
+		Per-thread counts, merged into the report once every batch is done so threads never share counters.
+	*/
+	struct ThreadTally {
+		ExecutionContext context;
+		int imageNum;
+		int skippedNum;
+		int correct;
+		int topKCorrect;
+		double lossSum;
+		vector<vector<int>> confusionMatrix;
+		vector<int> bestClasses;
+
+		ThreadTally() : imageNum(0), skippedNum(0), correct(0), topKCorrect(0), lossSum(0.0) {}
+	};
+
+public:
+
+	/**
+		Classifies every image of a labeled set in parallel batches on one shared network and tallies the results. The network is
+		only read, and each thread has its own ExecutionContext, so this is cheap enough to run on a validation set every epoch.
+
+		@param cnn An initialized network
+		@param labeledSet A vector of images with their accompanying class IDs {(img1, 3), (img2, 0), ...}
+		@param topK An image counts towards the top-k accuracy if its label is among its k highest scores
+		@param threadNum The amount of threads to use. 0 uses every hardware thread.
+		@param batchSize The amount of images a thread takes at a time
+		@return The accuracies, confusion matrix and throughput. Images whose label is not one of the network's classes are left out
+			of the accuracies and counted in skippedNum.
+	*/
+	static EvaluationReport evaluate(const ConvolutionalNeuralNetwork& cnn, const vector<tuple<cv::Mat, int>>& labeledSet,
+		int topK = 5, int threadNum = 0, int batchSize = 32)
+	{
+		EvaluationReport report;
+		if (!cnn.isInitialized() || cnn.getLayerCount() == 0) {
+			cout << "The network needs to be initialized before it can be evaluated." << endl;
+			return report;
+		}
+
+		int classNum = cnn.getOutputShape(cnn.getLayerCount() - 1).size();
+		batchSize = max(1, batchSize);
+		topK = max(1, topK);
+		int batchNum = ((int)labeledSet.size() + batchSize - 1) / batchSize;
+		threadNum = threadNum <= 0 ? hardwareThreads() : threadNum;
+
+		vector<ThreadTally> tallies(threadNum);
+		for (int threadIndex = 0; threadIndex < threadNum; threadIndex++) {
+			tallies.at(threadIndex).confusionMatrix.assign(classNum, vector<int>(classNum, 0));
+		}
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		parallelFor(batchNum, threadNum, [&](int batchIndex, int threadIndex) {
+			ThreadTally& tally = tallies.at(threadIndex);
+			int endIndex = min((int)labeledSet.size(), (batchIndex + 1) * batchSize);
+			for (int imageIndex = batchIndex * batchSize; imageIndex < endIndex; imageIndex++) {
+				vector<double> scores = cnn.forwardPass(get<0>(labeledSet.at(imageIndex)), tally.context);
+				int actual = get<1>(labeledSet.at(imageIndex));
+				if (scores.size() != classNum || actual < 0 || actual >= classNum) {
+					tally.skippedNum++;
+					continue;
+				}
+
+				tally.imageNum++;
+				tally.lossSum += softmaxCrossEntropy(scores.data(), classNum, actual);
+				topKClasses(scores, topK, tally.bestClasses);
+				int predicted = tally.bestClasses.at(0);
+				tally.confusionMatrix.at(actual).at(predicted)++;
+				if (predicted == actual) {
+					tally.correct++;
+				}
+				if (find(tally.bestClasses.begin(), tally.bestClasses.end(), actual) != tally.bestClasses.end()) {
+					tally.topKCorrect++;
+				}
+			}
+		});
+		report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		report.topK = topK;
+		report.confusionMatrix.assign(classNum, vector<int>(classNum, 0));
+		for (int threadIndex = 0; threadIndex < threadNum; threadIndex++) {
+			const ThreadTally& tally = tallies.at(threadIndex);
+			report.imageNum += tally.imageNum;
+			report.skippedNum += tally.skippedNum;
+			report.correct += tally.correct;
+			report.topKCorrect += tally.topKCorrect;
+			report.averageLoss += tally.lossSum;
+			for (int actual = 0; actual < classNum; actual++) {
+				for (int predicted = 0; predicted < classNum; predicted++) {
+					report.confusionMatrix.at(actual).at(predicted) += tally.confusionMatrix.at(actual).at(predicted);
+				}
+			}
+		}
+		if (report.imageNum > 0) {
+			report.accuracy = (double)report.correct / report.imageNum;
+			report.topKAccuracy = (double)report.topKCorrect / report.imageNum;
+			report.averageLoss /= report.imageNum;
+		}
+		if (report.seconds > 0.0) {
+			report.imagesPerSecond = labeledSet.size() / report.seconds;
+		}
+		return report;
+	}
+};
@@ -0,0 +1,83 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+
+#include "MemoryPlanner.h"
+
+using namespace std;
+
+/**
+	Holds the scratch matrices of one forward pass. The network's weights are never written during a forward pass, so any number
+	of threads can run the same ConvolutionalNeuralNetwork at once as long as each thread passes its own ExecutionContext.
+	The matrices are headers into a few arena slabs laid out by the network's MemoryPlan, so reusing a context between calls
+	classifies images without new allocations, and activations that are no longer needed are overwritten by later layers.
+*/
+class ExecutionContext {
+public:
+	MemoryPlan plan;					// The plan the slabs were allocated for
+	vector<cv::Mat> slabs;				// One row of doubles per slab
+	vector<vector<cv::Mat>> tensors;	// The prepared input image followed by the output of each layer
+	vector<vector<cv::Mat>> headTensors;	// The outputs of the layers of an exit head, reused by every head
+
+	/**
+		Allocates the slabs of a memory plan and points every tensor's 2D channels into its slab. Nothing happens if the context
+		is already bound to an identical plan.
+
+		@param memoryPlan The plan of the network that will use this context
+	*/
+	void bind(const MemoryPlan& memoryPlan) {
+		if (plan == memoryPlan && slabs.size() == memoryPlan.slabSizes.size()) {
+			return;
+		}
+		plan = memoryPlan;
+
+		slabs.resize(plan.slabSizes.size());
+		for (int slabIndex = 0; slabIndex < slabs.size(); slabIndex++) {
+			slabs.at(slabIndex).create(1, (int)max(plan.slabSizes.at(slabIndex), (size_t)1), CV_64FC1);
+		}
+
+		tensors.assign(plan.tensors.size(), vector<cv::Mat>());
+		for (int tensorIndex = 0; tensorIndex < tensors.size(); tensorIndex++) {
+			TensorShape shape = plan.tensors.at(tensorIndex).shape;
+			double* slabData = slabs.at(plan.slabOfTensor.at(tensorIndex)).ptr<double>(0);
+			for (int channel = 0; channel < shape.channels; channel++) {
+				tensors.at(tensorIndex).push_back(cv::Mat(shape.rows, shape.cols, CV_64FC1, slabData + channel * shape.rows * shape.cols));
+			}
+		}
+	}
+
+	/**
+		@return The prepared input image
+	*/
+	vector<cv::Mat>& input() {
+		return tensors.at(0);
+	}
+
+	/**
+		@param layerIndex The index of a layer in the network
+		@return The output of that layer from the last forward pass. It is only valid until a later layer reuses its slab.
+	*/
+	vector<cv::Mat>& activation(int layerIndex) {
+		return tensors.at(layerIndex + 1);
+	}
+
+	/**
+		Exit heads are small and only one runs at a time, so their outputs are not planned. They keep their memory between calls.
+
+		@param layerNum The amount of layers in the longest exit head
+	*/
+	void bindHeads(int layerNum) {
+		if (headTensors.size() < layerNum) {
+			headTensors.resize(layerNum);
+		}
+	}
+
+	/**
+		@param layerIndex The index of a layer in an exit head
+		@return The output of that layer
+	*/
+	vector<cv::Mat>& headActivation(int layerIndex) {
+		return headTensors.at(layerIndex);
+	}
+};
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <stdio.h>
+#ifdef _WIN32
 #include <tchar.h>
+#endif
 #include <iostream>
 #include <string>
 #include <vector>
@@ -17,31 +19,26 @@ private:
 	vector<double> weights;		// Each weight is a connection between the node and a 3D matrix's element. Each element has a connection.
 public:
 	/**
-		Constructor method for a Node. This node is used in a fully connected layer to generate a classification score.
+		Constructor method for a Node. This node is used in a fully connected layer to generate a classification score. The bias and
+		weights start at zero, and the layer draws the weights afterwards.
 
 		@param connectionNum The number of connections this node will make. This should be equal to the amount of elements of the 3D
 			matrix input into the Fully Connected Layer
-		@param low_inc The lower bound to randomly generate weights and biases with (inclusive)
-		@param hich_exc The upper bound to randomly generate weights and biases with (exclusive)
 	*/
-	Node(int connectionNum, double low_inc = 0.01, double high_exc = 1.0) {
-		bias = myRandom(low_inc, high_exc);
-
-		for (int i = 0; i < connectionNum; i++) {
-			double randomWeight = myRandom(low_inc, high_exc);
-			weights.push_back(randomWeight);
-		}
+	Node(int connectionNum) {
+		bias = 0.0;
+		weights.assign(connectionNum, 0.0);
 	}
 
 	/**
-		Generates a random value between a min (inclusive) and max (exclusive)
+		Constructor method for a Node with known parameters, for example when loading a model.
 
-		@param min The lower bound (inclusive)
-		@param max The upper bound (exclusive)
+		@param myBias The node's bias
+		@param myWeights The node's weights. This may be empty if the layer stores its weights in sparse form.
 	*/
-	double myRandom(double min, double max) {
-		double val = (double)rand() / (RAND_MAX + 1);
-		return min + val * (max = min);
+	Node(double myBias, vector<double> myWeights) {
+		bias = myBias;
+		weights = myWeights;
 	}
 
 	/**
@@ -51,19 +48,20 @@ public:
 		@param image The input matrix
 		@return The score for the input matrix and this node
 	*/
-	double evaluate(vector<cv::Mat> image) {
+	double evaluate(const vector<cv::Mat>& image) const {
 		if (weights.size() != image.size() * image.at(0).rows * image.at(0).cols) {
 			cout << "Improper weight count for image dimensions" << endl;
 			return 0.0;
 		}
 
 		double score = 0.0;
-		int weightIndex = 0;
+		const double* weight = weights.data();
 		for (int imgChannel = 0; imgChannel < image.size(); imgChannel++) {
 			for (int row = 0; row < image.at(imgChannel).rows; row++) {
+				const double* imgRow = image.at(imgChannel).ptr<double>(row);
 				for (int col = 0; col < image.at(imgChannel).cols; col++) {
-					score += weights.at(weightIndex) * image.at(0).at<double>(row, col);
-					weightIndex++;
+					score += *weight * imgRow[col];
+					weight++;
 				}
 			}
 		}
@@ -71,6 +69,45 @@ public:
 		return score;
 	}
 
+	double getBias() const {
+		return bias;
+	}
+
+	void setBias(double myBias) {
+		bias = myBias;
+	}
+
+	const vector<double>& getWeights() const {
+		return weights;
+	}
+
+	vector<double>& getWeights() {
+		return weights;
+	}
+
+	void setWeights(vector<double> myWeights) {
+		weights = myWeights;
+	}
+
+	/**
+		Sets every weight whose magnitude is below a threshold to zero.
+
+		@param threshold The magnitude below which weights are pruned
+		@return The amount of weights that are zero afterwards
+	*/
+	int pruneWeights(double threshold) {
+		int zeroNum = 0;
+		for (int i = 0; i < weights.size(); i++) {
+			if (fabs(weights.at(i)) < threshold) {
+				weights.at(i) = 0.0;
+			}
+			if (weights.at(i) == 0.0) {
+				zeroNum++;
+			}
+		}
+		return zeroNum;
+	}
+
 	/**
 		This function prints out the node's bias and weights
 	*/
@@ -86,6 +123,11 @@ class FullyConnectedLayer : public CNNLayer {
 private:
 	vector<Node> nodes;
 	int nodeNum;
+	int connectionNum;
+	bool sparse;					// Whether the weights live in sparseWeights instead of the nodes
+	SparseMatrix sparseWeights;		// After pruning, one row of non-zero weights per node
+	ParameterInitializer initializer;	// How the weights are drawn once the input size is known
+	unsigned long long stream;			// The layer's random stream
 public:
 
 	/**
@@ -96,27 +138,49 @@ public:
 
 		@param myNodeNum The amount of classifications to generate. These are not labeled as "Washer" or "Tape." Instead, you have 
 			two classifications and the index of the score corresponds to the class.
+		@param myInitializer The scheme and seed the weights are drawn with when the network is initialized
+		@param myStream The layer's random stream (ex. its index in the network)
 	*/
-	FullyConnectedLayer(int myNodeNum) :CNNLayer()
+	FullyConnectedLayer(int myNodeNum, const ParameterInitializer& myInitializer = ParameterInitializer(), unsigned long long myStream = 0) :CNNLayer()
 	{
 		nodeNum = myNodeNum;
+		initializer = myInitializer;
+		stream = myStream;
+		connectionNum = 0;
+		sparse = false;
 	}
 
 	/**
-		The fully connected layer is unique because, it does not use the execute function to manipulate an image like the Covolutional layer,
-		RELU layer, or Pooling layer do. Instead, you should call the score(image) function that will generator a vector of scores.
+		The fully connected layer flattens its input, so the output is a single row with one score per node.
 
-		Do not use this method! This only exists because FullyConnectedLayer inherits from CNNLayer. This can be refactored later.
-		TODO: Refactor CNNLayer into a new subclass that has the execute function and have Convolutional, RELU, and Pooling inherit from. That
-		way this function can be removed from the Fully Connected layer.
+		@param inputShape The dimensions of the matrix input into the layer
+		@return The dimensions of the scores
+	*/
+	TensorShape outputShape(TensorShape inputShape) const {
+		return TensorShape(1, 1, nodeNum);
+	}
 
-		@param image The input matrix
-		@return An unmodified matrix
+	/**
+		This function implements how the fully connected layer manipulates the input matrix. Each node's score is written into one
+		column of a single row, which lets another layer follow this one.
+
+		@param image The input matrix to be classified
+		@param output Receives a 1 x nodeNum matrix of scores
 	*/
-	vector<cv::Mat> execute(vector<cv::Mat> image) {
-		cout << "A fully connected layer cannot execute any modifications to an image."
-			<< endl << "Please use vector<double> score(vector<cv::Mat> image)." << endl;
-		return image;
+	void forward(const vector<cv::Mat>& image, vector<cv::Mat>& output) const {
+		allocateOutput(output, TensorShape(1, 1, nodeNum));
+		double* scoreRow = output.at(0).ptr<double>(0);
+		if (sparse) {
+			vector<double> scratch;
+			sparseWeights.multiply(flatten(image, scratch), scoreRow);
+			for (int classIndex = 0; classIndex < nodes.size(); classIndex++) {
+				scoreRow[classIndex] += nodes.at(classIndex).getBias();
+			}
+			return;
+		}
+		for (int classIndex = 0; classIndex < nodes.size(); classIndex++) {
+			scoreRow[classIndex] = nodes.at(classIndex).evaluate(image);
+		}
 	}
 
 	/**
@@ -127,47 +191,366 @@ public:
 
 		@param image The input matrix to be classified
 	*/
-	vector<double> score(vector<cv::Mat> image) {
-		vector<double> scores;
+	vector<double> score(const vector<cv::Mat>& image) const {
+		vector<cv::Mat> output;
+		forward(image, output);
+		const double* scoreRow = output.at(0).ptr<double>(0);
+		return vector<double>(scoreRow, scoreRow + nodeNum);
+	}
 
-		for (int classIndex = 0; classIndex < nodes.size(); classIndex++) {
-			double classScore = nodes.at(classIndex).evaluate(image);
-			scores.push_back(classScore);
+	/**
+		The nodes of this layer need to know the size of the input matrix, so they are created when the network is initialized.
+		Nodes that already fit the input (ex. loaded from a model file) are kept.
+
+		@param inputShape The dimensions of the matrix input into the layer
+	*/
+	void initialize(TensorShape inputShape) {
+		if (nodes.size() != nodeNum || connectionNum != inputShape.size()) {
+			initializeNodes(inputShape.size());
 		}
-		printScores(scores);
-		return scores;
 	}
 
 	/**
 		This function creates all of the nodes for this layer. It uses the connectionNum, because each node needs to know how many
-		connections to make, since each node has a weighted connection to every element in an input matrix.
+		connections to make, since each node has a weighted connection to every element in an input matrix. Weight j of node i is
+		element i * connectionNum + j of the layer's random stream, so the nodes do not depend on how many threads draw them.
+	*/
+	void initializeNodes(int myConnectionNum) {
+		connectionNum = myConnectionNum;
+		sparse = false;
+		sparseWeights = SparseMatrix();
+		nodes.assign(nodeNum, Node(connectionNum));
+		vector<ParameterSegment> segments;
+		for (int nodeIndex = 0; nodeIndex < nodeNum; nodeIndex++) {
+			segments.push_back(ParameterSegment(nodes.at(nodeIndex).getWeights().data(), connectionNum, (unsigned long long)nodeIndex * connectionNum));
+		}
+		initializer.fill(segments, connectionNum, nodeNum, stream);
+	}
+
+	/**
+		Keeps the initializer for when the input size is known, and redraws the weights now if it already is.
+
+		@param myInitializer The scheme and seed to draw with
+		@param myStream The layer's random stream (ex. its index in the network)
+	*/
+	void initializeParameters(const ParameterInitializer& myInitializer, unsigned long long myStream) {
+		initializer = myInitializer;
+		stream = myStream;
+		if (!nodes.empty()) {
+			initializeNodes(connectionNum);
+		}
+	}
+
+	/**
+		@return Every node's weights, node by node
+	*/
+	vector<double> getWeights() const {
+		vector<double> weights;
+		for (int nodeIndex = 0; nodeIndex < nodes.size(); nodeIndex++) {
+			if (sparse) {
+				vector<double> denseRow = sparseWeights.denseRow(nodeIndex);
+				weights.insert(weights.end(), denseRow.begin(), denseRow.end());
+			}
+			else {
+				weights.insert(weights.end(), nodes.at(nodeIndex).getWeights().begin(), nodes.at(nodeIndex).getWeights().end());
+			}
+		}
+		return weights;
+	}
+
+	/**
+		Moves the weights of a sparse layer back into its nodes.
+	*/
+	void makeDense() {
+		if (!sparse) {
+			return;
+		}
+		for (int nodeIndex = 0; nodeIndex < nodes.size(); nodeIndex++) {
+			nodes.at(nodeIndex).setWeights(sparseWeights.denseRow(nodeIndex));
+		}
+		sparse = false;
+		sparseWeights = SparseMatrix();
+	}
+
+	/**
+		@return Every node's weights followed by every node's bias
+	*/
+	int getParameterCount() const {
+		return (int)nodes.size() * (connectionNum + 1);
+	}
+
+	/**
+		Score i is the sum of weight (i, j) times input element j, plus bias i. So weight (i, j) has the gradient of score i times
+		input element j, and input element j receives every score gradient times the weight that connects it. A sparse layer only
+		passes the gradient back through the weights it kept, but still reports a gradient for every weight.
+
+		@param image The matrix that was input into the layer
+		@param output The scores forward produced for image
+		@param outputGradient How the cost changes with each score
+		@param inputGradient If not null, receives how the cost changes with each element of image
+		@param parameterGradient If not null, receives the gradients of every node's weights followed by every node's bias
+	*/
+	void backward(const vector<cv::Mat>& image, const vector<cv::Mat>& output, const vector<cv::Mat>& outputGradient,
+		vector<cv::Mat>* inputGradient, double* parameterGradient) const {
+		vector<double> scratch;
+		const double* input = flatten(image, scratch);
+		const double* scoreGradient = outputGradient.at(0).ptr<double>(0);
+		vector<double> flatGradient(inputGradient ? connectionNum : 0, 0.0);
+
+		for (int nodeIndex = 0; nodeIndex < nodes.size(); nodeIndex++) {
+			double gradient = scoreGradient[nodeIndex];
+			if (parameterGradient) {
+				double* weightGradient = parameterGradient + (size_t)nodeIndex * connectionNum;
+				for (int connection = 0; connection < connectionNum; connection++) {
+					weightGradient[connection] += gradient * input[connection];
+				}
+				parameterGradient[(size_t)nodes.size() * connectionNum + nodeIndex] += gradient;
+			}
+			if (!inputGradient) {
+				continue;
+			}
+			if (sparse) {
+				for (int index = sparseWeights.rowStarts.at(nodeIndex); index < sparseWeights.rowStarts.at(nodeIndex + 1); index++) {
+					flatGradient[sparseWeights.columns[index]] += gradient * sparseWeights.values[index];
+				}
+			}
+			else {
+				const double* weights = nodes.at(nodeIndex).getWeights().data();
+				for (int connection = 0; connection < connectionNum; connection++) {
+					flatGradient[connection] += gradient * weights[connection];
+				}
+			}
+		}
+
+		if (inputGradient) {
+			TensorShape inShape = shapeOf(image);
+			allocateOutput(*inputGradient, inShape);
+			const double* value = flatGradient.data();
+			for (int imgChannel = 0; imgChannel < inShape.channels; imgChannel++) {
+				for (int row = 0; row < inShape.rows; row++) {
+					std::copy(value, value + inShape.cols, inputGradient->at(imgChannel).ptr<double>(row));
+					value += inShape.cols;
+				}
+			}
+		}
+	}
+
+	/**
+		Adds the changes to the weights and biases. A sparse layer goes back to its dense form first, because a step usually moves
+		pruned weights away from zero. Prune it again once training is done, and tune it again if an Autotuner picked its engine.
+
+		@param changes The change of every node's weights followed by the change of every node's bias
+	*/
+	void updateParameters(const double* changes) {
+		makeDense();
+		for (int nodeIndex = 0; nodeIndex < nodes.size(); nodeIndex++) {
+			vector<double>& weights = nodes.at(nodeIndex).getWeights();
+			const double* weightChanges = changes + (size_t)nodeIndex * connectionNum;
+			for (int connection = 0; connection < connectionNum; connection++) {
+				weights[connection] += weightChanges[connection];
+			}
+			nodes.at(nodeIndex).setBias(nodes.at(nodeIndex).getBias() + changes[(size_t)nodes.size() * connectionNum + nodeIndex]);
+		}
+	}
+
+	/**
+		@param values Receives every node's weights followed by every node's bias
+	*/
+	void getParameters(double* values) const {
+		vector<double> weights = getWeights();
+		vector<double> myBiases = getBiases();
+		values = std::copy(weights.begin(), weights.end(), values);
+		std::copy(myBiases.begin(), myBiases.end(), values);
+	}
+
+	/**
+		A sparse layer goes back to its dense form, like in updateParameters.
+
+		@param values Every node's weights followed by every node's bias
+	*/
+	void setParameters(const double* values) {
+		makeDense();
+		for (int nodeIndex = 0; nodeIndex < nodes.size(); nodeIndex++) {
+			const double* weights = values + (size_t)nodeIndex * connectionNum;
+			nodes.at(nodeIndex).setWeights(vector<double>(weights, weights + connectionNum));
+			nodes.at(nodeIndex).setBias(values[(size_t)nodes.size() * connectionNum + nodeIndex]);
+		}
+	}
+
+	/**
+		Sets every weight whose magnitude is below a threshold to zero. Once the fraction of zero weights reaches sparseAbove,
+		the weights move into a CSR matrix and the nodes only keep their biases, which shrinks the layer as well as speeding it up.
+
+		@param threshold The magnitude below which weights are pruned
+		@param sparseAbove The fraction of zero weights at which the layer switches to its sparse kernels
+	*/
+	void pruneWeights(double threshold, double sparseAbove = SPARSE_CROSSOVER) {
+		// Go back to the dense form so weights can be pruned further with the same code
+		makeDense();
+
+		long long zeroNum = 0;
+		for (int nodeIndex = 0; nodeIndex < nodes.size(); nodeIndex++) {
+			zeroNum += nodes.at(nodeIndex).pruneWeights(threshold);
+		}
+
+		double sparsity = nodes.empty() || connectionNum == 0 ? 0.0 : (double)zeroNum / ((double)nodes.size() * connectionNum);
+		if (sparsity >= sparseAbove) {
+			vector<vector<double>> denseRows;
+			for (int nodeIndex = 0; nodeIndex < nodes.size(); nodeIndex++) {
+				denseRows.push_back(nodes.at(nodeIndex).getWeights());
+				nodes.at(nodeIndex).setWeights(vector<double>());
+			}
+			sparseWeights = SparseMatrix::fromDense(denseRows);
+			sparse = true;
+		}
+	}
+
+	bool isSparse() const {
+		return sparse;
+	}
+
+	/**
+		@return The dense kernel, and the sparse kernel if any weight is zero
+	*/
+	vector<LayerEngine> getEngines() const {
+		vector<LayerEngine> engines(1, DENSE_ENGINE);
+		if (zeroWeightFraction() > 0.0) {
+			engines.push_back(SPARSE_ENGINE);
+		}
+		return engines;
+	}
+
+	LayerEngine getEngine() const {
+		return sparse ? SPARSE_ENGINE : DENSE_ENGINE;
+	}
+
+	/**
+		Moves the weights between the nodes and the CSR matrix without pruning any of them.
+
+		@param engine One of getEngines()
+		@return Whether the layer can run that engine
+	*/
+	bool setEngine(LayerEngine engine) {
+		vector<LayerEngine> engines = getEngines();
+		if (find(engines.begin(), engines.end(), engine) == engines.end()) {
+			return false;
+		}
+		if (engine == SPARSE_ENGINE && !sparse) {
+			pruneWeights(0.0, 0.0);
+		}
+		else if (engine == DENSE_ENGINE) {
+			makeDense();
+		}
+		return true;
+	}
+
+	string getSignature(TensorShape inputShape) const {
+		return "Fully Connected " + to_string(nodeNum) + " input " + shapeText(inputShape) + " zeros " +
+			to_string((int)(zeroWeightFraction() * 20.0) * 5) + "%";
+	}
+
+	/**
+		Writes the layer to a model file. Sparse layers store their weights in CSR form.
+
+		@param out The model file
+	*/
+	void save(ostream& out) const {
+		writeValue<int>(out, FULLY_CONNECTED_LAYER);
+		writeValue<int>(out, nodeNum);
+		writeValue<int>(out, connectionNum);
+		writeValue<int>(out, sparse ? SPARSE_STORAGE : DENSE_STORAGE);
+		writeVector(out, getBiases());
+		if (sparse) {
+			sparseWeights.save(out);
+		}
+		else {
+			writeVector(out, getWeights());
+		}
+	}
+
+	/**
+		Reads a layer written by save. The type tag has already been read by the caller.
+
+		@param in The model file
+		@return The layer, or nullptr if the file is damaged
 	*/
-	void initializeNodes(int connectionNum) {
-		for (int i = 0; i < nodeNum; i++) {
-			Node newNode(connectionNum);
-			nodes.push_back(newNode);
+	static shared_ptr<FullyConnectedLayer> load(istream& in) {
+		int myNodeNum = readValue<int>(in);
+		int myConnectionNum = readValue<int>(in);
+		int storage = readValue<int>(in);
+		vector<double> biases = readVector<double>(in);
+		if (!in || myNodeNum <= 0 || myConnectionNum < 0 || (biases.size() != myNodeNum && !biases.empty())) {
+			return nullptr;
+		}
+
+		shared_ptr<FullyConnectedLayer> layer(new FullyConnectedLayer(myNodeNum));
+		if (biases.empty()) {
+			// The layer was saved before the network was initialized
+			return layer;
 		}
+		layer->connectionNum = myConnectionNum;
+		if (storage == SPARSE_STORAGE) {
+			SparseMatrix matrix = SparseMatrix::load(in);
+			if (!in || matrix.rows != myNodeNum || matrix.cols != myConnectionNum || !matrix.isValid()) {
+				return nullptr;
+			}
+			for (int nodeIndex = 0; nodeIndex < myNodeNum; nodeIndex++) {
+				layer->nodes.push_back(Node(biases.at(nodeIndex), vector<double>()));
+			}
+			layer->sparseWeights = matrix;
+			layer->sparse = true;
+		}
+		else {
+			vector<double> weights = readVector<double>(in);
+			if (!in || weights.size() != (size_t)myNodeNum * myConnectionNum) {
+				return nullptr;
+			}
+			for (int nodeIndex = 0; nodeIndex < myNodeNum; nodeIndex++) {
+				vector<double>::const_iterator first = weights.begin() + (size_t)nodeIndex * myConnectionNum;
+				layer->nodes.push_back(Node(biases.at(nodeIndex), vector<double>(first, first + myConnectionNum)));
+			}
+		}
+		return layer;
 	}
 
 	/**
 		This function prints out all of the scores.
 	*/
-	void printScores(vector<double> scores) {
+	void printScores(vector<double> scores) const {
 		cout << "Scores:" << endl;
 		for (int scoreIndex = 0; scoreIndex < scores.size(); scoreIndex++) {
 			cout << "Class " << scoreIndex << ": " << scores.at(scoreIndex) << endl;
 		}
 	}
 
+	int getNodeNum() const { return nodeNum; }
+	int getConnectionNum() const { return connectionNum; }
+
+	/**
+		@return Every node's bias
+	*/
+	vector<double> getBiases() const {
+		vector<double> biases;
+		for (int nodeIndex = 0; nodeIndex < nodes.size(); nodeIndex++) {
+			biases.push_back(nodes.at(nodeIndex).getBias());
+		}
+		return biases;
+	}
+
 	/**
 		This function prints out the layer's description and attributes.
 	*/
 	void printLayer() {
 		cout << "Fully Connected Layer" << endl;
-		cout << "Node number: " << nodeNum << endl;
+		cout << "Node number: " << nodeNum << ", Sparse: " << (sparse ? "yes" : "no") << endl;
 		for (int i = 0; i < nodes.size(); i++) {
 			cout << "Node " << i << endl;
-			nodes.at(i).printNode();
+			if (sparse) {
+				Node(nodes.at(i).getBias(), sparseWeights.denseRow(i)).printNode();
+			}
+			else {
+				nodes.at(i).printNode();
+			}
 		}
 		cout << endl;
 	}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+/**
+	16-bit floating point formats for stored weights. Both halve the memory and the memory traffic of the weights without the
+	calibration int8 quantization needs. The values are stored in the model file, so existing formats must never change.
+*/
+enum HalfFormat {
+	FP16_FORMAT = 1,		// IEEE half: 5 exponent bits, 10 mantissa bits. About 3 decimal digits, magnitudes from 6e-8 to 65504.
+	BF16_FORMAT = 2			// bfloat16: the top half of a float. About 2 decimal digits, the full range of a float.
+};
+
+/**
+	Widening a few hundred weights at a time keeps the widened copy in the L1 cache while only the 16-bit weights stream from memory.
+*/
+const int HALF_TILE_SIZE = 256;
+
+inline uint32_t floatBits(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+inline float bitsFloat(uint32_t bits) {
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+/**
+	@param value A real value
+	@return The nearest IEEE half (ties to even). Values too large become infinity.
+*/
+inline uint16_t toFp16(double value) {
+	uint32_t bits = floatBits((float)value);
+	uint32_t sign = (bits >> 16) & 0x8000;
+	bits &= 0x7FFFFFFF;
+	if (bits >= 0x47800000) {
+		// Too large for a half, infinity or NaN
+		return (uint16_t)(sign | (bits > 0x7F800000 ? 0x7E00 : 0x7C00));
+	}
+	if (bits < 0x38800000) {
+		// Below the smallest normal half: adding 0.5 lines the subnormal mantissa up with the bottom bits, and the float adder rounds
+		return (uint16_t)(sign | (floatBits(bitsFloat(bits) + 0.5f) - 0x3F000000));
+	}
+	uint32_t mantissaOdd = (bits >> 13) & 1;
+	bits += 0xC8000FFF + mantissaOdd;		// Rebias the exponent from 127 to 15 and round the 13 dropped bits to even
+	return (uint16_t)(sign | (bits >> 13));
+}
+
+/**
+	@param half An IEEE half
+	@return Its value. Shifting the bits into a float and multiplying by 2^112 rebiases the exponent, and turns subnormal halves
+		into normal floats. Infinities and NaNs get the float's all-ones exponent with a mask, so there is no branch.
+*/
+inline double fromFp16(uint16_t half) {
+	float magnitude = bitsFloat((uint32_t)(half & 0x7FFF) << 13) * 5.192296858534828e33f;
+	uint32_t infinityMask = (half & 0x7C00) == 0x7C00 ? 0x7F800000 : 0;
+	return (double)bitsFloat(floatBits(magnitude) | infinityMask | ((uint32_t)(half & 0x8000) << 16));
+}
+
+/**
+	@param value A real value
+	@return The nearest bfloat16 (ties to even)
+*/
+inline uint16_t toBf16(double value) {
+	uint32_t bits = floatBits((float)value);
+	if ((bits & 0x7FFFFFFF) > 0x7F800000) {
+		return (uint16_t)((bits >> 16) | 0x0040);	// Keep NaN a NaN
+	}
+	bits += 0x7FFF + ((bits >> 16) & 1);
+	return (uint16_t)(bits >> 16);
+}
+
+/**
+	@param half A bfloat16
+	@return Its value
+*/
+inline double fromBf16(uint16_t half) {
+	return (double)bitsFloat((uint32_t)half << 16);
+}
+
+/**
+	Stores weights in a 16-bit format.
+
+	@param weights The weights
+	@param format The format to store them in
+	@param halves Receives the 16-bit weights in the same order
+*/
+inline void narrowWeights(const vector<double>& weights, HalfFormat format, vector<uint16_t>& halves) {
+	halves.resize(weights.size());
+	for (size_t i = 0; i < weights.size(); i++) {
+		halves[i] = format == BF16_FORMAT ? toBf16(weights[i]) : toFp16(weights[i]);
+	}
+}
+
+/**
+	Widens a run of 16-bit weights to doubles. The loop for each format is branch-free, so the compiler can vectorize it.
+
+	@param halves The 16-bit weights
+	@param count The amount of weights
+	@param format The format they are stored in
+	@param widened Receives count doubles
+*/
+inline void widenWeights(const uint16_t* halves, size_t count, HalfFormat format, double* widened) {
+	if (format == BF16_FORMAT) {
+		for (size_t i = 0; i < count; i++) {
+			widened[i] = fromBf16(halves[i]);
+		}
+	}
+	else {
+		for (size_t i = 0; i < count; i++) {
+			widened[i] = fromFp16(halves[i]);
+		}
+	}
+}
+
+/**
+	@param format A 16-bit format
+	@return Its name for printing
+*/
+inline const char* halfFormatName(HalfFormat format) {
+	return format == BF16_FORMAT ? "bf16" : "fp16";
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "CNNLayer.h"
+#include "ConvolutionalLayer.h"
+#include "SpecializedKernels.h"
+#include "HalfPrecision.h"
+
+class HalfPrecisionConvolutionalLayer : public CNNLayer {
+private:
+	int filterNum, subsecWidth, subsecHeight, slideX, slideY, channels;
+	HalfFormat format;
+	vector<uint16_t> filters;		// Filter by filter, then channel by channel, row by row
+	vector<double> biases;
+	ConvolutionKernel kernel;		// The same dense kernel a ConvolutionalLayer of this shape uses
+
+public:
+
+	/**
+		Constructor method for a 16-bit Convolutional Layer. It does the same work as a ConvolutionalLayer, but its filters are stored as
+		fp16 or bf16. Each filter is widened to doubles once per forward pass, just before the layer's kernel slides it over the image,
+		so only the filter in use is held at full width and every dot product still sums in doubles. A sparse layer is stored densely.
+
+		@param layer The trained layer to convert
+		@param myFormat The 16-bit format to store the filters in
+	*/
+	HalfPrecisionConvolutionalLayer(const ConvolutionalLayer& layer, HalfFormat myFormat) :CNNLayer()
+	{
+		filterNum = layer.getFilterNum();
+		subsecWidth = layer.getSubsecWidth();
+		subsecHeight = layer.getSubsecHeight();
+		slideX = layer.getSlideX();
+		slideY = layer.getSlideY();
+		channels = layer.getChannels();
+		format = myFormat;
+		biases = layer.getBiases();
+		narrowWeights(layer.getWeights(), format, filters);
+		kernel = selectConvolutionKernel(subsecWidth, subsecHeight, slideX, slideY);
+	}
+
+	TensorShape outputShape(TensorShape inputShape) const {
+		return TensorShape(filterNum, (inputShape.rows - subsecHeight) / slideY + 1, (inputShape.cols - subsecWidth) / slideX + 1);
+	}
+
+	/**
+		This function implements the convolution with each filter widened right before it is used.
+
+		@param image The matrix to be manipulated
+		@param activationMap3D Receives one 2D activation map per filter
+	*/
+	void forward(const vector<cv::Mat>& image, vector<cv::Mat>& activationMap3D) const {
+		TensorShape outShape = outputShape(shapeOf(image));
+		allocateOutput(activationMap3D, outShape);
+		if (image.size() != channels) {
+			cout << "Improper channel count for the filters" << endl;
+			return;
+		}
+
+		// The kernel runs one widened filter at a time, writing straight into that filter's activation map
+		static thread_local vector<vector<cv::Mat>> widenedFilter(1);
+		allocateOutput(widenedFilter.at(0), TensorShape(channels, subsecHeight, subsecWidth));
+		vector<double> bias(1);
+		vector<cv::Mat> activationMap(1);
+		size_t channelSize = (size_t)subsecHeight * subsecWidth;
+		for (int filterIndex = 0; filterIndex < filterNum; filterIndex++) {
+			const uint16_t* filter = filters.data() + filterIndex * channels * channelSize;
+			for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+				widenWeights(filter + imgChannel * channelSize, channelSize, format, widenedFilter.at(0).at(imgChannel).ptr<double>(0));
+			}
+			bias.at(0) = biases.at(filterIndex);
+			activationMap.at(0) = activationMap3D.at(filterIndex);
+			kernel(image, widenedFilter, bias, activationMap, subsecWidth, subsecHeight, slideX, slideY);
+		}
+	}
+
+	/**
+		@return The widened filter weights, in the same order as ConvolutionalLayer::getWeights
+	*/
+	vector<double> getWeights() const {
+		vector<double> weights(filters.size());
+		widenWeights(filters.data(), filters.size(), format, weights.data());
+		return weights;
+	}
+
+	vector<double> getBiases() const { return biases; }
+	HalfFormat getFormat() const { return format; }
+
+	/**
+		Writes the layer to a model file with its 16-bit filters.
+
+		@param out The model file
+	*/
+	void save(ostream& out) const {
+		writeValue<int>(out, HALF_PRECISION_CONVOLUTIONAL_LAYER);
+		writeValue<int>(out, filterNum);
+		writeValue<int>(out, subsecWidth);
+		writeValue<int>(out, subsecHeight);
+		writeValue<int>(out, slideX);
+		writeValue<int>(out, slideY);
+		writeValue<int>(out, channels);
+		writeValue<int>(out, format);
+		writeVector(out, filters);
+		writeVector(out, biases);
+	}
+
+	/**
+		Reads a layer written by save. The type tag has already been read by the caller.
+
+		@param in The model file
+		@return The layer, or nullptr if the file is damaged
+	*/
+	static shared_ptr<HalfPrecisionConvolutionalLayer> load(istream& in) {
+		shared_ptr<HalfPrecisionConvolutionalLayer> layer(new HalfPrecisionConvolutionalLayer());
+		layer->filterNum = readValue<int>(in);
+		layer->subsecWidth = readValue<int>(in);
+		layer->subsecHeight = readValue<int>(in);
+		layer->slideX = readValue<int>(in);
+		layer->slideY = readValue<int>(in);
+		layer->channels = readValue<int>(in);
+		int myFormat = readValue<int>(in);
+		layer->format = (HalfFormat)myFormat;
+		layer->filters = readVector<uint16_t>(in);
+		layer->biases = readVector<double>(in);
+		if (!in || layer->filterNum <= 0 || layer->subsecWidth <= 0 || layer->subsecHeight <= 0 || layer->slideX <= 0 || layer->slideY <= 0 ||
+			layer->channels <= 0 || (myFormat != FP16_FORMAT && myFormat != BF16_FORMAT) || layer->biases.size() != layer->filterNum ||
+			layer->filters.size() != (size_t)layer->filterNum * layer->channels * layer->subsecHeight * layer->subsecWidth) {
+			return nullptr;
+		}
+		layer->kernel = selectConvolutionKernel(layer->subsecWidth, layer->subsecHeight, layer->slideX, layer->slideY);
+		return layer;
+	}
+
+	/**
+		This function prints out the layer's description and attributes.
+	*/
+	void printLayer() {
+		cout << "Convolutional Layer (" << halfFormatName(format) << ")" << endl;
+		cout << "Filter number: " << filterNum << ", Subsection Width: " << subsecWidth << ", Subsection Height: " << subsecHeight <<
+			", Slide X: " << slideX << ", Slide Y: " << slideY << ", Channel number: " << channels << endl << endl;
+	}
+
+private:
+	HalfPrecisionConvolutionalLayer() :CNNLayer() {}
+};
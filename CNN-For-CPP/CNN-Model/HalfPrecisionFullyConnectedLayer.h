@@ -0,0 +1,144 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+
+#include "CNNLayer.h"
+#include "FullyConnectedLayer.h"
+#include "HalfPrecision.h"
+
+class HalfPrecisionFullyConnectedLayer : public CNNLayer {
+private:
+	int nodeNum, connectionNum;
+	HalfFormat format;
+	vector<uint16_t> weights;		// Node by node
+	vector<double> biases;			// Kept as doubles, there is only one per node
+
+public:
+
+	/**
+		Constructor method for a 16-bit Fully Connected Layer. It scores like a FullyConnectedLayer, but its weights are stored as fp16
+		or bf16, which makes them 4 times smaller than doubles. In large layers, reading the weights from memory takes longer than the
+		arithmetic, so the layer reads a tile of 16-bit weights at a time, widens it to doubles while it is in the L1 cache, and sums in
+		doubles. A sparse layer is stored densely.
+
+		@param layer The trained and initialized layer to convert
+		@param myFormat The 16-bit format to store the weights in
+	*/
+	HalfPrecisionFullyConnectedLayer(const FullyConnectedLayer& layer, HalfFormat myFormat) :CNNLayer()
+	{
+		nodeNum = layer.getNodeNum();
+		connectionNum = layer.getConnectionNum();
+		format = myFormat;
+		biases = layer.getBiases();
+		narrowWeights(layer.getWeights(), format, weights);
+	}
+
+	TensorShape outputShape(TensorShape inputShape) const {
+		return TensorShape(1, 1, nodeNum);
+	}
+
+	/**
+		This function implements the scoring with weights widened tile by tile.
+
+		@param image The input matrix to be classified
+		@param output Receives a 1 x nodeNum matrix of scores
+	*/
+	void forward(const vector<cv::Mat>& image, vector<cv::Mat>& output) const {
+		allocateOutput(output, TensorShape(1, 1, nodeNum));
+		double* scoreRow = output.at(0).ptr<double>(0);
+		if (shapeOf(image).size() != connectionNum) {
+			cout << "Improper weight count for image dimensions" << endl;
+			return;
+		}
+
+		static thread_local vector<double> scratch;
+		const double* input = flatten(image, scratch);
+		double widened[HALF_TILE_SIZE];
+		for (int nodeIndex = 0; nodeIndex < nodeNum; nodeIndex++) {
+			const uint16_t* nodeWeights = weights.data() + (size_t)nodeIndex * connectionNum;
+			// Four running sums, so each addition does not wait for the one before it
+			double sums[4] = { 0.0, 0.0, 0.0, 0.0 };
+			for (int tileStart = 0; tileStart < connectionNum; tileStart += HALF_TILE_SIZE) {
+				int tileSize = min(HALF_TILE_SIZE, connectionNum - tileStart);
+				widenWeights(nodeWeights + tileStart, tileSize, format, widened);
+				const double* tileInput = input + tileStart;
+				int i = 0;
+				for (; i + 4 <= tileSize; i += 4) {
+					sums[0] += tileInput[i] * widened[i];
+					sums[1] += tileInput[i + 1] * widened[i + 1];
+					sums[2] += tileInput[i + 2] * widened[i + 2];
+					sums[3] += tileInput[i + 3] * widened[i + 3];
+				}
+				for (; i < tileSize; i++) {
+					sums[0] += tileInput[i] * widened[i];
+				}
+			}
+			scoreRow[nodeIndex] = biases.at(nodeIndex) + (sums[0] + sums[1]) + (sums[2] + sums[3]);
+		}
+	}
+
+	/**
+		@return The widened weights, in the same order as FullyConnectedLayer::getWeights
+	*/
+	vector<double> getWeights() const {
+		vector<double> widened(weights.size());
+		widenWeights(weights.data(), weights.size(), format, widened.data());
+		return widened;
+	}
+
+	vector<double> getBiases() const { return biases; }
+	HalfFormat getFormat() const { return format; }
+	int getNodeNum() const { return nodeNum; }
+	int getConnectionNum() const { return connectionNum; }
+
+	/**
+		Writes the layer to a model file with its 16-bit weights.
+
+		@param out The model file
+	*/
+	void save(ostream& out) const {
+		writeValue<int>(out, HALF_PRECISION_FULLY_CONNECTED_LAYER);
+		writeValue<int>(out, nodeNum);
+		writeValue<int>(out, connectionNum);
+		writeValue<int>(out, format);
+		writeVector(out, biases);
+		writeVector(out, weights);
+	}
+
+	/**
+		Reads a layer written by save. The type tag has already been read by the caller.
+
+		@param in The model file
+		@return The layer, or nullptr if the file is damaged
+	*/
+	static shared_ptr<HalfPrecisionFullyConnectedLayer> load(istream& in) {
+		shared_ptr<HalfPrecisionFullyConnectedLayer> layer(new HalfPrecisionFullyConnectedLayer());
+		layer->nodeNum = readValue<int>(in);
+		layer->connectionNum = readValue<int>(in);
+		int myFormat = readValue<int>(in);
+		layer->format = (HalfFormat)myFormat;
+		layer->biases = readVector<double>(in);
+		layer->weights = readVector<uint16_t>(in);
+		if (!in || layer->nodeNum <= 0 || layer->connectionNum <= 0 || (myFormat != FP16_FORMAT && myFormat != BF16_FORMAT) ||
+			layer->biases.size() != layer->nodeNum || layer->weights.size() != (size_t)layer->nodeNum * layer->connectionNum) {
+			return nullptr;
+		}
+		return layer;
+	}
+
+	/**
+		This function prints out the layer's description and attributes.
+	*/
+	void printLayer() {
+		cout << "Fully Connected Layer (" << halfFormatName(format) << ")" << endl;
+		cout << "Node number: " << nodeNum << ", Connection number: " << connectionNum << endl << endl;
+	}
+
+private:
+	HalfPrecisionFullyConnectedLayer() :CNNLayer() {}
+};
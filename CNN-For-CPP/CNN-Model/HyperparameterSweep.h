@@ -0,0 +1,460 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <functional>
+
+#include "ConvolutionalNeuralNetwork.h"
+#include "Trainer.h"
+#include "Evaluator.h"
+#include "ParameterInit.h"
+#include "ParallelFor.h"
+
+using namespace std;
+
+/**
+	The values one trial of a sweep uses, by name (ex. "filters" = 8, "learningRate" = 0.01).
+*/
+struct SweepConfiguration {
+	map<string, double> values;
+
+	/**
+		@param name The hyperparameter
+		@param defaultValue The value if the sweep does not vary this hyperparameter
+		@return The trial's value
+	*/
+	double get(const string& name, double defaultValue) const {
+		map<string, double>::const_iterator found = values.find(name);
+		return found == values.end() ? defaultValue : found->second;
+	}
+
+	int getInt(const string& name, int defaultValue) const {
+		return (int)lround(get(name, defaultValue));
+	}
+
+	/**
+		@return The values as "name=value name=value ..."
+	*/
+	string describe() const {
+		ostringstream text;
+		for (map<string, double>::const_iterator value = values.begin(); value != values.end(); ++value) {
+			text << (value == values.begin() ? "" : " ") << value->first << "=" << value->second;
+		}
+		return text.str();
+	}
+};
+
+/**
+	The hyperparameters a sweep varies. Each one either has a list of values, or a range that random search draws from and a grid
+	splits into evenly spaced points.
+*/
+class SearchSpace {
+private:
+	struct Dimension {
+		string name;
+		vector<double> values;		// Empty for a range
+		double low;
+		double high;
+		bool logScale;				// Whether a range is spaced evenly in log(value) (ex. learning rates)
+		int gridPoints;
+	};
+	vector<Dimension> dimensions;
+
+	/**
+		@param dimension A range
+		@param fraction Where in the range, from 0.0 to 1.0
+	*/
+	static double pointInRange(const Dimension& dimension, double fraction) {
+		if (dimension.logScale) {
+			return exp(log(dimension.low) + fraction * (log(dimension.high) - log(dimension.low)));
+		}
+		return dimension.low + fraction * (dimension.high - dimension.low);
+	}
+
+public:
+
+	/**
+		@param name The hyperparameter
+		@param values The values to try (ex. {1, 2, 3} convolutional layers)
+	*/
+	void addValues(const string& name, const vector<double>& values) {
+		if (values.empty()) {
+			cout << "Hyperparameter " << name << " needs at least one value." << endl;
+			return;
+		}
+		Dimension dimension = { name, values, 0.0, 0.0, false, 0 };
+		dimensions.push_back(dimension);
+	}
+
+	/**
+		@param name The hyperparameter
+		@param low The lowest value
+		@param high The highest value
+		@param logScale Whether to space the values evenly in log(value). Both ends have to be above 0.
+		@param gridPoints The amount of values a grid tries, from low to high
+	*/
+	void addRange(const string& name, double low, double high, bool logScale = false, int gridPoints = 3) {
+		if (high < low || (logScale && low <= 0.0)) {
+			cout << "Hyperparameter " << name << " has an improper range." << endl;
+			return;
+		}
+		Dimension dimension = { name, vector<double>(), low, high, logScale, max(1, gridPoints) };
+		dimensions.push_back(dimension);
+	}
+
+	/**
+		@return Every combination of values, with the first hyperparameter changing slowest
+	*/
+	vector<SweepConfiguration> grid() const {
+		vector<SweepConfiguration> configurations(1);
+		for (int dimensionIndex = 0; dimensionIndex < dimensions.size(); dimensionIndex++) {
+			const Dimension& dimension = dimensions.at(dimensionIndex);
+			vector<double> points = dimension.values;
+			if (points.empty()) {
+				for (int pointIndex = 0; pointIndex < dimension.gridPoints; pointIndex++) {
+					points.push_back(pointInRange(dimension, dimension.gridPoints > 1 ? (double)pointIndex / (dimension.gridPoints - 1) : 0.5));
+				}
+			}
+			vector<SweepConfiguration> combined;
+			for (int configurationIndex = 0; configurationIndex < configurations.size(); configurationIndex++) {
+				for (int pointIndex = 0; pointIndex < points.size(); pointIndex++) {
+					combined.push_back(configurations.at(configurationIndex));
+					combined.back().values[dimension.name] = points.at(pointIndex);
+				}
+			}
+			configurations.swap(combined);
+		}
+		return configurations;
+	}
+
+	/**
+		Draws each hyperparameter of each trial independently: one of the listed values, or a value from the range.
+
+		@param trialNum The amount of configurations
+		@param seed The same seed draws the same configurations
+		@return The configurations
+	*/
+	vector<SweepConfiguration> randomSearch(int trialNum, unsigned long long seed) const {
+		vector<SweepConfiguration> configurations(max(0, trialNum));
+		for (int trialIndex = 0; trialIndex < configurations.size(); trialIndex++) {
+			unsigned long long key = streamKey(seed, trialIndex);
+			for (int dimensionIndex = 0; dimensionIndex < dimensions.size(); dimensionIndex++) {
+				const Dimension& dimension = dimensions.at(dimensionIndex);
+				double draw = counterUniform(key, dimensionIndex);
+				configurations.at(trialIndex).values[dimension.name] = dimension.values.empty() ? pointInRange(dimension, draw) :
+					dimension.values.at(min((int)dimension.values.size() - 1, (int)(draw * dimension.values.size())));
+			}
+		}
+		return configurations;
+	}
+};
+
+/**
+	Adds the layers of one trial's network. The sweep initializes the network afterwards.
+	Arguments: the trial's configuration, the dimensions of the images, and the empty network.
+*/
+typedef function<void(const SweepConfiguration&, TensorShape, ConvolutionalNeuralNetwork&)> NetworkBuilder;
+
+/**
+	The settings of a sweep.
+*/
+struct SweepOptions {
+	int coreBudget;					// The threads every trial together may use. 0 uses every hardware thread.
+	int minEpochs;					// The epochs every trial trains before the first cut
+	int maxEpochs;					// The epochs the last trials train
+	int reduction;					// Each cut keeps the best 1 / reduction of the trials (successive halving with reduction 2)
+	unsigned long long seed;		// Picks each trial's starting weights and shuffles
+	bool printProgress;
+
+	SweepOptions() : coreBudget(0), minEpochs(1), maxEpochs(9), reduction(3), seed(0), printProgress(true) {}
+};
+
+/**
+	The row of the results table for one trial.
+*/
+struct SweepResult {
+	int trialIndex;
+	SweepConfiguration configuration;
+	size_t parameterCount;
+	int epochs;						// The epochs the trial trained before it finished or was cut
+	double trainingLoss;			// Of the last epoch
+	double validationLoss;
+	double validationAccuracy;
+	double seconds;					// Time spent training and validating the trial
+	bool valid;						// Whether the configuration built a network that fits the images
+	bool finished;					// Whether the trial survived every cut
+
+	SweepResult() : trialIndex(0), parameterCount(0), epochs(0), trainingLoss(0.0), validationLoss(numeric_limits<double>::infinity()),
+		validationAccuracy(0.0), seconds(0.0), valid(false), finished(false) {}
+
+	/**
+		@return The validation loss to rank the trial by. A trial that diverged to NaN ranks last, like an infinite loss, since NaN
+			compares false with everything and would break the sort.
+	*/
+	double rankingLoss() const {
+		return std::isnan(validationLoss) ? numeric_limits<double>::infinity() : validationLoss;
+	}
+};
+
+/**
+	The results of every trial of a sweep, best first: the trials that trained the most epochs, by validation loss.
+*/
+struct SweepReport {
+	vector<SweepResult> results;
+	double seconds;
+
+	SweepReport() : seconds(0.0) {}
+
+	/**
+		@return The trial with the lowest validation loss among the finished ones, or nullptr if every configuration was invalid
+	*/
+	const SweepResult* best() const {
+		return results.empty() || !results.at(0).valid ? nullptr : &results.at(0);
+	}
+
+	/**
+		This function prints out the results table.
+	*/
+	void printTable() const {
+		cout << "Sweep results (" << results.size() << " trials, " << seconds << " seconds)" << endl;
+		cout << setw(6) << "Trial" << setw(8) << "Epochs" << setw(12) << "Val loss" << setw(10) << "Val acc" << setw(12) << "Train loss" <<
+			setw(11) << "Params" << setw(12) << "Seconds" << "  Configuration" << endl;
+		for (int resultIndex = 0; resultIndex < results.size(); resultIndex++) {
+			const SweepResult& result = results.at(resultIndex);
+			cout << setw(6) << result.trialIndex << setw(8) << result.epochs << setw(12) << result.validationLoss << setw(10) <<
+				result.validationAccuracy << setw(12) << result.trainingLoss << setw(11) << result.parameterCount << setw(12) <<
+				result.seconds << "  " << (result.valid ? result.configuration.describe() : "invalid: " + result.configuration.describe()) << endl;
+		}
+		cout << endl;
+	}
+
+	/**
+		Writes the results table as CSV, one row per trial with one column per hyperparameter.
+
+		@param path The file to write
+		@return Whether the file was written
+	*/
+	bool saveCsv(string path) const {
+		ofstream out(path.c_str());
+		if (!out) {
+			cout << "Could not open results file " << path << " for writing." << endl;
+			return false;
+		}
+		vector<string> names;
+		for (int resultIndex = 0; resultIndex < results.size(); resultIndex++) {
+			const map<string, double>& values = results.at(resultIndex).configuration.values;
+			for (map<string, double>::const_iterator value = values.begin(); value != values.end(); ++value) {
+				if (find(names.begin(), names.end(), value->first) == names.end()) {
+					names.push_back(value->first);
+				}
+			}
+		}
+		out << "trial,valid,finished,epochs,validation_loss,validation_accuracy,training_loss,parameters,seconds";
+		for (int nameIndex = 0; nameIndex < names.size(); nameIndex++) {
+			out << "," << names.at(nameIndex);
+		}
+		out << "\n";
+		out << setprecision(10);
+		for (int resultIndex = 0; resultIndex < results.size(); resultIndex++) {
+			const SweepResult& result = results.at(resultIndex);
+			out << result.trialIndex << "," << result.valid << "," << result.finished << "," << result.epochs << "," << result.validationLoss <<
+				"," << result.validationAccuracy << "," << result.trainingLoss << "," << result.parameterCount << "," << result.seconds;
+			for (int nameIndex = 0; nameIndex < names.size(); nameIndex++) {
+				out << ",";
+				if (result.configuration.values.count(names.at(nameIndex))) {
+					out << result.configuration.values.at(names.at(nameIndex));
+				}
+			}
+			out << "\n";
+		}
+		return (bool)out;
+	}
+};
+
+/**
+	Trains many network configurations at once in one process, against one copy of the training and validation images that every trial
+	only reads. The trials share a budget of threads: as many trials as the budget allows train side by side, and the threads are split
+	between them.
+
+	Trials are cut with successive halving. Every trial trains minEpochs, then only the best 1 / reduction of them by validation loss
+	keep training, for reduction times as many epochs in total, and so on until the survivors reach maxEpochs. Most of the time goes
+	to the promising configurations, and a cut trial's network is freed right away.
+
+	The configuration names the sweep reads itself are "learningRate" (default 0.01), "momentum" (0.9) and "batchSize" (32). Every
+	other name is up to the network builder.
+*/
+class HyperparameterSweep {
+private:
+	// A trial that is still training
+	struct Trial {
+		unique_ptr<ConvolutionalNeuralNetwork> cnn;
+		unique_ptr<Trainer> trainer;
+		unsigned long long seed;
+	};
+
+	/**
+		Trains a trial until it has trained the given epochs, then checks it on the validation set.
+	*/
+	static void trainTrial(Trial& trial, SweepResult& result, int epochs, int threadNum, const vector<tuple<cv::Mat, int>>& trainingSet,
+		const vector<tuple<cv::Mat, int>>& validationSet) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		trial.trainer->setThreadNum(threadNum);
+		for (; result.epochs < epochs; result.epochs++) {
+			result.trainingLoss = trial.trainer->trainEpoch(trainingSet, streamKey(trial.seed, result.epochs + 1)).averageLoss();
+		}
+		EvaluationReport report = Evaluator::evaluate(*trial.cnn, validationSet, 1, threadNum);
+		result.validationLoss = report.averageLoss;
+		result.validationAccuracy = report.accuracy;
+		result.seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+
+public:
+
+	/**
+		A builder for networks of convolutional blocks followed by fully connected layers. Each block is a convolutional layer with
+		stride 1, a batch normalization layer if "batchNorm" is 1, a RELU layer and a 2x2 max pooling layer. The Trainer normalizes
+		each training batch with its own statistics and keeps the running statistics the validation pass uses up to date.
+		Configuration names: "convLayers" (default 1), "filters" (8), "filterSize" (3), "batchNorm" (0), "fcNodes" (0 for none,
+		otherwise one hidden fully connected layer with a RELU layer).
+
+		@param classNum The amount of classes, which is the size of the last fully connected layer
+		@return The builder
+	*/
+	static NetworkBuilder convolutionalBlocks(int classNum) {
+		return [classNum](const SweepConfiguration& configuration, TensorShape inputShape, ConvolutionalNeuralNetwork& cnn) {
+			int filterSize = configuration.getInt("filterSize", 3);
+			int filterNum = configuration.getInt("filters", 8);
+			int channels = inputShape.channels;
+			for (int block = 0; block < configuration.getInt("convLayers", 1); block++) {
+				cnn.addConvolutionalLayer(filterNum, filterSize, filterSize, 1, 1, channels);
+				if (configuration.getInt("batchNorm", 0) != 0) {
+					cnn.addBatchNormLayer();
+				}
+				cnn.addActivationLayer();
+				cnn.addPoolingLayer(2, 2, 2, 2);
+				channels = filterNum;
+			}
+			if (configuration.getInt("fcNodes", 0) > 0) {
+				cnn.addFullyConnectedLayer(configuration.getInt("fcNodes", 0));
+				cnn.addActivationLayer();
+			}
+			cnn.addFullyConnectedLayer(classNum);
+		};
+	}
+
+	/**
+		Runs a sweep.
+
+		@param configurations The trials (ex. from SearchSpace::grid or SearchSpace::randomSearch)
+		@param builder Adds the layers of a trial's network
+		@param trainingSet Images with their class IDs {(img1, 3), (img2, 0), ...}. Every trial reads the same images.
+		@param validationSet Images with their class IDs that rank the trials
+		@param options The thread budget, the epochs and how hard each cut is
+		@return The results of every trial
+	*/
+	static SweepReport run(const vector<SweepConfiguration>& configurations, const NetworkBuilder& builder,
+		const vector<tuple<cv::Mat, int>>& trainingSet, const vector<tuple<cv::Mat, int>>& validationSet,
+		const SweepOptions& options = SweepOptions()) {
+		SweepReport report;
+		if (trainingSet.empty() || validationSet.empty()) {
+			cout << "A sweep needs training and validation images." << endl;
+			return report;
+		}
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		const cv::Mat& firstImage = get<0>(trainingSet.at(0));
+		TensorShape inputShape(firstImage.channels(), firstImage.rows, firstImage.cols);
+		int coreBudget = options.coreBudget <= 0 ? hardwareThreads() : options.coreBudget;
+		int reduction = max(2, options.reduction);
+
+		vector<SweepResult> results(configurations.size());
+		vector<Trial> trials(configurations.size());
+		vector<int> alive;
+		for (int trialIndex = 0; trialIndex < configurations.size(); trialIndex++) {
+			SweepResult& result = results.at(trialIndex);
+			result.trialIndex = trialIndex;
+			result.configuration = configurations.at(trialIndex);
+
+			Trial& trial = trials.at(trialIndex);
+			trial.seed = streamKey(options.seed, trialIndex);
+			trial.cnn.reset(new ConvolutionalNeuralNetwork());
+			trial.cnn->initializeParameters(ParameterInitializer(HE_INIT, trial.seed, 1));
+			builder(result.configuration, inputShape, *trial.cnn);
+			trial.cnn->initializeNetwork(inputShape.rows, inputShape.cols, inputShape.channels);
+			if (!trial.cnn->isInitialized() || trial.cnn->getLayerCount() == 0) {
+				cout << "Trial " << trialIndex << " (" << result.configuration.describe() << ") does not fit the images." << endl;
+				trial.cnn.reset();
+				continue;
+			}
+			result.valid = true;
+			result.parameterCount = trial.cnn->getParameterCount();
+			trial.trainer.reset(new Trainer(*trial.cnn, result.configuration.get("learningRate", 0.01),
+				result.configuration.getInt("batchSize", 32), 1));
+			trial.trainer->setMomentum(result.configuration.get("momentum", 0.9));
+			alive.push_back(trialIndex);
+		}
+
+		mutex printMutex;
+		for (int rungEpochs = max(1, options.minEpochs); !alive.empty(); rungEpochs = min(options.maxEpochs, rungEpochs * reduction)) {
+			rungEpochs = min(rungEpochs, max(1, options.maxEpochs));
+
+			// Every slot trains one trial at a time, with the budget split evenly between the slots
+			int slotNum = min((int)alive.size(), coreBudget);
+			parallelFor((int)alive.size(), slotNum, [&](int aliveIndex, int slotIndex) {
+				int threadNum = coreBudget / slotNum + (slotIndex < coreBudget % slotNum ? 1 : 0);
+				int trialIndex = alive.at(aliveIndex);
+				SweepResult& result = results.at(trialIndex);
+				trainTrial(trials.at(trialIndex), result, rungEpochs, threadNum, trainingSet, validationSet);
+				if (options.printProgress) {
+					lock_guard<mutex> lock(printMutex);
+					cout << "Trial " << trialIndex << ", Epochs: " << result.epochs << ", Validation loss: " << result.validationLoss <<
+						", Validation accuracy: " << result.validationAccuracy << ", " << result.configuration.describe() << endl;
+				}
+			});
+
+			if (rungEpochs >= options.maxEpochs) {
+				for (int aliveIndex = 0; aliveIndex < alive.size(); aliveIndex++) {
+					results.at(alive.at(aliveIndex)).finished = true;
+				}
+				break;
+			}
+			stable_sort(alive.begin(), alive.end(), [&](int first, int second) {
+				return results.at(first).rankingLoss() < results.at(second).rankingLoss();
+			});
+			int keepNum = max(1, ((int)alive.size() + reduction - 1) / reduction);
+			for (int aliveIndex = keepNum; aliveIndex < alive.size(); aliveIndex++) {
+				trials.at(alive.at(aliveIndex)).trainer.reset();
+				trials.at(alive.at(aliveIndex)).cnn.reset();
+			}
+			alive.resize(keepNum);
+			if (options.printProgress) {
+				cout << "Kept " << keepNum << " trials after " << rungEpochs << " epochs" << endl;
+			}
+		}
+
+		stable_sort(results.begin(), results.end(), [](const SweepResult& first, const SweepResult& second) {
+			if (first.valid != second.valid) {
+				return first.valid;
+			}
+			if (first.epochs != second.epochs) {
+				return first.epochs > second.epochs;
+			}
+			return first.rankingLoss() < second.rankingLoss();
+		});
+		report.results.swap(results);
+		report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		return report;
+	}
+};
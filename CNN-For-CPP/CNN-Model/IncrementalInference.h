@@ -0,0 +1,262 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <cmath>
+
+#include "ConvolutionalNeuralNetwork.h"
+
+using namespace std;
+
+/**
+	How much work incremental inference saved over a sequence of frames.
+*/
+struct IncrementalStatistics {
+	long long frames;
+	long long fullFrames;				// Frames that were recomputed from scratch
+	double recomputedElements;			// Activation elements recomputed, summed over every layer and frame
+	double totalElements;				// Activation elements a full recompute of every frame would have computed
+
+	IncrementalStatistics() : frames(0), fullFrames(0), recomputedElements(0.0), totalElements(0.0) {}
+
+	/**
+		This function prints out how many frames were recomputed in full and the fraction of activations recomputed.
+	*/
+	void printStatistics() const {
+		cout << "Incremental Inference" << endl;
+		cout << "Frames: " << frames << ", Full recomputes: " << fullFrames << ", Activations recomputed: " <<
+			(totalElements > 0.0 ? 100.0 * recomputedElements / totalElements : 0.0) << "%" << endl << endl;
+	}
+};
+
+/**
+	Classifies a stream of frames from a fixed camera, recomputing only what changed since the previous frame. The output of every layer
+	is kept between frames. The input is compared with the previous frame in tiles, the changed tiles become dirty rectangles, and each
+	layer maps its dirty rectangles through its receptive field (ex. a 3x3 convolution grows a rectangle by 2) and recomputes only
+	those parts of its output. Once the dirty part of a layer's output passes a fraction of it, that layer and every later layer are
+	recomputed in full, since many small rectangles would cost more than one pass.
+
+	The network is only read, but the kept activations belong to this object, so each camera stream needs its own IncrementalInference.
+*/
+class IncrementalInference {
+private:
+	const ConvolutionalNeuralNetwork& cnn;
+	int tileSize;						// The width and height of the tiles the input is compared in
+	double changeThreshold;				// The difference at which an input element counts as changed
+	double fullRecomputeAbove;			// The dirty fraction of a layer's output at which it is recomputed in full (0.0 - 1.0)
+
+	bool hasPrevious;
+	vector<cv::Mat> previousInput;
+	vector<cv::Mat> input;
+	vector<vector<cv::Mat>> activations;	// The output of every layer for the previous frame
+	IncrementalStatistics statistics;
+
+	/**
+		Unites rectangles that overlap or touch until none do, so no element is recomputed twice.
+
+		@param regions The rectangles, which are merged in place
+	*/
+	static void mergeRegions(vector<cv::Rect>& regions) {
+		bool merged = true;
+		while (merged) {
+			merged = false;
+			for (int first = 0; first < regions.size() && !merged; first++) {
+				for (int second = first + 1; second < regions.size() && !merged; second++) {
+					cv::Rect grown(regions.at(first).x - 1, regions.at(first).y - 1, regions.at(first).width + 2, regions.at(first).height + 2);
+					if ((grown & regions.at(second)).area() > 0) {
+						regions.at(first) = regions.at(first) | regions.at(second);
+						regions.erase(regions.begin() + second);
+						merged = true;
+					}
+				}
+			}
+		}
+	}
+
+	/**
+		Compares the prepared input with the previous frame tile by tile.
+
+		@return One rectangle per run of changed tiles in a tile row
+	*/
+	vector<cv::Rect> changedRegions() const {
+		vector<cv::Rect> regions;
+		TensorShape shape = CNNLayer::shapeOf(input);
+		for (int tileY = 0; tileY < shape.rows; tileY += tileSize) {
+			int tileHeight = min(tileSize, shape.rows - tileY);
+			int runStart = -1;
+			for (int tileX = 0; tileX <= shape.cols; tileX += tileSize) {
+				bool changed = false;
+				if (tileX < shape.cols) {
+					int tileWidth = min(tileSize, shape.cols - tileX);
+					for (int channel = 0; channel < shape.channels && !changed; channel++) {
+						for (int y = tileY; y < tileY + tileHeight && !changed; y++) {
+							const double* row = input.at(channel).ptr<double>(y);
+							const double* previousRow = previousInput.at(channel).ptr<double>(y);
+							for (int x = tileX; x < tileX + tileWidth; x++) {
+								if (fabs(row[x] - previousRow[x]) > changeThreshold) {
+									changed = true;
+									break;
+								}
+							}
+						}
+					}
+				}
+				if (changed && runStart < 0) {
+					runStart = tileX;
+				}
+				else if (!changed && runStart >= 0) {
+					regions.push_back(cv::Rect(runStart, tileY, min(tileX, shape.cols) - runStart, tileHeight));
+					runStart = -1;
+				}
+			}
+		}
+		mergeRegions(regions);
+		return regions;
+	}
+
+	/**
+		Runs every layer from scratch.
+
+		@param firstLayer The index of the first layer to recompute
+	*/
+	void recomputeFrom(int firstLayer) {
+		const vector<cv::Mat>* modifiedImg = firstLayer == 0 ? &input : &activations.at(firstLayer - 1);
+		for (int layerIndex = firstLayer; layerIndex < cnn.getLayerCount(); layerIndex++) {
+			cnn.getLayer(layerIndex)->forward(*modifiedImg, activations.at(layerIndex));
+			statistics.recomputedElements += cnn.getOutputShape(layerIndex).size();
+			modifiedImg = &activations.at(layerIndex);
+		}
+	}
+
+public:
+
+	/**
+		@param myCnn An initialized network, which must outlive this object and must not change while it is used
+		@param myTileSize The width and height of the tiles the input is compared in
+		@param myChangeThreshold The difference at which an input element counts as changed (0 means any change)
+		@param myFullRecomputeAbove The dirty fraction of a layer's output at which it is recomputed in full (0.0 - 1.0)
+	*/
+	IncrementalInference(const ConvolutionalNeuralNetwork& myCnn, int myTileSize = 8, double myChangeThreshold = 0.0,
+		double myFullRecomputeAbove = 0.5) : cnn(myCnn)
+	{
+		tileSize = max(1, myTileSize);
+		changeThreshold = myChangeThreshold;
+		fullRecomputeAbove = myFullRecomputeAbove;
+		hasPrevious = false;
+	}
+
+	/**
+		Forgets the previous frame, so the next frame is recomputed in full. Call this when the camera or the network changes.
+	*/
+	void reset() {
+		hasPrevious = false;
+	}
+
+	/**
+		Classifies the next frame of the stream.
+
+		@param image The frame, with the dimensions the network was initialized for
+		@return A list of scores for image classification (0.89, 0.02, ...), the same as the network's forwardPass
+	*/
+	vector<double> forwardPass(const cv::Mat& image) {
+		vector<double> scores;
+		if (!cnn.isInitialized() || cnn.getLayerCount() == 0) {
+			cout << "The network needs to be initialized before a forward pass." << endl;
+			return scores;
+		}
+		TensorShape inputShape = cnn.getInputShape();
+		if (image.rows != inputShape.rows || image.cols != inputShape.cols || image.channels() != inputShape.channels) {
+			cout << "Image dimensions do not match the dimensions the network was initialized for." << endl;
+			return scores;
+		}
+
+		int layerNum = cnn.getLayerCount();
+		cnn.prepareImage(image, input);
+		activations.resize(layerNum);
+		statistics.frames++;
+		for (int layerIndex = 0; layerIndex < layerNum; layerIndex++) {
+			statistics.totalElements += cnn.getOutputShape(layerIndex).size();
+		}
+
+		// Whether the whole input was recomputed this frame, and otherwise the regions of it that were
+		bool fullFrame = !hasPrevious;
+		vector<cv::Rect> inputRegions;
+		if (!hasPrevious) {
+			statistics.fullFrames++;
+			recomputeFrom(0);
+		}
+		else {
+			inputRegions = changedRegions();
+			vector<cv::Rect> regions = inputRegions;
+			TensorShape shape = inputShape;
+			const vector<cv::Mat>* modifiedImg = &input;
+			for (int layerIndex = 0; layerIndex < layerNum && !regions.empty(); layerIndex++) {
+				shared_ptr<const CNNLayer> layer = cnn.getLayer(layerIndex);
+				TensorShape outShape = cnn.getOutputShape(layerIndex);
+
+				vector<cv::Rect> outputRegions;
+				for (int regionIndex = 0; regionIndex < regions.size(); regionIndex++) {
+					cv::Rect outputRegion = layer->affectedRegion(regions.at(regionIndex), shape);
+					if (outputRegion.area() > 0) {
+						outputRegions.push_back(outputRegion);
+					}
+				}
+				mergeRegions(outputRegions);
+
+				double dirtyElements = 0.0;
+				for (int regionIndex = 0; regionIndex < outputRegions.size(); regionIndex++) {
+					dirtyElements += outputRegions.at(regionIndex).area();
+				}
+				if (dirtyElements >= fullRecomputeAbove * outShape.rows * outShape.cols) {
+					if (layerIndex == 0) {
+						statistics.fullFrames++;
+						fullFrame = true;
+					}
+					recomputeFrom(layerIndex);
+					break;
+				}
+
+				for (int regionIndex = 0; regionIndex < outputRegions.size(); regionIndex++) {
+					layer->forwardRegion(*modifiedImg, activations.at(layerIndex), outputRegions.at(regionIndex));
+				}
+				statistics.recomputedElements += dirtyElements * outShape.channels;
+				regions = outputRegions;
+				shape = outShape;
+				modifiedImg = &activations.at(layerIndex);
+			}
+		}
+
+		// The next frame is compared with the input the kept activations were computed from, so only the recomputed regions are
+		// copied and changes below the threshold add up until they are caught instead of drifting away frame by frame
+		if (fullFrame) {
+			previousInput.resize(input.size());
+			for (int channel = 0; channel < input.size(); channel++) {
+				input.at(channel).copyTo(previousInput.at(channel));
+			}
+		}
+		else {
+			for (int channel = 0; channel < input.size(); channel++) {
+				for (int regionIndex = 0; regionIndex < inputRegions.size(); regionIndex++) {
+					cv::Mat previousRegion = previousInput.at(channel)(inputRegions.at(regionIndex));
+					input.at(channel)(inputRegions.at(regionIndex)).copyTo(previousRegion);
+				}
+			}
+		}
+		hasPrevious = true;
+
+		const vector<cv::Mat>& output = activations.at(layerNum - 1);
+		for (int channel = 0; channel < output.size(); channel++) {
+			for (int row = 0; row < output.at(channel).rows; row++) {
+				const double* scoreRow = output.at(channel).ptr<double>(row);
+				scores.insert(scores.end(), scoreRow, scoreRow + output.at(channel).cols);
+			}
+		}
+		return scores;
+	}
+
+	const IncrementalStatistics& getStatistics() const {
+		return statistics;
+	}
+};
@@ -0,0 +1,83 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+/**
+	Symmetric int8 quantization: a real value v is stored as round(v / scale) clamped to [-127, 127], and read back as q * scale.
+	The range is kept symmetric so zero is always exactly representable and int8 products never need a zero-point correction.
+*/
+const int INT8_LIMIT = 127;
+
+/**
+	@param maxAbs The largest magnitude that needs to be represented
+	@return The scale that maps maxAbs to INT8_LIMIT. A range of zero gets a scale of 1 so nothing divides by zero.
+*/
+inline double int8Scale(double maxAbs) {
+	return maxAbs > 0.0 ? maxAbs / INT8_LIMIT : 1.0;
+}
+
+/**
+	@param value A real value
+	@param inverseScale One divided by the quantization scale
+	@return The nearest int8 value
+*/
+inline int8_t quantizeInt8(double value, double inverseScale) {
+	long rounded = lround(value * inverseScale);
+	return (int8_t)max(-(long)INT8_LIMIT, min((long)INT8_LIMIT, rounded));
+}
+
+/**
+	Quantizes a matrix of weights row by row, with one scale per row (per output channel), so a row of small weights does not lose
+	its precision to a row of large weights.
+
+	@param weights The weights, one row after another
+	@param rowNum The amount of rows (filters or nodes)
+	@param quantized Receives the int8 weights in the same order
+	@param scales Receives the scale of each row
+*/
+inline void quantizeRows(const vector<double>& weights, int rowNum, vector<int8_t>& quantized, vector<double>& scales) {
+	size_t rowLength = rowNum > 0 ? weights.size() / rowNum : 0;
+	quantized.resize(weights.size());
+	scales.resize(rowNum);
+	for (int row = 0; row < rowNum; row++) {
+		const double* rowWeights = weights.data() + row * rowLength;
+		double maxAbs = 0.0;
+		for (size_t i = 0; i < rowLength; i++) {
+			maxAbs = max(maxAbs, fabs(rowWeights[i]));
+		}
+		scales.at(row) = int8Scale(maxAbs);
+		double inverseScale = 1.0 / scales.at(row);
+		for (size_t i = 0; i < rowLength; i++) {
+			quantized.at(row * rowLength + i) = quantizeInt8(rowWeights[i], inverseScale);
+		}
+	}
+}
+
+/**
+	Quantizes a 3D matrix into one block of int8 values in channel, row, column order.
+
+	@param image The matrix
+	@param scale The activation scale found during calibration
+	@param quantized Receives the int8 values
+*/
+inline void quantizeTensor(const vector<cv::Mat>& image, double scale, vector<int8_t>& quantized) {
+	double inverseScale = 1.0 / scale;
+	size_t channelSize = image.empty() ? 0 : (size_t)image.at(0).rows * image.at(0).cols;
+	quantized.resize(image.size() * channelSize);
+	int8_t* out = quantized.data();
+	for (int channel = 0; channel < image.size(); channel++) {
+		const cv::Mat& imgLayer = image.at(channel);
+		for (int row = 0; row < imgLayer.rows; row++) {
+			const double* imgRow = imgLayer.ptr<double>(row);
+			for (int col = 0; col < imgLayer.cols; col++) {
+				*out++ = quantizeInt8(imgRow[col], inverseScale);
+			}
+		}
+	}
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+/**
+	How the learning rate changes after the warm-up.
+*/
+enum ScheduleType {
+	CONSTANT_SCHEDULE = 0,		// The base rate throughout
+	STEP_SCHEDULE = 1,			// The rate is multiplied by decay every decaySteps steps
+	COSINE_SCHEDULE = 2			// The rate falls from the base rate to the minimum rate along half a cosine wave over totalSteps steps
+};
+
+/**
+	Gives the learning rate of every gradient descent step. During the warm-up the rate climbs linearly from almost zero to the base
+	rate, which keeps the first steps of a freshly initialized network from overshooting. The rate only depends on the step, so a
+	resumed run continues with the same rates.
+*/
+class LearningRateSchedule {
+private:
+	ScheduleType type;
+	double baseRate;
+	long long warmupSteps;
+	long long decaySteps;		// STEP_SCHEDULE: the steps between two decays
+	double decay;				// STEP_SCHEDULE: the factor of each decay
+	long long totalSteps;		// COSINE_SCHEDULE: the step the rate reaches minRate
+	double minRate;
+
+public:
+
+	/**
+		@param myType How the rate changes after the warm-up
+		@param myBaseRate The rate right after the warm-up
+		@param myWarmupSteps The amount of steps the rate climbs to the base rate over. 0 starts at the base rate.
+		@param myDecaySteps STEP_SCHEDULE: the steps between two decays
+		@param myDecay STEP_SCHEDULE: the factor of each decay (ex. 0.1)
+		@param myTotalSteps COSINE_SCHEDULE: the step the rate reaches myMinRate, counted from the first step
+		@param myMinRate COSINE_SCHEDULE: the lowest rate
+	*/
+	LearningRateSchedule(ScheduleType myType = CONSTANT_SCHEDULE, double myBaseRate = 0.01, long long myWarmupSteps = 0,
+		long long myDecaySteps = 1000, double myDecay = 0.1, long long myTotalSteps = 10000, double myMinRate = 0.0) {
+		type = myType;
+		baseRate = myBaseRate;
+		warmupSteps = max(0LL, myWarmupSteps);
+		decaySteps = max(1LL, myDecaySteps);
+		decay = myDecay;
+		totalSteps = max(1LL, myTotalSteps);
+		minRate = myMinRate;
+	}
+
+	/**
+		@param step The index of a gradient descent step, starting at 0
+		@return The learning rate of that step
+	*/
+	double rateAt(long long step) const {
+		if (step < warmupSteps) {
+			return baseRate * (step + 1) / (warmupSteps + 1);
+		}
+		long long decayingStep = step - warmupSteps;
+		switch (type) {
+		case STEP_SCHEDULE:
+			return baseRate * pow(decay, (double)(decayingStep / decaySteps));
+		case COSINE_SCHEDULE: {
+			double progress = min(1.0, (double)decayingStep / max(1LL, totalSteps - warmupSteps));
+			return minRate + (baseRate - minRate) * 0.5 * (1.0 + cos(progress * 3.14159265358979323846));
+		}
+		default:
+			return baseRate;
+		}
+	}
+
+	ScheduleType getType() const { return type; }
+	double getBaseRate() const { return baseRate; }
+	long long getWarmupSteps() const { return warmupSteps; }
+	long long getDecaySteps() const { return decaySteps; }
+	double getDecay() const { return decay; }
+	long long getTotalSteps() const { return totalSteps; }
+	double getMinRate() const { return minRate; }
+};
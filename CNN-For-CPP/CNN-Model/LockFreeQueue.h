@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+using namespace std;
+
+/**
+	A bounded single-producer single-consumer queue. Exactly one thread may push and exactly one other thread may pop.
+	Neither side ever takes a lock: the producer only writes tail and the consumer only writes head, and each side publishes
+	its index with release ordering after touching the slot.
+*/
+template <typename T>
+class LockFreeQueue {
+private:
+	vector<T> slots;				// One more slot than the capacity, so a full queue can be told apart from an empty one
+	atomic<size_t> head;			// The next slot to pop
+	atomic<size_t> tail;			// The next slot to push
+
+public:
+
+	/**
+		@param capacity The most items the queue can hold at once
+	*/
+	LockFreeQueue(size_t capacity) : slots(capacity + 1), head(0), tail(0) {}
+
+	/**
+		Adds an item to the back of the queue. Only call this from the producer thread.
+
+		@param item The item to add
+		@return False if the queue is full
+	*/
+	bool tryPush(const T& item) {
+		size_t currentTail = tail.load(memory_order_relaxed);
+		size_t nextTail = (currentTail + 1) % slots.size();
+		if (nextTail == head.load(memory_order_acquire)) {
+			return false;
+		}
+		slots[currentTail] = item;
+		tail.store(nextTail, memory_order_release);
+		return true;
+	}
+
+	/**
+		Removes the item at the front of the queue. Only call this from the consumer thread.
+
+		@param item Receives the removed item
+		@return False if the queue is empty
+	*/
+	bool tryPop(T& item) {
+		size_t currentHead = head.load(memory_order_relaxed);
+		if (currentHead == tail.load(memory_order_acquire)) {
+			return false;
+		}
+		item = slots[currentHead];
+		head.store((currentHead + 1) % slots.size(), memory_order_release);
+		return true;
+	}
+
+	/**
+		@return The amount of items in the queue. This is only a snapshot when the other thread is active.
+	*/
+	size_t size() const {
+		size_t currentHead = head.load(memory_order_acquire);
+		size_t currentTail = tail.load(memory_order_acquire);
+		return (currentTail + slots.size() - currentHead) % slots.size();
+	}
+
+	size_t capacity() const {
+		return slots.size() - 1;
+	}
+};
@@ -0,0 +1,140 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <vector>
+
+#include "CNNLayer.h"
+
+using namespace std;
+
+/**
+	One 3D matrix produced during a forward pass and the steps during which it has to stay in memory.
+	Step i is the execution of layer i. The prepared input image is defined at step -1.
+*/
+struct PlannedTensor {
+	TensorShape shape;
+	int definedAt;		// The step that writes the tensor
+	int lastUsedAt;		// The last step that reads the tensor
+	int aliasOf;		// The tensor whose memory this tensor is written into (for in-place layers), or -1
+
+	PlannedTensor(TensorShape myShape = TensorShape(), int myDefinedAt = -1, int myLastUsedAt = -1, int myAliasOf = -1)
+		: shape(myShape), definedAt(myDefinedAt), lastUsedAt(myLastUsedAt), aliasOf(myAliasOf) {}
+
+	bool operator==(const PlannedTensor& other) const {
+		return shape.channels == other.shape.channels && shape.rows == other.shape.rows && shape.cols == other.shape.cols &&
+			definedAt == other.definedAt && lastUsedAt == other.lastUsedAt && aliasOf == other.aliasOf;
+	}
+};
+
+/**
+	The result of planning: every tensor is assigned to a slab, and tensors whose lifetimes do not overlap share a slab.
+	Sizes are counted in doubles, since every activation is a CV_64F matrix.
+*/
+struct MemoryPlan {
+	vector<PlannedTensor> tensors;
+	vector<int> slabOfTensor;
+	vector<size_t> slabSizes;
+
+	/**
+		@return The amount of doubles needed by all slabs together
+	*/
+	size_t plannedSize() const {
+		size_t total = 0;
+		for (int slabIndex = 0; slabIndex < slabSizes.size(); slabIndex++) {
+			total += slabSizes.at(slabIndex);
+		}
+		return total;
+	}
+
+	/**
+		@return The amount of doubles needed if every tensor had its own memory
+	*/
+	size_t unplannedSize() const {
+		size_t total = 0;
+		for (int tensorIndex = 0; tensorIndex < tensors.size(); tensorIndex++) {
+			total += tensors.at(tensorIndex).shape.size();
+		}
+		return total;
+	}
+
+	bool operator==(const MemoryPlan& other) const {
+		return tensors == other.tensors && slabOfTensor == other.slabOfTensor && slabSizes == other.slabSizes;
+	}
+
+	bool operator!=(const MemoryPlan& other) const {
+		return !(*this == other);
+	}
+
+	/**
+		This function prints out which slab each tensor lives in and how much memory the plan saves.
+	*/
+	void printPlan() const {
+		cout << "Memory Plan" << endl;
+		for (int tensorIndex = 0; tensorIndex < tensors.size(); tensorIndex++) {
+			const PlannedTensor& tensor = tensors.at(tensorIndex);
+			cout << " - Tensor " << tensorIndex << " (" << tensor.shape.channels << "x" << tensor.shape.rows << "x" << tensor.shape.cols <<
+				"), steps " << tensor.definedAt << " to " << tensor.lastUsedAt << ": slab " << slabOfTensor.at(tensorIndex) << endl;
+		}
+		cout << "Slabs: " << slabSizes.size() << ", Planned bytes: " << plannedSize() * sizeof(double) <<
+			", Unplanned bytes: " << unplannedSize() * sizeof(double) << endl << endl;
+	}
+};
+
+class MemoryPlanner {
+public:
+
+	/**
+		Assigns tensors to as few slabs as possible. Tensors are visited in the order they are defined. A tensor that aliases another
+		tensor shares its slab. Any other tensor takes the smallest free slab that is big enough, grows the largest free slab if none is
+		big enough, or opens a new slab if every slab is still in use. A slab is free once every tensor in it has been read for the last time
+		before the new tensor is written, so a layer's input and output never share memory unless the layer works in place.
+
+		@param tensors The tensors of one forward pass, sorted by definedAt
+		@return The slab assignment
+	*/
+	static MemoryPlan plan(const vector<PlannedTensor>& tensors) {
+		MemoryPlan memoryPlan;
+		memoryPlan.tensors = tensors;
+		memoryPlan.slabOfTensor.assign(tensors.size(), -1);
+		vector<int> slabFreeAfter;	// The last step at which each slab is still read
+
+		for (int tensorIndex = 0; tensorIndex < tensors.size(); tensorIndex++) {
+			const PlannedTensor& tensor = tensors.at(tensorIndex);
+			size_t tensorSize = tensor.shape.size();
+
+			int slab = -1;
+			if (tensor.aliasOf >= 0) {
+				slab = memoryPlan.slabOfTensor.at(tensor.aliasOf);
+			}
+			else {
+				int largestFree = -1;
+				for (int slabIndex = 0; slabIndex < slabFreeAfter.size(); slabIndex++) {
+					if (slabFreeAfter.at(slabIndex) >= tensor.definedAt) {
+						continue;
+					}
+					size_t slabSize = memoryPlan.slabSizes.at(slabIndex);
+					if (slabSize >= tensorSize && (slab < 0 || slabSize < memoryPlan.slabSizes.at(slab))) {
+						slab = slabIndex;
+					}
+					if (largestFree < 0 || slabSize > memoryPlan.slabSizes.at(largestFree)) {
+						largestFree = slabIndex;
+					}
+				}
+				if (slab < 0) {
+					slab = largestFree;
+				}
+				if (slab < 0) {
+					slab = (int)slabFreeAfter.size();
+					slabFreeAfter.push_back(-1);
+					memoryPlan.slabSizes.push_back(0);
+				}
+			}
+
+			memoryPlan.slabOfTensor.at(tensorIndex) = slab;
+			memoryPlan.slabSizes.at(slab) = max(memoryPlan.slabSizes.at(slab), tensorSize);
+			slabFreeAfter.at(slab) = max(slabFreeAfter.at(slab), tensor.lastUsedAt);
+		}
+		return memoryPlan;
+	}
+};
@@ -0,0 +1,551 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <climits>
+
+#include "ConvolutionalNeuralNetwork.h"
+
+using namespace std;
+
+/**
+	Names one version of one model (ex. the inspection model of a part type).
+*/
+struct ModelKey {
+	string id;
+	int version;
+
+	ModelKey(string myId = "", int myVersion = 0) : id(myId), version(myVersion) {}
+
+	bool operator<(const ModelKey& other) const {
+		return id != other.id ? id < other.id : version < other.version;
+	}
+};
+
+/**
+	What a model registry has done since it was created, and what it holds now.
+*/
+struct RegistryStatistics {
+	long long hits;				// Requests that found their model resident
+	long long misses;			// Requests that had to wait for, or start, a load
+	long long loads;
+	long long failedLoads;
+	long long evictions;
+	long long sharedLayers;		// Loaded layers replaced by an identical layer that another model already held
+	int residentModels;
+	size_t residentBytes;		// Layers shared by several resident models are counted once
+
+	RegistryStatistics() : hits(0), misses(0), loads(0), failedLoads(0), evictions(0), sharedLayers(0), residentModels(0),
+		residentBytes(0) {}
+
+	/**
+		This function prints out the counts and the memory held.
+	*/
+	void printStatistics() const {
+		cout << "Model Registry" << endl;
+		cout << "Resident models: " << residentModels << ", Resident MB: " << residentBytes / (1024.0 * 1024.0) << endl;
+		cout << "Hits: " << hits << ", Misses: " << misses << ", Loads: " << loads << ", Failed loads: " << failedLoads <<
+			", Evictions: " << evictions << ", Shared layers: " << sharedLayers << endl << endl;
+	}
+};
+
+/**
+	Keeps the models of several part types in memory, so a job that switches part types does not read its model from disk again. Each
+	version of each model is registered with its model file and loaded the first time it is asked for. Once the resident models take
+	more memory than the cap, the least recently used ones are evicted. Pinned models are never evicted.
+
+	Versions of a model often share most of their layers (ex. only the last fully connected layer was retrained). A loaded layer whose
+	saved bytes are identical to a layer another model already holds is replaced by that layer, so its weights are in memory once.
+
+	Models are loaded by background threads, or by the thread asking for them. The registry's lock is never held while a file is read,
+	and a forward pass never takes it, so inference keeps running on the resident models while another model loads. A network handed
+	out stays valid after it is evicted, until the last caller holding it lets go.
+*/
+class ModelRegistry {
+private:
+	enum ModelState {
+		UNLOADED_MODEL,
+		QUEUED_MODEL,		// Waiting for a loader thread
+		LOADING_MODEL,
+		RESIDENT_MODEL
+	};
+
+	/**
+		One version of one model. layerSizes has the saved size of each of its layers, so shared layers can be counted once.
+	*/
+	struct RegisteredModel {
+		string path;
+		ModelState state;
+		bool pinned;
+		bool failed;			// Whether the last load failed
+		long long lastUsed;
+		shared_ptr<const ConvolutionalNeuralNetwork> network;
+		vector<pair<const CNNLayer*, size_t>> layerSizes;
+
+		RegisteredModel(string myPath = "") : path(myPath), state(UNLOADED_MODEL), pinned(false), failed(false), lastUsed(0) {}
+	};
+
+	/**
+		A layer that a loaded model holds, found by the hash of its saved bytes. Only a weak pointer is kept, so the layer is freed
+		together with the last network using it.
+	*/
+	struct WeightBlob {
+		weak_ptr<CNNLayer> layer;
+		size_t bytes;
+	};
+
+	map<ModelKey, RegisteredModel> models;
+	multimap<uint64_t, WeightBlob> blobs;
+	size_t memoryCap;
+	long long useClock;
+	RegistryStatistics statistics;
+	deque<ModelKey> loadQueue;
+	bool stopping;
+	mutable mutex stateMutex;
+	condition_variable stateChanged;
+	vector<thread> loaders;
+
+	/**
+		@param layer A layer
+		@return The bytes the layer writes to a model file
+	*/
+	static string layerBytes(const CNNLayer& layer) {
+		ostringstream out(ios::binary);
+		layer.save(out);
+		return out.str();
+	}
+
+	/**
+		@param bytes Any bytes
+		@return Their 64-bit FNV-1a hash
+	*/
+	static uint64_t hashBytes(const string& bytes) {
+		uint64_t hash = 14695981039346656037ULL;
+		for (size_t i = 0; i < bytes.size(); i++) {
+			hash = (hash ^ (unsigned char)bytes[i]) * 1099511628211ULL;
+		}
+		return hash;
+	}
+
+	/**
+		A loader thread: loads queued models until the registry is destroyed.
+	*/
+	void loadLoop() {
+		unique_lock<mutex> lock(stateMutex);
+		while (true) {
+			stateChanged.wait(lock, [&]() { return stopping || !loadQueue.empty(); });
+			if (stopping) {
+				return;
+			}
+			ModelKey key = loadQueue.front();
+			loadQueue.pop_front();
+			RegisteredModel& model = models.at(key);
+			if (model.state != QUEUED_MODEL) {
+				continue;		// A caller that could not wait loaded it first
+			}
+			model.state = LOADING_MODEL;
+			load(key, lock);
+		}
+	}
+
+	/**
+		Queues a model for the loader threads if it is not loaded or on its way.
+	*/
+	void queueLoad(const ModelKey& key, RegisteredModel& model) {
+		if (model.state == UNLOADED_MODEL) {
+			model.state = QUEUED_MODEL;
+			loadQueue.push_back(key);
+			stateChanged.notify_all();
+		}
+	}
+
+	/**
+		Reads a model file, swaps its layers for identical ones that are already in memory and makes the model resident. The lock is
+		released while the file is read and while layers are compared.
+
+		@param key The model, whose state has been set to LOADING_MODEL
+		@param lock The held registry lock, which is held again when this returns
+	*/
+	void load(const ModelKey& key, unique_lock<mutex>& lock) {
+		string path = models.at(key).path;
+		lock.unlock();
+
+		shared_ptr<ConvolutionalNeuralNetwork> network(new ConvolutionalNeuralNetwork());
+		bool loaded = network->loadModel(path);
+		if (loaded && !network->isInitialized()) {
+			cout << "Model file " << path << " holds a network that was never initialized." << endl;
+			loaded = false;
+		}
+
+		vector<shared_ptr<CNNLayer>> loadedLayers;
+		vector<string> savedBytes;
+		vector<uint64_t> hashes;
+		if (loaded) {
+			network->replaceLayers([&](const shared_ptr<CNNLayer>& layer) {
+				loadedLayers.push_back(layer);
+				savedBytes.push_back(layerBytes(*layer));
+				hashes.push_back(hashBytes(savedBytes.back()));
+				return layer;
+			});
+		}
+
+		// Layers of other models with the same hash, held so they cannot be freed while they are compared
+		lock.lock();
+		vector<vector<shared_ptr<CNNLayer>>> candidates(loadedLayers.size());
+		for (int layerIndex = 0; layerIndex < loadedLayers.size(); layerIndex++) {
+			auto range = blobs.equal_range(hashes.at(layerIndex));
+			for (auto blob = range.first; blob != range.second; blob++) {
+				shared_ptr<CNNLayer> candidate = blob->second.layer.lock();
+				if (candidate && blob->second.bytes == savedBytes.at(layerIndex).size()) {
+					candidates.at(layerIndex).push_back(candidate);
+				}
+			}
+		}
+		lock.unlock();
+
+		vector<shared_ptr<CNNLayer>> sharedLayers(loadedLayers.size());
+		for (int layerIndex = 0; layerIndex < loadedLayers.size(); layerIndex++) {
+			for (int candidateIndex = 0; candidateIndex < candidates.at(layerIndex).size() && !sharedLayers.at(layerIndex); candidateIndex++) {
+				if (layerBytes(*candidates.at(layerIndex).at(candidateIndex)) == savedBytes.at(layerIndex)) {
+					sharedLayers.at(layerIndex) = candidates.at(layerIndex).at(candidateIndex);
+				}
+			}
+		}
+		int visitedNum = 0;
+		int sharedNum = loaded ? network->replaceLayers([&](const shared_ptr<CNNLayer>& layer) {
+			shared_ptr<CNNLayer> shared = sharedLayers.at(visitedNum++);
+			return shared ? shared : layer;
+		}) : 0;
+
+		lock.lock();
+		RegisteredModel& model = models.at(key);
+		if (!loaded) {
+			model.state = UNLOADED_MODEL;
+			model.failed = true;
+			statistics.failedLoads++;
+		}
+		else {
+			model.layerSizes.clear();
+			for (int layerIndex = 0; layerIndex < loadedLayers.size(); layerIndex++) {
+				shared_ptr<CNNLayer> layer = sharedLayers.at(layerIndex) ? sharedLayers.at(layerIndex) : loadedLayers.at(layerIndex);
+				if (!sharedLayers.at(layerIndex)) {
+					WeightBlob blob;
+					blob.layer = layer;
+					blob.bytes = savedBytes.at(layerIndex).size();
+					blobs.insert(make_pair(hashes.at(layerIndex), blob));
+				}
+				model.layerSizes.push_back(make_pair((const CNNLayer*)layer.get(), savedBytes.at(layerIndex).size()));
+			}
+			model.network = network;
+			model.state = RESIDENT_MODEL;
+			model.failed = false;
+			statistics.loads++;
+			statistics.sharedLayers += sharedNum;
+			evictOverCap(&key);
+		}
+		stateChanged.notify_all();
+	}
+
+	/**
+		@return The memory held by the resident models, counting each shared layer once. The lock must be held.
+	*/
+	size_t residentBytes() const {
+		set<const CNNLayer*> counted;
+		size_t bytes = 0;
+		for (auto model = models.begin(); model != models.end(); model++) {
+			for (int layerIndex = 0; layerIndex < model->second.layerSizes.size(); layerIndex++) {
+				if (counted.insert(model->second.layerSizes.at(layerIndex).first).second) {
+					bytes += model->second.layerSizes.at(layerIndex).second;
+				}
+			}
+		}
+		return bytes;
+	}
+
+	void unload(RegisteredModel& model) {
+		model.network.reset();
+		model.layerSizes.clear();
+		model.state = UNLOADED_MODEL;
+		statistics.evictions++;
+	}
+
+	/**
+		Evicts the least recently used models until the resident models fit in the cap. The lock must be held.
+
+		@param keep A model that must stay, usually the one that was just loaded, or nullptr
+	*/
+	void evictOverCap(const ModelKey* keep) {
+		while (residentBytes() > memoryCap) {
+			RegisteredModel* oldest = nullptr;
+			for (auto model = models.begin(); model != models.end(); model++) {
+				bool kept = keep != nullptr && !(model->first < *keep) && !(*keep < model->first);
+				if (model->second.state == RESIDENT_MODEL && !model->second.pinned && !kept &&
+					(oldest == nullptr || model->second.lastUsed < oldest->lastUsed)) {
+					oldest = &model->second;
+				}
+			}
+			if (oldest == nullptr) {
+				break;		// Only pinned models are left. The cap is exceeded rather than failing the request.
+			}
+			unload(*oldest);
+		}
+		for (auto blob = blobs.begin(); blob != blobs.end();) {
+			blob = blob->second.layer.expired() ? blobs.erase(blob) : ++blob;
+		}
+	}
+
+public:
+
+	/**
+		Constructor method for a ModelRegistry. Starts the loader threads.
+
+		@param myMemoryCap The most bytes the resident models may take, measured by the size of their layers in a model file
+		@param loaderThreads The amount of models that can be loaded in the background at once
+	*/
+	ModelRegistry(size_t myMemoryCap, int loaderThreads = 1) {
+		memoryCap = myMemoryCap;
+		useClock = 0;
+		stopping = false;
+		for (int threadIndex = 0; threadIndex < max(1, loaderThreads); threadIndex++) {
+			loaders.push_back(thread(&ModelRegistry::loadLoop, this));
+		}
+	}
+
+	/**
+		Stops the loader threads. Queued models that have not started loading are dropped.
+	*/
+	~ModelRegistry() {
+		{
+			lock_guard<mutex> lock(stateMutex);
+			stopping = true;
+		}
+		stateChanged.notify_all();
+		for (int threadIndex = 0; threadIndex < loaders.size(); threadIndex++) {
+			loaders.at(threadIndex).join();
+		}
+	}
+
+	/**
+		Tells the registry where a version of a model is stored. Nothing is read until the model is asked for. A version is never
+		changed once registered: retrained weights get a new version.
+
+		@param id The model (ex. a part type)
+		@param version The version of the model
+		@param path The model file written by saveModel
+		@return False if this version of the model was already registered
+	*/
+	bool registerModel(string id, int version, string path) {
+		lock_guard<mutex> lock(stateMutex);
+		if (models.count(ModelKey(id, version)) > 0) {
+			cout << "Model " << id << " version " << version << " is already registered." << endl;
+			return false;
+		}
+		models[ModelKey(id, version)] = RegisteredModel(path);
+		return true;
+	}
+
+	/**
+		@param id A model
+		@return Its newest registered version, or -1 if it has none
+	*/
+	int latestVersion(string id) const {
+		lock_guard<mutex> lock(stateMutex);
+		auto model = models.lower_bound(ModelKey(id, INT_MAX));
+		if (model == models.begin() || (--model)->first.id != id) {
+			return -1;
+		}
+		return model->first.version;
+	}
+
+	/**
+		Gets a model, loading it on this thread if it is not resident or waiting for the thread that is loading it.
+
+		@param id The model
+		@param version The version of the model
+		@return The network, or nullptr if it is not registered or could not be loaded. Several threads may run it at once.
+	*/
+	shared_ptr<const ConvolutionalNeuralNetwork> acquire(string id, int version) {
+		ModelKey key(id, version);
+		unique_lock<mutex> lock(stateMutex);
+		auto found = models.find(key);
+		if (found == models.end()) {
+			cout << "Model " << id << " version " << version << " is not registered." << endl;
+			return nullptr;
+		}
+		RegisteredModel& model = found->second;
+		model.lastUsed = ++useClock;
+		model.state == RESIDENT_MODEL ? statistics.hits++ : statistics.misses++;
+		bool attempted = false;
+		while (model.state != RESIDENT_MODEL) {
+			if (model.state == LOADING_MODEL) {
+				stateChanged.wait(lock);
+			}
+			else if (attempted && model.failed) {
+				return nullptr;
+			}
+			else {
+				// Load it here rather than wait behind the models queued before it
+				model.state = LOADING_MODEL;
+				load(key, lock);
+				attempted = true;
+			}
+		}
+		return model.network;
+	}
+
+	/**
+		Gets a model without waiting. If it is not resident, it is queued for the loader threads, so a later call finds it.
+
+		@param id The model
+		@param version The version of the model
+		@return The network, or nullptr if it is not resident yet
+	*/
+	shared_ptr<const ConvolutionalNeuralNetwork> tryAcquire(string id, int version) {
+		ModelKey key(id, version);
+		lock_guard<mutex> lock(stateMutex);
+		auto found = models.find(key);
+		if (found == models.end()) {
+			cout << "Model " << id << " version " << version << " is not registered." << endl;
+			return nullptr;
+		}
+		RegisteredModel& model = found->second;
+		model.lastUsed = ++useClock;
+		if (model.state == RESIDENT_MODEL) {
+			statistics.hits++;
+			return model.network;
+		}
+		statistics.misses++;
+		queueLoad(key, model);
+		return nullptr;
+	}
+
+	/**
+		Starts loading a model in the background, for example the model of the next job while the current one is still running.
+
+		@param id The model
+		@param version The version of the model
+		@return Whether the model is registered
+	*/
+	bool prefetch(string id, int version) {
+		ModelKey key(id, version);
+		lock_guard<mutex> lock(stateMutex);
+		auto found = models.find(key);
+		if (found == models.end()) {
+			cout << "Model " << id << " version " << version << " is not registered." << endl;
+			return false;
+		}
+		found->second.lastUsed = ++useClock;
+		queueLoad(key, found->second);
+		return true;
+	}
+
+	/**
+		Keeps a model resident however long it goes unused, and starts loading it if it is not resident. Pinned models still count
+		against the memory cap.
+
+		@param id The model
+		@param version The version of the model
+		@param pinned Whether to pin or unpin the model
+		@return Whether the model is registered
+	*/
+	bool pin(string id, int version, bool pinned = true) {
+		ModelKey key(id, version);
+		lock_guard<mutex> lock(stateMutex);
+		auto found = models.find(key);
+		if (found == models.end()) {
+			cout << "Model " << id << " version " << version << " is not registered." << endl;
+			return false;
+		}
+		found->second.pinned = pinned;
+		if (pinned) {
+			queueLoad(key, found->second);
+		}
+		else {
+			evictOverCap(nullptr);
+		}
+		return true;
+	}
+
+	/**
+		Drops a resident model, for example a version that was replaced. Callers still holding it can keep using it.
+
+		@param id The model
+		@param version The version of the model
+		@return Whether the model was resident
+	*/
+	bool evict(string id, int version) {
+		lock_guard<mutex> lock(stateMutex);
+		auto found = models.find(ModelKey(id, version));
+		if (found == models.end() || found->second.state != RESIDENT_MODEL) {
+			return false;
+		}
+		found->second.pinned = false;
+		unload(found->second);
+		evictOverCap(nullptr);
+		return true;
+	}
+
+	/**
+		@param myMemoryCap The most bytes the resident models may take. Models are evicted right away if they no longer fit.
+	*/
+	void setMemoryCap(size_t myMemoryCap) {
+		lock_guard<mutex> lock(stateMutex);
+		memoryCap = myMemoryCap;
+		evictOverCap(nullptr);
+	}
+
+	size_t getMemoryCap() const {
+		lock_guard<mutex> lock(stateMutex);
+		return memoryCap;
+	}
+
+	/**
+		@param id The model
+		@param version The version of the model
+		@return Whether the model is loaded and can be acquired without waiting
+	*/
+	bool isResident(string id, int version) const {
+		lock_guard<mutex> lock(stateMutex);
+		auto found = models.find(ModelKey(id, version));
+		return found != models.end() && found->second.state == RESIDENT_MODEL;
+	}
+
+	RegistryStatistics getStatistics() const {
+		lock_guard<mutex> lock(stateMutex);
+		RegistryStatistics current = statistics;
+		current.residentBytes = residentBytes();
+		for (auto model = models.begin(); model != models.end(); model++) {
+			current.residentModels += model->second.state == RESIDENT_MODEL ? 1 : 0;
+		}
+		return current;
+	}
+
+	/**
+		This function prints out every registered model and whether it is in memory.
+	*/
+	void printModels() const {
+		lock_guard<mutex> lock(stateMutex);
+		const char* stateNames[] = { "not loaded", "queued", "loading", "resident" };
+		for (auto model = models.begin(); model != models.end(); model++) {
+			size_t bytes = 0;
+			for (int layerIndex = 0; layerIndex < model->second.layerSizes.size(); layerIndex++) {
+				bytes += model->second.layerSizes.at(layerIndex).second;
+			}
+			cout << model->first.id << " version " << model->first.version << ": " << stateNames[model->second.state] <<
+				(model->second.pinned ? ", pinned" : "") << (model->second.failed ? ", last load failed" : "") << ", MB: " <<
+				bytes / (1024.0 * 1024.0) << ", File: " << model->second.path << endl;
+		}
+		cout << endl;
+	}
+};
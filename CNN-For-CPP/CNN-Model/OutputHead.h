@@ -0,0 +1,235 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <tuple>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+
+/**
+	The output head turns the raw scores of the last fully connected layer into probabilities, a loss and a classification. Classes
+	are integer IDs everywhere, and the LabelDictionary maps them to and from their names outside of the per-image work.
+*/
+
+/**
+	@param scores The raw scores of one image
+	@param classNum The amount of scores
+	@return The index of the highest score, or -1 if there are no scores. Negative scores are handled like any other.
+*/
+inline int argmaxClass(const double* scores, int classNum) {
+	if (classNum <= 0) {
+		return -1;
+	}
+	return (int)(max_element(scores, scores + classNum) - scores);
+}
+
+inline int argmaxClass(const vector<double>& scores) {
+	return argmaxClass(scores.data(), (int)scores.size());
+}
+
+/**
+	log(sum(exp(scores))), computed after subtracting the largest score so no exp can overflow.
+
+	@param scores The raw scores of one image
+	@param classNum The amount of scores
+	@param exps If not null, receives exp(score - largest score) for every class
+	@return The log of the softmax denominator
+*/
+inline double logSumExp(const double* scores, int classNum, double* exps = nullptr) {
+	if (classNum <= 0) {
+		return 0.0;
+	}
+	double largest = *max_element(scores, scores + classNum);
+	double sum = 0.0;
+	for (int classIndex = 0; classIndex < classNum; classIndex++) {
+		double e = exp(scores[classIndex] - largest);
+		if (exps) {
+			exps[classIndex] = e;
+		}
+		sum += e;
+	}
+	return largest + log(sum);
+}
+
+/**
+	Numerically stable softmax: probability_i = exp(score_i) / sum(exp(score_j)).
+
+	@param scores The raw scores of one image
+	@param classNum The amount of scores
+	@param probabilities Receives the probability of every class. May be the same array as scores.
+*/
+inline void softmax(const double* scores, int classNum, double* probabilities) {
+	double largest = classNum > 0 ? *max_element(scores, scores + classNum) : 0.0;
+	double logSum = logSumExp(scores, classNum, probabilities);
+	double inverseSum = exp(largest - logSum);
+	for (int classIndex = 0; classIndex < classNum; classIndex++) {
+		probabilities[classIndex] *= inverseSum;
+	}
+}
+
+/**
+	Numerically stable log-softmax: log(probability_i) = score_i - log(sum(exp(score_j))).
+
+	@param scores The raw scores of one image
+	@param classNum The amount of scores
+	@param logProbabilities Receives the log probability of every class. May be the same array as scores.
+*/
+inline void logSoftmax(const double* scores, int classNum, double* logProbabilities) {
+	double logSum = logSumExp(scores, classNum);
+	for (int classIndex = 0; classIndex < classNum; classIndex++) {
+		logProbabilities[classIndex] = scores[classIndex] - logSum;
+	}
+}
+
+/**
+	Softmax and cross-entropy in one pass over the scores. The loss is -log(probability of the label), which is
+	log(sum(exp(scores))) - score_label, so it never takes the log of a probability that underflowed to zero. The gradient of the loss
+	with respect to the raw scores is softmax(scores) - onehot(label), which is where backpropagation starts.
+
+	@param scores The raw scores of one image
+	@param classNum The amount of scores
+	@param label The class ID the image belongs to
+	@param gradient If not null, receives the gradient of the loss with respect to every score
+	@return The cross-entropy loss, or -1 if the label is not a valid class
+*/
+inline double softmaxCrossEntropy(const double* scores, int classNum, int label, double* gradient = nullptr) {
+	if (label < 0 || label >= classNum) {
+		return -1.0;
+	}
+	double logSum = logSumExp(scores, classNum, gradient);
+	if (gradient) {
+		double inverseSum = exp(*max_element(scores, scores + classNum) - logSum);
+		for (int classIndex = 0; classIndex < classNum; classIndex++) {
+			gradient[classIndex] *= inverseSum;
+		}
+		gradient[label] -= 1.0;
+	}
+	return logSum - scores[label];
+}
+
+/**
+	Finds the k highest scores without sorting the rest of them.
+
+	@param scores The raw scores (or probabilities) of one image
+	@param k The amount of classes wanted
+	@param classes Receives the IDs of the k best classes, best first. Its memory is reused between calls.
+*/
+inline void topKClasses(const vector<double>& scores, int k, vector<int>& classes) {
+	int classNum = (int)scores.size();
+	k = max(0, min(k, classNum));
+	classes.resize(classNum);
+	for (int classIndex = 0; classIndex < classNum; classIndex++) {
+		classes.at(classIndex) = classIndex;
+	}
+	partial_sort(classes.begin(), classes.begin() + k, classes.end(),
+		[&scores](int a, int b) { return scores[a] > scores[b] || (scores[a] == scores[b] && a < b); });
+	classes.resize(k);
+}
+
+/**
+	Maps class names (ex. "cat", "7") to the integer class IDs the network is trained and evaluated with. Names are only looked up when
+	a data set is loaded or a result is printed, never per image during training or evaluation.
+*/
+class LabelDictionary {
+private:
+	vector<string> names;
+	unordered_map<string, int> ids;
+
+public:
+
+	/**
+		@param name A class name
+		@return The class's ID. A new name gets the next free ID.
+	*/
+	int addLabel(const string& name) {
+		unordered_map<string, int>::const_iterator found = ids.find(name);
+		if (found != ids.end()) {
+			return found->second;
+		}
+		int id = (int)names.size();
+		names.push_back(name);
+		ids[name] = id;
+		return id;
+	}
+
+	/**
+		@param name A class name
+		@return The class's ID, or -1 if the name is unknown
+	*/
+	int findLabel(const string& name) const {
+		unordered_map<string, int>::const_iterator found = ids.find(name);
+		return found == ids.end() ? -1 : found->second;
+	}
+
+	/**
+		@param id A class ID
+		@return The class's name, or the ID written out if it has no name
+	*/
+	string labelName(int id) const {
+		return id >= 0 && id < names.size() ? names.at(id) : to_string(id);
+	}
+
+	int size() const {
+		return (int)names.size();
+	}
+
+	/**
+		Converts a data set labeled with names into one labeled with class IDs, adding any new names to the dictionary.
+
+		@param namedSet A vector of images with their accompanying label names {(img1, "cat"), (img2, "dog"), ...}
+		@return The same images with their class IDs {(img1, 0), (img2, 1), ...}
+	*/
+	vector<tuple<cv::Mat, int>> encode(const vector<tuple<cv::Mat, string>>& namedSet) {
+		vector<tuple<cv::Mat, int>> labeledSet;
+		labeledSet.reserve(namedSet.size());
+		for (int imageIndex = 0; imageIndex < namedSet.size(); imageIndex++) {
+			labeledSet.push_back(make_tuple(get<0>(namedSet.at(imageIndex)), addLabel(get<1>(namedSet.at(imageIndex)))));
+		}
+		return labeledSet;
+	}
+
+	/**
+		Writes one name per line, in ID order.
+
+		@param path The file to write
+		@return Whether the file was written
+	*/
+	bool save(string path) const {
+		ofstream out(path.c_str());
+		for (int id = 0; id < names.size(); id++) {
+			out << names.at(id) << "\n";
+		}
+		return (bool)out;
+	}
+
+	/**
+		Reads a file written by save, replacing the dictionary.
+
+		@param path The file to read
+		@return Whether the file was read
+	*/
+	bool load(string path) {
+		ifstream in(path.c_str());
+		if (!in) {
+			cout << "Could not read label file " << path << "." << endl;
+			return false;
+		}
+		names.clear();
+		ids.clear();
+		string name;
+		while (getline(in, name)) {
+			if (!name.empty() && name.back() == '\r') {
+				name.pop_back();
+			}
+			addLabel(name);
+		}
+		return true;
+	}
+};
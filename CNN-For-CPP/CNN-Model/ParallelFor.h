@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+using namespace std;
+
+/**
+	@return The amount of threads the machine can run at once (at least 1)
+*/
+inline int hardwareThreads() {
+	return max(1, (int)thread::hardware_concurrency());
+}
+
+/**
+	Runs taskNum tasks on threadNum threads (the calling thread is one of them). Threads take the next unclaimed task whenever they
+	finish one, so tasks of uneven cost still keep every thread busy. Returns once every task is done.
+
+	@param taskNum The amount of tasks
+	@param threadNum The amount of threads to use. 0 uses every hardware thread.
+	@param task Called once per task with the task's index and the index of the thread running it (0 to threadNum - 1), so the
+		task can use per-thread scratch data without locking
+*/
+inline void parallelFor(int taskNum, int threadNum, const function<void(int taskIndex, int threadIndex)>& task) {
+	if (threadNum <= 0) {
+		threadNum = hardwareThreads();
+	}
+	threadNum = max(1, min(threadNum, taskNum));
+
+	atomic<int> nextTask(0);
+	auto worker = [&](int threadIndex) {
+		for (int taskIndex = nextTask.fetch_add(1); taskIndex < taskNum; taskIndex = nextTask.fetch_add(1)) {
+			task(taskIndex, threadIndex);
+		}
+	};
+
+	vector<thread> threads;
+	for (int threadIndex = 1; threadIndex < threadNum; threadIndex++) {
+		threads.push_back(thread(worker, threadIndex));
+	}
+	worker(0);
+	for (int threadIndex = 0; threadIndex < threads.size(); threadIndex++) {
+		threads.at(threadIndex).join();
+	}
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "ParallelFor.h"
+
+using namespace std;
+
+/**
+	How a layer's weights are drawn. Biases always start at zero.
+*/
+enum InitScheme {
+	UNIFORM_INIT = 0,	// Uniform between the initializer's low and high bounds
+	XAVIER_INIT = 1,	// Uniform within +-sqrt(6 / (fanIn + fanOut)), which keeps the variance of the values flowing through steady
+	HE_INIT = 2,		// Uniform within +-sqrt(6 / fanIn), which makes up for RELU zeroing half of the values
+	ZERO_INIT = 3		// Every weight zero, for layers whose parameters are about to be loaded
+};
+
+/**
+	Scrambles the bits of a 64-bit value (the SplitMix64 finalizer). Nearby inputs give unrelated outputs.
+*/
+inline unsigned long long mixBits(unsigned long long x) {
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBULL;
+	x ^= x >> 31;
+	return x;
+}
+
+/**
+	A counter-based random number: the value depends only on the stream's key and the counter, so any element of a stream can be drawn
+	on its own, in any order and on any thread.
+
+	@param key The stream's key from streamKey
+	@param counter The position in the stream
+	@return A value from 0.0 (inclusive) to 1.0 (exclusive)
+*/
+inline double counterUniform(unsigned long long key, unsigned long long counter) {
+	return (mixBits(key + counter * 0x9E3779B97F4A7C15ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+	@param seed The seed of the whole network
+	@param stream The stream of one layer
+	@return A key for counterUniform that is unrelated to the keys of other seeds and streams
+*/
+inline unsigned long long streamKey(unsigned long long seed, unsigned long long stream) {
+	return mixBits(mixBits(seed) ^ (stream * 0xD1B54A32D192ED03ULL + 0x2545F4914F6CDD1DULL));
+}
+
+/**
+	A run of parameters that lives in one piece of memory (ex. one filter channel or one node's weights), together with the
+	position of its first element in the layer's random stream.
+*/
+struct ParameterSegment {
+	double* values;
+	size_t count;
+	unsigned long long firstCounter;
+
+	ParameterSegment(double* myValues = nullptr, size_t myCount = 0, unsigned long long myFirstCounter = 0) :
+		values(myValues), count(myCount), firstCounter(myFirstCounter) {}
+};
+
+/**
+	Draws layer parameters from seeded, counter-based random streams. Each layer has its own stream, and every parameter of a layer has
+	its own position in that stream, so the same seed gives bit-identical weights however many threads fill them and in whatever order.
+*/
+class ParameterInitializer {
+private:
+	InitScheme scheme;
+	unsigned long long seed;
+	int threadNum;
+	double low, high;		// The bounds of UNIFORM_INIT
+
+	static const size_t PARAMETERS_PER_TASK = 16384;	// Enough work per task that handing out tasks costs little
+
+public:
+
+	/**
+		@param myScheme How weights are drawn
+		@param mySeed The seed every layer's stream is derived from
+		@param myThreadNum The amount of threads to fill with. 0 uses every hardware thread. This never changes the values.
+		@param myLow The lower bound of UNIFORM_INIT (inclusive)
+		@param myHigh The upper bound of UNIFORM_INIT (exclusive)
+	*/
+	ParameterInitializer(InitScheme myScheme = HE_INIT, unsigned long long mySeed = 0, int myThreadNum = 0, double myLow = 0.01,
+		double myHigh = 1.0) : scheme(myScheme), seed(mySeed), threadNum(myThreadNum), low(myLow), high(myHigh) {}
+
+	InitScheme getScheme() const { return scheme; }
+	unsigned long long getSeed() const { return seed; }
+	int getThreadNum() const { return threadNum; }
+
+	/**
+		@param fanIn The amount of inputs each output of the layer sums over
+		@param fanOut The amount of outputs each input of the layer feeds
+		@param lowBound Receives the lower bound of the weights
+		@param highBound Receives the upper bound of the weights
+	*/
+	void bounds(int fanIn, int fanOut, double& lowBound, double& highBound) const {
+		double limit = 0.0;
+		switch (scheme) {
+		case UNIFORM_INIT:
+			lowBound = low;
+			highBound = high;
+			return;
+		case XAVIER_INIT:
+			limit = fanIn + fanOut > 0 ? sqrt(6.0 / (fanIn + fanOut)) : 0.0;
+			break;
+		case HE_INIT:
+			limit = fanIn > 0 ? sqrt(6.0 / fanIn) : 0.0;
+			break;
+		default:
+			break;
+		}
+		lowBound = -limit;
+		highBound = limit;
+	}
+
+	/**
+		Fills the parameters of one layer. The segments are split into tasks of about PARAMETERS_PER_TASK parameters that run in
+		parallel. Each element only depends on its counter, so the loop over a segment has no carried state and vectorizes.
+
+		@param segments The layer's parameters
+		@param fanIn The amount of inputs each output of the layer sums over
+		@param fanOut The amount of outputs each input of the layer feeds
+		@param stream The layer's stream (ex. its index in the network)
+	*/
+	void fill(const vector<ParameterSegment>& segments, int fanIn, int fanOut, unsigned long long stream) const {
+		double lowBound, highBound;
+		bounds(fanIn, fanOut, lowBound, highBound);
+		double range = highBound - lowBound;
+		unsigned long long key = streamKey(seed, stream);
+		bool zero = scheme == ZERO_INIT;
+
+		vector<int> taskStarts(1, 0);
+		size_t taskSize = 0;
+		for (int segmentIndex = 0; segmentIndex < segments.size(); segmentIndex++) {
+			taskSize += segments.at(segmentIndex).count;
+			if (taskSize >= PARAMETERS_PER_TASK || segmentIndex + 1 == segments.size()) {
+				taskStarts.push_back(segmentIndex + 1);
+				taskSize = 0;
+			}
+		}
+		int taskNum = (int)taskStarts.size() - 1;
+		if (taskNum <= 0) {
+			return;
+		}
+
+		parallelFor(taskNum, min(taskNum, threadNum <= 0 ? hardwareThreads() : threadNum), [&](int taskIndex, int threadIndex) {
+			for (int segmentIndex = taskStarts.at(taskIndex); segmentIndex < taskStarts.at(taskIndex + 1); segmentIndex++) {
+				const ParameterSegment& segment = segments.at(segmentIndex);
+				double* values = segment.values;
+				if (zero) {
+					fill_n(values, segment.count, 0.0);
+					continue;
+				}
+				for (size_t i = 0; i < segment.count; i++) {
+					values[i] = lowBound + range * counterUniform(key, segment.firstCounter + i);
+				}
+			}
+		});
+	}
+};
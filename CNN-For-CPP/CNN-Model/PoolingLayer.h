@@ -2,17 +2,21 @@
 #include <opencv2/opencv.hpp>
 
 #include <stdio.h>
+#ifdef _WIN32
 #include <tchar.h>
+#endif
 #include <iostream>
 #include <string>
 #include <vector>
 #include <tuple>
 #include <memory>
 #include "CNNLayer.h"
+#include "SpecializedKernels.h"
 
 class PoolingLayer : public CNNLayer {
 private:
 	int subsecWidth, subsecHeight, slideX, slideY;
+	PoolingKernel kernel;	// The kernel for this layer's subsection size and slide
 public:
 
 	/**
@@ -31,66 +35,163 @@ public:
 		subsecHeight = mySubsecHeight;
 		slideX = mySlideX;
 		slideY = mySlideY;
+		kernel = selectPoolingKernel(subsecWidth, subsecHeight, slideX, slideY);
+	}
+
+	/**
+		@param inputShape The dimensions of the matrix input into the layer
+		@return The dimensions of the downsampled matrix, which keeps the depth of the input
+	*/
+	TensorShape outputShape(TensorShape inputShape) const {
+		return TensorShape(inputShape.channels, (inputShape.rows - subsecHeight) / slideY + 1, (inputShape.cols - subsecWidth) / slideX + 1);
 	}
 
 	/**
 		This function implements how the pooling layer manipulates the input matrix.
 
 		@param image The matrix to be manipulated
-		@return a new matrix of the same depth dimension, but smaller x and y dimensions. The matrix only has the maxes from the input matrix's
-			subsections
+		@param downsampledImg Receives a new matrix of the same depth dimension, but smaller x and y dimensions. The matrix only has the maxes
+			from the input matrix's subsections
 	*/
-	vector<cv::Mat> execute(vector<cv::Mat> image) {
-		vector<cv::Mat> downsampledImg;
+	void forward(const vector<cv::Mat>& image, vector<cv::Mat>& downsampledImg) const {
 		// Assumes that all 2D Mat's in image are the same size
-		int oldWidth = image.at(0).cols;
-		int oldHeight = image.at(0).rows;
-		int newWidth = (oldWidth - subsecWidth) / slideX + 1;
-		int newHeight = (oldHeight - subsecHeight) / slideY + 1;
-
-		// Initialize downsampledImg
-		for (int imgChannel = 0; imgChannel < image.size(); imgChannel++) {
-			cv::Mat imgLayer = cv::Mat::zeros(newHeight, newWidth, CV_64FC1);
-			downsampledImg.push_back(imgLayer);
+		TensorShape newShape = outputShape(shapeOf(image));
+		allocateOutput(downsampledImg, newShape);
+
+		for (int imgChannel = 0; imgChannel < newShape.channels; imgChannel++) {
+			kernel(image.at(imgChannel), downsampledImg.at(imgChannel), subsecWidth, subsecHeight, slideX, slideY);
 		}
+	}
 
-		int x = 0;
-		int y = 0;
-		while (y + subsecHeight <= oldHeight) {
-			while (x + subsecWidth <= oldWidth) {
-				for (int imgChannel = 0; imgChannel < downsampledImg.size(); imgChannel++) {
-					cv::Mat subImage = cv::Mat(image.at(imgChannel), cv::Rect(x, y, subsecWidth, subsecHeight));
-					double max = maxPool(subImage);
-					downsampledImg.at(imgChannel).col(x).row(y) = max;
-				}
-				x += slideX;
-			}
-			y += slideY;
+	/**
+		Recomputes a rectangle of the downsampled matrix by running the layer's kernel on a window of the input and of the output.
+
+		@param image The matrix to be manipulated
+		@param downsampledImg The downsampled matrix from the previous call, which is updated in place
+		@param outputRegion The rectangle of every channel to recompute
+	*/
+	void forwardRegion(const vector<cv::Mat>& image, vector<cv::Mat>& downsampledImg, cv::Rect outputRegion) const {
+		TensorShape newShape = outputShape(shapeOf(image));
+		allocateOutput(downsampledImg, newShape);
+		outputRegion &= cv::Rect(0, 0, newShape.cols, newShape.rows);
+		if (outputRegion.area() <= 0) {
+			return;
 		}
 
-		print3DMat("Downsampled Image", downsampledImg);
+		cv::Rect inputRegion = windowInput(outputRegion, subsecWidth, subsecHeight, slideX, slideY);
+		for (int imgChannel = 0; imgChannel < newShape.channels; imgChannel++) {
+			cv::Mat downsampledWindow = downsampledImg.at(imgChannel)(outputRegion);
+			kernel(image.at(imgChannel)(inputRegion), downsampledWindow, subsecWidth, subsecHeight, slideX, slideY);
+		}
+	}
 
-		return downsampledImg;
+	cv::Rect affectedRegion(cv::Rect inputRegion, TensorShape inputShape) const {
+		return windowRegion(inputRegion, subsecWidth, subsecHeight, slideX, slideY, outputShape(inputShape));
 	}
 
 	/**
-		Finds the maximum value in a subsection of a matrix
-		
-		@param subImage The subsection of a matrix
+		Each subsection's gradient goes to the element that was its max (the first one, if several tie), since that is the only
+		element the output depends on. Overlapping subsections add up.
+
+		@param image The matrix that was input into the layer
+		@param downsampledImg The matrix forward produced for image
+		@param outputGradient How the cost changes with each element of downsampledImg
+		@param inputGradient If not null, receives how the cost changes with each element of image
+		@param parameterGradient Unused, since the layer learns nothing
 	*/
-	double maxPool(cv::Mat subImage) {
-		double max = 0.0;
-		for (int y = 0; y < subImage.rows; y++) {
-			for (int x = 0; x < subImage.cols; x++) {
-				double nextVal = subImage.at<double>(y, x);
-				if (nextVal > max) {
-					max = nextVal;
+	void backward(const vector<cv::Mat>& image, const vector<cv::Mat>& downsampledImg, const vector<cv::Mat>& outputGradient,
+		vector<cv::Mat>* inputGradient, double* parameterGradient) const {
+		if (!inputGradient) {
+			return;
+		}
+		allocateZeros(*inputGradient, shapeOf(image));
+		for (int imgChannel = 0; imgChannel < downsampledImg.size(); imgChannel++) {
+			const cv::Mat& imgLayer = image.at(imgChannel);
+			cv::Mat& inputGradientLayer = inputGradient->at(imgChannel);
+			for (int outY = 0; outY < downsampledImg.at(imgChannel).rows; outY++) {
+				const double* maxRow = downsampledImg.at(imgChannel).ptr<double>(outY);
+				const double* gradientRow = outputGradient.at(imgChannel).ptr<double>(outY);
+				for (int outX = 0; outX < downsampledImg.at(imgChannel).cols; outX++) {
+					bool found = false;
+					for (int row = outY * slideY; row < outY * slideY + subsecHeight && !found; row++) {
+						const double* imgRow = imgLayer.ptr<double>(row);
+						for (int col = outX * slideX; col < outX * slideX + subsecWidth; col++) {
+							if (imgRow[col] == maxRow[outX]) {
+								inputGradientLayer.ptr<double>(row)[col] += gradientRow[outX];
+								found = true;
+								break;
+							}
+						}
+					}
 				}
 			}
 		}
-		return max;
 	}
 
+	/**
+		Writes the layer's attributes to a model file.
+
+		@param out The model file
+	*/
+	void save(ostream& out) const {
+		writeValue<int>(out, POOLING_LAYER);
+		writeValue<int>(out, subsecWidth);
+		writeValue<int>(out, subsecHeight);
+		writeValue<int>(out, slideX);
+		writeValue<int>(out, slideY);
+	}
+
+	/**
+		Reads a layer written by save. The type tag has already been read by the caller.
+
+		@param in The model file
+		@return The layer, or nullptr if the file is damaged
+	*/
+	static shared_ptr<PoolingLayer> load(istream& in) {
+		int mySubsecWidth = readValue<int>(in);
+		int mySubsecHeight = readValue<int>(in);
+		int mySlideX = readValue<int>(in);
+		int mySlideY = readValue<int>(in);
+		if (!in || mySubsecWidth <= 0 || mySubsecHeight <= 0 || mySlideX <= 0 || mySlideY <= 0) {
+			return nullptr;
+		}
+		return shared_ptr<PoolingLayer>(new PoolingLayer(mySubsecWidth, mySubsecHeight, mySlideX, mySlideY));
+	}
+
+	/**
+		@return The specialized kernel and the generic kernel, if the layer's shape has a specialized kernel
+	*/
+	vector<LayerEngine> getEngines() const {
+		vector<LayerEngine> engines;
+		if (selectPoolingKernel(subsecWidth, subsecHeight, slideX, slideY) != &poolGeneric) {
+			engines.push_back(DENSE_ENGINE);
+			engines.push_back(GENERIC_ENGINE);
+		}
+		return engines;
+	}
+
+	LayerEngine getEngine() const {
+		return kernel == selectPoolingKernel(subsecWidth, subsecHeight, slideX, slideY) ? DENSE_ENGINE : GENERIC_ENGINE;
+	}
+
+	bool setEngine(LayerEngine engine) {
+		if (engine != DENSE_ENGINE && engine != GENERIC_ENGINE) {
+			return false;
+		}
+		kernel = engine == GENERIC_ENGINE ? &poolGeneric : selectPoolingKernel(subsecWidth, subsecHeight, slideX, slideY);
+		return true;
+	}
+
+	string getSignature(TensorShape inputShape) const {
+		return "Pooling " + to_string(subsecWidth) + "x" + to_string(subsecHeight) + " slide " + to_string(slideX) + "x" +
+			to_string(slideY) + " input " + shapeText(inputShape);
+	}
+
+	int getSubsecWidth() const { return subsecWidth; }
+	int getSubsecHeight() const { return subsecHeight; }
+	int getSlideX() const { return slideX; }
+	int getSlideY() const { return slideY; }
+
 	/**
 		This function convienently prints out a 3D matrix.
 		TODO: Refactor this function into a Utilities class
@@ -0,0 +1,227 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <tuple>
+#include <memory>
+#include <cmath>
+
+#include "ConvolutionalNeuralNetwork.h"
+#include "Evaluator.h"
+#include "ParallelFor.h"
+
+using namespace std;
+
+/**
+	How an int8 network compares to the network it was quantized from on the same labeled set.
+*/
+struct QuantizationReport {
+	EvaluationReport floatReport;
+	EvaluationReport int8Report;
+	double accuracyDelta;			// int8 accuracy minus float accuracy
+	double agreement;				// Fraction of images both networks gave the same classification
+	double maxScoreDifference;		// The largest difference between a float score and its int8 score
+	size_t floatBytes;				// Size of the float model file
+	size_t int8Bytes;				// Size of the int8 model file
+
+	QuantizationReport() : accuracyDelta(0.0), agreement(0.0), maxScoreDifference(0.0), floatBytes(0), int8Bytes(0) {}
+
+	/**
+		This function prints out the accuracy delta, agreement, size and speed of both networks.
+	*/
+	void printReport() const {
+		cout << "Quantization Report" << endl;
+		cout << "Float accuracy: " << floatReport.accuracy << ", Int8 accuracy: " << int8Report.accuracy << ", Delta: " << accuracyDelta << endl;
+		cout << "Top-1 agreement: " << agreement << ", Largest score difference: " << maxScoreDifference << endl;
+		cout << "Float bytes: " << floatBytes << ", Int8 bytes: " << int8Bytes <<
+			", Ratio: " << (int8Bytes > 0 ? (double)floatBytes / int8Bytes : 0.0) << endl;
+		cout << "Float images/second: " << floatReport.imagesPerSecond << ", Int8 images/second: " << int8Report.imagesPerSecond << endl << endl;
+	}
+};
+
+class PostTrainingQuantization {
+private:
+
+	/**
+		@param tensor A layer's input
+		@param range The largest magnitude seen so far, which is raised to the largest magnitude in tensor
+	*/
+	static void widenRange(const vector<cv::Mat>& tensor, double& range) {
+		for (int channel = 0; channel < tensor.size(); channel++) {
+			double minVal, maxVal;
+			cv::minMaxLoc(tensor.at(channel), &minVal, &maxVal);
+			range = max(range, max(fabs(minVal), fabs(maxVal)));
+		}
+	}
+
+	/**
+		@param layer A float layer
+		@param inputRange The largest input magnitude the layer received during calibration
+		@return The int8 version of a convolutional or fully connected layer, or the layer itself for every other kind
+	*/
+	static shared_ptr<CNNLayer> quantizeLayer(shared_ptr<const CNNLayer> layer, double inputRange) {
+		double inputScale = int8Scale(inputRange);
+		shared_ptr<const ConvolutionalLayer> convLayer = dynamic_pointer_cast<const ConvolutionalLayer>(layer);
+		shared_ptr<const FullyConnectedLayer> fcLayer = dynamic_pointer_cast<const FullyConnectedLayer>(layer);
+		if (convLayer) {
+			return shared_ptr<CNNLayer>(new QuantizedConvolutionalLayer(*convLayer, inputScale));
+		}
+		else if (fcLayer) {
+			return shared_ptr<CNNLayer>(new QuantizedFullyConnectedLayer(*fcLayer, inputScale));
+		}
+		return const_pointer_cast<CNNLayer>(layer);
+	}
+
+public:
+
+	/**
+		Runs representative images through the network and records the largest magnitude each layer receives as input.
+
+		@param cnn An initialized float network
+		@param images Representative images, with the dimensions the network was initialized for
+		@param headRanges If not null, receives the largest input magnitude of each exit head's layers, indexed by head and then layer
+		@return The largest input magnitude of each layer, indexed the same as the network's layers
+	*/
+	static vector<double> calibrate(const ConvolutionalNeuralNetwork& cnn, const vector<cv::Mat>& images,
+		vector<vector<double>>* headRanges = nullptr)
+	{
+		int layerNum = cnn.getLayerCount();
+		int headNum = cnn.getExitHeadCount();
+		vector<double> inputRanges(layerNum, 0.0);
+		if (headRanges) {
+			headRanges->assign(headNum, vector<double>());
+			for (int headIndex = 0; headIndex < headNum; headIndex++) {
+				headRanges->at(headIndex).assign(cnn.getExitHead(headIndex).layers.size(), 0.0);
+			}
+		}
+		if (!cnn.isInitialized()) {
+			cout << "The network needs to be initialized before it can be calibrated." << endl;
+			return inputRanges;
+		}
+
+		vector<cv::Mat> input;
+		vector<vector<cv::Mat>> activations(layerNum);
+		vector<vector<cv::Mat>> headActivations(2);
+		for (int imageIndex = 0; imageIndex < images.size(); imageIndex++) {
+			cnn.prepareImage(images.at(imageIndex), input);
+			const vector<cv::Mat>* modifiedImg = &input;
+			int headIndex = 0;
+			for (int layerIndex = 0; layerIndex < layerNum; layerIndex++) {
+				widenRange(*modifiedImg, inputRanges.at(layerIndex));
+				cnn.getLayer(layerIndex)->forward(*modifiedImg, activations.at(layerIndex));
+				modifiedImg = &activations.at(layerIndex);
+
+				// Every image runs through every head, whether or not it would have exited there
+				for (; headRanges && headIndex < headNum && cnn.getExitHead(headIndex).afterLayer == layerIndex; headIndex++) {
+					const ExitHead& head = cnn.getExitHead(headIndex);
+					const vector<cv::Mat>* headImg = modifiedImg;
+					for (int headLayerIndex = 0; headLayerIndex < head.layers.size(); headLayerIndex++) {
+						widenRange(*headImg, headRanges->at(headIndex).at(headLayerIndex));
+						vector<cv::Mat>& headOutput = headActivations.at(headLayerIndex % 2);
+						head.layers.at(headLayerIndex)->forward(*headImg, headOutput);
+						headImg = &headOutput;
+					}
+				}
+			}
+		}
+		return inputRanges;
+	}
+
+	/**
+		Builds an int8 copy of a network. Convolutional and fully connected layers are replaced by their int8 versions, with per-filter
+		and per-node weight scales and input scales from calibration. All other layers are shared with the original network. Exit heads
+		are calibrated and quantized the same way and keep their thresholds.
+
+		@param cnn An initialized float network
+		@param calibrationImages Representative images used to find each layer's input range
+		@return The int8 network, initialized for the same input dimensions
+	*/
+	static ConvolutionalNeuralNetwork quantize(const ConvolutionalNeuralNetwork& cnn, const vector<cv::Mat>& calibrationImages) {
+		vector<vector<double>> headRanges;
+		vector<double> inputRanges = calibrate(cnn, calibrationImages, &headRanges);
+
+		ConvolutionalNeuralNetwork quantized;
+		for (int layerIndex = 0; layerIndex < cnn.getLayerCount(); layerIndex++) {
+			quantized.addLayer(quantizeLayer(cnn.getLayer(layerIndex), inputRanges.at(layerIndex)));
+		}
+		for (int headIndex = 0; headIndex < cnn.getExitHeadCount(); headIndex++) {
+			const ExitHead& head = cnn.getExitHead(headIndex);
+			vector<shared_ptr<CNNLayer>> headLayers;
+			for (int layerIndex = 0; layerIndex < head.layers.size(); layerIndex++) {
+				headLayers.push_back(quantizeLayer(head.layers.at(layerIndex), headRanges.at(headIndex).at(layerIndex)));
+			}
+			quantized.addExitHead(head.afterLayer, head.threshold, headLayers);
+		}
+
+		TensorShape inputShape = cnn.getInputShape();
+		quantized.initializeNetwork(inputShape.rows, inputShape.cols, inputShape.channels);
+		return quantized;
+	}
+
+	/**
+		@param cnn A network
+		@return The size of the network's layers and exit head layers in a model file, in bytes
+	*/
+	static size_t modelBytes(const ConvolutionalNeuralNetwork& cnn) {
+		ostringstream out(ios::binary);
+		for (int layerIndex = 0; layerIndex < cnn.getLayerCount(); layerIndex++) {
+			cnn.getLayer(layerIndex)->save(out);
+		}
+		for (int headIndex = 0; headIndex < cnn.getExitHeadCount(); headIndex++) {
+			const ExitHead& head = cnn.getExitHead(headIndex);
+			for (int layerIndex = 0; layerIndex < head.layers.size(); layerIndex++) {
+				head.layers.at(layerIndex)->save(out);
+			}
+		}
+		return out.str().size();
+	}
+
+	/**
+		Classifies a labeled set with a float network and its int8 copy and reports how much accuracy, size and speed changed.
+
+		@param floatCnn The original network
+		@param int8Cnn The network returned by quantize
+		@param labeledSet A vector of images with their accompanying class IDs {(img1, 3), (img2, 0), ...}
+		@return The comparison
+	*/
+	static QuantizationReport compare(const ConvolutionalNeuralNetwork& floatCnn, const ConvolutionalNeuralNetwork& int8Cnn,
+		const vector<tuple<cv::Mat, int>>& labeledSet)
+	{
+		QuantizationReport report;
+		report.floatReport = Evaluator::evaluate(floatCnn, labeledSet, 1);
+		report.int8Report = Evaluator::evaluate(int8Cnn, labeledSet, 1);
+		report.accuracyDelta = report.int8Report.accuracy - report.floatReport.accuracy;
+		report.floatBytes = modelBytes(floatCnn);
+		report.int8Bytes = modelBytes(int8Cnn);
+
+		int threadNum = hardwareThreads();
+		vector<ExecutionContext> floatContexts(threadNum), int8Contexts(threadNum);
+		vector<int> agreements(threadNum, 0);
+		vector<double> maxDifferences(threadNum, 0.0);
+		parallelFor((int)labeledSet.size(), threadNum, [&](int imageIndex, int threadIndex) {
+			const cv::Mat& image = get<0>(labeledSet.at(imageIndex));
+			vector<double> floatScores = floatCnn.forwardPass(image, floatContexts.at(threadIndex));
+			vector<double> int8Scores = int8Cnn.forwardPass(image, int8Contexts.at(threadIndex));
+			if (floatScores.empty() || floatScores.size() != int8Scores.size()) {
+				return;
+			}
+			for (int classIndex = 0; classIndex < floatScores.size(); classIndex++) {
+				maxDifferences.at(threadIndex) = max(maxDifferences.at(threadIndex), fabs(floatScores.at(classIndex) - int8Scores.at(classIndex)));
+			}
+			if (argmaxClass(floatScores) == argmaxClass(int8Scores)) {
+				agreements.at(threadIndex)++;
+			}
+		});
+
+		int agreed = 0;
+		for (int threadIndex = 0; threadIndex < threadNum; threadIndex++) {
+			agreed += agreements.at(threadIndex);
+			report.maxScoreDifference = max(report.maxScoreDifference, maxDifferences.at(threadIndex));
+		}
+		report.agreement = labeledSet.empty() ? 0.0 : (double)agreed / labeledSet.size();
+		return report;
+	}
+};
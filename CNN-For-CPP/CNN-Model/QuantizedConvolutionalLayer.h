@@ -0,0 +1,166 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "CNNLayer.h"
+#include "ConvolutionalLayer.h"
+#include "Int8Quantization.h"
+
+class QuantizedConvolutionalLayer : public CNNLayer {
+private:
+	int filterNum, subsecWidth, subsecHeight, slideX, slideY, channels;
+	double inputScale;				// The activation scale of the layer's input, from calibration
+	vector<int8_t> filters;			// Filter by filter, then channel by channel, row by row
+	vector<double> filterScales;	// One scale per filter
+	vector<double> biases;			// Kept as doubles, since they are added after the int32 sum is converted back
+
+public:
+
+	/**
+		Constructor method for an int8 Convolutional Layer. It does the same work as a ConvolutionalLayer, but its filters are stored as
+		int8 with one scale per filter, which makes them 8 times smaller than doubles. The input is quantized with a scale found by
+		running representative images through the network, the dot products are summed as int32, and each sum is converted back to a
+		double with a single multiply (the requantization is fused into the kernel's output).
+
+		@param layer The trained layer to quantize
+		@param myInputScale The int8 scale of the layer's input
+	*/
+	QuantizedConvolutionalLayer(const ConvolutionalLayer& layer, double myInputScale) :CNNLayer()
+	{
+		filterNum = layer.getFilterNum();
+		subsecWidth = layer.getSubsecWidth();
+		subsecHeight = layer.getSubsecHeight();
+		slideX = layer.getSlideX();
+		slideY = layer.getSlideY();
+		channels = layer.getChannels();
+		inputScale = myInputScale;
+		biases = layer.getBiases();
+		quantizeRows(layer.getWeights(), filterNum, filters, filterScales);
+	}
+
+	TensorShape outputShape(TensorShape inputShape) const {
+		return TensorShape(filterNum, (inputShape.rows - subsecHeight) / slideY + 1, (inputShape.cols - subsecWidth) / slideX + 1);
+	}
+
+	/**
+		This function implements the int8 convolution. Each product of two int8 values fits in 16 bits, so a filter would need more
+		than 130000 elements before an int32 sum could overflow.
+
+		@param image The matrix to be manipulated
+		@param activationMap3D Receives one 2D activation map per filter
+	*/
+	void forward(const vector<cv::Mat>& image, vector<cv::Mat>& activationMap3D) const {
+		TensorShape inShape = shapeOf(image);
+		TensorShape outShape = outputShape(inShape);
+		allocateOutput(activationMap3D, outShape);
+
+		static thread_local vector<int8_t> quantizedImage;
+		quantizeTensor(image, inputScale, quantizedImage);
+		size_t channelSize = (size_t)inShape.rows * inShape.cols;
+		size_t filterSize = (size_t)channels * subsecHeight * subsecWidth;
+
+		for (int filterIndex = 0; filterIndex < filterNum; filterIndex++) {
+			const int8_t* filter = filters.data() + filterIndex * filterSize;
+			double outputScale = inputScale * filterScales.at(filterIndex);
+			double bias = biases.at(filterIndex);
+			for (int outY = 0; outY < outShape.rows; outY++) {
+				double* activationRow = activationMap3D.at(filterIndex).ptr<double>(outY);
+				for (int outX = 0; outX < outShape.cols; outX++) {
+					const int8_t* imgCorner = quantizedImage.data() + (size_t)outY * slideY * inShape.cols + outX * slideX;
+					const int8_t* filterRow = filter;
+					int32_t sum = 0;
+					for (int imgChannel = 0; imgChannel < channels; imgChannel++) {
+						const int8_t* imgRow = imgCorner + imgChannel * channelSize;
+						for (int row = 0; row < subsecHeight; row++) {
+							for (int col = 0; col < subsecWidth; col++) {
+								sum += (int32_t)imgRow[col] * (int32_t)filterRow[col];
+							}
+							imgRow += inShape.cols;
+							filterRow += subsecWidth;
+						}
+					}
+					activationRow[outX] = sum * outputScale + bias;
+				}
+			}
+		}
+	}
+
+	/**
+		@return The dequantized filter weights, in the same order as ConvolutionalLayer::getWeights
+	*/
+	vector<double> getWeights() const {
+		vector<double> weights(filters.size());
+		size_t filterSize = filterNum > 0 ? filters.size() / filterNum : 0;
+		for (size_t i = 0; i < filters.size(); i++) {
+			weights.at(i) = filters.at(i) * filterScales.at(i / filterSize);
+		}
+		return weights;
+	}
+
+	/**
+		Writes the layer to a model file with its int8 filters.
+
+		@param out The model file
+	*/
+	void save(ostream& out) const {
+		writeValue<int>(out, QUANTIZED_CONVOLUTIONAL_LAYER);
+		writeValue<int>(out, filterNum);
+		writeValue<int>(out, subsecWidth);
+		writeValue<int>(out, subsecHeight);
+		writeValue<int>(out, slideX);
+		writeValue<int>(out, slideY);
+		writeValue<int>(out, channels);
+		writeValue<double>(out, inputScale);
+		writeVector(out, filterScales);
+		writeVector(out, filters);
+		writeVector(out, biases);
+	}
+
+	/**
+		Reads a layer written by save. The type tag has already been read by the caller.
+
+		@param in The model file
+		@param version The version of the model file. Layers from version 1 files have no biases.
+		@return The layer, or nullptr if the file is damaged
+	*/
+	static shared_ptr<QuantizedConvolutionalLayer> load(istream& in, int version = MODEL_FILE_VERSION) {
+		shared_ptr<QuantizedConvolutionalLayer> layer(new QuantizedConvolutionalLayer());
+		layer->filterNum = readValue<int>(in);
+		layer->subsecWidth = readValue<int>(in);
+		layer->subsecHeight = readValue<int>(in);
+		layer->slideX = readValue<int>(in);
+		layer->slideY = readValue<int>(in);
+		layer->channels = readValue<int>(in);
+		layer->inputScale = readValue<double>(in);
+		layer->filterScales = readVector<double>(in);
+		layer->filters = readVector<int8_t>(in);
+		if (version >= 2) {
+			layer->biases = readVector<double>(in);
+		}
+		else {
+			layer->biases.assign(max(0, layer->filterNum), 0.0);
+		}
+		if (!in || layer->filterNum <= 0 || layer->subsecWidth <= 0 || layer->subsecHeight <= 0 || layer->slideX <= 0 || layer->slideY <= 0 ||
+			layer->channels <= 0 || layer->inputScale <= 0.0 || layer->filterScales.size() != layer->filterNum || layer->biases.size() != layer->filterNum ||
+			layer->filters.size() != (size_t)layer->filterNum * layer->channels * layer->subsecHeight * layer->subsecWidth) {
+			return nullptr;
+		}
+		return layer;
+	}
+
+	/**
+		This function prints out the layer's description and attributes.
+	*/
+	void printLayer() {
+		cout << "Quantized Convolutional Layer (int8)" << endl;
+		cout << "Filter number: " << filterNum << ", Subsection Width: " << subsecWidth << ", Subsection Height: " << subsecHeight <<
+			", Slide X: " << slideX << ", Slide Y: " << slideY << ", Channel number: " << channels << ", Input scale: " << inputScale << endl << endl;
+	}
+
+private:
+	QuantizedConvolutionalLayer() :CNNLayer() {}
+};
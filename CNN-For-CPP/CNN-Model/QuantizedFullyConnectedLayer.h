@@ -0,0 +1,129 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "CNNLayer.h"
+#include "FullyConnectedLayer.h"
+#include "Int8Quantization.h"
+
+class QuantizedFullyConnectedLayer : public CNNLayer {
+private:
+	int nodeNum, connectionNum;
+	double inputScale;				// The activation scale of the layer's input, from calibration
+	vector<int8_t> weights;			// Node by node
+	vector<double> weightScales;	// One scale per node
+	vector<double> biases;			// Kept as doubles, since they are added after the int32 sum is converted back
+
+public:
+
+	/**
+		Constructor method for an int8 Fully Connected Layer. It scores like a FullyConnectedLayer, but its weights are stored as int8
+		with one scale per node. The input is quantized with the scale found during calibration, each node sums int8 products as int32,
+		and the sum is converted back and biased in the same step.
+
+		@param layer The trained and initialized layer to quantize
+		@param myInputScale The int8 scale of the layer's input
+	*/
+	QuantizedFullyConnectedLayer(const FullyConnectedLayer& layer, double myInputScale) :CNNLayer()
+	{
+		nodeNum = layer.getNodeNum();
+		connectionNum = layer.getConnectionNum();
+		inputScale = myInputScale;
+		biases = layer.getBiases();
+		quantizeRows(layer.getWeights(), nodeNum, weights, weightScales);
+	}
+
+	TensorShape outputShape(TensorShape inputShape) const {
+		return TensorShape(1, 1, nodeNum);
+	}
+
+	/**
+		This function implements the int8 scoring.
+
+		@param image The input matrix to be classified
+		@param output Receives a 1 x nodeNum matrix of scores
+	*/
+	void forward(const vector<cv::Mat>& image, vector<cv::Mat>& output) const {
+		allocateOutput(output, TensorShape(1, 1, nodeNum));
+		double* scoreRow = output.at(0).ptr<double>(0);
+
+		static thread_local vector<int8_t> quantizedImage;
+		quantizeTensor(image, inputScale, quantizedImage);
+		if (quantizedImage.size() != connectionNum) {
+			cout << "Improper weight count for image dimensions" << endl;
+			return;
+		}
+
+		const int8_t* input = quantizedImage.data();
+		for (int nodeIndex = 0; nodeIndex < nodeNum; nodeIndex++) {
+			const int8_t* nodeWeights = weights.data() + (size_t)nodeIndex * connectionNum;
+			int32_t sum = 0;
+			for (int i = 0; i < connectionNum; i++) {
+				sum += (int32_t)input[i] * (int32_t)nodeWeights[i];
+			}
+			scoreRow[nodeIndex] = sum * (inputScale * weightScales.at(nodeIndex)) + biases.at(nodeIndex);
+		}
+	}
+
+	/**
+		@return The dequantized weights, in the same order as FullyConnectedLayer::getWeights
+	*/
+	vector<double> getWeights() const {
+		vector<double> dequantized(weights.size());
+		for (size_t i = 0; i < weights.size(); i++) {
+			dequantized.at(i) = weights.at(i) * weightScales.at(i / connectionNum);
+		}
+		return dequantized;
+	}
+
+	/**
+		Writes the layer to a model file with its int8 weights.
+
+		@param out The model file
+	*/
+	void save(ostream& out) const {
+		writeValue<int>(out, QUANTIZED_FULLY_CONNECTED_LAYER);
+		writeValue<int>(out, nodeNum);
+		writeValue<int>(out, connectionNum);
+		writeValue<double>(out, inputScale);
+		writeVector(out, biases);
+		writeVector(out, weightScales);
+		writeVector(out, weights);
+	}
+
+	/**
+		Reads a layer written by save. The type tag has already been read by the caller.
+
+		@param in The model file
+		@return The layer, or nullptr if the file is damaged
+	*/
+	static shared_ptr<QuantizedFullyConnectedLayer> load(istream& in) {
+		shared_ptr<QuantizedFullyConnectedLayer> layer(new QuantizedFullyConnectedLayer());
+		layer->nodeNum = readValue<int>(in);
+		layer->connectionNum = readValue<int>(in);
+		layer->inputScale = readValue<double>(in);
+		layer->biases = readVector<double>(in);
+		layer->weightScales = readVector<double>(in);
+		layer->weights = readVector<int8_t>(in);
+		if (!in || layer->nodeNum <= 0 || layer->connectionNum <= 0 || layer->inputScale <= 0.0 || layer->biases.size() != layer->nodeNum ||
+			layer->weightScales.size() != layer->nodeNum || layer->weights.size() != (size_t)layer->nodeNum * layer->connectionNum) {
+			return nullptr;
+		}
+		return layer;
+	}
+
+	/**
+		This function prints out the layer's description and attributes.
+	*/
+	void printLayer() {
+		cout << "Quantized Fully Connected Layer (int8)" << endl;
+		cout << "Node number: " << nodeNum << ", Connection number: " << connectionNum << ", Input scale: " << inputScale << endl << endl;
+	}
+
+private:
+	QuantizedFullyConnectedLayer() :CNNLayer() {}
+};
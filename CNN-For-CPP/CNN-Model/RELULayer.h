@@ -2,7 +2,9 @@
 #include <opencv2/opencv.hpp>
 
 #include <stdio.h>
+#ifdef _WIN32
 #include <tchar.h>
+#endif
 #include <iostream>
 #include <string>
 #include <vector>
@@ -25,25 +27,89 @@ public:
 		This function implements how the RELU layer manipulates the input matrix
 
 		@param image The matrix to be manipulated
-		@return a matrix of the same dimensions with all of the negative values replaced with 0 and the positive values untouched
+		@param rectifiedImg Receives a matrix of the same dimensions with all of the negative values replaced with 0 and the positive
+			values untouched
 	*/
-	vector<cv::Mat> execute(vector<cv::Mat> image) {
-		vector<cv::Mat> rectifiedImg = image;
+	void forward(const vector<cv::Mat>& image, vector<cv::Mat>& rectifiedImg) const {
+		allocateOutput(rectifiedImg, shapeOf(image));
+		for (int imgChannel = 0; imgChannel < image.size(); imgChannel++) {
+			for (int y = 0; y < image.at(imgChannel).rows; y++) {
+				const double* imgRow = image.at(imgChannel).ptr<double>(y);
+				double* rectifiedRow = rectifiedImg.at(imgChannel).ptr<double>(y);
+				for (int x = 0; x < image.at(imgChannel).cols; x++) {
+					// Replaces all negative values in the img with 0
+					rectifiedRow[x] = max(0.0, imgRow[x]);
+				}
+			}
+		}
+	}
+
+	/**
+		Rectifies a rectangle of the input.
+
+		@param image The matrix to be manipulated
+		@param rectifiedImg The rectified matrix from the previous call, which is updated in place
+		@param outputRegion The rectangle of every channel to recompute
+	*/
+	void forwardRegion(const vector<cv::Mat>& image, vector<cv::Mat>& rectifiedImg, cv::Rect outputRegion) const {
+		allocateOutput(rectifiedImg, shapeOf(image));
+		for (int imgChannel = 0; imgChannel < image.size(); imgChannel++) {
+			for (int y = outputRegion.y; y < outputRegion.y + outputRegion.height; y++) {
+				const double* imgRow = image.at(imgChannel).ptr<double>(y);
+				double* rectifiedRow = rectifiedImg.at(imgChannel).ptr<double>(y);
+				for (int x = outputRegion.x; x < outputRegion.x + outputRegion.width; x++) {
+					rectifiedRow[x] = max(0.0, imgRow[x]);
+				}
+			}
+		}
+	}
+
+	cv::Rect affectedRegion(cv::Rect inputRegion, TensorShape inputShape) const {
+		return inputRegion;
+	}
+
+	/**
+		The gradient only flows through the elements that were positive. Those are read from the output, so this still works after
+		forward overwrote its input.
+
+		@param image The matrix that was input into the layer
+		@param rectifiedImg The matrix forward produced for image
+		@param outputGradient How the cost changes with each element of rectifiedImg
+		@param inputGradient If not null, receives how the cost changes with each element of image
+		@param parameterGradient Unused, since the layer learns nothing
+	*/
+	void backward(const vector<cv::Mat>& image, const vector<cv::Mat>& rectifiedImg, const vector<cv::Mat>& outputGradient,
+		vector<cv::Mat>* inputGradient, double* parameterGradient) const {
+		if (!inputGradient) {
+			return;
+		}
+		allocateOutput(*inputGradient, shapeOf(rectifiedImg));
 		for (int imgChannel = 0; imgChannel < rectifiedImg.size(); imgChannel++) {
 			for (int y = 0; y < rectifiedImg.at(imgChannel).rows; y++) {
+				const double* rectifiedRow = rectifiedImg.at(imgChannel).ptr<double>(y);
+				const double* gradientRow = outputGradient.at(imgChannel).ptr<double>(y);
+				double* inputGradientRow = inputGradient->at(imgChannel).ptr<double>(y);
 				for (int x = 0; x < rectifiedImg.at(imgChannel).cols; x++) {
-					// Replaces all negative values in the img with 0
-					rectifiedImg.at(imgChannel).row(y).col(x) = max(0, rectifiedImg.at(imgChannel).row(y).col(x));
+					inputGradientRow[x] = rectifiedRow[x] > 0.0 ? gradientRow[x] : 0.0;
 				}
 			}
 		}
+	}
 
-		/*cout << "Rectified Image:" << endl;
-		for (int imgChannel = 0; imgChannel < rectifiedImg.size(); imgChannel++) {
-			cout << "Channel: " << imgChannel << endl << rectifiedImg.at(imgChannel) << endl << endl;
-		}*/
+	/**
+		Each output element only depends on the input element at the same position, so the input can be overwritten.
+	*/
+	bool worksInPlace() const {
+		return true;
+	}
 
-		return rectifiedImg;
+	/**
+		Writes the layer to a model file. The RELU layer has no attributes, so only its type tag is written.
+
+		@param out The model file
+	*/
+	void save(ostream& out) const {
+		writeValue<int>(out, RELU_LAYER);
 	}
 
 	/**
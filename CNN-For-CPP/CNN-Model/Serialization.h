@@ -0,0 +1,111 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+
+using namespace std;
+
+const int MODEL_FILE_MAGIC = 0x4D4E4E43;		// "CNNM"
+const int MODEL_FILE_VERSION = 5;		// Version 2 added convolutional biases and the batch normalization layer, version 3 exit heads,
+										// version 4 16-bit layers, version 5 sparse taps field by field
+
+/**
+	The tag written in front of every layer in a model file, so the loader knows which layer to create.
+	Values are stored in the file, so existing tags must never change.
+*/
+enum LayerType {
+	CONVOLUTIONAL_LAYER = 1,
+	RELU_LAYER = 2,
+	POOLING_LAYER = 3,
+	FULLY_CONNECTED_LAYER = 4,
+	QUANTIZED_CONVOLUTIONAL_LAYER = 5,
+	QUANTIZED_FULLY_CONNECTED_LAYER = 6,
+	BATCH_NORM_LAYER = 7,
+	HALF_PRECISION_CONVOLUTIONAL_LAYER = 8,
+	HALF_PRECISION_FULLY_CONNECTED_LAYER = 9
+};
+
+/**
+	How a layer's weights are laid out in a model file.
+*/
+enum WeightStorage {
+	DENSE_STORAGE = 0,		// Every weight in order
+	SPARSE_STORAGE = 1		// Only the non-zero weights with their positions (CSR)
+};
+
+/**
+	Model files are plain binary in the byte order of the machine that wrote them. These helpers read and write
+	single values and vectors of values.
+*/
+template <typename T>
+void writeValue(ostream& out, const T& value) {
+	out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+T readValue(istream& in) {
+	T value = T();
+	in.read(reinterpret_cast<char*>(&value), sizeof(T));
+	return value;
+}
+
+template <typename T>
+void writeVector(ostream& out, const vector<T>& values) {
+	writeValue<long long>(out, (long long)values.size());
+	if (!values.empty()) {
+		out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+	}
+}
+
+template <typename T>
+vector<T> readVector(istream& in) {
+	// The size comes from the file, so a damaged one could ask for any amount of memory. The vector grows a chunk at a time as the
+	// values actually arrive, and a size past the end of the file fails once the stream runs out.
+	const size_t CHUNK_BYTES = 1 << 20;
+	long long size = readValue<long long>(in);
+	vector<T> values;
+	if (!in || size < 0) {
+		in.setstate(ios::failbit);
+		return values;
+	}
+	size_t chunkSize = max((size_t)1, CHUNK_BYTES / sizeof(T));
+	while (values.size() < (unsigned long long)size) {
+		size_t readNum = (size_t)min((unsigned long long)chunkSize, (unsigned long long)size - values.size());
+		size_t first = values.size();
+		values.resize(first + readNum);
+		in.read(reinterpret_cast<char*>(values.data() + first), readNum * sizeof(T));
+		if (!in) {
+			values.clear();
+			return values;
+		}
+	}
+	return values;
+}
+
+/**
+	Moves a completely written temporary file over another file in one step, so a crash leaves either the old file or the new one.
+
+	@param temporaryPath The written file
+	@param path The file to replace, which does not have to exist
+	@return Whether the file was replaced
+*/
+inline bool replaceFile(const string& temporaryPath, const string& path) {
+#ifdef _WIN32
+	// rename fails on Windows if path exists, and removing path first would leave neither file after a crash
+	return MoveFileExA(temporaryPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+#endif
+}
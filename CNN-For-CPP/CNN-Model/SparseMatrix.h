@@ -0,0 +1,169 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "Serialization.h"
+
+using namespace std;
+
+/**
+	The fraction of zero weights above which the sparse kernels beat the dense kernels. Below it a pruned layer keeps its dense
+	storage with the pruned weights set to zero. The value comes from benchmarkSparseCrossover() in Benchmark.h.
+*/
+const double SPARSE_CROSSOVER = 0.5;
+
+/**
+	Checks the start offsets of a compressed list (ex. the rows of a SparseMatrix) read from a file, so the kernels can index the
+	entries without bounds checks.
+
+	@param starts The offsets, one per group plus one for the end
+	@param groupNum The amount of groups
+	@param entryNum The amount of entries the offsets point into
+	@return Whether the offsets begin at 0, never decrease, and end at entryNum
+*/
+inline bool validStarts(const vector<int>& starts, int groupNum, size_t entryNum) {
+	if (groupNum < 0 || starts.size() != (size_t)groupNum + 1 || starts.front() != 0 || (size_t)starts.back() != entryNum) {
+		return false;
+	}
+	for (int group = 0; group < groupNum; group++) {
+		if (starts.at(group + 1) < starts.at(group)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+	A matrix in compressed sparse row (CSR) form. Only the non-zero values are stored, row by row, together with their column.
+	Row r's values are values[rowStarts[r]] to values[rowStarts[r + 1] - 1].
+*/
+class SparseMatrix {
+public:
+	int rows, cols;
+	vector<int> rowStarts;
+	vector<int> columns;
+	vector<double> values;
+
+	SparseMatrix() : rows(0), cols(0) {}
+
+	/**
+		Builds the sparse form of a dense matrix, dropping every exact zero.
+
+		@param denseRows The dense matrix, one vector per row. Every row needs the same length.
+	*/
+	static SparseMatrix fromDense(const vector<vector<double>>& denseRows) {
+		SparseMatrix matrix;
+		matrix.rows = (int)denseRows.size();
+		matrix.cols = denseRows.empty() ? 0 : (int)denseRows.at(0).size();
+		matrix.rowStarts.push_back(0);
+		for (int row = 0; row < matrix.rows; row++) {
+			const vector<double>& denseRow = denseRows.at(row);
+			for (int col = 0; col < denseRow.size(); col++) {
+				if (denseRow.at(col) != 0.0) {
+					matrix.columns.push_back(col);
+					matrix.values.push_back(denseRow.at(col));
+				}
+			}
+			matrix.rowStarts.push_back((int)matrix.values.size());
+		}
+		return matrix;
+	}
+
+	/**
+		@param row The row to expand
+		@return The row with its zeros put back
+	*/
+	vector<double> denseRow(int row) const {
+		vector<double> dense(cols, 0.0);
+		for (int index = rowStarts.at(row); index < rowStarts.at(row + 1); index++) {
+			dense.at(columns.at(index)) = values.at(index);
+		}
+		return dense;
+	}
+
+	/**
+		Sparse matrix times dense vector (GEMV).
+
+		@param input A vector of cols values
+		@param output Receives rows values
+	*/
+	void multiply(const double* input, double* output) const {
+		const int* column = columns.data();
+		const double* value = values.data();
+		for (int row = 0; row < rows; row++) {
+			double sum = 0.0;
+			for (int index = rowStarts[row]; index < rowStarts[row + 1]; index++) {
+				sum += value[index] * input[column[index]];
+			}
+			output[row] = sum;
+		}
+	}
+
+	/**
+		@return The fraction of elements that are zero
+	*/
+	double sparsity() const {
+		if (rows == 0 || cols == 0) {
+			return 0.0;
+		}
+		return 1.0 - (double)values.size() / ((double)rows * cols);
+	}
+
+	void save(ostream& out) const {
+		writeValue<int>(out, rows);
+		writeValue<int>(out, cols);
+		writeVector(out, rowStarts);
+		writeVector(out, columns);
+		writeVector(out, values);
+	}
+
+	/**
+		@return Whether the row offsets and columns fit the matrix's size, which a matrix read from a damaged file may not
+	*/
+	bool isValid() const {
+		if (rows < 0 || cols < 0 || columns.size() != values.size() || !validStarts(rowStarts, rows, values.size())) {
+			return false;
+		}
+		for (int index = 0; index < columns.size(); index++) {
+			if (columns.at(index) < 0 || columns.at(index) >= cols) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static SparseMatrix load(istream& in) {
+		SparseMatrix matrix;
+		matrix.rows = readValue<int>(in);
+		matrix.cols = readValue<int>(in);
+		matrix.rowStarts = readVector<int>(in);
+		matrix.columns = readVector<int>(in);
+		matrix.values = readVector<double>(in);
+		return matrix;
+	}
+};
+
+/**
+	Finds the magnitude below which a given fraction of the weights falls.
+
+	@param weights The weights to look at
+	@param sparsity The fraction of weights that should be pruned (0.0 - 1.0)
+	@return The threshold to pass to a layer's pruneWeights, or 0.0 if nothing should be pruned
+*/
+inline double sparsityThreshold(vector<double> weights, double sparsity) {
+	if (weights.empty() || sparsity <= 0.0) {
+		return 0.0;
+	}
+	for (int i = 0; i < weights.size(); i++) {
+		weights.at(i) = fabs(weights.at(i));
+	}
+	size_t prunedNum = min(weights.size(), (size_t)(sparsity * weights.size()));
+	if (prunedNum == weights.size()) {
+		return *max_element(weights.begin(), weights.end()) * 2.0 + 1.0;
+	}
+	nth_element(weights.begin(), weights.begin() + prunedNum, weights.end());
+	return weights.at(prunedNum);
+}
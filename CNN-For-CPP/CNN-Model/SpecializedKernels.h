@@ -0,0 +1,204 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+/**
+	The inner loops of the convolutional and pooling layers, with the subsection size and slide as template parameters so the
+	compiler can unroll the subsection and vectorize the slide for the shapes networks use most. Every kernel has the same signature,
+	so a layer picks one from a dispatch table when it is built and calls it through a function pointer. The generic kernels take the
+	shape at runtime and handle everything else.
+*/
+
+/**
+	@param image The 3D input matrix
+	@param filters The layer's filters, each a vector of 2D Mat rectangles, one per input channel
+	@param biases The bias of each filter, which every dot product starts from
+	@param activationMap3D The allocated activation maps, one per filter
+	@param subsecWidth, subsecHeight, slideX, slideY The layer's shape (ignored by the specialized kernels)
+*/
+typedef void (*ConvolutionKernel)(const vector<cv::Mat>& image, const vector<vector<cv::Mat>>& filters, const vector<double>& biases,
+	vector<cv::Mat>& activationMap3D,
+	int subsecWidth, int subsecHeight, int slideX, int slideY);
+
+/**
+	@param imgLayer One channel of the input matrix
+	@param downsampledLayer The allocated downsampled channel
+	@param subsecWidth, subsecHeight, slideX, slideY The layer's shape (ignored by the specialized kernels)
+*/
+typedef void (*PoolingKernel)(const cv::Mat& imgLayer, cv::Mat& downsampledLayer, int subsecWidth, int subsecHeight, int slideX, int slideY);
+
+/**
+	Convolution for any subsection size and slide.
+*/
+inline void convolveGeneric(const vector<cv::Mat>& image, const vector<vector<cv::Mat>>& filters, const vector<double>& biases,
+	vector<cv::Mat>& activationMap3D,
+	int subsecWidth, int subsecHeight, int slideX, int slideY)
+{
+	for (int filterIndex = 0; filterIndex < filters.size(); filterIndex++) {
+		cv::Mat& activationMap = activationMap3D.at(filterIndex);
+		for (int outY = 0; outY < activationMap.rows; outY++) {
+			double* activationRow = activationMap.ptr<double>(outY);
+			for (int outX = 0; outX < activationMap.cols; outX++) {
+				double dotProduct = biases.at(filterIndex);
+				for (int imgChannel = 0; imgChannel < image.size(); imgChannel++) {
+					const cv::Mat& filterLayer = filters.at(filterIndex).at(imgChannel);
+					for (int row = 0; row < subsecHeight; row++) {
+						const double* imgRow = image.at(imgChannel).ptr<double>(outY * slideY + row) + outX * slideX;
+						const double* filterRow = filterLayer.ptr<double>(row);
+						for (int col = 0; col < subsecWidth; col++) {
+							dotProduct += imgRow[col] * filterRow[col];
+						}
+					}
+				}
+				activationRow[outX] = dotProduct;
+			}
+		}
+	}
+}
+
+/**
+	Convolution for one fixed subsection size and slide. The filter channel is copied into locals, which stay in registers for
+	the small shapes, and the subsection loops have constant bounds, so they are fully unrolled.
+*/
+template <int SubsecWidth, int SubsecHeight, int SlideX, int SlideY>
+void convolveFixed(const vector<cv::Mat>& image, const vector<vector<cv::Mat>>& filters, const vector<double>& biases,
+	vector<cv::Mat>& activationMap3D,
+	int, int, int, int)
+{
+	for (int filterIndex = 0; filterIndex < filters.size(); filterIndex++) {
+		cv::Mat& activationMap = activationMap3D.at(filterIndex);
+		for (int imgChannel = 0; imgChannel < image.size(); imgChannel++) {
+			const cv::Mat& imgLayer = image.at(imgChannel);
+			const cv::Mat& filterLayer = filters.at(filterIndex).at(imgChannel);
+			double weights[SubsecHeight][SubsecWidth];
+			for (int row = 0; row < SubsecHeight; row++) {
+				for (int col = 0; col < SubsecWidth; col++) {
+					weights[row][col] = filterLayer.at<double>(row, col);
+				}
+			}
+
+			// The first channel fills the activation map with the bias, the others add to it
+			bool firstChannel = imgChannel == 0;
+			for (int outY = 0; outY < activationMap.rows; outY++) {
+				double* activationRow = activationMap.ptr<double>(outY);
+				const double* imgRows[SubsecHeight];
+				for (int row = 0; row < SubsecHeight; row++) {
+					imgRows[row] = imgLayer.ptr<double>(outY * SlideY + row);
+				}
+				if (firstChannel) {
+					fill(activationRow, activationRow + activationMap.cols, biases.at(filterIndex));
+				}
+				// Every tap is added to the whole output row, so the row loop has a constant stride and vectorizes
+				for (int row = 0; row < SubsecHeight; row++) {
+					for (int col = 0; col < SubsecWidth; col++) {
+						double weight = weights[row][col];
+						const double* imgRow = imgRows[row] + col;
+						for (int outX = 0; outX < activationMap.cols; outX++) {
+							activationRow[outX] += weight * imgRow[outX * SlideX];
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+/**
+	Max pooling for any subsection size and slide.
+*/
+inline void poolGeneric(const cv::Mat& imgLayer, cv::Mat& downsampledLayer, int subsecWidth, int subsecHeight, int slideX, int slideY) {
+	for (int newY = 0; newY < downsampledLayer.rows; newY++) {
+		double* downsampledRow = downsampledLayer.ptr<double>(newY);
+		for (int newX = 0; newX < downsampledLayer.cols; newX++) {
+			int x = newX * slideX;
+			double max = imgLayer.at<double>(newY * slideY, x);
+			for (int row = 0; row < subsecHeight; row++) {
+				const double* imgRow = imgLayer.ptr<double>(newY * slideY + row);
+				for (int col = x; col < x + subsecWidth; col++) {
+					if (imgRow[col] > max) {
+						max = imgRow[col];
+					}
+				}
+			}
+			downsampledRow[newX] = max;
+		}
+	}
+}
+
+/**
+	Max pooling for one fixed subsection size and slide.
+*/
+template <int SubsecWidth, int SubsecHeight, int SlideX, int SlideY>
+void poolFixed(const cv::Mat& imgLayer, cv::Mat& downsampledLayer, int, int, int, int) {
+	for (int newY = 0; newY < downsampledLayer.rows; newY++) {
+		double* downsampledRow = downsampledLayer.ptr<double>(newY);
+		const double* imgRows[SubsecHeight];
+		for (int row = 0; row < SubsecHeight; row++) {
+			imgRows[row] = imgLayer.ptr<double>(newY * SlideY + row);
+		}
+		for (int newX = 0; newX < downsampledLayer.cols; newX++) {
+			const double* corner = imgRows[0] + newX * SlideX;
+			double max = corner[0];
+			for (int row = 0; row < SubsecHeight; row++) {
+				const double* imgRow = imgRows[row] + newX * SlideX;
+				for (int col = 0; col < SubsecWidth; col++) {
+					max = imgRow[col] > max ? imgRow[col] : max;
+				}
+			}
+			downsampledRow[newX] = max;
+		}
+	}
+}
+
+/**
+	One entry of a dispatch table: the shape a kernel was instantiated for.
+*/
+template <typename Kernel>
+struct KernelEntry {
+	int subsecWidth, subsecHeight, slideX, slideY;
+	Kernel kernel;
+};
+
+#define SPECIALIZED_SHAPE(kernelTemplate, size, slide) { size, size, slide, slide, &kernelTemplate<size, size, slide, slide> }
+#define SPECIALIZED_SHAPES(kernelTemplate) \
+	SPECIALIZED_SHAPE(kernelTemplate, 1, 1), SPECIALIZED_SHAPE(kernelTemplate, 1, 2), \
+	SPECIALIZED_SHAPE(kernelTemplate, 2, 1), SPECIALIZED_SHAPE(kernelTemplate, 2, 2), \
+	SPECIALIZED_SHAPE(kernelTemplate, 3, 1), SPECIALIZED_SHAPE(kernelTemplate, 3, 2), \
+	SPECIALIZED_SHAPE(kernelTemplate, 5, 1), SPECIALIZED_SHAPE(kernelTemplate, 5, 2)
+
+const KernelEntry<ConvolutionKernel> CONVOLUTION_KERNELS[] = { SPECIALIZED_SHAPES(convolveFixed) };
+const KernelEntry<PoolingKernel> POOLING_KERNELS[] = { SPECIALIZED_SHAPES(poolFixed) };
+const int SPECIALIZED_KERNEL_NUM = sizeof(CONVOLUTION_KERNELS) / sizeof(CONVOLUTION_KERNELS[0]);
+
+#undef SPECIALIZED_SHAPES
+#undef SPECIALIZED_SHAPE
+
+/**
+	Looks a shape up in a dispatch table.
+
+	@param table The dispatch table
+	@param generic The kernel to fall back to if the shape has no specialized kernel
+	@return The kernel to run
+*/
+template <typename Kernel>
+Kernel selectKernel(const KernelEntry<Kernel>* table, Kernel generic, int subsecWidth, int subsecHeight, int slideX, int slideY) {
+	for (int entryIndex = 0; entryIndex < SPECIALIZED_KERNEL_NUM; entryIndex++) {
+		const KernelEntry<Kernel>& entry = table[entryIndex];
+		if (entry.subsecWidth == subsecWidth && entry.subsecHeight == subsecHeight && entry.slideX == slideX && entry.slideY == slideY) {
+			return entry.kernel;
+		}
+	}
+	return generic;
+}
+
+inline ConvolutionKernel selectConvolutionKernel(int subsecWidth, int subsecHeight, int slideX, int slideY) {
+	return selectKernel(CONVOLUTION_KERNELS, &convolveGeneric, subsecWidth, subsecHeight, slideX, slideY);
+}
+
+inline PoolingKernel selectPoolingKernel(int subsecWidth, int subsecHeight, int slideX, int slideY) {
+	return selectKernel(POOLING_KERNELS, &poolGeneric, subsecWidth, subsecHeight, slideX, slideY);
+}
@@ -0,0 +1,380 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+
+#include "ConvolutionalNeuralNetwork.h"
+#include "LockFreeQueue.h"
+
+using namespace std;
+
+/**
+	A 3D matrix travelling between two stages, together with the frame it belongs to.
+*/
+struct StreamFrame {
+	long long frameId;
+	chrono::steady_clock::time_point submitted;
+	vector<cv::Mat> tensor;
+};
+
+/**
+	The scores of one frame that went through the whole network.
+*/
+struct StreamResult {
+	long long frameId;
+	vector<double> scores;
+	double latencySeconds;		// The time between submit and the last stage finishing the frame
+};
+
+/**
+	The frames travelling from one stage to the next. A link owns a fixed pool of frame buffers that circle between its
+	two queues: the producer takes an empty buffer from free, fills it and pushes it to filled, and the consumer gives it
+	back to free once it is done reading. The pool size is the queue capacity, so a producer waiting for a free buffer is
+	being held back by a slower stage downstream.
+*/
+struct StreamLink {
+	LockFreeQueue<StreamFrame*> filled;
+	LockFreeQueue<StreamFrame*> free;
+	vector<unique_ptr<StreamFrame>> pool;
+
+	StreamLink(int capacity, TensorShape shape) : filled(capacity), free(capacity) {
+		for (int i = 0; i < capacity; i++) {
+			unique_ptr<StreamFrame> frame(new StreamFrame());
+			CNNLayer::allocateOutput(frame->tensor, shape);
+			free.tryPush(frame.get());
+			pool.push_back(move(frame));
+		}
+	}
+};
+
+/**
+	The layers one worker thread runs and the counters it keeps about its work. Times are in nanoseconds.
+*/
+struct StreamStage {
+	int firstLayer, endLayer;					// The stage runs layers [firstLayer, endLayer)
+	double estimatedSeconds;					// The profiled cost of the stage's layers for one frame
+	atomic<bool> done;							// Set once the stage has passed on its last frame
+	atomic<long long> frames;
+	atomic<long long> busyNanos;				// Time spent running layers
+	atomic<long long> starvedNanos;				// Time spent waiting for the previous stage
+	atomic<long long> blockedNanos;				// Time spent waiting for the next stage to free a buffer (back-pressure)
+	atomic<long long> maxQueueDepth;			// The most frames waiting in the stage's input queue
+
+	StreamStage(int myFirstLayer, int myEndLayer, double myEstimatedSeconds) : firstLayer(myFirstLayer), endLayer(myEndLayer),
+		estimatedSeconds(myEstimatedSeconds), done(false), frames(0), busyNanos(0), starvedNanos(0), blockedNanos(0), maxQueueDepth(0) {}
+};
+
+/**
+	Runs a stream of frames through a network with pipeline parallelism. The layers are split into stages and each stage has its own
+	worker thread, so frame k + 1 can be in the convolutional stage while frame k is in the fully connected stage. Stages pass frames
+	through bounded lock-free queues. Throughput is limited by the slowest stage, so the stage boundaries are picked from the profiled
+	cost of each layer.
+
+	One thread submits frames and one (possibly the same) thread receives results. Results come out in the order frames were submitted.
+*/
+class StreamingExecutor {
+private:
+	ConvolutionalNeuralNetwork cnn;
+	vector<unique_ptr<StreamStage>> stages;
+	vector<unique_ptr<StreamLink>> links;		// Link s feeds stage s. The last link holds the finished scores.
+	vector<thread> workers;
+	atomic<bool> closed;
+	long long nextFrameId;
+	atomic<long long> submitBlockedNanos;		// Time the submitting thread waited for the first stage (back-pressure)
+	chrono::steady_clock::time_point startTime;
+
+	static long long nanosSince(chrono::steady_clock::time_point start) {
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+	}
+
+	static void addNanos(atomic<long long>& counter, long long nanos) {
+		counter.fetch_add(nanos, memory_order_relaxed);
+	}
+
+	static const int SPIN_ATTEMPTS = 64;			// Tries that only yield before a waiting thread starts to sleep
+	static const int MAX_SLEEP_MICROS = 200;		// The longest a waiting thread sleeps between two tries
+
+	/**
+		Waits a little longer each time a queue had nothing to give. The first tries only yield, so a frame that is about to arrive
+		is picked up at once, and later tries sleep for a doubling time, so a stage waiting on a slow neighbour stops using a core.
+
+		@param attempt How many tries have failed so far, which is incremented
+	*/
+	static void backOff(int& attempt) {
+		if (attempt < SPIN_ATTEMPTS) {
+			this_thread::yield();
+		}
+		else {
+			int sleepMicros = min(MAX_SLEEP_MICROS, 1 << min(attempt - SPIN_ATTEMPTS, 10));
+			this_thread::sleep_for(chrono::microseconds(sleepMicros));
+		}
+		attempt++;
+	}
+
+	/**
+		Waits for a frame in a queue.
+
+		@param queue The queue to pop from
+		@param frame Receives the frame
+		@param upstreamDone Set once nothing more will be pushed to the queue, or nullptr if the queue is never finished
+		@return False if the queue is empty and finished
+	*/
+	static bool waitPop(LockFreeQueue<StreamFrame*>& queue, StreamFrame*& frame, const atomic<bool>* upstreamDone) {
+		int attempt = 0;
+		while (!queue.tryPop(frame)) {
+			if (upstreamDone != nullptr && upstreamDone->load(memory_order_acquire)) {
+				// The producer may have pushed its last frame just before finishing
+				return queue.tryPop(frame);
+			}
+			backOff(attempt);
+		}
+		return true;
+	}
+
+	/**
+		The loop of one stage's worker thread.
+
+		@param stageIndex The stage this thread runs
+	*/
+	void runStage(int stageIndex) {
+		StreamStage& stage = *stages.at(stageIndex);
+		StreamLink& input = *links.at(stageIndex);
+		StreamLink& output = *links.at(stageIndex + 1);
+		const atomic<bool>* upstreamDone = stageIndex == 0 ? &closed : &stages.at(stageIndex - 1)->done;
+
+		// Every layer but the stage's last writes into the stage's own scratch matrices
+		vector<vector<cv::Mat>> scratch(max(0, stage.endLayer - stage.firstLayer - 1));
+
+		for (;;) {
+			StreamFrame* inFrame;
+			chrono::steady_clock::time_point waitStart = chrono::steady_clock::now();
+			if (!waitPop(input.filled, inFrame, upstreamDone)) {
+				break;
+			}
+			addNanos(stage.starvedNanos, nanosSince(waitStart));
+			long long queueDepth = (long long)input.filled.size() + 1;
+			if (queueDepth > stage.maxQueueDepth.load(memory_order_relaxed)) {
+				stage.maxQueueDepth.store(queueDepth, memory_order_relaxed);
+			}
+
+			StreamFrame* outFrame;
+			waitStart = chrono::steady_clock::now();
+			waitPop(output.free, outFrame, nullptr);
+			addNanos(stage.blockedNanos, nanosSince(waitStart));
+
+			chrono::steady_clock::time_point workStart = chrono::steady_clock::now();
+			const vector<cv::Mat>* modifiedImg = &inFrame->tensor;
+			for (int layerIndex = stage.firstLayer; layerIndex < stage.endLayer; layerIndex++) {
+				vector<cv::Mat>& layerOutput = layerIndex + 1 == stage.endLayer ? outFrame->tensor : scratch.at(layerIndex - stage.firstLayer);
+				cnn.getLayer(layerIndex)->forward(*modifiedImg, layerOutput);
+				modifiedImg = &layerOutput;
+			}
+			outFrame->frameId = inFrame->frameId;
+			outFrame->submitted = inFrame->submitted;
+			addNanos(stage.busyNanos, nanosSince(workStart));
+
+			input.free.tryPush(inFrame);
+			output.filled.tryPush(outFrame);
+			stage.frames.fetch_add(1, memory_order_relaxed);
+		}
+		stage.done.store(true, memory_order_release);
+	}
+
+public:
+
+	/**
+		Profiles the network on a sample image, splits its layers into balanced stages and starts one worker thread per stage.
+
+		@param myCnn An initialized network. The executor keeps its own copy, which shares the layers with myCnn, so myCnn must not
+			be changed (ex. by initializeNetwork, pruneLayer or training) until the executor is destroyed. Functions that replace
+			layers instead, like foldBatchNorm, leave the executor's copy alone.
+		@param stageNum The amount of stages (and worker threads). It is capped at the amount of layers.
+		@param queueCapacity The most frames that can wait between two stages
+		@param sampleImage An image used to profile the cost of each layer
+	*/
+	StreamingExecutor(const ConvolutionalNeuralNetwork& myCnn, int stageNum, int queueCapacity, const cv::Mat& sampleImage)
+		: cnn(myCnn), closed(false), nextFrameId(0), submitBlockedNanos(0)
+	{
+		startTime = chrono::steady_clock::now();
+		if (!cnn.isInitialized() || cnn.getLayerCount() == 0) {
+			cout << "The network needs to be initialized before it is streamed." << endl;
+			return;
+		}
+		TensorShape imageShape = cnn.getInputShape();
+		if (sampleImage.rows != imageShape.rows || sampleImage.cols != imageShape.cols || sampleImage.channels() != imageShape.channels) {
+			cout << "Image dimensions do not match the dimensions the network was initialized for." << endl;
+			return;
+		}
+
+		vector<double> layerSeconds = cnn.profileLayers(sampleImage);
+		vector<int> stageStarts = balanceStages(layerSeconds, stageNum);
+
+		for (int stageIndex = 0; stageIndex + 1 < stageStarts.size(); stageIndex++) {
+			double estimatedSeconds = 0.0;
+			for (int layerIndex = stageStarts.at(stageIndex); layerIndex < stageStarts.at(stageIndex + 1); layerIndex++) {
+				estimatedSeconds += layerSeconds.at(layerIndex);
+			}
+			stages.push_back(unique_ptr<StreamStage>(new StreamStage(stageStarts.at(stageIndex), stageStarts.at(stageIndex + 1), estimatedSeconds)));
+
+			TensorShape inputShape = stageIndex == 0 ? cnn.getInputShape() : cnn.getOutputShape(stageStarts.at(stageIndex) - 1);
+			links.push_back(unique_ptr<StreamLink>(new StreamLink(max(1, queueCapacity), inputShape)));
+		}
+		links.push_back(unique_ptr<StreamLink>(new StreamLink(max(1, queueCapacity), cnn.getOutputShape(cnn.getLayerCount() - 1))));
+
+		for (int stageIndex = 0; stageIndex < stages.size(); stageIndex++) {
+			workers.push_back(thread(&StreamingExecutor::runStage, this, stageIndex));
+		}
+	}
+
+	~StreamingExecutor() {
+		close();
+		// Drain the results nobody received so the last stage is never left waiting for a free buffer
+		StreamFrame* frame;
+		int attempt = 0;
+		while (!stages.empty() && !stages.back()->done.load(memory_order_acquire)) {
+			if (links.back()->filled.tryPop(frame)) {
+				links.back()->free.tryPush(frame);
+				attempt = 0;
+			}
+			else {
+				backOff(attempt);
+			}
+		}
+		for (int workerIndex = 0; workerIndex < workers.size(); workerIndex++) {
+			workers.at(workerIndex).join();
+		}
+	}
+
+	/**
+		Splits a sequence of layers into contiguous stages so that the most expensive stage is as cheap as possible.
+
+		@param layerSeconds The cost of each layer
+		@param stageNum The wanted amount of stages. It is capped at the amount of layers.
+		@return The first layer of each stage, followed by the amount of layers
+	*/
+	static vector<int> balanceStages(const vector<double>& layerSeconds, int stageNum) {
+		int layerNum = (int)layerSeconds.size();
+		stageNum = max(1, min(stageNum, layerNum));
+
+		vector<double> prefix(layerNum + 1, 0.0);
+		for (int layerIndex = 0; layerIndex < layerNum; layerIndex++) {
+			prefix.at(layerIndex + 1) = prefix.at(layerIndex) + layerSeconds.at(layerIndex);
+		}
+
+		// cost[s][l] is the cheapest slowest stage when the first l layers are split into s stages
+		const double infinity = numeric_limits<double>::max();
+		vector<vector<double>> cost(stageNum + 1, vector<double>(layerNum + 1, infinity));
+		vector<vector<int>> split(stageNum + 1, vector<int>(layerNum + 1, 0));
+		cost.at(0).at(0) = 0.0;
+		for (int s = 1; s <= stageNum; s++) {
+			for (int l = s; l <= layerNum; l++) {
+				for (int start = s - 1; start < l; start++) {
+					if (cost.at(s - 1).at(start) == infinity) {
+						continue;
+					}
+					double slowest = max(cost.at(s - 1).at(start), prefix.at(l) - prefix.at(start));
+					if (slowest < cost.at(s).at(l)) {
+						cost.at(s).at(l) = slowest;
+						split.at(s).at(l) = start;
+					}
+				}
+			}
+		}
+
+		vector<int> stageStarts(stageNum + 1);
+		stageStarts.at(stageNum) = layerNum;
+		for (int s = stageNum; s > 0; s--) {
+			stageStarts.at(s - 1) = split.at(s).at(stageStarts.at(s));
+		}
+		return stageStarts;
+	}
+
+	/**
+		Adds a frame to the stream. This waits while the first stage has no free buffer, so results need to be received
+		by another thread while frames are submitted. Only one thread may submit.
+
+		@param image The frame, with the dimensions the network was initialized for
+		@return The id of the frame, which is returned again with its result, or -1 if the executor could not be started
+	*/
+	long long submit(const cv::Mat& image) {
+		if (stages.empty()) {
+			return -1;
+		}
+		StreamLink& input = *links.front();
+		StreamFrame* frame;
+		chrono::steady_clock::time_point waitStart = chrono::steady_clock::now();
+		waitPop(input.free, frame, nullptr);
+		addNanos(submitBlockedNanos, nanosSince(waitStart));
+
+		cnn.prepareImage(image, frame->tensor);
+		frame->frameId = nextFrameId++;
+		frame->submitted = chrono::steady_clock::now();
+		input.filled.tryPush(frame);
+		return frame->frameId;
+	}
+
+	/**
+		Tells the workers that no more frames will be submitted. Frames already submitted still finish.
+	*/
+	void close() {
+		closed.store(true, memory_order_release);
+	}
+
+	/**
+		Waits for the next finished frame. Only one thread may receive.
+
+		@param result Receives the frame's scores
+		@return False once the stream is closed and every submitted frame has been received
+	*/
+	bool receive(StreamResult& result) {
+		if (stages.empty()) {
+			return false;
+		}
+		StreamLink& output = *links.back();
+		StreamFrame* frame;
+		if (!waitPop(output.filled, frame, &stages.back()->done)) {
+			return false;
+		}
+
+		result.frameId = frame->frameId;
+		result.latencySeconds = chrono::duration<double>(chrono::steady_clock::now() - frame->submitted).count();
+		result.scores.clear();
+		for (int channel = 0; channel < frame->tensor.size(); channel++) {
+			const cv::Mat& scoreLayer = frame->tensor.at(channel);
+			for (int row = 0; row < scoreLayer.rows; row++) {
+				const double* scoreRow = scoreLayer.ptr<double>(row);
+				result.scores.insert(result.scores.end(), scoreRow, scoreRow + scoreLayer.cols);
+			}
+		}
+		output.free.tryPush(frame);
+		return true;
+	}
+
+	/**
+		This function prints out each stage's layers, how much of the time it was working, starved by the previous stage, or
+		blocked by the next stage, and the throughput so far. A stage that is rarely starved or blocked is the bottleneck.
+	*/
+	void printStatistics() const {
+		double wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+		long long finishedFrames = stages.empty() ? 0 : stages.back()->frames.load();
+
+		cout << "Streaming Executor" << endl;
+		for (int stageIndex = 0; stageIndex < stages.size(); stageIndex++) {
+			const StreamStage& stage = *stages.at(stageIndex);
+			cout << " - Stage " << stageIndex << ": layers " << stage.firstLayer << " to " << stage.endLayer - 1 <<
+				", Estimated ms/frame: " << stage.estimatedSeconds * 1000.0 << ", Frames: " << stage.frames.load() << endl;
+			cout << "   Busy: " << stage.busyNanos.load() / 1e9 << "s, Starved: " << stage.starvedNanos.load() / 1e9 <<
+				"s, Blocked by next stage: " << stage.blockedNanos.load() / 1e9 << "s, Most queued frames: " << stage.maxQueueDepth.load() <<
+				"/" << links.at(stageIndex)->filled.capacity() << endl;
+		}
+		cout << "Submit blocked: " << submitBlockedNanos.load() / 1e9 << "s" << endl;
+		cout << "Frames: " << finishedFrames << ", Frames/second: " << (wallSeconds > 0.0 ? finishedFrames / wallSeconds : 0.0) << endl << endl;
+	}
+};
@@ -0,0 +1,727 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+#include <iostream>
+#include <vector>
+#include <tuple>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+
+#include "ConvolutionalNeuralNetwork.h"
+#include "ActivationCheckpointing.h"
+#include "OutputHead.h"
+#include "ParallelFor.h"
+#include "Augmentation.h"
+#include "Evaluator.h"
+#include "LearningRateSchedule.h"
+#include "TrainingCheckpoint.h"
+
+using namespace std;
+
+/**
+	What a training run did: the loss and accuracy on the training images, and what activation checkpointing cost and saved.
+*/
+struct TrainingStatistics {
+	long long imageNum;
+	long long correctNum;			// Images whose best score was their label, before the step
+	double lossSum;					// The softmax cross-entropy summed over the images
+	double seconds;
+	long long recomputedLayers;		// Layer forward calls the backward passes made again
+	double recomputeSeconds;		// Seconds spent in those calls, summed over threads
+	double inputWaitSeconds;		// Seconds the trainer waited for the input pipeline to finish a batch
+	size_t peakSize;				// The most doubles one thread held at once
+	size_t plannedPeakSize;			// The peak the checkpoint plan predicted
+	size_t fullSize;				// The peak without checkpointing
+
+	TrainingStatistics() : imageNum(0), correctNum(0), lossSum(0.0), seconds(0.0), recomputedLayers(0), recomputeSeconds(0.0),
+		inputWaitSeconds(0.0), peakSize(0), plannedPeakSize(0), fullSize(0) {}
+
+	double averageLoss() const {
+		return imageNum > 0 ? lossSum / imageNum : 0.0;
+	}
+
+	double accuracy() const {
+		return imageNum > 0 ? (double)correctNum / imageNum : 0.0;
+	}
+
+	/**
+		Adds the statistics of a later batch to these.
+
+		@param other The statistics of the batch
+	*/
+	void add(const TrainingStatistics& other) {
+		imageNum += other.imageNum;
+		correctNum += other.correctNum;
+		lossSum += other.lossSum;
+		seconds += other.seconds;
+		recomputedLayers += other.recomputedLayers;
+		recomputeSeconds += other.recomputeSeconds;
+		inputWaitSeconds += other.inputWaitSeconds;
+		peakSize = max(peakSize, other.peakSize);
+		plannedPeakSize = other.plannedPeakSize;
+		fullSize = other.fullSize;
+	}
+
+	/**
+		This function prints out the loss and accuracy, and the activation memory saved against the extra time spent recomputing.
+	*/
+	void printStatistics() const {
+		cout << "Training" << endl;
+		cout << "Images: " << imageNum << ", Loss: " << averageLoss() << ", Accuracy: " << accuracy() << ", Seconds: " << seconds <<
+			", Images/second: " << (seconds > 0.0 ? imageNum / seconds : 0.0) << endl;
+		cout << "Activation bytes per thread: " << peakSize * sizeof(double) << " (planned " << plannedPeakSize * sizeof(double) <<
+			", without checkpointing " << fullSize * sizeof(double) << "), Recomputed layers: " << recomputedLayers <<
+			", Recompute seconds: " << recomputeSeconds << endl;
+		cout << "Seconds waiting for input: " << inputWaitSeconds << endl << endl;
+	}
+};
+
+/**
+	The settings of Trainer::fit.
+*/
+struct TrainingOptions {
+	int maxEpochs;
+	int patience;					// Stop after this many epochs without a lower validation loss. 0 never stops early.
+	double minDelta;				// How much lower the validation loss has to be to count as lower
+	double desiredAccuracy;			// Stop once the validation accuracy reaches this (0.0 - 1.0). Above 1.0 never stops.
+	bool restoreBest;				// Whether to return to the values of the epoch with the lowest validation loss at the end
+	string checkpointPath;			// The snapshot file. Empty does not save snapshots.
+	int checkpointInterval;			// Save a snapshot every this many epochs, and after the last one
+	bool resume;					// Whether to continue from the snapshot file if it holds an unfinished run with the same settings
+	unsigned long long seed;		// Picks the shuffle of every epoch
+	bool printProgress;
+
+	TrainingOptions() : maxEpochs(100), patience(0), minDelta(0.0), desiredAccuracy(2.0), restoreBest(true), checkpointInterval(1),
+		resume(true), seed(0), printProgress(true) {}
+};
+
+/**
+	Trains a network with mini-batch gradient descent with momentum on the softmax cross-entropy of its scores. The images of a batch
+	are spread over threads. Each thread runs the forward and backward pass of one image at a time and adds up its parameter gradients,
+	and the averaged gradient is applied once per batch. The learning rate of each step comes from a schedule.
+
+	Keeping every activation of a pass for the backward pass can take more memory than the weights. With a checkpoint plan, only the
+	chosen activations are kept, and the backward pass recomputes each segment between checkpoints from the checkpoint before it, just
+	before it passes the gradient back through that segment. This gives the same gradients for extra forward work.
+
+	A network with batch normalization layers is trained a batch at a time instead: each layer runs on every image of the batch
+	before the next layer starts, so the batch normalization layers can normalize with the statistics of the batch, move their running
+	statistics towards them, and pass the gradient back through them (see BatchNormLayer::forwardTraining and backwardTraining). The
+	other layers still spread the images over threads. Every activation of the batch is kept, so the checkpoint plan is not used.
+	Exit heads are not trained.
+*/
+class Trainer {
+private:
+	ConvolutionalNeuralNetwork& cnn;
+	LearningRateSchedule schedule;
+	double momentum;					// How much of the last step each step keeps (0.0 - 1.0)
+	vector<double> velocity;			// The last step of every parameter
+	long long step;						// Gradient descent steps taken
+	int batchSize;
+	int threadNum;
+	CheckpointPlan checkpointPlan;
+	vector<size_t> parameterOffsets;	// The first parameter of each layer, and the total amount of parameters at the end
+	vector<shared_ptr<BatchNormLayer>> batchNorms;	// Each layer that is a batch normalization layer, and null for the rest
+	bool batchNormalized;				// Whether the network has batch normalization layers, so batches are trained a layer at a time
+	vector<vector<vector<cv::Mat>>> batchTensors;	// The input and the output of every layer for every image of the batch
+	vector<vector<cv::Mat>> batchGradients, previousBatchGradients;
+
+	// The activations, gradients and totals of one thread
+	struct ThreadScratch {
+		vector<vector<cv::Mat>> tensors;	// The same numbering as the checkpoint plan. Dropped tensors are empty.
+		vector<cv::Mat> gradient, previousGradient;
+		vector<double> scores, scoreGradient;
+		vector<double> parameterGradient;
+		TrainingStatistics statistics;
+	};
+	vector<ThreadScratch> scratches;
+
+	/**
+		@return The doubles a thread currently holds in activations and gradients
+	*/
+	static size_t heldSize(const ThreadScratch& scratch) {
+		size_t total = CNNLayer::shapeOf(scratch.gradient).size() + CNNLayer::shapeOf(scratch.previousGradient).size();
+		for (int tensorIndex = 0; tensorIndex < scratch.tensors.size(); tensorIndex++) {
+			total += CNNLayer::shapeOf(scratch.tensors.at(tensorIndex)).size();
+		}
+		return total;
+	}
+
+	/**
+		Finds the loss of one image's scores and how it changes with each score, and counts the image in the thread's statistics.
+
+		@param scoreTensor The output of the network's last layer
+		@param label The image's class ID
+		@param scratch The thread's buffers
+		@param gradient Receives how the loss changes with each element of scoreTensor
+		@return The image's loss, or -1 if the label is not one of the network's classes
+	*/
+	static double lossGradient(const vector<cv::Mat>& scoreTensor, int label, ThreadScratch& scratch, vector<cv::Mat>& gradient) {
+		scratch.scores.clear();
+		for (int channel = 0; channel < scoreTensor.size(); channel++) {
+			for (int row = 0; row < scoreTensor.at(channel).rows; row++) {
+				const double* scoreRow = scoreTensor.at(channel).ptr<double>(row);
+				scratch.scores.insert(scratch.scores.end(), scoreRow, scoreRow + scoreTensor.at(channel).cols);
+			}
+		}
+		int classNum = (int)scratch.scores.size();
+		scratch.scoreGradient.resize(classNum);
+		double loss = softmaxCrossEntropy(scratch.scores.data(), classNum, label, scratch.scoreGradient.data());
+		if (loss < 0.0) {
+			cout << "Label " << label << " is not one of the network's " << classNum << " classes." << endl;
+			return -1.0;
+		}
+		scratch.statistics.imageNum++;
+		scratch.statistics.lossSum += loss;
+		scratch.statistics.correctNum += argmaxClass(scratch.scores) == label ? 1 : 0;
+
+		CNNLayer::allocateOutput(gradient, CNNLayer::shapeOf(scoreTensor));
+		const double* scoreGradient = scratch.scoreGradient.data();
+		for (int channel = 0; channel < scoreTensor.size(); channel++) {
+			for (int row = 0; row < scoreTensor.at(channel).rows; row++) {
+				std::copy(scoreGradient, scoreGradient + scoreTensor.at(channel).cols, gradient.at(channel).ptr<double>(row));
+				scoreGradient += scoreTensor.at(channel).cols;
+			}
+		}
+		return loss;
+	}
+
+	/**
+		Runs the forward and backward pass of one image, following the checkpoint plan, and adds the image's parameter gradients to
+		the thread's.
+
+		@param image The image, with the dimensions the network was initialized for
+		@param label The image's class ID
+		@param scratch The thread's buffers
+		@return The image's loss
+	*/
+	double backpropagate(const cv::Mat& image, int label, ThreadScratch& scratch) const {
+		int layerNum = cnn.getLayerCount();
+		vector<vector<cv::Mat>>& tensors = scratch.tensors;
+		tensors.resize(layerNum + 1);
+		cnn.prepareImage(image, tensors.at(0));
+
+		for (int layerIndex = 0; layerIndex < layerNum; layerIndex++) {
+			cnn.getLayer(layerIndex)->forward(tensors.at(layerIndex), tensors.at(layerIndex + 1));
+			scratch.statistics.peakSize = max(scratch.statistics.peakSize, heldSize(scratch));
+			if (!checkpointPlan.kept.at(layerIndex)) {
+				tensors.at(layerIndex).clear();
+			}
+		}
+
+		double loss = lossGradient(tensors.at(layerNum), label, scratch, scratch.gradient);
+		if (loss < 0.0) {
+			return 0.0;
+		}
+
+		// Walk the segments from the last one back. A segment starts at a checkpoint and ends before the next one.
+		for (int segmentEnd = layerNum; segmentEnd > 0;) {
+			int segmentStart = checkpointPlan.checkpointBefore(segmentEnd);
+			if (segmentEnd - segmentStart > 1) {
+				chrono::steady_clock::time_point start = chrono::steady_clock::now();
+				for (int layerIndex = segmentStart; layerIndex < segmentEnd - 1; layerIndex++) {
+					cnn.getLayer(layerIndex)->forward(tensors.at(layerIndex), tensors.at(layerIndex + 1));
+				}
+				scratch.statistics.recomputeSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+				scratch.statistics.recomputedLayers += segmentEnd - 1 - segmentStart;
+			}
+
+			for (int layerIndex = segmentEnd - 1; layerIndex >= segmentStart; layerIndex--) {
+				cnn.getLayer(layerIndex)->backward(tensors.at(layerIndex), tensors.at(layerIndex + 1), scratch.gradient,
+					layerIndex > 0 ? &scratch.previousGradient : nullptr, scratch.parameterGradient.data() + parameterOffsets.at(layerIndex));
+				scratch.statistics.peakSize = max(scratch.statistics.peakSize, heldSize(scratch));
+				if (!checkpointPlan.kept.at(layerIndex + 1)) {
+					tensors.at(layerIndex + 1).clear();
+				}
+				scratch.gradient.swap(scratch.previousGradient);
+			}
+			segmentEnd = segmentStart;
+		}
+		return loss;
+	}
+
+	/**
+		Runs the forward and backward pass of a whole batch a layer at a time, so the batch normalization layers can use the batch's
+		statistics. The other layers spread the images over threads, and each thread adds its images' parameter gradients to its own.
+
+		@param images The batch, with the dimensions the network was initialized for
+		@param labels The class ID of each image, each one of the network's classes
+		@param batchThreads The amount of threads to use, each with its own scratch
+	*/
+	void backpropagateBatch(const vector<cv::Mat>& images, const vector<int>& labels, int batchThreads) {
+		int layerNum = cnn.getLayerCount();
+		int imageNum = (int)images.size();
+		batchTensors.resize(layerNum + 1);
+		for (int tensorIndex = 0; tensorIndex <= layerNum; tensorIndex++) {
+			batchTensors.at(tensorIndex).resize(imageNum);
+		}
+		batchGradients.resize(imageNum);
+		previousBatchGradients.resize(imageNum);
+
+		parallelFor(imageNum, batchThreads, [&](int imageIndex, int threadIndex) {
+			cnn.prepareImage(images.at(imageIndex), batchTensors.at(0).at(imageIndex));
+		});
+		for (int layerIndex = 0; layerIndex < layerNum; layerIndex++) {
+			if (batchNorms.at(layerIndex)) {
+				batchNorms.at(layerIndex)->forwardTraining(batchTensors.at(layerIndex), batchTensors.at(layerIndex + 1));
+				continue;
+			}
+			shared_ptr<const CNNLayer> layer = cnn.getLayer(layerIndex);
+			parallelFor(imageNum, batchThreads, [&](int imageIndex, int threadIndex) {
+				layer->forward(batchTensors.at(layerIndex).at(imageIndex), batchTensors.at(layerIndex + 1).at(imageIndex));
+			});
+		}
+		parallelFor(imageNum, batchThreads, [&](int imageIndex, int threadIndex) {
+			lossGradient(batchTensors.at(layerNum).at(imageIndex), labels.at(imageIndex), scratches.at(threadIndex), batchGradients.at(imageIndex));
+		});
+
+		for (int layerIndex = layerNum - 1; layerIndex >= 0; layerIndex--) {
+			size_t offset = parameterOffsets.at(layerIndex);
+			if (batchNorms.at(layerIndex)) {
+				batchNorms.at(layerIndex)->backwardTraining(batchTensors.at(layerIndex), batchGradients,
+					layerIndex > 0 ? &previousBatchGradients : nullptr, scratches.at(0).parameterGradient.data() + offset);
+			}
+			else {
+				shared_ptr<const CNNLayer> layer = cnn.getLayer(layerIndex);
+				parallelFor(imageNum, batchThreads, [&](int imageIndex, int threadIndex) {
+					layer->backward(batchTensors.at(layerIndex).at(imageIndex), batchTensors.at(layerIndex + 1).at(imageIndex),
+						batchGradients.at(imageIndex), layerIndex > 0 ? &previousBatchGradients.at(imageIndex) : nullptr,
+						scratches.at(threadIndex).parameterGradient.data() + offset);
+				});
+			}
+			batchGradients.swap(previousBatchGradients);
+		}
+
+		size_t heldNum = 0;
+		for (int tensorIndex = 0; tensorIndex <= layerNum; tensorIndex++) {
+			for (int imageIndex = 0; imageIndex < imageNum; imageIndex++) {
+				heldNum += CNNLayer::shapeOf(batchTensors.at(tensorIndex).at(imageIndex)).size();
+			}
+		}
+		scratches.at(0).statistics.peakSize = max(scratches.at(0).statistics.peakSize, heldNum);
+	}
+
+	/**
+		@return The dimensions of every tensor of a training pass
+	*/
+	vector<TensorShape> tensorShapes() const {
+		vector<TensorShape> shapes(1, cnn.getInputShape());
+		for (int layerIndex = 0; layerIndex < cnn.getLayerCount(); layerIndex++) {
+			shapes.push_back(cnn.getOutputShape(layerIndex));
+		}
+		return shapes;
+	}
+
+public:
+
+	/**
+		Constructor method for a Trainer. The network has to be initialized already, and the trainer keeps a reference to it. Every
+		activation is kept until a checkpoint plan is chosen.
+
+		@param myCnn The network to train
+		@param myLearningRate How far each step moves the parameters against the gradient, for every step
+		@param myBatchSize The amount of images whose gradients are averaged for one step
+		@param myThreadNum The amount of threads to spread a batch over. 0 uses every hardware thread.
+	*/
+	Trainer(ConvolutionalNeuralNetwork& myCnn, double myLearningRate = 0.01, int myBatchSize = 32, int myThreadNum = 0) : cnn(myCnn) {
+		schedule = LearningRateSchedule(CONSTANT_SCHEDULE, myLearningRate);
+		momentum = 0.0;
+		batchNormalized = false;
+		step = 0;
+		batchSize = max(1, myBatchSize);
+		threadNum = myThreadNum <= 0 ? hardwareThreads() : myThreadNum;
+		if (!cnn.isInitialized()) {
+			cout << "The network needs to be initialized before training." << endl;
+			return;
+		}
+
+		parameterOffsets.assign(1, 0);
+		batchNormalized = false;
+		for (int layerIndex = 0; layerIndex < cnn.getLayerCount(); layerIndex++) {
+			parameterOffsets.push_back(parameterOffsets.back() + cnn.getLayer(layerIndex)->getParameterCount());
+			// The trainer changes the network it was given, so it may change the statistics of its layers too
+			batchNorms.push_back(const_pointer_cast<BatchNormLayer>(dynamic_pointer_cast<const BatchNormLayer>(cnn.getLayer(layerIndex))));
+			batchNormalized = batchNormalized || batchNorms.back() != nullptr;
+		}
+		velocity.assign(parameterOffsets.back(), 0.0);
+		keepAllActivations();
+	}
+
+	/**
+		Keeps every activation, so nothing is recomputed.
+	*/
+	void keepAllActivations() {
+		checkpointPlan = CheckpointPlanner::keepAll(tensorShapes(), vector<double>(cnn.getLayerCount(), 0.0));
+	}
+
+	/**
+		Keeps only the outputs of the chosen layers (and the input and scores). The rest are recomputed during the backward pass.
+
+		@param layerIndices The layers whose outputs are checkpoints
+	*/
+	void setCheckpoints(const vector<int>& layerIndices) {
+		checkpointPlan = CheckpointPlanner::keepLayers(tensorShapes(), profileLayerCosts(), layerIndices);
+	}
+
+	/**
+		Picks the checkpoints that fit the activations of one thread into a memory budget while recomputing as little forward time as
+		possible, using the measured time of each layer.
+
+		@param bytes The most activation and gradient memory one thread may hold at once
+		@return Whether a plan fits in the budget
+	*/
+	bool setMemoryBudget(size_t bytes) {
+		checkpointPlan = CheckpointPlanner::plan(tensorShapes(), profileLayerCosts(), bytes / sizeof(double));
+		return checkpointPlan.peakSize() * sizeof(double) <= bytes;
+	}
+
+	/**
+		@return The average seconds each layer takes on a blank image, as the cost of recomputing it
+	*/
+	vector<double> profileLayerCosts() const {
+		TensorShape shape = cnn.getInputShape();
+		cv::Mat blank = cv::Mat::zeros(shape.rows, shape.cols, CV_64FC(shape.channels));
+		return cnn.profileLayers(blank, 3);
+	}
+
+	const CheckpointPlan& getCheckpointPlan() const {
+		return checkpointPlan;
+	}
+
+	/**
+		@return The learning rate of the next step
+	*/
+	double getLearningRate() const { return schedule.rateAt(step); }
+
+	/**
+		Uses the same learning rate for every step.
+
+		@param myLearningRate How far each step moves the parameters against the gradient
+	*/
+	void setLearningRate(double myLearningRate) { schedule = LearningRateSchedule(CONSTANT_SCHEDULE, myLearningRate); }
+
+	void setSchedule(const LearningRateSchedule& mySchedule) { schedule = mySchedule; }
+	const LearningRateSchedule& getSchedule() const { return schedule; }
+
+	/**
+		@param myMomentum How much of the last step each step keeps (0.0 - 1.0). 0 is plain gradient descent.
+	*/
+	void setMomentum(double myMomentum) { momentum = myMomentum; }
+	double getMomentum() const { return momentum; }
+	long long getStep() const { return step; }
+	int getBatchSize() const { return batchSize; }
+	int getThreadNum() const { return threadNum; }
+
+	/**
+		@param myThreadNum The amount of threads to spread a batch over. 0 uses every hardware thread.
+	*/
+	void setThreadNum(int myThreadNum) { threadNum = myThreadNum <= 0 ? hardwareThreads() : myThreadNum; }
+
+	/**
+		Finds how the loss of one image changes with every parameter of the network, without changing the network. Batch
+		normalization layers use their running statistics here, as at inference.
+
+		@param image The image, with the dimensions the network was initialized for
+		@param label The image's class ID
+		@param gradient Receives one value per parameter, in the order of ConvolutionalNeuralNetwork::updateParams
+		@return The image's loss
+	*/
+	double computeGradient(const cv::Mat& image, int label, vector<double>& gradient) {
+		scratches.resize(max((size_t)1, scratches.size()));
+		ThreadScratch& scratch = scratches.at(0);
+		scratch.parameterGradient.assign(parameterOffsets.back(), 0.0);
+		double loss = backpropagate(image, label, scratch);
+		gradient = scratch.parameterGradient;
+		return loss;
+	}
+
+	/**
+		Takes one gradient descent step on a batch: the parameter gradients of the images are found in parallel and averaged. The step
+		is the momentum times the last step, minus the step's learning rate times the averaged gradient.
+
+		@param images The batch, with the dimensions the network was initialized for
+		@param labels The class ID of each image
+		@return What the batch did
+	*/
+	TrainingStatistics trainBatch(const vector<cv::Mat>& images, const vector<int>& labels) {
+		TrainingStatistics statistics;
+		if (!cnn.isInitialized() || checkpointPlan.kept.size() != cnn.getLayerCount() + 1) {
+			cout << "The network needs to be initialized before training." << endl;
+			return statistics;
+		}
+		if (images.empty() || images.size() != labels.size()) {
+			return statistics;
+		}
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		int batchThreads = min(threadNum, (int)images.size());
+		scratches.resize(max(scratches.size(), (size_t)batchThreads));
+		for (int threadIndex = 0; threadIndex < batchThreads; threadIndex++) {
+			scratches.at(threadIndex).parameterGradient.assign(parameterOffsets.back(), 0.0);
+			scratches.at(threadIndex).statistics = TrainingStatistics();
+		}
+		if (batchNormalized) {
+			// An image with a label outside the classes would still move the batch statistics, so it is left out of the batch
+			int classNum = cnn.getOutputShape(cnn.getLayerCount() - 1).size();
+			vector<cv::Mat> validImages;
+			vector<int> validLabels;
+			for (int imageIndex = 0; imageIndex < images.size(); imageIndex++) {
+				if (labels.at(imageIndex) < 0 || labels.at(imageIndex) >= classNum) {
+					cout << "Label " << labels.at(imageIndex) << " is not one of the network's " << classNum << " classes." << endl;
+					continue;
+				}
+				validImages.push_back(images.at(imageIndex));
+				validLabels.push_back(labels.at(imageIndex));
+			}
+			if (!validImages.empty()) {
+				backpropagateBatch(validImages, validLabels, batchThreads);
+			}
+		}
+		else {
+			parallelFor((int)images.size(), batchThreads, [&](int imageIndex, int threadIndex) {
+				backpropagate(images.at(imageIndex), labels.at(imageIndex), scratches.at(threadIndex));
+			});
+		}
+
+		vector<double> changes(parameterOffsets.back(), 0.0);
+		for (int threadIndex = 0; threadIndex < batchThreads; threadIndex++) {
+			const vector<double>& parameterGradient = scratches.at(threadIndex).parameterGradient;
+			for (size_t parameterIndex = 0; parameterIndex < changes.size(); parameterIndex++) {
+				changes[parameterIndex] += parameterGradient[parameterIndex];
+			}
+			statistics.add(scratches.at(threadIndex).statistics);
+		}
+		if (statistics.imageNum > 0) {
+			double stepSize = -schedule.rateAt(step) / statistics.imageNum;
+			for (size_t parameterIndex = 0; parameterIndex < changes.size(); parameterIndex++) {
+				velocity[parameterIndex] = momentum * velocity[parameterIndex] + stepSize * changes[parameterIndex];
+			}
+			cnn.updateParams(velocity);
+			step++;
+		}
+
+		statistics.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		statistics.plannedPeakSize = checkpointPlan.peakSize();
+		statistics.fullSize = checkpointPlan.fullSize();
+		return statistics;
+	}
+
+	/**
+		Trains on every image of a labeled set once, in batches of batchSize, in an order shuffled by a seed.
+
+		@param labeledSet Images with their class IDs {(img1, 3), (img2, 0), ...}
+		@param seed The seed of the shuffle. The same seed visits the images in the same order.
+		@return What the epoch did
+	*/
+	TrainingStatistics trainEpoch(const vector<tuple<cv::Mat, int>>& labeledSet, unsigned long long seed = 0) {
+		vector<int> order(labeledSet.size());
+		for (int imageIndex = 0; imageIndex < order.size(); imageIndex++) {
+			order.at(imageIndex) = imageIndex;
+		}
+		unsigned long long key = streamKey(seed, 0);
+		for (int imageIndex = (int)order.size() - 1; imageIndex > 0; imageIndex--) {
+			swap(order.at(imageIndex), order.at((int)(counterUniform(key, imageIndex) * (imageIndex + 1))));
+		}
+
+		TrainingStatistics statistics;
+		vector<cv::Mat> images;
+		vector<int> labels;
+		for (size_t batchStart = 0; batchStart < order.size(); batchStart += batchSize) {
+			images.clear();
+			labels.clear();
+			for (size_t imageIndex = batchStart; imageIndex < min(order.size(), batchStart + batchSize); imageIndex++) {
+				images.push_back(get<0>(labeledSet.at(order.at(imageIndex))));
+				labels.push_back(get<1>(labeledSet.at(order.at(imageIndex))));
+			}
+			statistics.add(trainBatch(images, labels));
+		}
+		return statistics;
+	}
+
+	/**
+		Trains on one epoch of augmented copies. The pipeline's workers augment the next batches while the current one trains, and
+		the trainer reads each batch straight from the pipeline's buffers.
+
+		@param pipeline The augmentation pipeline of the training set, with the same batch size as this trainer
+		@param epoch The pass over the training set, which picks the shuffle and the random changes
+		@return What the epoch did, including how long the trainer waited for batches
+	*/
+	TrainingStatistics trainEpoch(AugmentationPipeline& pipeline, unsigned long long epoch) {
+		TrainingStatistics statistics;
+		pipeline.startEpoch(epoch);
+		TrainingBatch* batch = nullptr;
+		while (true) {
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			if (!pipeline.nextBatch(batch)) {
+				break;
+			}
+			statistics.inputWaitSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			statistics.add(trainBatch(batch->images, batch->labels));
+			pipeline.releaseBatch();
+		}
+		return statistics;
+	}
+
+	/**
+		Copies the network's learned values and the optimizer state into a snapshot. The snapshot's vectors keep their memory, so
+		refilling the same snapshot does not allocate.
+
+		@param snapshot Receives the values
+		@param progress How far the run has come
+		@param bestParameters The values of the best epoch so far, or empty
+		@param bestStatistics The batch normalization statistics of the best epoch so far, or empty
+	*/
+	void fillSnapshot(TrainingSnapshot& snapshot, const TrainingProgress& progress, const vector<double>& bestParameters,
+		const vector<double>& bestStatistics = vector<double>()) const {
+		snapshot.progress = progress;
+		snapshot.progress.step = step;
+		cnn.getParams(snapshot.parameters);
+		cnn.getBatchNormStatistics(snapshot.statistics);
+		snapshot.velocity.assign(velocity.begin(), velocity.end());
+		snapshot.bestParameters.assign(bestParameters.begin(), bestParameters.end());
+		snapshot.bestStatistics.assign(bestStatistics.begin(), bestStatistics.end());
+	}
+
+	/**
+		Identifies a run, so a snapshot is only resumed by the run that wrote it: the same layers' parameter counts, optimizer, schedule,
+		stopping settings, seed and amount of training images.
+
+		@param options The run's settings
+		@param trainingImageNum The amount of training images
+		@return The run key
+	*/
+	unsigned long long runKey(const TrainingOptions& options, size_t trainingImageNum) const {
+		double doubles[] = { momentum, schedule.getBaseRate(), schedule.getDecay(), schedule.getMinRate(), options.minDelta,
+			options.desiredAccuracy };
+		long long integers[] = { batchSize, schedule.getType(), schedule.getWarmupSteps(), schedule.getDecaySteps(),
+			schedule.getTotalSteps(), options.maxEpochs, options.patience, options.restoreBest ? 1 : 0, (long long)trainingImageNum };
+		unsigned long long key = streamKey(options.seed, parameterOffsets.size());
+		for (int index = 0; index < parameterOffsets.size(); index++) {
+			key = streamKey(key, parameterOffsets.at(index));
+		}
+		for (int index = 0; index < sizeof(doubles) / sizeof(doubles[0]); index++) {
+			unsigned long long bits;
+			memcpy(&bits, &doubles[index], sizeof(bits));
+			key = streamKey(key, bits);
+		}
+		for (int index = 0; index < sizeof(integers) / sizeof(integers[0]); index++) {
+			key = streamKey(key, (unsigned long long)integers[index]);
+		}
+		return key;
+	}
+
+	/**
+		Puts the network and the optimizer back into the state of a snapshot. The network has to have the same layers it had when the
+		snapshot was taken.
+
+		@param snapshot The snapshot
+		@return Whether the snapshot matched the network
+	*/
+	bool restoreSnapshot(const TrainingSnapshot& snapshot) {
+		vector<double> statistics;
+		cnn.getBatchNormStatistics(statistics);
+		if (snapshot.parameters.size() != parameterOffsets.back() || snapshot.statistics.size() != statistics.size()) {
+			cout << "The checkpoint does not match the network's " << parameterOffsets.back() << " parameters and " << statistics.size() <<
+				" batch normalization statistics." << endl;
+			return false;
+		}
+		cnn.setParams(snapshot.parameters);
+		cnn.setBatchNormStatistics(snapshot.statistics);
+		velocity = snapshot.velocity;
+		step = snapshot.progress.step;
+		return true;
+	}
+
+	/**
+		Trains epoch after epoch, checking the loss and accuracy on a validation set after each one. Training stops after the last
+		epoch, once the validation accuracy reaches the desired accuracy, or once the validation loss has not improved for the patience
+		in epochs. A snapshot is handed to a background writer every few epochs, so a crashed run can continue from it with the same
+		results it would have had, and the disk never holds training up. The last snapshot is marked finished. A snapshot that is
+		finished or was written by a run with other settings or another network is not resumed, and the run starts over.
+
+		@param trainingSet Images with their class IDs {(img1, 3), (img2, 0), ...} to learn from
+		@param validationSet Images with their class IDs to check the network with. If empty, the training loss is watched instead.
+		@param options When to stop and where to save snapshots
+		@return How far the run came
+	*/
+	TrainingProgress fit(const vector<tuple<cv::Mat, int>>& trainingSet, const vector<tuple<cv::Mat, int>>& validationSet,
+		const TrainingOptions& options = TrainingOptions()) {
+		TrainingProgress progress;
+		vector<double> bestParameters, bestStatistics;
+		unique_ptr<CheckpointWriter> writer;
+		unsigned long long key = runKey(options, trainingSet.size());
+		if (!options.checkpointPath.empty()) {
+			TrainingSnapshot snapshot;
+			bool found = options.resume && TrainingSnapshot::load(options.checkpointPath, snapshot);
+			if (found && (snapshot.runKey != key || snapshot.progress.finished)) {
+				cout << "Checkpoint file " << options.checkpointPath << (snapshot.progress.finished ? " holds a finished run" :
+					" was written by a run with other settings") << ", so training starts over." << endl;
+				found = false;
+			}
+			if (found && restoreSnapshot(snapshot)) {
+				progress = snapshot.progress;
+				bestParameters.swap(snapshot.bestParameters);
+				bestStatistics.swap(snapshot.bestStatistics);
+				if (options.printProgress) {
+					cout << "Resuming after epoch " << progress.epochs << ", step " << progress.step << endl;
+				}
+			}
+			writer.reset(new CheckpointWriter(options.checkpointPath));
+		}
+
+		bool stopping = options.patience > 0 && progress.epochsWithoutImprovement >= options.patience;
+		while (!stopping && progress.epochs < options.maxEpochs) {
+			TrainingStatistics statistics = trainEpoch(trainingSet, streamKey(options.seed, progress.epochs + 1));
+			double loss = statistics.averageLoss(), accuracy = statistics.accuracy();
+			if (!validationSet.empty()) {
+				EvaluationReport report = Evaluator::evaluate(cnn, validationSet, 1, threadNum);
+				loss = report.averageLoss;
+				accuracy = report.accuracy;
+			}
+			progress.epochs++;
+			progress.step = step;
+
+			if (loss < progress.bestLoss - options.minDelta) {
+				progress.bestLoss = loss;
+				progress.bestEpoch = progress.epochs;
+				progress.epochsWithoutImprovement = 0;
+				if (options.restoreBest) {
+					cnn.getParams(bestParameters);
+					cnn.getBatchNormStatistics(bestStatistics);
+				}
+			}
+			else {
+				progress.epochsWithoutImprovement++;
+			}
+			bool patienceRanOut = options.patience > 0 && progress.epochsWithoutImprovement >= options.patience;
+			stopping = patienceRanOut || accuracy >= options.desiredAccuracy;
+			progress.stoppedEarly = stopping && progress.epochs < options.maxEpochs;
+			progress.finished = stopping || progress.epochs == options.maxEpochs;
+
+			if (options.printProgress) {
+				cout << "Epoch " << progress.epochs << ", Learning rate: " << getLearningRate() << ", Training loss: " <<
+					statistics.averageLoss() << ", Validation loss: " << loss << ", Validation accuracy: " << accuracy <<
+					(patienceRanOut ? ", stopping early" : "") << endl;
+			}
+			if (writer && (progress.epochs % max(1, options.checkpointInterval) == 0 || progress.finished)) {
+				TrainingSnapshot* snapshot = writer->acquire();
+				fillSnapshot(*snapshot, progress, bestParameters, bestStatistics);
+				snapshot->runKey = key;
+				writer->submit(snapshot);
+			}
+		}
+
+		if (options.restoreBest && !bestParameters.empty() && progress.bestEpoch != progress.epochs) {
+			cnn.setParams(bestParameters);
+			if (bestStatistics.size() > 0) {
+				cnn.setBatchNormStatistics(bestStatistics);
+			}
+			if (options.printProgress) {
+				cout << "Returned to the values after epoch " << progress.bestEpoch << endl;
+			}
+		}
+		return progress;
+	}
+};
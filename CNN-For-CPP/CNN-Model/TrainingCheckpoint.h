@@ -0,0 +1,317 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <limits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "Serialization.h"
+
+using namespace std;
+
+const int CHECKPOINT_FILE_MAGIC = 0x4B434E43;		// "CNCK"
+const int CHECKPOINT_FILE_VERSION = 3;		// version 2 run keys and finished runs, version 3 batch normalization statistics
+
+/**
+	How far a training run has come, and what early stopping has seen so far.
+*/
+struct TrainingProgress {
+	long long step;						// Gradient descent steps taken, which picks the learning rate
+	int epochs;							// Epochs finished
+	double bestLoss;					// The lowest validation loss after an epoch
+	int bestEpoch;						// The epoch count when bestLoss was reached
+	int epochsWithoutImprovement;
+	bool stoppedEarly;					// Whether the run stopped before its last epoch
+	bool finished;						// Whether the run reached its end. A finished run is never resumed.
+
+	TrainingProgress() : step(0), epochs(0), bestLoss(numeric_limits<double>::infinity()), bestEpoch(0), epochsWithoutImprovement(0),
+		stoppedEarly(false), finished(false) {}
+};
+
+/**
+	Everything a training run needs to continue where it left off: the progress, the network's learned values, the optimizer's
+	velocity, the values of the best epoch so far, which early stopping returns to, and the running statistics of the batch
+	normalization layers for both.
+*/
+struct TrainingSnapshot {
+	unsigned long long runKey;			// Identifies the settings and parameter layout of the run, so no other run resumes from it
+	TrainingProgress progress;
+	vector<double> parameters;			// In the order of ConvolutionalNeuralNetwork::getParams
+	vector<double> velocity;
+	vector<double> bestParameters;
+	vector<double> statistics;			// In the order of ConvolutionalNeuralNetwork::getBatchNormStatistics
+	vector<double> bestStatistics;
+
+	TrainingSnapshot() : runKey(0) {}
+
+	/**
+		Writes the snapshot to a binary file.
+
+		@param out The file
+		@return Whether the file was written
+	*/
+	bool save(ostream& out) const {
+		writeValue<int>(out, CHECKPOINT_FILE_MAGIC);
+		writeValue<int>(out, CHECKPOINT_FILE_VERSION);
+		writeValue<long long>(out, progress.step);
+		writeValue<int>(out, progress.epochs);
+		writeValue<double>(out, progress.bestLoss);
+		writeValue<int>(out, progress.bestEpoch);
+		writeValue<int>(out, progress.epochsWithoutImprovement);
+		writeValue<unsigned long long>(out, runKey);
+		writeValue<int>(out, progress.finished ? 1 : 0);
+		writeVector(out, parameters);
+		writeVector(out, velocity);
+		writeVector(out, bestParameters);
+		writeVector(out, statistics);
+		writeVector(out, bestStatistics);
+		return (bool)out;
+	}
+
+	/**
+		Reads a snapshot written by save. If the file is missing or damaged, the temporary file a CheckpointWriter writes next to it is
+		tried, since a crash can come after the temporary file was written but before it replaced the snapshot.
+
+		@param path The file to read
+		@param snapshot Receives the snapshot. It is left unchanged if the file cannot be read.
+		@return Whether the snapshot was read
+	*/
+	static bool load(string path, TrainingSnapshot& snapshot) {
+		return loadFile(path, snapshot) || loadFile(path + ".tmp", snapshot);
+	}
+
+private:
+	static bool loadFile(string path, TrainingSnapshot& snapshot) {
+		ifstream in(path.c_str(), ios::binary);
+		if (!in || readValue<int>(in) != CHECKPOINT_FILE_MAGIC) {
+			return false;
+		}
+		int version = readValue<int>(in);
+		if (version < 1 || version > CHECKPOINT_FILE_VERSION) {
+			cout << "Checkpoint file " << path << " has unsupported version " << version << "." << endl;
+			return false;
+		}
+		TrainingSnapshot loaded;
+		loaded.progress.step = readValue<long long>(in);
+		loaded.progress.epochs = readValue<int>(in);
+		loaded.progress.bestLoss = readValue<double>(in);
+		loaded.progress.bestEpoch = readValue<int>(in);
+		loaded.progress.epochsWithoutImprovement = readValue<int>(in);
+		if (version >= 2) {
+			// Version 1 snapshots have no run key, so they never match a run
+			loaded.runKey = readValue<unsigned long long>(in);
+			loaded.progress.finished = readValue<int>(in) != 0;
+		}
+		loaded.parameters = readVector<double>(in);
+		loaded.velocity = readVector<double>(in);
+		loaded.bestParameters = readVector<double>(in);
+		if (version >= 3) {
+			loaded.statistics = readVector<double>(in);
+			loaded.bestStatistics = readVector<double>(in);
+		}
+		if (!in || loaded.progress.step < 0 || loaded.progress.epochs < 0 || loaded.velocity.size() != loaded.parameters.size() ||
+			(!loaded.bestParameters.empty() && loaded.bestParameters.size() != loaded.parameters.size()) ||
+			(!loaded.bestStatistics.empty() && loaded.bestStatistics.size() != loaded.statistics.size())) {
+			cout << "Checkpoint file " << path << " is damaged." << endl;
+			return false;
+		}
+		snapshot = loaded;
+		return true;
+	}
+};
+
+/**
+	Writes training snapshots to disk on a background thread, so training does not wait for the disk. There are two snapshot arenas.
+	The trainer copies the values into whichever one the writer is not writing, which only costs a copy in memory, and the writer
+	thread writes the newest filled arena. If the trainer fills a new snapshot before the writer got to the last one, the older one is
+	skipped rather than making the trainer wait.
+
+	Each snapshot is written to path + ".tmp" and then renamed over path, so a crash while writing leaves the previous snapshot intact.
+*/
+class CheckpointWriter {
+private:
+	enum ArenaState {
+		FREE_ARENA,
+		FILLING_ARENA,		// The trainer is copying values into it
+		PENDING_ARENA,		// Filled and waiting for the writer
+		WRITING_ARENA
+	};
+
+	string path;
+	TrainingSnapshot arenas[2];
+	ArenaState states[2];
+	long long sequences[2];				// Which snapshot each arena holds, so the writer takes the newest
+	long long nextSequence;
+	long long writtenNum;
+	long long skippedNum;
+	long long failedNum;
+	bool stopping;
+	mutex stateMutex;
+	condition_variable stateChanged;
+	thread writerThread;
+
+	/**
+		The writer thread: writes pending arenas until the writer is destroyed.
+	*/
+	void writeLoop() {
+		unique_lock<mutex> lock(stateMutex);
+		while (true) {
+			stateChanged.wait(lock, [&]() { return stopping || states[0] == PENDING_ARENA || states[1] == PENDING_ARENA; });
+			int arenaIndex = -1;
+			for (int candidate = 0; candidate < 2; candidate++) {
+				if (states[candidate] == PENDING_ARENA && (arenaIndex < 0 || sequences[candidate] > sequences[arenaIndex])) {
+					arenaIndex = candidate;
+				}
+			}
+			if (arenaIndex < 0) {
+				return;
+			}
+			if (states[1 - arenaIndex] == PENDING_ARENA) {
+				states[1 - arenaIndex] = FREE_ARENA;
+				skippedNum++;
+			}
+			states[arenaIndex] = WRITING_ARENA;
+
+			lock.unlock();
+			bool written = writeFile(arenas[arenaIndex]);
+			lock.lock();
+
+			written ? writtenNum++ : failedNum++;
+			states[arenaIndex] = FREE_ARENA;
+			stateChanged.notify_all();
+		}
+	}
+
+	bool writeFile(const TrainingSnapshot& snapshot) const {
+		string temporaryPath = path + ".tmp";
+		{
+			ofstream out(temporaryPath.c_str(), ios::binary);
+			if (!out || !snapshot.save(out)) {
+				cout << "Could not write checkpoint file " << temporaryPath << "." << endl;
+				return false;
+			}
+		}
+		if (!replaceFile(temporaryPath, path)) {
+			cout << "Could not replace checkpoint file " << path << "." << endl;
+			return false;
+		}
+		return true;
+	}
+
+public:
+
+	/**
+		Constructor method for a CheckpointWriter. Starts the writer thread.
+
+		@param myPath The file the snapshots are written to
+	*/
+	CheckpointWriter(string myPath) {
+		path = myPath;
+		states[0] = states[1] = FREE_ARENA;
+		sequences[0] = sequences[1] = 0;
+		nextSequence = 1;
+		writtenNum = 0;
+		skippedNum = 0;
+		failedNum = 0;
+		stopping = false;
+		writerThread = thread(&CheckpointWriter::writeLoop, this);
+	}
+
+	/**
+		Writes the last pending snapshot, then stops the writer thread.
+	*/
+	~CheckpointWriter() {
+		{
+			lock_guard<mutex> lock(stateMutex);
+			stopping = true;
+		}
+		stateChanged.notify_all();
+		writerThread.join();
+	}
+
+	/**
+		Hands out an arena to copy the next snapshot into. This never waits: the writer only ever holds one arena, so the other one is
+		free, or holds an older snapshot that has not been written yet and is skipped. Only one thread may fill snapshots. An arena
+		that was acquired but never submitted is handed out again.
+
+		@return The arena, whose vectors keep their memory between snapshots. Pass it to submit once it is filled.
+	*/
+	TrainingSnapshot* acquire() {
+		lock_guard<mutex> lock(stateMutex);
+		int arenaIndex = -1;
+		for (int candidate = 0; candidate < 2 && arenaIndex < 0; candidate++) {
+			if (states[candidate] == FREE_ARENA) {
+				arenaIndex = candidate;
+			}
+		}
+		for (int candidate = 0; candidate < 2 && arenaIndex < 0; candidate++) {
+			// Neither is free, so one is being written. Replace the oldest snapshot still waiting.
+			if (states[candidate] == PENDING_ARENA && (states[1 - candidate] != PENDING_ARENA || sequences[candidate] < sequences[1 - candidate])) {
+				arenaIndex = candidate;
+			}
+		}
+		for (int candidate = 0; candidate < 2 && arenaIndex < 0; candidate++) {
+			// An arena from an earlier acquire that was never submitted is handed out again
+			if (states[candidate] == FILLING_ARENA) {
+				arenaIndex = candidate;
+			}
+		}
+		if (states[arenaIndex] == PENDING_ARENA) {
+			skippedNum++;
+		}
+		states[arenaIndex] = FILLING_ARENA;
+		return &arenas[arenaIndex];
+	}
+
+	/**
+		Queues a filled arena for writing.
+
+		@param snapshot The arena from acquire
+	*/
+	void submit(TrainingSnapshot* snapshot) {
+		{
+			lock_guard<mutex> lock(stateMutex);
+			int arenaIndex = snapshot == &arenas[0] ? 0 : 1;
+			states[arenaIndex] = PENDING_ARENA;
+			sequences[arenaIndex] = nextSequence++;
+		}
+		stateChanged.notify_all();
+	}
+
+	/**
+		Waits until every submitted snapshot has been written or skipped.
+	*/
+	void flush() {
+		unique_lock<mutex> lock(stateMutex);
+		stateChanged.wait(lock, [&]() { return (states[0] == FREE_ARENA || states[0] == FILLING_ARENA) &&
+			(states[1] == FREE_ARENA || states[1] == FILLING_ARENA); });
+	}
+
+	string getPath() const { return path; }
+
+	/**
+		@return The snapshots that reached the disk
+	*/
+	long long getWrittenCount() {
+		lock_guard<mutex> lock(stateMutex);
+		return writtenNum;
+	}
+
+	/**
+		@return The snapshots replaced by a newer one before they were written
+	*/
+	long long getSkippedCount() {
+		lock_guard<mutex> lock(stateMutex);
+		return skippedNum;
+	}
+
+	long long getFailedCount() {
+		lock_guard<mutex> lock(stateMutex);
+		return failedNum;
+	}
+};
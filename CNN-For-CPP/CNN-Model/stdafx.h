@@ -7,4 +7,6 @@
 
 #include "targetver.h"
 #include <stdio.h>
-#include <tchar.h>
\ No newline at end of file
+#ifdef _WIN32
+#include <tchar.h>
+#endif
\ No newline at end of file